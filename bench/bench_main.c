@@ -0,0 +1,408 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Microbenchmarks for prompts, resumptions, effect operations, and gstacks.
+
+  Usage: bench_mp [--config=default|nogpool|overcommit|lite|huge] [--format=text|json|csv]
+                  [--samples=<n>] [--filter=<substring>] [--output=<file>]
+
+  Each benchmark is run once for warmup and then `samples` times; we report
+  the minimum, median, mean, and standard deviation of the nanoseconds per operation.
+-----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <mpeff.h>
+
+#define UNUSED(x)  (void)(x)
+
+#if defined(_MSC_VER) && !defined(__clang__) && !defined(__GNUC__)
+# define __noinline     __declspec(noinline)
+#else
+# define __noinline     __attribute__((noinline))
+#endif
+
+
+// -------------------------------
+// Timing
+
+static double bench_secs_now(void) {
+  struct timespec t;
+  timespec_get(&t, TIME_UTC);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+// Prevent the compiler from optimizing away results
+static volatile intptr_t bench_sink;
+
+
+// -------------------------------
+// Prompts and resumptions
+
+static void* return_null(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  return NULL;
+}
+
+static void bench_prompt_enter_exit(long iters) {
+  for (long i = 0; i < iters; i++) {
+    mp_prompt(&return_null, NULL);
+  }
+}
+
+static void* suspend(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;   // return the resumption to the parent
+}
+
+static void* yielder(mp_prompt_t* p, void* arg) {
+  const long iters = (long)(intptr_t)arg;
+  for (long i = 0; i < iters; i++) {
+    mp_yield(p, &suspend, NULL);
+  }
+  return NULL;
+}
+
+static void bench_yield_resume(long iters) {
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&yielder, (void*)(intptr_t)iters);
+  while (r != NULL) {
+    r = (mp_resume_t*)mp_resume(r, NULL);
+  }
+}
+
+static void* resume_tail(mp_resume_t* r, void* arg) {
+  return mp_resume_tail(r, arg);
+}
+
+static void* tail_yielder(mp_prompt_t* p, void* arg) {
+  const long iters = (long)(intptr_t)arg;
+  intptr_t sum = 0;
+  for (long i = 0; i < iters; i++) {
+    sum += (intptr_t)mp_yield(p, &resume_tail, (void*)(intptr_t)i);
+  }
+  return (void*)sum;
+}
+
+static void bench_resume_tail(long iters) {
+  bench_sink = (intptr_t)mp_prompt(&tail_yielder, (void*)(intptr_t)iters);
+}
+
+
+// Multi-shot resumptions where the captured stack is `depth` KiB deep
+
+static void* suspend_multi(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return mp_resume_multi(r);
+}
+
+static __noinline intptr_t use_stack(mp_prompt_t* p, long kb) {
+  if (kb <= 0) {
+    return (intptr_t)mp_yield(p, &suspend_multi, NULL);
+  }
+  volatile char buf[1024];
+  buf[0] = (char)kb;
+  return use_stack(p, kb - 1) + buf[0];
+}
+
+static void* multi_yielder(mp_prompt_t* p, void* arg) {
+  return (void*)use_stack(p, (long)(intptr_t)arg);
+}
+
+static void bench_multi_resume(long iters, long kb) {
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&multi_yielder, (void*)(intptr_t)kb);
+  for (long i = 0; i < iters; i++) {
+    bench_sink = (intptr_t)mp_resume(mp_resume_dup(r), NULL);
+  }
+  mp_resume_drop(r);
+}
+
+static void bench_multi_resume_1k(long iters)   { bench_multi_resume(iters, 1); }
+static void bench_multi_resume_16k(long iters)  { bench_multi_resume(iters, 16); }
+static void bench_multi_resume_128k(long iters) { bench_multi_resume(iters, 128); }
+
+
+// -------------------------------
+// Effect operations of each kind
+
+MPE_DEFINE_EFFECT6(bench, tail_noop, tail, scoped_once, scoped, once, multi)
+MPE_DEFINE_EFFECT2(bexit, never, abort)
+
+static void* handle_resume(mpe_resume_t* r, void* local, void* arg) {
+  return mpe_resume_tail(r, local, arg);
+}
+
+static void* handle_exit(mpe_resume_t* r, void* local, void* arg) {
+  UNUSED(r); UNUSED(local);
+  return arg;
+}
+
+static const mpe_handlerdef_t bench_hdef = { MPE_EFFECT(bench), NULL, {
+  { MPE_OP_TAIL_NOOP,   MPE_OPTAG(bench,tail_noop),   &handle_resume },
+  { MPE_OP_TAIL,        MPE_OPTAG(bench,tail),        &handle_resume },
+  { MPE_OP_SCOPED_ONCE, MPE_OPTAG(bench,scoped_once), &handle_resume },
+  { MPE_OP_SCOPED,      MPE_OPTAG(bench,scoped),      &handle_resume },
+  { MPE_OP_ONCE,        MPE_OPTAG(bench,once),        &handle_resume },
+  { MPE_OP_MULTI,       MPE_OPTAG(bench,multi),       &handle_resume },
+  { MPE_OP_NULL, mpe_op_null, NULL }
+} };
+
+static const mpe_handlerdef_t bexit_hdef = { MPE_EFFECT(bexit), NULL, {
+  { MPE_OP_NEVER, MPE_OPTAG(bexit,never), &handle_exit },
+  { MPE_OP_ABORT, MPE_OPTAG(bexit,abort), &handle_exit },
+  { MPE_OP_NULL, mpe_op_null, NULL }
+} };
+
+typedef struct perform_env_s {
+  mpe_optag_t optag;
+  long        iters;
+} perform_env_t;
+
+static void* perform_loop(void* arg) {
+  perform_env_t* env = (perform_env_t*)arg;
+  intptr_t sum = 0;
+  for (long i = 0; i < env->iters; i++) {
+    sum += (intptr_t)mpe_perform(env->optag, (void*)(intptr_t)i);
+  }
+  return (void*)sum;
+}
+
+static void bench_perform(mpe_optag_t optag, long iters) {
+  perform_env_t env = { optag, iters };
+  bench_sink = (intptr_t)mpe_handle(&bench_hdef, NULL, &perform_loop, &env);
+}
+
+static void bench_perform_tail_noop(long iters)   { bench_perform(MPE_OPTAG(bench,tail_noop), iters); }
+static void bench_perform_tail(long iters)        { bench_perform(MPE_OPTAG(bench,tail), iters); }
+static void bench_perform_scoped_once(long iters) { bench_perform(MPE_OPTAG(bench,scoped_once), iters); }
+static void bench_perform_scoped(long iters)      { bench_perform(MPE_OPTAG(bench,scoped), iters); }
+static void bench_perform_once(long iters)        { bench_perform(MPE_OPTAG(bench,once), iters); }
+static void bench_perform_multi(long iters)       { bench_perform(MPE_OPTAG(bench,multi), iters); }
+
+// operations that do not resume need a fresh handler each time
+static void* perform_once(void* arg) {
+  return mpe_perform((mpe_optag_t)arg, NULL);
+}
+
+static void bench_perform_exit(mpe_optag_t optag, long iters) {
+  for (long i = 0; i < iters; i++) {
+    bench_sink = (intptr_t)mpe_handle(&bexit_hdef, NULL, &perform_once, (void*)optag);
+  }
+}
+
+static void bench_perform_never(long iters) { bench_perform_exit(MPE_OPTAG(bexit,never), iters); }
+static void bench_perform_abort(long iters) { bench_perform_exit(MPE_OPTAG(bexit,abort), iters); }
+
+
+// -------------------------------
+// Gstack allocation with many stacks alive (beyond the thread-local cache)
+
+#define LIVE_STACKS  (1000)
+
+static void* live_yielder(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  mp_yield(p, &suspend, NULL);
+  return NULL;
+}
+
+static void bench_gstack_alloc_free(long iters) {
+  static mp_resume_t* live[LIVE_STACKS];
+  while (iters > 0) {
+    const long n = (iters < LIVE_STACKS ? iters : LIVE_STACKS);
+    for (long i = 0; i < n; i++) {
+      live[i] = (mp_resume_t*)mp_prompt(&live_yielder, NULL);
+    }
+    for (long i = 0; i < n; i++) {
+      mp_resume_drop(live[i]);
+    }
+    iters -= n;
+  }
+}
+
+
+// -------------------------------
+// Deep stacks (4 MiB) in fresh prompts
+
+static __noinline intptr_t deep_stack(long kb) {
+  if (kb <= 0) return 0;
+  volatile char buf[1024];
+  buf[0] = (char)kb;
+  return deep_stack(kb - 1) + buf[0];
+}
+
+static void* deep_prompt(mp_prompt_t* p, void* arg) {
+  UNUSED(p);
+  return (void*)deep_stack((long)(intptr_t)arg);
+}
+
+static void bench_gstack_deep(long iters) {
+  for (long i = 0; i < iters; i++) {
+    bench_sink = (intptr_t)mp_prompt(&deep_prompt, (void*)(intptr_t)(4 * 1024));
+  }
+}
+
+
+// -------------------------------
+// Benchmark table
+
+typedef void (bench_fun_t)(long iters);
+
+typedef struct bench_s {
+  const char*  name;
+  bench_fun_t* fun;
+  long         iters;   // operations per sample
+} bench_t;
+
+static const bench_t benchmarks[] = {
+  { "prompt/enter-exit",          &bench_prompt_enter_exit,   1000000 },
+  { "prompt/yield-resume",        &bench_yield_resume,        1000000 },
+  { "prompt/resume-tail",         &bench_resume_tail,         1000000 },
+  { "prompt/multi-resume-1k",     &bench_multi_resume_1k,      100000 },
+  { "prompt/multi-resume-16k",    &bench_multi_resume_16k,      20000 },
+  { "prompt/multi-resume-128k",   &bench_multi_resume_128k,      2000 },
+  { "perform/tail-noop",          &bench_perform_tail_noop,   1000000 },
+  { "perform/tail",               &bench_perform_tail,        1000000 },
+  { "perform/scoped-once",        &bench_perform_scoped_once, 1000000 },
+  { "perform/scoped",             &bench_perform_scoped,       200000 },
+  { "perform/once",               &bench_perform_once,        1000000 },
+  { "perform/multi",              &bench_perform_multi,        200000 },
+  { "perform/never",              &bench_perform_never,        200000 },
+  { "perform/abort",              &bench_perform_abort,        200000 },
+  { "gstack/alloc-free-live1000", &bench_gstack_alloc_free,    100000 },
+  { "gstack/deep-4m",             &bench_gstack_deep,             1000 },
+  { NULL, NULL, 0 }
+};
+
+
+// -------------------------------
+// Statistics
+
+typedef struct bench_stats_s {
+  double min;
+  double median;
+  double mean;
+  double stddev;
+} bench_stats_t;
+
+static int double_compare(const void* x, const void* y) {
+  const double a = *(const double*)x;
+  const double b = *(const double*)y;
+  return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+static bench_stats_t bench_stats(double* samples, int n) {
+  bench_stats_t st;
+  qsort(samples, (size_t)n, sizeof(double), &double_compare);
+  st.min = samples[0];
+  st.median = (n % 2 == 1 ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2.0);
+  double sum = 0;
+  for (int i = 0; i < n; i++) { sum += samples[i]; }
+  st.mean = sum / n;
+  double var = 0;
+  for (int i = 0; i < n; i++) { var += (samples[i] - st.mean) * (samples[i] - st.mean); }
+  st.stddev = (n > 1 ? sqrt(var / (n - 1)) : 0.0);
+  return st;
+}
+
+static bench_stats_t bench_run(const bench_t* b, double* samples, int n) {
+  b->fun(b->iters / 10 + 1);  // warmup
+  for (int i = 0; i < n; i++) {
+    const double start = bench_secs_now();
+    b->fun(b->iters);
+    samples[i] = (bench_secs_now() - start) * 1e9 / (double)b->iters;
+  }
+  return bench_stats(samples, n);
+}
+
+
+// -------------------------------
+// Main
+
+typedef enum bench_format_e {
+  BENCH_TEXT,
+  BENCH_JSON,
+  BENCH_CSV
+} bench_format_t;
+
+static const char* arg_value(const char* arg, const char* option) {
+  const size_t len = strlen(option);
+  return (strncmp(arg, option, len) == 0 ? arg + len : NULL);
+}
+
+int main(int argc, char** argv) {
+  const char* config_name = "default";
+  bench_format_t format = BENCH_TEXT;
+  int nsamples = 10;
+  const char* filter = NULL;
+  const char* output = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char* v;
+    if ((v = arg_value(argv[i], "--config=")) != NULL) config_name = v;
+    else if ((v = arg_value(argv[i], "--format=")) != NULL) {
+      if (strcmp(v, "json") == 0) format = BENCH_JSON;
+      else if (strcmp(v, "csv") == 0) format = BENCH_CSV;
+      else format = BENCH_TEXT;
+    }
+    else if ((v = arg_value(argv[i], "--samples=")) != NULL) nsamples = atoi(v);
+    else if ((v = arg_value(argv[i], "--filter=")) != NULL) filter = v;
+    else if ((v = arg_value(argv[i], "--output=")) != NULL) output = v;
+    else {
+      fprintf(stderr, "usage: %s [--config=default|nogpool|overcommit|lite|huge] [--format=text|json|csv] [--samples=<n>] [--filter=<substring>] [--output=<file>]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (nsamples < 1) nsamples = 1;
+
+  mp_config_t config = mp_config_default();
+  if (strcmp(config_name, "nogpool") == 0) config.gpool_enable = false;
+  else if (strcmp(config_name, "overcommit") == 0) config.stack_use_overcommit = true;
+  else if (strcmp(config_name, "lite") == 0) config.context_switch_lite = true;
+  else if (strcmp(config_name, "huge") == 0) config.stack_huge_from = 1024 * 1024;
+  else if (strcmp(config_name, "default") != 0) {
+    fprintf(stderr, "unknown configuration: %s\n", config_name);
+    return 1;
+  }
+  mp_init(&config);
+
+  FILE* out = stdout;
+  if (output != NULL) {
+    out = fopen(output, "w");
+    if (out == NULL) {
+      fprintf(stderr, "unable to open: %s\n", output);
+      return 1;
+    }
+  }
+  double* samples = (double*)malloc((size_t)nsamples * sizeof(double));
+
+  if (format == BENCH_JSON) fprintf(out, "{\n  \"config\": \"%s\",\n  \"samples\": %d,\n  \"results\": [", config_name, nsamples);
+  else if (format == BENCH_CSV) fprintf(out, "config,name,iters,samples,min_ns,median_ns,mean_ns,stddev_ns\n");
+  else fprintf(out, "%-28s %10s %10s %10s %10s   (ns/op, config: %s, samples: %d)\n", "benchmark", "min", "median", "mean", "stddev", config_name, nsamples);
+
+  bool first = true;
+  for (const bench_t* b = benchmarks; b->name != NULL; b++) {
+    if (filter != NULL && strstr(b->name, filter) == NULL) continue;
+    const bench_stats_t st = bench_run(b, samples, nsamples);
+    if (format == BENCH_JSON) {
+      fprintf(out, "%s\n    { \"name\": \"%s\", \"iters\": %ld, \"min_ns\": %.3f, \"median_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f }",
+                   (first ? "" : ","), b->name, b->iters, st.min, st.median, st.mean, st.stddev);
+    }
+    else if (format == BENCH_CSV) {
+      fprintf(out, "%s,%s,%ld,%d,%.3f,%.3f,%.3f,%.3f\n", config_name, b->name, b->iters, nsamples, st.min, st.median, st.mean, st.stddev);
+    }
+    else {
+      fprintf(out, "%-28s %10.2f %10.2f %10.2f %10.2f\n", b->name, st.min, st.median, st.mean, st.stddev);
+    }
+    fflush(out);
+    first = false;
+  }
+  if (format == BENCH_JSON) fprintf(out, "\n  ]\n}\n");
+
+  free(samples);
+  if (out != stdout) fclose(out);
+  return 0;
+}
@@ -0,0 +1,77 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Measure the cost of a context switch (a yield or a resume).
+  Run as `bench_mp_switch [lite]` where `lite` uses `config.context_switch_lite`.
+-----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <mprompt.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAS_CYCLES 1
+static uint64_t cycles_now(void) { return __rdtsc(); }
+#else
+#define HAS_CYCLES 0
+static uint64_t cycles_now(void) { return 0; }
+#endif
+
+#define SWITCHES  (10000000L)   // number of yield/resume pairs
+#define RUNS      (5)           // take the best run
+
+static double secs_now(void) {
+  struct timespec t;
+  timespec_get(&t, TIME_UTC);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void* suspend(mp_resume_t* r, void* arg) {
+  (void)(arg);
+  return r;
+}
+
+static void* yielder(mp_prompt_t* p, void* arg) {
+  (void)(arg);
+  for (long i = 0; i < SWITCHES; i++) {
+    mp_yield(p, &suspend, NULL);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  const bool lite = (argc > 1 && strcmp(argv[1], "lite") == 0);
+  mp_config_t config = mp_config_default();
+  config.context_switch_lite = lite;
+  mp_init(&config);
+
+  double best_secs = 1e9;
+  uint64_t best_cycles = UINT64_MAX;
+  for (int run = 0; run < RUNS; run++) {
+    const double t0 = secs_now();
+    const uint64_t c0 = cycles_now();
+    mp_resume_t* r = (mp_resume_t*)mp_prompt(&yielder, NULL);
+    while (r != NULL) {
+      r = (mp_resume_t*)mp_resume(r, NULL);
+    }
+    const uint64_t cycles = cycles_now() - c0;
+    const double secs = secs_now() - t0;
+    if (secs < best_secs) best_secs = secs;
+    if (cycles < best_cycles) best_cycles = cycles;
+  }
+  const double switches = 2.0 * (double)SWITCHES;
+  printf("%s context switch: %.2f ns", (lite ? "lite" : "full"), best_secs * 1e9 / switches);
+  if (HAS_CYCLES) printf(", %.1f cycles", (double)best_cycles / switches);
+  printf(" per switch\n");
+  return 0;
+}
@@ -36,6 +36,7 @@
 #define mp_atomic_load(p)                        mp_atomic(load)(p)
 #define mp_atomic_store(p,x)                     mp_atomic(store)(p,x)
 #define mp_atomic_add(p,x)                       mp_atomic(fetch_add)(p,x)
+#define mp_atomic_exchange(p,x)                  mp_atomic(exchange)(p,x)
 
 static inline void mp_atomic_yield(void);
 
@@ -50,9 +51,11 @@ static inline void mp_atomic_yield(void);
 #if defined(__cplusplus)
 #define mp_atomic_store_ptr(tp,p,x)             mp_atomic_store(p,(tp*)x)
 #define mp_atomic_cas_ptr(tp,p,exp,des)         mp_atomic_cas(p,exp,(tp*)des)
+#define mp_atomic_exchange_ptr(tp,p,x)          mp_atomic_exchange(p,(tp*)x)
 #else
 #define mp_atomic_store_ptr(tp,p,x)             mp_atomic_store(p,x)
 #define mp_atomic_cas_ptr(tp,p,exp,des)         mp_atomic_cas(p,exp,des)
+#define mp_atomic_exchange_ptr(tp,p,x)          mp_atomic_exchange(p,x)
 #endif
 
 #else // defined(_MSC_VER)
@@ -98,18 +101,19 @@ static inline void mp_msvc_atomic_store(_Atomic(intptr_t)*p, intptr_t x) {
   #if defined(_M_IX86) || defined(_M_X64)
     *p = x;
   #else
-    mi_atomic_exchange(p, x);
+    mp_msvc_atomic_exchange(p, x);
   #endif
 }
 
-static inline intptr_t mp_msvc_atomic_add(_Atomic(intptr_t)*p, intptr_t x) {
-  return (intptr_t)MI_64(InterlockedAdd)((volatile msc_intptr_t*)p, (msc_intptr_t)x);
+static inline intptr_t mp_msvc_atomic_fetch_add(_Atomic(intptr_t)*p, intptr_t x) {
+  return (intptr_t)MI_64(_InterlockedExchangeAdd)((volatile msc_intptr_t*)p, (msc_intptr_t)x);  // returns the previous value
 }
 
 // ptr variants
 #define mp_atomic_load_ptr(tp,p)                (tp*)mp_atomic_load((_Atomic(uintptr_t)*)(p))
 #define mp_atomic_store_ptr(tp,p,x)             mp_atomic_store((_Atomic(uintptr_t)*)(p),(uintptr_t)x)
 #define mp_atomic_cas_ptr(tp,p,exp,des)         mp_atomic_cas((_Atomic(uintptr_t)*)(p),(uintptr_t*)exp,(uintptr_t)des)
+#define mp_atomic_exchange_ptr(tp,p,x)          (tp*)mp_atomic_exchange((_Atomic(uintptr_t)*)(p),(uintptr_t)x)
 
 #endif
 
@@ -17,18 +17,59 @@ typedef struct mp_gsave_s  mp_gsave_t;
 bool         mp_gstack_init(const mp_config_t* config); // normally called automatically
 void         mp_gstack_clear_cache(void);               // clear thread-local cache of gstacks (called automatically on thread termination)
 
-mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra); 
+mp_gstack_t* mp_gstack_alloc(ssize_t size_hint, ssize_t extra_size, void** extra);  // `size_hint` selects a stack size class (0 for the default)
 void         mp_gstack_free(mp_gstack_t* gstack, bool delay);
 void         mp_gstack_enter(mp_gstack_t* g, mp_jmpbuf_t** return_jmp, mp_stack_start_fun_t* fun, void* arg);
+void         mp_gstack_commit(mp_gstack_t* g, ssize_t commit);  // commit at least `commit` bytes (from the base) up front
+ssize_t      mp_gstack_committed(const mp_gstack_t* g);         // currently committed bytes (from the base)
+ssize_t      mp_gstack_grow_count(const mp_gstack_t* g);        // stack growths on a page fault since it was allocated
+ssize_t      mp_gstack_trim(mp_gstack_t* g, const uint8_t* sp, bool eager);  // decommit beyond the stack pointer `sp` (plus slack); returns the bytes decommitted
 
 mp_gsave_t*  mp_gstack_save(mp_gstack_t* gstack, uint8_t* sp);    // save up to the given stack pointer (that should be in `gstack`)
 void         mp_gsave_restore(mp_gsave_t* gsave);
 void         mp_gsave_free(mp_gsave_t* gsave);
+mp_gstack_t* mp_gstack_clone(const mp_gstack_t* g, const uint8_t* sp, ssize_t extra_size, void** extra, ptrdiff_t* delta, uint8_t** start, ssize_t* size);  // copy up to `sp` into a fresh gstack (at a different address)
+ssize_t      mp_gstack_used(const mp_gstack_t* g, const uint8_t* sp, uint8_t** start);  // the used part from the base up to `sp` (starting at `*start`)
+ssize_t      mp_gstack_size(const mp_gstack_t* g);                                       // usable stack size
+mp_gstack_t* mp_gstack_alloc_used(ssize_t size_hint, ssize_t used, ssize_t extra_size, void** extra, uint8_t** start);  // allocate with `used` bytes committed at the base (starting at `*start`)
 
 mp_gstack_t* mp_gstack_current(void);             // implemented in <mprompt.c>
+void         mp_prompt_thread_done(void);         // implemented in <mprompt.c>; called on thread termination
 
 
 
+/*------------------------------------------------------------------------------
+  Tracing (only if `MP_TRACE` is defined)
+------------------------------------------------------------------------------*/
+
+#if !defined(MP_TRACE)
+#define MP_TRACE 0
+#endif
+
+#if MP_TRACE
+extern mp_trace_fun_t* mp_trace_hook;
+void mp_trace_emit(mp_trace_event_t event, mp_prompt_t* p, mp_gstack_t* g, size_t size);
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define mp_trace_probe(event,p,g,size)  DTRACE_PROBE4(libmprompt, event, (int)(event), p, g, size)
+#endif
+#endif
+#if !defined(mp_trace_probe)
+#define mp_trace_probe(event,p,g,size)  ((void)0)
+#endif
+
+#define mp_trace_event(event,p,g,size) \
+  do { \
+    mp_trace_probe(event,p,g,size); \
+    if (mp_unlikely(mp_trace_hook != NULL)) { mp_trace_emit(event,p,g,size); } \
+  } while(0)
+#else
+#define mp_trace_event(event,p,g,size)  ((void)0)
+#endif
+
+
 /*------------------------------------------------------------------------------
   Support address sanitizer
 ------------------------------------------------------------------------------*/
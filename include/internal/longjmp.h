@@ -48,6 +48,12 @@ mp_decl_externc mp_decl_noreturn       void  mp_longjmp(mp_jmpbuf_t* jmp);
 mp_decl_externc void* mp_stack_enter(void* stack_base, void* stack_commit_limit, void* stack_limit, 
                                      mp_jmpbuf_t** return_jmp, mp_stack_start_fun_t* fun, void* arg);
 
+// Flags in the `context_flags` of a register context; these must be set before calling `mp_setjmp`
+// and are kept as is (by both `mp_setjmp` and `mp_longjmp`).
+// With `MP_JMPBUF_LITE` the floating point control (and status) registers are neither saved nor restored.
+// This is only safe if the code between the switches does not change the floating point control state.
+#define MP_JMPBUF_LITE  (1)
+
 
 
 // Register context definitions are platform specific
@@ -87,7 +93,7 @@ struct mp_jmpbuf_s {
   void*     tib_fiber_data;        /* TIB+32   */
   uint32_t  reg_mxcrs;
   uint16_t  reg_fpcr;
-  uint16_t  context_padding;
+  uint16_t  context_flags;
 };
 
 // On windows we do not have dwarf expressions and update the return address
@@ -143,7 +149,7 @@ struct mp_jmpbuf_s {
   int64_t   reg_r15;
   uint32_t  reg_mxcrs;
   uint16_t  reg_fpcr;
-  uint16_t  context_padding;
+  uint16_t  context_flags;
 };
 
 
@@ -175,6 +181,7 @@ struct mp_jmpbuf_s {
   int64_t   reg_d13;
   int64_t   reg_d14; 
   int64_t   reg_d15;
+  int64_t   context_flags;
 };
 
 
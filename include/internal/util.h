@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>     // malloc
+#include <string.h>     // memset
 #include <sys/types.h>  // ssize_t  
 
 #if (defined(_MSC_VER) || defined(__MINGW32__)) && !defined(__ssize_t_defined)
@@ -30,16 +31,23 @@ typedef ptrdiff_t  ssize_t;
 #define mp_decl_thread          __declspec(thread)
 #define mp_decl_noreturn        __declspec(noreturn)
 #define mp_decl_returns_twice
+#define mp_decl_noclone         __declspec(noinline)
 #elif (defined(__GNUC__) && (__GNUC__>=3))  // includes clang and icc
 #define mp_decl_noinline        __attribute__((noinline))
 #define mp_decl_thread          __thread
 #define mp_decl_noreturn        __attribute__((noreturn))
 #define mp_decl_returns_twice   __attribute__((returns_twice))
+#if defined(__clang__) || defined(__INTEL_COMPILER)
+#define mp_decl_noclone         __attribute__((noinline))
+#else
+#define mp_decl_noclone         __attribute__((noinline,noclone))
+#endif
 #else
 #define mp_decl_noinline
 #define mp_decl_thread          __thread    // hope for the best :-)
 #define mp_decl_noreturn        
 #define mp_decl_returns_twice   
+#define mp_decl_noclone
 #endif
 
 
@@ -130,21 +138,45 @@ void mp_guard_init(void);
   Malloc interface (to facilitate replacing malloc)
 ------------------------------------------------------------------------------*/
 
+// Custom allocation functions (set by `mp_init`)
+typedef struct mp_allocator_s {
+  mp_malloc_fun_t*  malloc_fun;
+  mp_realloc_fun_t* realloc_fun;
+  mp_free_fun_t*    free_fun;
+  void*             arg;
+} mp_allocator_t;
+
+extern mp_allocator_t mp_allocator;
+
+void mp_allocator_init(const mp_config_t* config);
+
 #define mp_malloc_safe_tp(tp)  (tp*)mp_malloc_safe(sizeof(tp))
 #define mp_zalloc_safe_tp(tp)  (tp*)mp_zalloc_safe(sizeof(tp))
 #define mp_malloc_tp(tp)       (tp*)mp_malloc(sizeof(tp))
 #define mp_zalloc_tp(tp)       (tp*)mp_zalloc(sizeof(tp))
 
+static inline void* mp_malloc(size_t size) {
+  if (mp_unlikely(mp_allocator.malloc_fun != NULL)) return (mp_allocator.malloc_fun)(size, mp_allocator.arg);
+  return malloc(size);
+}
+
 // allocate zero initialized
 static inline void* mp_zalloc(size_t size) {
+  if (mp_unlikely(mp_allocator.malloc_fun != NULL)) {
+    void* p = (mp_allocator.malloc_fun)(size, mp_allocator.arg);
+    if (p != NULL) { memset(p, 0, size); }
+    return p;
+  }
   return calloc(1,size);
 }
 
-static inline void* mp_malloc(size_t size) {
-  return malloc(size);
+static inline void* mp_realloc(void* p, size_t newsize) {
+  if (mp_unlikely(mp_allocator.realloc_fun != NULL)) return (mp_allocator.realloc_fun)(p, newsize, mp_allocator.arg);
+  return realloc(p, newsize);
 }
 
 static inline void mp_free(void* p) {
+  if (mp_unlikely(mp_allocator.free_fun != NULL)) { (mp_allocator.free_fun)(p, mp_allocator.arg); return; }
   free(p);
 }
 
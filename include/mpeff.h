@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "mprompt.h"
 
 //------------------------------------------------------
 // Compiler specific attributes
@@ -71,10 +72,14 @@ typedef const struct mpe_optag_s {
 /// Operation functions are called when that operation is `yield`ed to. 
 typedef void* (mpe_opfun_t)(mpe_resume_t* r, void* local, void* arg);
 
+/// Operation functions that take two (word-sized) arguments (see `mpe_perform2`).
+typedef void* (mpe_opfun2_t)(mpe_resume_t* r, void* local, void* arg0, void* arg1);
+
 
 /// Operation kinds. 
 /// When defining the operations that a handler can handle, 
 /// these are specified to make the handling of operations more efficient. 
+/// (New kinds are added at the end so the values of the existing ones stay the same.)
 typedef enum mpe_opkind_e {
   MPE_OP_NULL,        ///< Invalid operation (used in static declarations to signal end of the operation array)
   MPE_OP_FORWARD,     ///< forwarding the operation, the `opfun` should be `NULL` in this case. 
@@ -85,7 +90,9 @@ typedef enum mpe_opkind_e {
   MPE_OP_SCOPED_ONCE, ///< resume at most once within the scope of an operation function.
   MPE_OP_SCOPED,      ///< resume never or multiple times within the scope of an operation function.
   MPE_OP_ONCE,        ///< resume at most once.
-  MPE_OP_MULTI        ///< resume never or multiple times.
+  MPE_OP_MULTI,       ///< resume never or multiple times.
+  MPE_OP_MAYBE_TAIL,  ///< usually like `MPE_OP_TAIL` and executed in place; but the operation function can return `mpe_resume_suspend(r)` (before performing any effects) to be invoked again at the handler as `MPE_OP_SCOPED_ONCE`.
+  MPE_OP_ABORT_FINALLY ///< never resume -- and run the finalizers (of `mpe_finally`) but not C++ destructors; this unwinds directly without an exception (and is the same as `MPE_OP_NEVER` in C)
 } mpe_opkind_t;
 
 /// Operation defintion.
@@ -94,6 +101,7 @@ typedef struct mpe_operation_s {
   mpe_opkind_t opkind;  ///< Kind of the operation
   mpe_optag_t  optag;   ///< The identifying tag
   mpe_opfun_t* opfun;   ///< The operation function; use `NULL` (with #MPE_OP_FORWARD) to have the operation forwarded to the next enclosing effect (i.e. a direct tail-resume with the same arguments).
+  mpe_opfun2_t* opfun2; ///< Alternatively (if `opfun` is `NULL`), an operation function with two arguments; these are passed directly through `mp_yieldx` without boxing them in a structure.
 } mpe_operation_t; 
 
 /// Handler definition.
@@ -112,16 +120,60 @@ typedef struct mpe_handlerdef_s {
 
 mpe_decl_export void* mpe_handle(const mpe_handlerdef_t* hdef, void* local, mpe_actionfun_t* body, void* arg);
 mpe_decl_export void* mpe_perform(mpe_optag_t optag, void* arg);
+mpe_decl_export void* mpe_perform2(mpe_optag_t optag, void* arg0, void* arg1);  // perform with two arguments (the second one is ignored by an `opfun`, and `arg1` is NULL for an `opfun2` called by `mpe_perform`)
+
+/// Evidence: a direct reference to an installed handler. This is valid as long 
+/// as the handler is installed and only in the dynamic scope of its action (and not in 
+/// its operation clauses). Performing through evidence skips the dynamic search for the 
+/// handler (and thus also ignores any mask frames).
+typedef struct mpe_evidence_s {
+  void*     handler;
+  uintptr_t id;
+} mpe_evidence_t;
+
+typedef void* (mpe_evactionfun_t)(mpe_evidence_t ev, void* arg);
+
+mpe_decl_export void* mpe_handle_ev(const mpe_handlerdef_t* hdef, void* local, mpe_evactionfun_t* body, void* arg); // pass evidence to the action
+mpe_decl_export mpe_evidence_t mpe_evidence_find(mpe_effect_t effect);                  // evidence of the innermost handler for `effect` (with a NULL handler if not found)
+mpe_decl_export void* mpe_perform_ev(mpe_evidence_t ev, mpe_optag_t optag, void* arg);
+mpe_decl_export void* mpe_perform2_ev(mpe_evidence_t ev, mpe_optag_t optag, void* arg0, void* arg1);
 
 mpe_decl_export void* mpe_resume(mpe_resume_t* resume, void* local, void* arg);
 mpe_decl_export void* mpe_resume_final(mpe_resume_t* resume, void* local, void* arg);  // final resumption
 mpe_decl_export void* mpe_resume_tail(mpe_resume_t* resume, void* local, void* arg);   // final resumption in tail position
 mpe_decl_export void  mpe_resume_release(mpe_resume_t* resume);                        // final resumption causing unwinding (raise unwind exception on resume)
+mpe_decl_export bool  mpe_resume_is_tentative(const mpe_resume_t* resume);             // invoked in place for a `MPE_OP_MAYBE_TAIL` operation? (and can thus suspend)
+mpe_decl_export void* mpe_resume_suspend(mpe_resume_t* resume);                        // invoke the `MPE_OP_MAYBE_TAIL` operation again at the handler (with a scoped once resumption)
+mpe_decl_export mpe_resume_t* mpe_resume_clone(mpe_resume_t* resume);                  // an independent once resumption on fresh stacks, see `mp_resume_clone` (or NULL)
 
 
 mpe_decl_export void* mpe_mask(mpe_effect_t eff, size_t from, mpe_actionfun_t* fun, void* arg);
 mpe_decl_export void* mpe_finally(void* local, mpe_releasefun_t* finally_fun, mpe_actionfun_t* fun, void* arg);
 
+/// Migration: the handler frames are linked through the stacks of the prompts they are installed in.
+/// To suspend a prompt directly (using `mp_yield`) while handlers are installed inside it, enter it 
+/// with `mpe_prompt` and yield with `mpe_yield`. This detaches the handler frames of the prompt while
+/// it is suspended, and relinks them to the handlers of the resumer, which can be another thread.
+mpe_decl_export void* mpe_prompt(mp_start_fun_t* fun, void* arg);
+mpe_decl_export void* mpe_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg);
+mpe_decl_export void* mpe_resume_transfer(mp_prompt_t* p, mp_resume_t** from, mp_resume_t* target, void* arg);  // `mp_resume_transfer` to a `target` suspended with `mpe_yield`
+
+/// Profiles per effect: when `prompt_profile` is enabled (see `mp_prompt_profile`), the profile of 
+/// the prompt of each handler is added to the profile of its effect when the handler completes.
+/// The ticks of a handler include the time of its action and of the operations it resumed, but
+/// not of its operation clauses. A high count of resumes relative to the ticks shows a chatty yield loop.
+typedef struct mpe_effect_profile_s {
+  mpe_effect_t       effect;
+  size_t             handled;       ///< completed handlers
+  unsigned long long ticks;         ///< total ticks running inside the handlers
+  size_t             resumes;       ///< total resumes of the handlers (after yielding an operation to them)
+  size_t             stack_peak;    ///< largest peak committed stack of a handler
+  size_t             stack_grows;   ///< total stack growths on a page fault
+} mpe_effect_profile_t;
+
+mpe_decl_export size_t mpe_effect_profiles(mpe_effect_profile_t* profiles, size_t max_count);  // returns the total number of profiled effects (which may be more than `max_count`)
+mpe_decl_export void   mpe_effect_profiles_reset(void);
+
 
 /*-----------------------------------------------------------------
   Operation tags
@@ -173,6 +225,10 @@ restype effect##_##op();
 MPE_DECLARE_OP(effect,op) \
 restype effect##_##op(argtype arg);
 
+#define MPE_DECLARE_OP2(effect,op,restype,argtype0,argtype1) \
+MPE_DECLARE_OP(effect,op) \
+restype effect##_##op(argtype0 arg0, argtype1 arg1);
+
 #define MPE_DECLARE_VOIDOP0(effect,op) \
 MPE_DECLARE_OP(effect,op) \
 void effect##_##op();
@@ -181,6 +237,10 @@ void effect##_##op();
 MPE_DECLARE_OP(effect,op) \
 void effect##_##op(argtype arg);
 
+#define MPE_DECLARE_VOIDOP2(effect,op,argtype0,argtype1) \
+MPE_DECLARE_OP(effect,op) \
+void effect##_##op(argtype0 arg0, argtype1 arg1);
+
 
 #define MPE_DEFINE_EFFECT0(effect) \
 const char* MPE_EFFECT(effect)[2] = { #effect, NULL }; 
@@ -241,6 +301,12 @@ const struct mpe_optag_s MPE_OPTAG_DEF(effect,op7) = { MPE_EFFECT(effect), 6 };
 #define MPE_DEFINE_OP1(effect,op,restype,argtype) \
   restype effect##_##op(argtype arg) { void* res = mpe_perform(MPE_OPTAG(effect,op), mpe_voidp_##argtype(arg)); return mpe_##restype##_voidp(res); }
 
+#define MPE_DEFINE_OP2(effect,op,restype,argtype0,argtype1) \
+  restype effect##_##op(argtype0 arg0, argtype1 arg1) { void* res = mpe_perform2(MPE_OPTAG(effect,op), mpe_voidp_##argtype0(arg0), mpe_voidp_##argtype1(arg1)); return mpe_##restype##_voidp(res); }
+
+#define MPE_DEFINE_VOIDOP2(effect,op,argtype0,argtype1) \
+  void effect##_##op(argtype0 arg0, argtype1 arg1) { mpe_perform2(MPE_OPTAG(effect,op), mpe_voidp_##argtype0(arg0), mpe_voidp_##argtype1(arg1)); }
+
 #define MPE_DEFINE_VOIDOP0(effect,op) \
   void effect##_##op() { mpe_perform(MPE_OPTAG(effect,op), NULL); }
 
@@ -0,0 +1,358 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MPE_EFFECT_HPP
+#define MPE_EFFECT_HPP
+
+/* ----------------------------------------------------------------------------
+  A header-only C++17 layer over `mpeff.h`.
+
+  Effects and operations are types, and handlers are plain objects with an
+  overloaded call operator per operation. The `mpe_handlerdef_t` of a handler
+  is generated at compile time, and arguments and results are passed by
+  pointer to their (typed) storage instead of being boxed in a `void*`:
+
+    struct state;
+    struct get : mpe::op<state, long()> { static constexpr const char* name = "get"; };
+    struct set : mpe::op<state, void(long)> { static constexpr const char* name = "set"; };
+    struct state : mpe::effect<state, get, set> { static constexpr const char* name = "state"; };
+
+    struct state_handler {
+      long st;
+      long operator()(get) { return st; }           // tail resumptive (`MPE_OP_TAIL`)
+      void operator()(set, long x) { st = x; }
+      static constexpr mpe_opkind_t opkind(get) { return MPE_OP_TAIL_NOOP; }
+    };
+
+    state_handler h{ 42 };
+    long x = mpe::handle<state>(h, [] { return mpe::perform<get>() + 1; });
+
+  An operation clause `R operator()(Op, Args...)` is tail resumptive: its result
+  is resumed with directly. A clause that takes a resumption as its second
+  argument, `T operator()(Op, mpe::resume<R,T> k, Args...)`, can resume
+  with `k(value)` (returning the result of the resumed handler), or not at all,
+  in which case the performer is unwound when `k` is destructed. Its own result
+  (of type `T`, the result type of the body) becomes the result of `handle`.
+
+  The kind of an operation is `MPE_OP_TAIL` for tail resumptive clauses and
+  `MPE_OP_ONCE` otherwise, unless the handler declares a (static constexpr)
+  `opkind(Op)` function; tail resumptive clauses can be `MPE_OP_TAIL_NOOP`
+  (if they do not perform operations themselves) and the others `MPE_OP_MULTI`.
+
+  If the body takes an `mpe::evidence<H>` argument, operations performed
+  through that evidence skip the dynamic search for the handler, and
+  `MPE_OP_TAIL_NOOP` operations are called directly (such that the compiler
+  can inline them). Evidence is only valid in the dynamic scope of the body.
+
+  note: the handler object is held by reference and is the `local` state of
+  the handler; all resumptions (also of multi-shot resumptions) share it.
+-----------------------------------------------------------------------------*/
+
+#include <cstdlib>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "mpeff.h"
+
+namespace mpe {
+
+/*-----------------------------------------------------------------
+  Effect and operation definitions
+-----------------------------------------------------------------*/
+
+// An operation `Op` of effect `Eff` with signature `R(Args...)`; define as `struct Op : mpe::op<Eff, R(Args...)> {}`.
+template<class Eff, class Sig> struct op;
+
+template<class Eff, class R, class... Args>
+struct op<Eff, R(Args...)> {
+  using effect_type = Eff;
+  using result_type = std::decay_t<R>;
+  using args_type   = std::tuple<std::decay_t<Args>...>;
+};
+
+namespace detail {
+  template<class T, class = void> struct name_of {
+    static constexpr const char* value = "<op>";
+  };
+  template<class T> struct name_of<T, std::void_t<decltype(T::name)>> {
+    static constexpr const char* value = T::name;
+  };
+}
+
+// An effect `Eff` with operations `Ops...`; define as `struct Eff : mpe::effect<Eff, Ops...> { static constexpr const char* name = "eff"; }`.
+template<class Eff, class... Ops>
+struct effect {
+  static_assert(sizeof...(Ops) <= 8, "mpe::effect: an effect can have at most 8 operations");
+  using ops_type = std::tuple<Ops...>;
+
+  // the names are used as the (unique) effect tag
+  static inline const char* names[sizeof...(Ops) + 2] = { Eff::name, detail::name_of<Ops>::value..., nullptr };
+
+  template<class Op>
+  static constexpr long index_of() {
+    long i = 0;
+    long idx = -1;
+    ((std::is_same_v<Op, Ops> ? (idx = i, i++) : i++), ...);
+    return idx;
+  }
+
+  template<class Op>
+  static inline const struct mpe_optag_s optag = { names, index_of<Op>() };
+};
+
+
+namespace detail {
+
+  // Storage for a value of type `T` (or nothing if it is `void`)
+  template<class T>
+  struct slot {
+    std::optional<T> value;
+    template<class F> void set(F&& f) { value.emplace(std::forward<F>(f)()); }
+    T take() { return std::move(*value); }
+  };
+
+  template<>
+  struct slot<void> {
+    template<class F> void set(F&& f) { std::forward<F>(f)(); }
+    void take() { }
+  };
+
+  // The environment of a perform: the arguments, and the result of a tail resumptive clause
+  template<class Op>
+  struct perform_env {
+    typename Op::args_type            args;
+    slot<typename Op::result_type>    result;
+  };
+
+  // The local state of a handler: the handler object and the result of `handle`
+  template<class H, class T>
+  struct handler_local {
+    H*       handler;
+    slot<T>* out;
+  };
+
+  template<class Op, class F, size_t... I>
+  decltype(auto) apply_args(F&& f, typename Op::args_type& args, std::index_sequence<I...>) {
+    return std::forward<F>(f)(std::move(std::get<I>(args))...);
+  }
+
+  template<class Op, class F>
+  decltype(auto) apply_args(F&& f, typename Op::args_type& args) {
+    return apply_args<Op>(std::forward<F>(f), args, std::make_index_sequence<std::tuple_size_v<typename Op::args_type>>{});
+  }
+
+  [[noreturn]] inline void unhandled(mpe_optag_t optag) {
+    (void)(optag);    // the message is already printed by `mpe_perform`
+    std::abort();
+  }
+
+} // namespace detail
+
+
+/*-----------------------------------------------------------------
+  Resumptions
+-----------------------------------------------------------------*/
+
+// A resumption that resumes with a value of type `R`, returning the result `T` of the resumed handler.
+// If it was not resumed (or, for `MPE_OP_MULTI`, after its last use) it is released when destructed.
+template<class R, class T>
+class resume {
+  mpe_resume_t*     r;
+  void*             local;
+  detail::slot<T>*  out;
+  bool              multi;
+
+public:
+  resume(mpe_resume_t* resumption, void* hlocal, detail::slot<T>* result, bool is_multi) : r(resumption), local(hlocal), out(result), multi(is_multi) { }
+  resume(const resume&) = delete;
+  resume& operator=(const resume&) = delete;
+  resume(resume&& k) noexcept : r(k.r), local(k.local), out(k.out), multi(k.multi) { k.r = nullptr; }
+  ~resume() { release(); }
+
+  // Resume with a value; a once resumption can only be resumed once.
+  template<class... V>
+  T operator()(V&&... value) {
+    if (r == nullptr) std::abort();   // resumed more than once or after being released
+    detail::slot<R> result;
+    result.set([&]() -> R { if constexpr (!std::is_void_v<R>) { return R(std::forward<V>(value)...); } });
+    mpe_resume_t* k = r;
+    if (!multi) {
+      r = nullptr;
+      mpe_resume_final(k, local, &result);
+    }
+    else {
+      mpe_resume(k, local, &result);
+    }
+    return out->take();
+  }
+
+  // Release without resuming (unwinding the performer if needed)
+  void release() {
+    if (r != nullptr) {
+      mpe_resume_t* k = r;
+      r = nullptr;
+      mpe_resume_release(k);
+    }
+  }
+};
+
+
+namespace detail {
+
+  // Is `Op` handled by a tail resumptive clause of `H`?
+  template<class H, class Op, class Args = typename Op::args_type> struct is_tail_clause;
+  template<class H, class Op, class... Args>
+  struct is_tail_clause<H, Op, std::tuple<Args...>> : std::is_invocable<H&, Op, Args&&...> { };
+
+  // Is `Op` handled by a clause of `H` that takes a resumption?
+  template<class H, class T, class Op, class Args = typename Op::args_type> struct is_resume_clause;
+  template<class H, class T, class Op, class... Args>
+  struct is_resume_clause<H, T, Op, std::tuple<Args...>> : std::is_invocable<H&, Op, resume<typename Op::result_type, T>&&, Args&&...> { };
+
+  // The declared operation kind (if any)
+  template<class H, class Op, class = void> struct declared_opkind {
+    static constexpr mpe_opkind_t value = MPE_OP_NULL;
+  };
+  template<class H, class Op> struct declared_opkind<H, Op, std::void_t<decltype(H::opkind(Op{}))>> {
+    static constexpr mpe_opkind_t value = H::opkind(Op{});
+  };
+
+  template<class H, class T, class Op>
+  constexpr mpe_opkind_t opkind_of() {
+    constexpr mpe_opkind_t kind = declared_opkind<H, Op>::value;
+    if constexpr (is_tail_clause<H, Op>::value) {
+      static_assert(kind == MPE_OP_NULL || kind == MPE_OP_TAIL || kind == MPE_OP_TAIL_NOOP,
+                    "mpe::handle: a tail resumptive clause must have kind MPE_OP_TAIL or MPE_OP_TAIL_NOOP");
+      return (kind == MPE_OP_NULL ? MPE_OP_TAIL : kind);
+    }
+    else {
+      static_assert(is_resume_clause<H, T, Op>::value, "mpe::handle: the handler has no clause for an operation of the effect");
+      static_assert(kind == MPE_OP_NULL || kind == MPE_OP_ONCE || kind == MPE_OP_MULTI,
+                    "mpe::handle: a clause with a resumption must have kind MPE_OP_ONCE or MPE_OP_MULTI");
+      return (kind == MPE_OP_NULL ? MPE_OP_ONCE : kind);
+    }
+  }
+
+  // The operation function of a clause
+  template<class H, class T, class Op>
+  void* opfun(mpe_resume_t* r, void* local, void* arg) {
+    handler_local<H, T>* hl = static_cast<handler_local<H, T>*>(local);
+    perform_env<Op>* env = static_cast<perform_env<Op>*>(arg);
+    H& h = *hl->handler;
+    if constexpr (is_tail_clause<H, Op>::value) {
+      // executed in place by `mpe_perform` (with an in-place resumption); just return to the performer
+      (void)(r);
+      env->result.set([&]() -> decltype(auto) { return apply_args<Op>([&](auto&&... xs) -> decltype(auto) { return h(Op{}, std::forward<decltype(xs)>(xs)...); }, env->args); });
+      return &env->result;
+    }
+    else {
+      // note: the arguments are moved out of the performer as it may be unwound before the clause returns
+      typename Op::args_type args = std::move(env->args);
+      resume<typename Op::result_type, T> k(r, local, hl->out, opkind_of<H, T, Op>() == MPE_OP_MULTI);
+      hl->out->set([&]() -> decltype(auto) { return apply_args<Op>([&](auto&&... xs) -> decltype(auto) { return h(Op{}, std::move(k), std::forward<decltype(xs)>(xs)...); }, args); });
+      return nullptr;
+    }
+  }
+
+  // The handler definition of `H` for effect `Eff` where the body has result type `T`
+  template<class Eff, class H, class T, class Ops = typename Eff::ops_type> struct handlerdef;
+  template<class Eff, class H, class T, class... Ops>
+  struct handlerdef<Eff, H, T, std::tuple<Ops...>> {
+    static inline const mpe_handlerdef_t def = {
+      Eff::names, nullptr, { { opkind_of<H, T, Ops>(), &Eff::template optag<Ops>, &opfun<H, T, Ops> }... }
+    };
+  };
+
+
+  // Perform through the handler found by `find_perform`
+  template<class Op, class P, class... A>
+  typename Op::result_type perform_with(P&& find_perform, A&&... args) {
+    perform_env<Op> env{ typename Op::args_type(std::forward<A>(args)...), {} };
+    void* res = std::forward<P>(find_perform)(&Op::effect_type::template optag<Op>, &env);
+    if (res == nullptr) unhandled(&Op::effect_type::template optag<Op>);
+    return static_cast<slot<typename Op::result_type>*>(res)->take();
+  }
+
+  template<class H, class T, class F>
+  struct handle_env {
+    F*                      body;
+    handler_local<H, T>*    local;
+  };
+
+} // namespace detail
+
+
+/*-----------------------------------------------------------------
+  Perform
+-----------------------------------------------------------------*/
+
+// Perform operation `Op` with the given arguments, handled by the innermost handler of its effect.
+template<class Op, class... A>
+typename Op::result_type perform(A&&... args) {
+  return detail::perform_with<Op>([](mpe_optag_t optag, void* env) { return mpe_perform(optag, env); }, std::forward<A>(args)...);
+}
+
+
+// Evidence of an installed handler `H`; passed to the body of `handle` if it takes an argument.
+template<class H>
+class evidence {
+  mpe_evidence_t ev;
+  H*             handler;
+
+public:
+  evidence(mpe_evidence_t ev, H* handler) : ev(ev), handler(handler) { }
+
+  // Perform operation `Op` at this handler; `MPE_OP_TAIL_NOOP` operations are called directly.
+  template<class Op, class... A>
+  typename Op::result_type perform(A&&... args) const {
+    if constexpr (detail::is_tail_clause<H, Op>::value && detail::declared_opkind<H, Op>::value == MPE_OP_TAIL_NOOP) {
+      return (*handler)(Op{}, std::forward<A>(args)...);
+    }
+    else {
+      const mpe_evidence_t e = ev;
+      return detail::perform_with<Op>([e](mpe_optag_t optag, void* env) { return mpe_perform_ev(e, optag, env); }, std::forward<A>(args)...);
+    }
+  }
+};
+
+
+/*-----------------------------------------------------------------
+  Handle
+-----------------------------------------------------------------*/
+
+// Handle the operations of effect `Eff` performed in `body()` (or `body(mpe::evidence<H>)`) with the clauses of `handler`.
+template<class Eff, class H, class F>
+auto handle(H& handler, F&& body) {
+  using body_type = std::remove_reference_t<F>;
+  constexpr bool with_evidence = std::is_invocable_v<body_type&, evidence<H>>;
+  using T = std::decay_t<typename std::conditional_t<with_evidence, std::invoke_result<body_type&, evidence<H>>, std::invoke_result<body_type&>>::type>;
+  detail::slot<T> out;
+  detail::handler_local<H, T> local{ &handler, &out };
+  detail::handle_env<H, T, body_type> env{ &body, &local };
+  const mpe_handlerdef_t* hdef = &detail::handlerdef<Eff, H, T>::def;
+  if constexpr (with_evidence) {
+    mpe_handle_ev(hdef, &local, [](mpe_evidence_t ev, void* arg) -> void* {
+      auto* env = static_cast<detail::handle_env<H, T, body_type>*>(arg);
+      evidence<H> e(ev, env->local->handler);
+      env->local->out->set([&]() -> decltype(auto) { return (*env->body)(e); });
+      return nullptr;
+    }, &env);
+  }
+  else {
+    mpe_handle(hdef, &local, [](void* arg) -> void* {
+      auto* env = static_cast<detail::handle_env<H, T, body_type>*>(arg);
+      env->local->out->set([&]() -> decltype(auto) { return (*env->body)(); });
+      return nullptr;
+    }, &env);
+  }
+  return out.take();
+}
+
+} // namespace mpe
+
+#endif
@@ -0,0 +1,69 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MPIO_MPIO_H
+#define MPIO_MPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>     // ssize_t
+#include <sys/socket.h>    // struct sockaddr, socklen_t
+#include <sys/uio.h>       // struct iovec
+#include "mpeff.h"
+
+//------------------------------------------------------
+// Compiler specific attributes
+//------------------------------------------------------
+#if defined(__GNUC__) // includes clang and icc
+#define mpio_decl_export     __attribute__((visibility("default")))
+#else
+#define mpio_decl_export
+#endif
+
+
+//------------------------------------------------------
+// Asynchronous I/O as an effect.
+// Strands run under an I/O event loop and can use direct-style blocking calls:
+// these suspend the current strand until the operation completes while other
+// strands keep running. Completions are resumed in batches.
+// Uses io_uring on Linux when available, and epoll (or poll) otherwise.
+//------------------------------------------------------
+
+typedef enum mpio_backend_e {
+  MPIO_BACKEND_DEFAULT,   // io_uring if available, and otherwise readiness based
+  MPIO_BACKEND_URING,     // io_uring (Linux 5.6+)
+  MPIO_BACKEND_POLL       // readiness based: epoll on Linux, poll elsewhere
+} mpio_backend_t;
+
+// Run `action(arg)` as the first strand of a fresh event loop, and return its
+// result once all strands are done.
+mpio_decl_export void*  mpio_main(mpe_actionfun_t* action, void* arg);
+mpio_decl_export void*  mpio_main_ex(mpio_backend_t backend, mpe_actionfun_t* action, void* arg);
+
+// Start a new strand `action(arg)` in the current event loop (its result is ignored).
+mpio_decl_export void   mpio_fork(mpe_actionfun_t* action, void* arg);
+
+// Asynchronous operations: these suspend the current strand until completion and
+// return -1 with `errno` set on failure (like their POSIX counterparts).
+// Note: the poll backend puts file descriptors in non-blocking mode, and
+// descriptors should be closed with `mpio_close`.
+mpio_decl_export ssize_t mpio_read(int fd, void* buf, size_t count);
+mpio_decl_export ssize_t mpio_write(int fd, const void* buf, size_t count);
+mpio_decl_export int     mpio_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+mpio_decl_export int     mpio_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+mpio_decl_export int     mpio_sleep(uint64_t msecs);
+mpio_decl_export int     mpio_close(int fd);
+
+// Register buffers with the current event loop so reads and writes within them are zero-copy.
+// Returns `false` if the backend does not support registered buffers (in which case they are still usable as is).
+mpio_decl_export bool    mpio_register_buffers(const struct iovec* iovs, size_t count);
+
+// The backend of the current event loop ("io_uring", "epoll", or "poll"), or NULL outside an event loop.
+mpio_decl_export const char* mpio_backend_name(void);
+
+#endif
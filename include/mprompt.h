@@ -8,6 +8,8 @@
 #ifndef MP_MPROMPT_H
 #define MP_MPROMPT_H 
 
+#include <stddef.h>   // size_t
+
 //------------------------------------------------------
 // Compiler specific attributes
 //------------------------------------------------------
@@ -37,6 +39,7 @@ typedef struct mp_resume_s   mp_resume_t;     // abstract resumption
 // Function types
 typedef void* (mp_start_fun_t)(mp_prompt_t*, void* arg); 
 typedef void* (mp_yield_fun_t)(mp_resume_t*, void* arg);  
+typedef void* (mp_yieldx_fun_t)(mp_resume_t*, void* arg0, void* arg1, void* arg2, void* arg3);
 
 // Continue with `fun(p,arg)` under a fresh prompt `p`.
 mp_decl_export void* mp_prompt(mp_start_fun_t* fun, void* arg); 
@@ -49,6 +52,24 @@ mp_decl_export void* mp_resume(mp_resume_t* resume, void* arg);      // resume
 mp_decl_export void* mp_resume_tail(mp_resume_t* resume, void* arg); // resume as the last action in a `mp_yield_fun_t`
 mp_decl_export void  mp_resume_drop(mp_resume_t* resume);            // drop the resume object without resuming
 
+// Yield and resume with a few word-sized values: the arguments are passed directly to `fun(r,arg0,...,arg3)` and
+// `mp_resumex` passes two results (where `*result1` receives the second one), without going through an
+// environment on the stack. Resuming an `mp_yieldx` with `mp_resume` gives a NULL `*result1`.
+mp_decl_export void* mp_yieldx(mp_prompt_t* p, mp_yieldx_fun_t* fun, void* arg0, void* arg1, void* arg2, void* arg3, void** result1);
+mp_decl_export void* mp_resumex(mp_resume_t* resume, void* result0, void* result1);
+mp_decl_export void* mp_resumex_tail(mp_resume_t* resume, void* result0, void* result1);
+
+// Resume `rs[i]` with `args[i]` for each `i < n` in order, and store the result of each (as returned by `mp_resume`) in `results[i]`. 
+// This is more efficient than resuming each individually as the return point is set up only once.
+// Both `args` and `results` can be NULL.
+mp_decl_export void  mp_resume_batch(mp_resume_t** rs, void** args, size_t n, void** results);
+
+// Symmetric transfer: suspend up to the parent prompt `p` (as if yielding), store the resumption of the
+// current computation in `*from`, and directly resume `target` with `arg` in its place (under the same parent).
+// This switches stacks once instead of twice through the parent. When `target` later yields or returns, it
+// returns to the parent as if the parent resumed `target` itself. Returns the argument passed when `*from` is resumed.
+mp_decl_export void* mp_resume_transfer(mp_prompt_t* p, mp_resume_t** from, mp_resume_t* target, void* arg);
+
 
 //---------------------------------------------------------------------------
 // Multi-shot resumptions; use with care in combination with linear resources.
@@ -57,6 +78,26 @@ mp_decl_export void  mp_resume_drop(mp_resume_t* resume);            // drop the
 mp_decl_export mp_resume_t* mp_resume_multi(mp_resume_t* r);  // consume a resumption and return one that can be invoked multiple times
 mp_decl_export mp_resume_t* mp_resume_dup(mp_resume_t* r);    // only multi-resumptions can be dup'd
 
+// Clone a suspended resumption into fresh gstacks at different addresses, without consuming `r`. The
+// returned at-most-once resumption is independent of `r` and can be resumed concurrently with it on
+// another thread (as in speculative parallel search). The words on the cloned stacks that point into the 
+// original stacks (or prompts) are relocated; this is conservative and means the continuation must not 
+// keep pointers to its stack frames in heap data (or hide them). Returns NULL on failure (with `errno` 
+// set to ENOMEM, EBUSY if `r` is currently being resumed, or ENOSYS if this is not supported on the platform).
+mp_decl_export mp_resume_t* mp_resume_clone(mp_resume_t* r);
+
+// Serialize a suspended resumption (without consuming it) into `buf` (of `buf_size` bytes) for checkpointing. 
+// Returns the size of the snapshot, and only writes it if it fits in `buf` (so use a NULL `buf` to get the size).
+// Returns 0 on failure (with `errno` set). The snapshot can be restored with `mp_resume_deserialize` as 
+// a once resumption in fresh gstacks, also in a later process running the same binary. This relocates as
+// `mp_resume_clone` and additionally pointers into the binary (and the stack protector canary); the 
+// continuation must not refer to heap or thread local data, nor to code in other shared libraries.
+// A snapshot is rejected (with EINVAL) if it does not come from this binary, or if its prompts and
+// resume and return points do not form a chain within its own stacks. Restoring requires the extent
+// of the binary to be known (currently on Linux only).
+mp_decl_export size_t       mp_resume_serialize(mp_resume_t* r, void* buf, size_t buf_size);
+mp_decl_export mp_resume_t* mp_resume_deserialize(const void* buf, size_t size);   // returns NULL on failure (with `errno` set to EINVAL, ENOMEM, or ENOSYS)
+
 
 
 //---------------------------------------------------------------------------
@@ -65,18 +106,43 @@ mp_decl_export mp_resume_t* mp_resume_dup(mp_resume_t* r);    // only multi-resu
 #include <stddef.h>
 #include <stdbool.h>
 
+// Custom allocation functions for the meta data of prompts, resumptions, and saved stacks
+// (but not for the stack memory itself). Each receives the `alloc_arg` from the configuration.
+typedef void* (mp_malloc_fun_t)(size_t size, void* arg);
+typedef void* (mp_realloc_fun_t)(void* p, size_t newsize, void* arg);
+typedef void  (mp_free_fun_t)(void* p, void* arg);
+
 // Configuration settings
 typedef struct mp_config_s {
   bool      gpool_enable;         // enable gpools for in-process reuse of stack memory (besides the thread-local cache)
+  bool      gpool_numa;           // partition the gpools per NUMA node and allocate gstacks from the node of the calling thread; only used if there is more than one node (true)
   bool      stack_grow_fast;      // grow stacks by doubling (to up to 1MiB at a time) instead of per-page
   bool      stack_use_overcommit; // use overcommit on systems that support this (Linux only) -- disables gpools and fast stack growing.
   bool      stack_reset_decommits;// instead of resetting memory in a gpool, use a full decommit in instead.
+  bool      stack_save_incremental;// use dirty page tracking to save and restore multi-shot resumptions incrementally (not on Windows) (false)
+  bool      stack_restore_lazy;   // restore multi-shot resumptions on demand as frames are returned into; implies `stack_save_incremental` (false)
+  bool      stack_trim_on_yield;  // trim a gstack at every yield once it has more than twice `stack_trim_slack` committed beyond its stack pointer (see `mp_prompt_trim`) (false)
+  bool      context_switch_lite;  // do not save and restore the floating point control state when switching stacks; only use if no code changes it (e.g. the rounding mode) (false)
+  bool      prompt_profile;       // account the running time, resumes, and stack growth of each prompt (see `mp_prompt_profile`) (false)
   ptrdiff_t gpool_max_size;       // maximum virtual size per gpool (256 GiB)
   ptrdiff_t stack_max_size;       // maximum virtual size of a gstack (8 MiB)
   ptrdiff_t stack_exn_guaranteed; // guaranteed extra stack space available during exception unwinding (Windows only) (16 KiB)
   ptrdiff_t stack_initial_commit; // initial commit size of a gstack (OS page size, 4 KiB)
   ptrdiff_t stack_gap_size;       // virtual no-access gap between stacks for security (64 KiB)
-  ptrdiff_t stack_cache_count;    // count of gstacks to keep in a thread-local cache (4)  
+  ptrdiff_t stack_keep_hot;       // when a gstack is freed to a gpool, keep the memory of its first N bytes (from the base) instead of resetting it (0)
+  ptrdiff_t stack_cache_count;    // minimal count of gstacks to keep in a thread-local cache (4)  
+  ptrdiff_t stack_cache_max_count;// the thread-local cache adapts to the observed demand up to this count (64)
+  ptrdiff_t stack_cache_max_committed; // bound on the total committed memory held in all thread-local caches (256 MiB)
+  ptrdiff_t stack_delayed_max_count; // bound on the gstacks per thread that are kept alive until an exception propagated out of them is caught; beyond it the oldest are freed (32)
+  ptrdiff_t stack_small_size;     // maximum virtual size of a gstack in the small size class, used for prompts created with a small size hint; 0 to disable (128 KiB)
+  ptrdiff_t stack_large_size;     // maximum virtual size of a gstack in the large size class, used for prompts created with a size hint above `stack_max_size`; 0 to disable (64 MiB)
+  ptrdiff_t stack_heap_size;      // if > 0, use fixed size heap allocated gstacks of this size that never grow; no virtual memory is reserved and no fault handler is installed. Overflow is detected (and fatal) when a gstack is freed (0, disabled)
+  ptrdiff_t stack_trim_slack;     // stack space beyond the stack pointer that stays committed when trimming a gstack (64 KiB)
+  ptrdiff_t stack_huge_from;      // commit the parts of a stack deeper than this (from the base) in 2 MiB ranges advised for transparent huge pages; Linux only (0, disabled)
+  mp_malloc_fun_t*  malloc_fun;   // custom allocator; either all three functions are given or none (NULL, using `malloc`)
+  mp_realloc_fun_t* realloc_fun;  
+  mp_free_fun_t*    free_fun;     
+  void*             alloc_arg;    // passed to the custom allocation functions (NULL)
 } mp_config_t;
 
 // Initialize with `config`; use NULL for default settings.
@@ -84,6 +150,128 @@ typedef struct mp_config_s {
 // Use as: `mp_config_t config = mp_config_default(); config.<setting> = <N>; mp_init(&config);`.
 mp_decl_export void        mp_init(const mp_config_t* config);
 mp_decl_export mp_config_t mp_config_default(void);  // default configuration for this platform
+mp_decl_export void        mp_thread_init(void);      // initialize the current thread (optional: done on demand when creating or resuming prompts)
+
+
+//---------------------------------------------------------------------------
+// Generators with batched yields.
+// The producer `fun(g,arg)` runs under its own prompt and copies its elements into a
+// buffer of `capacity` elements owned by the generator; it only switches back to the consumer
+// when the buffer is full (or when it returns), and the consumer only resumes the producer
+// once the buffer is empty. A generator is used by one consumer at a time.
+//---------------------------------------------------------------------------
+
+typedef struct mp_gen_s mp_gen_t;
+typedef void (mp_gen_fun_t)(mp_gen_t* g, void* arg);
+
+mp_decl_export mp_gen_t*   mp_gen_create(mp_gen_fun_t* fun, void* arg, size_t elem_size, size_t capacity);  // use a `capacity` of 0 for a buffer of about 4 KiB; the producer starts at the first request for an element
+mp_decl_export void        mp_gen_free(mp_gen_t* g);                                  // a suspended producer is dropped without resuming it
+
+// Producer side (only from within `fun`)
+mp_decl_export void        mp_gen_yield(mp_gen_t* g, const void* elem);               // copy an element of `elem_size` bytes into the buffer
+mp_decl_export void        mp_gen_yield_many(mp_gen_t* g, const void* elems, size_t n);
+
+// Consumer side
+mp_decl_export bool        mp_gen_next(mp_gen_t* g, void* elem);                      // copy the next element into `elem`; returns `false` at the end
+mp_decl_export size_t      mp_gen_next_many(mp_gen_t* g, void* elems, size_t max);    // copy up to `max` elements into `elems`; returns 0 only at the end
+mp_decl_export const void* mp_gen_next_span(mp_gen_t* g, size_t* count);              // consume the next contiguous elements in the buffer in place (valid until the next call on `g`); returns NULL at the end
+mp_decl_export bool        mp_gen_is_done(const mp_gen_t* g);                         // the producer returned and all elements are consumed
+
+
+//---------------------------------------------------------------------------
+// Statistics
+// Counters are kept per thread and aggregated on demand, so the totals are
+// approximate while other threads are running. Gstacks are counted by the thread
+// that allocated or freed them.
+//---------------------------------------------------------------------------
+
+typedef struct mp_stats_s {
+  size_t    gstack_live;          // gstacks currently in use
+  size_t    gstack_cached;        // gstacks in the thread-local caches
+  size_t    gstack_delayed;       // gstacks on the delayed free lists (kept alive during exception unwinding)
+  size_t    gstack_delayed_forced;// delayed gstacks that were freed before their exception was caught (see `stack_delayed_max_count`)
+  size_t    gstack_reserved;      // reserved virtual memory of all gstacks that are not released to the OS (or a gpool)
+  size_t    gstack_committed;     // estimated committed memory of those gstacks
+  size_t    gstack_allocs;        // total gstack allocations
+  size_t    gstack_os_allocs;     // total gstack allocations that were not served from a cache
+  size_t    commit_faults;        // page faults served by committing stack pages on demand
+  size_t    commit_fast_grows;    // of those, the faults that committed more than one page at once
+  size_t    commit_huge_grows;    // of those, the faults that committed a range for transparent huge pages (see `stack_huge_from`)
+  size_t    commit_trims;         // trims that decommitted stack pages (see `mp_prompt_trim`)
+  size_t    gsave_count;          // total saves of a gstack (for multi-shot resumptions)
+  size_t    gsave_bytes;          // total bytes copied by saves
+  size_t    gsave_restore_bytes;  // total bytes copied by restores
+  size_t    gpool_count;          // number of gpools
+  size_t    gpool_blocks;         // total gstack blocks in all gpools
+  size_t    gpool_blocks_used;    // blocks in all gpools that are currently allocated
+} mp_stats_t;
+
+typedef struct mp_gpool_stats_s {
+  void*     start;                // start of the reserved area
+  size_t    size;                 // size of the reserved area
+  size_t    blocks;               // number of gstack blocks (including the first ones holding the gpool info)
+  size_t    blocks_used;          // blocks that are currently allocated
+  size_t    blocks_fresh;         // blocks that were never used
+  int       numa_node;            // the preferred NUMA node of the physical pages (or -1 if not bound to a node)
+} mp_gpool_stats_t;
+
+mp_decl_export void   mp_stats_get(mp_stats_t* stats);
+mp_decl_export size_t mp_stats_get_gpools(mp_gpool_stats_t* stats, size_t max_count);  // returns the total number of gpools (which may be more than `max_count`)
+
+
+//---------------------------------------------------------------------------
+// Profiling
+// Only accounted when `prompt_profile` is enabled in the configuration. A prompt
+// is running from the moment it is entered or resumed until it yields or returns 
+// up to its parent; this includes the time of prompts that run nested inside it.
+// Time is measured in ticks of the cycle counter (`rdtsc` on x64 and `cntvct_el0` 
+// on arm64, otherwise a monotonic clock in nanoseconds).
+//---------------------------------------------------------------------------
+
+typedef struct mp_prompt_profile_s {
+  unsigned long long ticks;       // cumulative ticks while running
+  size_t    resumes;              // times resumed (not counting the initial entry)
+  size_t    stack_peak;           // peak committed stack in bytes (sampled at each yield and return)
+  size_t    stack_grows;          // stack growths on a page fault
+} mp_prompt_profile_t;
+
+// Get the profile of a suspended prompt, or of a running prompt in the current thread (including its current run).
+// Returns `false` (with a zero profile) if profiling is not enabled.
+mp_decl_export bool mp_prompt_profile(mp_prompt_t* p, mp_prompt_profile_t* profile);
+mp_decl_export unsigned long long mp_profile_ticks(void);  // the current tick count
+
+
+//---------------------------------------------------------------------------
+// Tracing
+// Only available when built with `MP_TRACE` (`cmake -DMP_USE_TRACE=ON`); otherwise
+// the events compile away and `mp_trace_set_hook` returns `false`.
+// Each event is also a USDT probe `libmprompt:event(kind,prompt,gstack,size)` 
+// if `<sys/sdt.h>` is available.
+//---------------------------------------------------------------------------
+
+typedef enum mp_trace_event_e {
+  MP_TRACE_PROMPT_CREATE,         // a fresh prompt is allocated
+  MP_TRACE_PROMPT_ENTER,          // the initial entry into a prompt
+  MP_TRACE_YIELD,                 // suspending up to a prompt
+  MP_TRACE_RESUME,                // resuming a suspended prompt (chain)
+  MP_TRACE_RESUME_DROP,           // a resumption is dropped without resuming
+  MP_TRACE_PROMPT_FREE,           // a prompt and its gstack are freed
+  MP_TRACE_GSTACK_GROW            // stack pages are committed on demand (`size` is the new committed size)
+} mp_trace_event_t;
+
+typedef struct mp_trace_info_s {
+  mp_trace_event_t   event;
+  mp_prompt_t*       prompt;
+  void*              gstack;      // base of the stack of the prompt (or NULL)
+  size_t             size;
+  unsigned long long timestamp;   // monotonic time in nanoseconds
+} mp_trace_info_t;
+
+// The hook runs synchronously in the thread where the event happens. Note: `MP_TRACE_GSTACK_GROW`
+// is called from the page fault handler and the hook should only use async-signal-safe functions for it.
+typedef void (mp_trace_fun_t)(const mp_trace_info_t* info, void* arg);
+
+mp_decl_export bool mp_trace_set_hook(mp_trace_fun_t* fun, void* arg);  // `NULL` to remove the hook
 
 
 
@@ -92,6 +280,10 @@ mp_decl_export mp_config_t mp_config_default(void);  // default configuration fo
 // (only `mp_mresume_should_unwind` is required by `libmphandler`)
 //---------------------------------------------------------------------------
 
+// Allocate using the configured allocator (also used by `libmpeff`)
+mp_decl_export void*        mp_lib_malloc(size_t size);
+mp_decl_export void         mp_lib_free(void* p);
+
 // Get a portable backtrace
 mp_decl_export int          mp_backtrace(void** backtrace, int len);
 
@@ -101,8 +293,30 @@ mp_decl_export int          mp_resume_should_unwind(mp_resume_t* r);  // refcoun
 
 // Separate prompt creation
 mp_decl_export mp_prompt_t* mp_prompt_create(void);
+mp_decl_export mp_prompt_t* mp_prompt_create_ex(size_t size_hint, size_t commit_hint);  // use a gstack of the smallest size class that can hold `size_hint` bytes (or the default class if 0), with at least `commit_hint` bytes committed up front
 mp_decl_export void* mp_prompt_enter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg) ;
 
+// A call site that learns how much stack its prompts use, such that further prompts 
+// created at this site commit that size up front (instead of page faulting on demand). 
+// Declare as a zero initialized static; the fields are private.
+typedef struct mp_prompt_site_s {
+  ptrdiff_t commit;               // learned commit size (the high-water mark that decays every window)
+  ptrdiff_t count;                // prompts freed in the current window
+} mp_prompt_site_t;
+
+mp_decl_export mp_prompt_t* mp_prompt_create_at(mp_prompt_site_t* site, size_t size_hint);
+
+// Decommit the stack pages of a prompt (and the prompts above it) beyond `stack_trim_slack` of their 
+// current stack pointer, such that a long lived prompt that once ran deep does not stay at its peak memory. 
+// The prompt should be either suspended or an ancestor of the current prompt (NULL for the current prompt). 
+// Returns the number of bytes decommitted.
+mp_decl_export size_t mp_prompt_trim(mp_prompt_t* p);
+mp_decl_export size_t mp_resume_trim(mp_resume_t* r);   // trim the suspended prompt chain of a resumption
+
+// Migration: a suspended prompt (i.e. its resumption) can be resumed on any thread. 
+// Code running in a prompt should not cache thread-local addresses across a yield since it 
+// may continue on another thread. (Use `mpe_prompt` and `mpe_yield` when using `libmpeff` handlers).
+
 // Walk the chain of prompts.
 mp_decl_export mp_prompt_t* mp_prompt_top(void);
 mp_decl_export mp_prompt_t* mp_prompt_parent(mp_prompt_t* p);
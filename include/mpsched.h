@@ -0,0 +1,102 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MPS_MPSCHED_H
+#define MPS_MPSCHED_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//------------------------------------------------------
+// Compiler specific attributes
+//------------------------------------------------------
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#if !defined(MP_SHARED_LIB)
+#define mps_decl_export
+#elif defined(MP_SHARED_LIB_EXPORT)
+#define mps_decl_export      __declspec(dllexport)
+#else
+#define mps_decl_export      __declspec(dllimport)
+#endif
+#elif defined(__GNUC__) // includes clang and icc
+#define mps_decl_export      __attribute__((visibility("default")))
+#else
+#define mps_decl_export
+#endif
+
+
+//------------------------------------------------------
+// A work-stealing M:N scheduler of lightweight tasks.
+// Each task runs in its own prompt and can be suspended (`mps_yield`, `mps_await`)
+// and resumed later on any of the worker threads.
+//------------------------------------------------------
+
+typedef struct mps_task_s mps_task_t;
+typedef void* (mps_task_fun_t)(void* arg);
+
+// Start the worker threads (use 0 for one worker per processor).
+// Call once from the main thread (after `mp_init`, if used).
+mps_decl_export bool        mps_start(ptrdiff_t worker_count);
+
+// Wait until all tasks are done and stop the workers.
+mps_decl_export void        mps_stop(void);
+
+// Spawn a new task; can be called from any thread. Every task handle must be
+// either awaited or detached exactly once.
+mps_decl_export mps_task_t* mps_spawn(mps_task_fun_t* fun, void* arg);
+
+// Wait for a task to finish and return its result. This suspends the current task
+// when called from a task, and blocks the current thread otherwise.
+mps_decl_export void*       mps_await(mps_task_t* task);
+
+// Release a task handle without waiting for its result.
+mps_decl_export void        mps_detach(mps_task_t* task);
+
+// Suspend the current task and let other tasks run (or yield the thread if not in a task).
+mps_decl_export void        mps_yield(void);
+
+// Are we running in a task?
+mps_decl_export bool        mps_in_task(void);
+
+// The id of the current worker (or -1 if not called from a worker thread).
+mps_decl_export ptrdiff_t   mps_worker_id(void);
+
+
+//------------------------------------------------------
+// Bounded channels of `void*` values.
+// Sending and receiving suspends the current task while the channel is full
+// (or empty); when not called from a task, the thread is blocked instead.
+// A channel with a capacity of 0 is a rendezvous channel where each send waits
+// for a receiver. A sender that wakes up a waiting receiver continues with the
+// receiver directly and becomes ready itself.
+//------------------------------------------------------
+
+typedef struct mps_chan_s mps_chan_t;
+
+mps_decl_export mps_chan_t* mps_chan_create(size_t capacity);
+mps_decl_export void        mps_chan_free(mps_chan_t* ch);      // there should be no more waiting tasks
+
+// Close a channel: waiting (and later) senders fail, and receivers fail once the buffer is empty.
+mps_decl_export void        mps_chan_close(mps_chan_t* ch);
+
+mps_decl_export bool        mps_chan_send(mps_chan_t* ch, void* value);   // returns `false` if the channel is closed
+mps_decl_export bool        mps_chan_recv(mps_chan_t* ch, void** value);  // returns `false` if the channel is closed and empty
+
+// Select: complete the first case that is ready, or wait for one to become ready (if `block`).
+// Returns the index of the completed case (or -1 if none was ready and `block` is false,
+// or if there are more than 32 cases). The `ok` field of the completed case is `false` if
+// its channel was closed; a receive case stores the received value in its `value` field.
+typedef struct mps_select_case_s {
+  mps_chan_t* chan;
+  bool        send;     // send `value` (or receive into `value`)
+  bool        ok;
+  void*       value;
+} mps_select_case_t;
+
+mps_decl_export ptrdiff_t   mps_select(mps_select_case_t* cases, size_t n, bool block);
+
+#endif
@@ -16,6 +16,7 @@
 
 #include <mprompt.h>
 #include "mpeff.h"
+#include "internal/atomic.h"
 
 
 /*-----------------------------------------------------------------
@@ -43,9 +44,26 @@
 #if defined(__GNUC__) || defined(__clang__)
 #define mpe_unlikely(x)          __builtin_expect((x),0)
 #define mpe_likely(x)            __builtin_expect((x),1)
+#define mpe_compiler_barrier()   __asm__ __volatile__("" : : : "memory")
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define mpe_unlikely(x)          (x)
+#define mpe_likely(x)            (x)
+#define mpe_compiler_barrier()   _ReadWriteBarrier()
 #else
 #define mpe_unlikely(x)          (x)
 #define mpe_likely(x)            (x)
+#define mpe_compiler_barrier()   ((void)0)
+#endif
+
+// Cache the handler lookup of `mpe_perform` per thread
+#ifndef MPE_USE_FIND_CACHE
+#define MPE_USE_FIND_CACHE       (1)
+#endif
+
+// Index the handler frames of each thread in a dense array (see `mpe_frame_arena_push`)
+#ifndef MPE_USE_FRAME_ARENA
+#define MPE_USE_FRAME_ARENA      (0)
 #endif
 
 #define mpe_assert(x)            assert(x)
@@ -54,14 +72,14 @@
 
 
 static inline void* mpe_malloc_safe(size_t size) {
-  void* p = malloc(size);
+  void* p = mp_lib_malloc(size);
   if (p != NULL) return p;
   fprintf(stderr,"out of memory\n");
   abort();
 }
 
 static inline void mpe_free(void* p) {
-  free(p);
+  mp_lib_free(p);
 }
 
 
@@ -74,6 +92,10 @@ static inline void mpe_free(void* p) {
 typedef struct mpe_frame_s {
   mpe_effect_t        effect;     // every frame has an effect (to speed up tests)
   struct mpe_frame_s* parent;
+  uintptr_t           id;         // unique for each push of a frame; validates evidence and the find cache
+  #if MPE_USE_FRAME_ARENA
+  size_t              depth;      // number of frames below this one (its index in the frame arena)
+  #endif
 } mpe_frame_t;
 
 
@@ -110,15 +132,25 @@ typedef struct mpe_frame_finally_s {
 } mpe_frame_finally_t;
 
 
+// Prompt frame: the parent of all frames pushed inside a prompt entered with `mpe_prompt`
+typedef struct mpe_frame_prompt_s {
+  mpe_frame_t   frame;
+  mp_prompt_t*  prompt;
+} mpe_frame_prompt_t;
+
+
 // For search efficiency, non-handler frames are identified by a unique effect tag
 MPE_DEFINE_EFFECT0(mpe_frame_under)
 MPE_DEFINE_EFFECT0(mpe_frame_mask)
 MPE_DEFINE_EFFECT0(mpe_frame_finally)
+MPE_DEFINE_EFFECT0(mpe_frame_prompt)
 
 
 // Resumption kinds: used to avoid allocation etc.
 typedef enum mpe_resumption_kind_e {
   MPE_RESUMPTION_INPLACE,           
+  MPE_RESUMPTION_TENTATIVE,         // in place for MPE_OP_MAYBE_TAIL (and can be suspended)
+  MPE_RESUMPTION_SUSPENDED,         // a tentative resumption after `mpe_resume_suspend`
   MPE_RESUMPTION_SCOPED_ONCE,       
   MPE_RESUMPTION_ONCE,              
   MPE_RESUMPTION_MULTI
@@ -127,13 +159,39 @@ typedef enum mpe_resumption_kind_e {
 
 // A resumption
 struct mpe_resume_s {
-  mpe_resumption_kind_t kind;       // todo: encode kind in lower bits so we can avoid allocating resumes?
+  mpe_resumption_kind_t kind;       
   union {
-    void**        plocal;           // kind == MPE_RESUMPTION_INPLACE
-    mp_resume_t*  resume;           // kind == MPE_RESUMPTION_SCOPED_ONCE || MPE_RESUMPTION_ONCE || MPE_RESUME_MULTI
+    void**        plocal;           // kind == MPE_RESUMPTION_INPLACE || kind == MPE_RESUMPTION_TENTATIVE
+    mp_resume_t*  resume;           // kind == MPE_RESUMPTION_SCOPED_ONCE 
   } mp;
 };
 
+// Resumptions of kind MPE_RESUMPTION_ONCE and MPE_RESUMPTION_MULTI escape the operation
+// and are not allocated: we return the `mp_resume_t*` with a tag in the lower 2 bits instead
+// (as those are always at least 8-byte aligned). Stack allocated `mpe_resume_t`'s are 
+// left untagged.
+#define MPE_RESUME_TAG_ONCE   (1)
+#define MPE_RESUME_TAG_MULTI  (2)
+#define MPE_RESUME_TAG_MASK   (3)
+
+static inline mpe_resume_t* mpe_resume_tagged(mp_resume_t* mpr, uintptr_t tag) {
+  mpe_assert_internal(((uintptr_t)mpr & MPE_RESUME_TAG_MASK) == 0);
+  return (mpe_resume_t*)((uintptr_t)mpr | tag);
+}
+
+static inline mpe_resumption_kind_t mpe_resume_kind(const mpe_resume_t* r) {
+  const uintptr_t tag = ((uintptr_t)r & MPE_RESUME_TAG_MASK);
+  if (mpe_likely(tag == 0)) return r->kind;
+  return (tag == MPE_RESUME_TAG_ONCE ? MPE_RESUMPTION_ONCE : MPE_RESUMPTION_MULTI);
+}
+
+// The underlying `mp_resume_t` (for all kinds except MPE_RESUMPTION_INPLACE)
+static inline mp_resume_t* mpe_resume_mp(const mpe_resume_t* r) {
+  const uintptr_t tag = ((uintptr_t)r & MPE_RESUME_TAG_MASK);
+  if (mpe_likely(tag == 0)) return r->mp.resume;
+  return (mp_resume_t*)((uintptr_t)r & ~(uintptr_t)MPE_RESUME_TAG_MASK);
+}
+
 
 /*-----------------------------------------------------------------
   Handler shadow stack
@@ -142,6 +200,81 @@ struct mpe_resume_s {
 // Top of the frames in the current execution stack
 mpe_decl_thread mpe_frame_t* mpe_frame_top;
 
+// A prompt can be resumed on another thread (see `mpe_yield`) but compilers may cache
+// the address of a thread local (or the thread pointer itself) across calls. Thread local
+// state that is accessed after a potential resumption is therefore accessed through a
+// function that is not inlined (and that has a barrier so it is not inferred to be `const`).
+static mpe_decl_noinline mpe_frame_t** mpe_frame_top_current(void) {
+  mpe_compiler_barrier();
+  return &mpe_frame_top;
+}
+
+// Unique frame id's: each thread takes blocks of id's from a global counter
+// so id's stay unique when frames migrate to another thread with their prompt.
+#define MPE_FRAME_ID_BLOCK    (1024)
+static _Atomic(uintptr_t) mpe_frame_id_blocks;
+static mpe_decl_thread uintptr_t mpe_frame_id;
+
+static mpe_decl_noinline uintptr_t mpe_frame_id_block(void) {
+  mpe_frame_id = mp_atomic_add(&mpe_frame_id_blocks, (uintptr_t)MPE_FRAME_ID_BLOCK);
+  return ++mpe_frame_id;
+}
+
+static inline uintptr_t mpe_frame_new_id(void) {
+  if (mpe_unlikely(mpe_frame_id % MPE_FRAME_ID_BLOCK == 0)) return mpe_frame_id_block();
+  return ++mpe_frame_id;
+}
+
+#define mpe_frame_set_id(f)   ((f)->id = mpe_frame_new_id())
+
+#if MPE_USE_FIND_CACHE
+// An epoch that is incremented when handler frames are relinked (on a resume)
+static mpe_decl_thread uintptr_t mpe_frame_epoch;
+#define mpe_frame_relinked()  (mpe_frame_epoch++)
+#else
+#define mpe_frame_relinked()  ((void)0)
+#endif
+
+#if MPE_USE_FRAME_ARENA
+// The frames are linked through `parent` pointers and are spread over many gstacks, so a
+// search chases pointers across stacks (and pages). The frame arena is a dense per-thread
+// index of the current frames: the effect and frame at each depth, with the effects in a 
+// separate array so a search scans consecutive words. The frames themselves stay on the 
+// stacks (and are thus saved with resumptions): the arena entries up to the top frame are 
+// always valid, as unlinking frames only moves the top down and relinking frames on a resume 
+// rewrites the entries of the relinked frames. Frames beyond the arena size are not indexed
+// and a search from there falls back to following the `parent` pointers.
+#define MPE_FRAME_ARENA_SIZE  (256)
+static mpe_decl_thread mpe_effect_t mpe_frame_arena_effect[MPE_FRAME_ARENA_SIZE];
+static mpe_decl_thread mpe_frame_t* mpe_frame_arena_frame[MPE_FRAME_ARENA_SIZE];
+
+static inline void mpe_frame_arena_set(mpe_frame_t* f) {
+  if (mpe_likely(f->depth < MPE_FRAME_ARENA_SIZE)) {
+    mpe_frame_arena_effect[f->depth] = f->effect;
+    mpe_frame_arena_frame[f->depth] = f;
+  }
+}
+
+// Index a frame pushed on the current top
+static inline void mpe_frame_arena_push(mpe_frame_t* f) {
+  f->depth = (f->parent == NULL ? 0 : f->parent->depth + 1);
+  mpe_frame_arena_set(f);
+}
+
+// Re-index the frames from `resume_top` down to `f` after `f` is relinked (at a possibly different depth)
+static void mpe_frame_arena_relink(mpe_frame_t* f, mpe_frame_t* resume_top) {
+  const size_t delta = (f->parent == NULL ? 0 : f->parent->depth + 1) - f->depth;  // (modulo)
+  for (mpe_frame_t* g = resume_top; g != NULL; g = g->parent) {
+    g->depth += delta;
+    mpe_frame_arena_set(g);
+    if (g == f) break;
+  }
+}
+#else
+#define mpe_frame_arena_push(f)              ((void)0)
+#define mpe_frame_arena_relink(f,resume_top) ((void)0)
+#endif
+
 
 // use as: `{mpe_with_frame(f){ <body> }}`
 #if MPE_HAS_TRY
@@ -154,22 +287,42 @@ public:
   mpe_raii_with_frame_t(mpe_frame_t* f) {
     this->f = f;
     f->parent = mpe_frame_top;
+    mpe_frame_set_id(f);
+    mpe_frame_arena_push(f);
     mpe_frame_top = f;
   }
   ~mpe_raii_with_frame_t() {
-    mpe_assert_internal(mpe_frame_top == f);
-    mpe_frame_top = f->parent;
+    mpe_frame_t** top = mpe_frame_top_current();
+    mpe_assert_internal(*top == f);
+    *top = f->parent;
   }
 };
 #else
 // C version
 #define mpe_with_frame(f) \
-  for( bool _once = ((f)->parent = mpe_frame_top, mpe_frame_top = (f), true); \
+  for( bool _once = ((f)->parent = mpe_frame_top, mpe_frame_set_id(f), mpe_frame_arena_push(f), mpe_frame_top = (f), true); \
        _once; \
-       _once = (mpe_frame_top = (f)->parent, false) ) 
+       _once = (*mpe_frame_top_current() = (f)->parent, false) ) 
 #endif
 
 
+static void* mpe_perform_yield_to_abort(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1);
+
+// Unwind directly to the handler `target` without raising an exception: run the finalizers of 
+// the `mpe_finally` frames up to the handler (innermost first) and abort to the handler (which 
+// discards the stack in between). This does not run any C++ destructors.
+static void mpe_unwind_finally_to(mpe_frame_handle_t* target, const mpe_operation_t* op, void* arg, void* arg1) {
+  mpe_frame_t** top = mpe_frame_top_current();
+  for (mpe_frame_t* f = *top; f != NULL && f != &target->frame; f = f->parent) {
+    if (f->effect == MPE_EFFECT(mpe_frame_finally)) {
+      mpe_frame_finally_t* ff = (mpe_frame_finally_t*)f;
+      *top = f->parent;               // run the finalizer outside its own frame
+      (ff->fun)(ff->local);
+    }
+  }
+  mpe_perform_yield_to_abort(target, op, arg, arg1);
+}
+
 #if MPE_HAS_TRY
 // in some cases (like MPE_OP_NORESUME) we need to unwind to the effect handler operation
 // while calling destructors. We do this using a special unwind exception.
@@ -178,12 +331,13 @@ public:
   mpe_frame_handle_t* target;
   const mpe_operation_t* op;
   void* arg;
-  mpe_unwind_exception(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg) : target(h), op(op), arg(arg) {  }
-  mpe_unwind_exception(const mpe_unwind_exception& e) : target(e.target), op(e.op), arg(e.arg) {  
+  void* arg1;
+  mpe_unwind_exception(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg, void* arg1) : target(h), op(op), arg(arg), arg1(arg1) {  }
+  mpe_unwind_exception(const mpe_unwind_exception& e) : target(e.target), op(e.op), arg(e.arg), arg1(e.arg1) {  
     fprintf(stderr, "copy exception\n");
   }
   mpe_unwind_exception& operator=(const mpe_unwind_exception& e) { 
-    target = e.target; op = e.op; arg = e.arg; 
+    target = e.target; op = e.op; arg = e.arg; arg1 = e.arg1;
     return *this; 
   }
 
@@ -192,15 +346,14 @@ public:
   }
 };
 
-static void mpe_unwind_to(mpe_frame_handle_t* target, const mpe_operation_t* op, void* arg) {
+static void mpe_unwind_to(mpe_frame_handle_t* target, const mpe_operation_t* op, void* arg, void* arg1) {
   //fprintf(stderr, "throw unwind..\n");
-  throw mpe_unwind_exception(target, op, arg);
+  throw mpe_unwind_exception(target, op, arg, arg1);
 }
 #else
-static void* mpe_perform_yield_to_abort(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg);
-static void mpe_unwind_to(mpe_frame_handle_t* target, const mpe_operation_t* op, void* arg) {
-  // TODO: walk the handlers and invoke finally frames
-  mpe_perform_yield_to_abort(target, op, arg);
+// In C there are no destructors and we unwind the finally frames explicitly
+static void mpe_unwind_to(mpe_frame_handle_t* target, const mpe_operation_t* op, void* arg, void* arg1) {
+  mpe_unwind_finally_to(target, op, arg, arg1);
 }
 #endif
 
@@ -240,110 +393,131 @@ const char* mpe_optag_name(mpe_optag_t optag) {
   Perform
 -----------------------------------------------------------------*/
 
-typedef struct mpe_perform_env_s {
-  mpe_resumption_kind_t rkind;
-  mpe_opfun_t* opfun;
-  void* local;
-  void* oparg;
-} mpe_perform_env_t;
+// Call an operation function with one or two arguments
+static inline void* mpe_opfun_call(const mpe_operation_t* op, mpe_resume_t* r, void* local, void* arg0, void* arg1) {
+  if (mpe_likely(op->opfun != NULL)) return (op->opfun)(r, local, arg0);
+  return (op->opfun2)(r, local, arg0, arg1);
+}
 
-typedef struct mpe_resume_env_s {
-  void* local;
-  void* result;
-  bool  unwind;
-} mpe_resume_env_t;
+// A yielded operation is resumed with its result and the new local state of the handler 
+// (through `mp_resumex`), where the local state is `MPE_RESUME_UNWIND` if it should unwind instead.
+static char mpe_resume_unwind_marker;
+#define MPE_RESUME_UNWIND   ((void*)&mpe_resume_unwind_marker)
+
+// The operation clauses run at the handler; the operation, the local state, and the
+// arguments are passed directly (through `mp_yieldx`) for each resumption kind.
+static void* mpe_perform_op_clause_scoped_once(mp_resume_t* mpr, void* op, void* local, void* arg0, void* arg1) {
+  mpe_resume_t resume = { MPE_RESUMPTION_SCOPED_ONCE, { NULL } };
+  resume.mp.resume = mpr;
+  return mpe_opfun_call((const mpe_operation_t*)op, &resume, local, arg0, arg1);
+}
 
+static void* mpe_perform_op_clause_once(mp_resume_t* mpr, void* op, void* local, void* arg0, void* arg1) {
+  return mpe_opfun_call((const mpe_operation_t*)op, mpe_resume_tagged(mpr, MPE_RESUME_TAG_ONCE), local, arg0, arg1);
+}
 
-// Regular once resumption
-static void* mpe_perform_op_clause(mp_resume_t* mpr, void* earg) {
-  mpe_perform_env_t* env = (mpe_perform_env_t*)earg;
-  mpe_resume_t resume_stack;
-  mpe_resume_t* resume;
-  if (mpe_likely(env->rkind == MPE_RESUMPTION_SCOPED_ONCE)) {
-    resume = &resume_stack;
-  }
-  else {
-    resume = mpe_malloc_tp(mpe_resume_t);
-  }    
-  resume->kind = env->rkind;
-  resume->mp.resume = (env->rkind == MPE_RESUMPTION_MULTI ? mp_resume_multi(mpr) : mpr);
-  return (env->opfun)(resume, env->local, env->oparg);
+static void* mpe_perform_op_clause_multi(mp_resume_t* mpr, void* op, void* local, void* arg0, void* arg1) {
+  return mpe_opfun_call((const mpe_operation_t*)op, mpe_resume_tagged(mp_resume_multi(mpr), MPE_RESUME_TAG_MULTI), local, arg0, arg1);
+}
+
+// Relink the frames from `f` (downward) to the current top after resuming (possibly on another thread)
+static mpe_decl_noinline void mpe_frames_relink(mpe_frame_t* f, mpe_frame_t* resume_top) {
+  mpe_frame_t** top = mpe_frame_top_current();
+  f->parent = *top;
+  mpe_frame_relinked();
+  mpe_frame_arena_relink(f, resume_top);
+  *top = resume_top;
 }
 
 // Yield 
-static void* mpe_perform_yield_to(mpe_resumption_kind_t rkind, mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg) {
+static void* mpe_perform_yield_to(mp_yieldx_fun_t* clause, mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1) {
   mpe_frame_t* resume_top = mpe_frame_top; // save current top
   mpe_frame_top = h->frame.parent;           // and unlink handlers
-  mpe_perform_env_t penv = { rkind, op->opfun, h->local, arg };
   // yield up
-  mpe_resume_env_t* renv = (mpe_resume_env_t*)mp_yield(h->prompt, &mpe_perform_op_clause, &penv);
+  void* local;
+  void* result = mp_yieldx(h->prompt, clause, (void*)op, h->local, arg0, arg1, &local);
   // resumed!                     
-  h->local = renv->local;           // set new state
-  h->frame.parent = mpe_frame_top;  // relink handlers
-  mpe_frame_top = resume_top;
-  if (renv->unwind) {
-    mpe_unwind_to(h, &mpe_op_unwind, renv->result);
+  const bool unwind = (local == MPE_RESUME_UNWIND);
+  h->local = (unwind ? NULL : local);         // set new state
+  mpe_frames_relink(&h->frame, resume_top);   // relink handlers
+  if (unwind) {
+    mpe_unwind_to(h, &mpe_op_unwind, result, NULL);
   }
-  return renv->result;
+  return result;
 }
 
 // Never resumption
-static void* mpe_perform_op_clause_abort(mp_resume_t* mpr, void* earg) {
-  mpe_perform_env_t env = *((mpe_perform_env_t*)earg);  // copy out all args before dropping the prompt
-  mp_resume_drop(mpr);
-  return (env.opfun)(NULL, env.local, env.oparg);
+static void* mpe_perform_op_clause_abort(mp_resume_t* mpr, void* op, void* local, void* arg0, void* arg1) {
+  mp_resume_drop(mpr);  // the arguments are not on the dropped stack
+  return mpe_opfun_call((const mpe_operation_t*)op, NULL, local, arg0, arg1);
 }
 
-static void* mpe_perform_yield_to_abort(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg) {
-  mpe_perform_env_t env = { MPE_RESUMPTION_SCOPED_ONCE /* unused */, op->opfun, h->local, arg };
-  return mp_yield(h->prompt, &mpe_perform_op_clause_abort, &env);
+static void* mpe_perform_yield_to_abort(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1) {
+  *mpe_frame_top_current() = h->frame.parent;  // the frames in between are discarded
+  return mp_yieldx(h->prompt, &mpe_perform_op_clause_abort, (void*)op, h->local, arg0, arg1, NULL);
 }
 
 
 // Tail resumptive under an "under" frame
-static void* mpe_perform_under(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg) {
+static void* mpe_perform_under(mpe_resume_t* resume, mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1) {
   mpe_frame_under_t f;
   f.frame.effect = MPE_EFFECT(mpe_frame_under);
   f.under = h->frame.effect;
   void* result = NULL;
   {mpe_with_frame(&f.frame) {
-    mpe_resume_t resume = { MPE_RESUMPTION_INPLACE, { &h->local } };
-    result = (op->opfun)(&resume, h->local, arg);
+    result = mpe_opfun_call(op, resume, h->local, arg0, arg1);
   }}
   return result;
 }
 
+// Usually tail resumptive: first try in place, and only yield to the handler 
+// if the operation function suspended its tentative resumption.
+static void* mpe_perform_maybe_tail(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1) {
+  mpe_resume_t resume = { MPE_RESUMPTION_TENTATIVE, { &h->local } };
+  void* result = mpe_perform_under(&resume, h, op, arg0, arg1);
+  if (mpe_likely(resume.kind != MPE_RESUMPTION_SUSPENDED)) return result;
+  return mpe_perform_yield_to(&mpe_perform_op_clause_scoped_once, h, op, arg0, arg1);
+}
+
 // ------------------------------------------------------------------------------
 // Perform
 // ------------------------------------------------------------------------------
 
-static void* mpe_perform_at(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg) {
+static void* mpe_perform_at(mpe_frame_handle_t* h, const mpe_operation_t* op, void* arg0, void* arg1) {
   mpe_opkind_t opkind = op->opkind;
   mpe_assert_internal(opkind == op->opkind);
   if (mpe_likely(opkind == MPE_OP_TAIL_NOOP)) {
     // tail resumptive, calls no operations, execute in place
     mpe_resume_t resume = { MPE_RESUMPTION_INPLACE, { &h->local } };
-    return (op->opfun)(&resume, h->local, arg);
+    return mpe_opfun_call(op, &resume, h->local, arg0, arg1);
   }
   else if (mpe_likely(opkind == MPE_OP_TAIL)) {
     // tail resumptive; execute in place under an "under" frame
-    return mpe_perform_under(h, op, arg);
+    mpe_resume_t resume = { MPE_RESUMPTION_INPLACE, { &h->local } };
+    return mpe_perform_under(&resume, h, op, arg0, arg1);
+  }
+  else if (mpe_likely(opkind == MPE_OP_MAYBE_TAIL)) {
+    return mpe_perform_maybe_tail(h, op, arg0, arg1);
   }
   else if (opkind == MPE_OP_SCOPED_ONCE) {
-    return mpe_perform_yield_to(MPE_RESUMPTION_SCOPED_ONCE, h, op, arg);
+    return mpe_perform_yield_to(&mpe_perform_op_clause_scoped_once, h, op, arg0, arg1);
   }
   else if (opkind == MPE_OP_ONCE) {
-    return mpe_perform_yield_to(MPE_RESUMPTION_ONCE, h, op, arg);
+    return mpe_perform_yield_to(&mpe_perform_op_clause_once, h, op, arg0, arg1);
   }
   else if (opkind == MPE_OP_NEVER) {
-    mpe_unwind_to(h, op, arg);
+    mpe_unwind_to(h, op, arg0, arg1);
     return NULL; // never reached
   }
   else if (opkind == MPE_OP_ABORT) {
-    return mpe_perform_yield_to_abort(h, op, arg);
+    return mpe_perform_yield_to_abort(h, op, arg0, arg1);
+  }
+  else if (opkind == MPE_OP_ABORT_FINALLY) {
+    mpe_unwind_finally_to(h, op, arg0, arg1);
+    return NULL; // never reached
   }
   else {
-    return mpe_perform_yield_to(MPE_RESUMPTION_MULTI, h, op, arg);    
+    return mpe_perform_yield_to(&mpe_perform_op_clause_multi, h, op, arg0, arg1);    
   }
 }
 
@@ -355,7 +529,7 @@ static mpe_decl_noinline void* mpe_unhandled_operation(mpe_optag_t optag) {
 
 // Perform finds the innermost handler and performs the operation
 // note: this is performance sensitive code
-static mpe_frame_handle_t* mpe_find(mpe_optag_t optag) {
+static mpe_frame_handle_t* mpe_find_linked(mpe_optag_t optag) {
   mpe_frame_t* f = mpe_frame_top;
   mpe_effect_t opeff = optag->effect;
   size_t mask_level = 0;
@@ -390,13 +564,211 @@ static mpe_frame_handle_t* mpe_find(mpe_optag_t optag) {
   return NULL;
 }
 
-void* mpe_perform(mpe_optag_t optag, void* arg) {
+#if MPE_USE_FRAME_ARENA
+// The same search as `mpe_find_linked` but scanning the frame arena
+static mpe_frame_handle_t* mpe_find(mpe_optag_t optag) {
+  mpe_frame_t* top = mpe_frame_top;
+  if (mpe_unlikely(top == NULL)) return NULL;
+  if (mpe_unlikely(top->depth >= MPE_FRAME_ARENA_SIZE)) return mpe_find_linked(optag);
+  mpe_effect_t opeff = optag->effect;
+  size_t mask_level = 0;
+  size_t i = top->depth + 1;
+  mpe_frame_handle_t* h = NULL;
+  while (mpe_likely(i > 0)) {
+    mpe_effect_t eff = mpe_frame_arena_effect[--i];
+    // handle
+    if (mpe_likely(eff == opeff)) {
+      if (mpe_likely(mask_level == 0)) {
+        h = (mpe_frame_handle_t*)mpe_frame_arena_frame[i];    // found our handler
+        break;
+      }
+      else {
+        mask_level--;
+      }
+    }
+    // under
+    else if (mpe_unlikely(eff == MPE_EFFECT(mpe_frame_under))) {
+      mpe_effect_t ueff = ((mpe_frame_under_t*)mpe_frame_arena_frame[i])->under;
+      do {
+        if (i == 0) break;
+        i--;
+      } while (mpe_frame_arena_effect[i] != ueff);
+    }
+    // mask
+    else if (mpe_unlikely(eff == MPE_EFFECT(mpe_frame_mask))) {
+      mpe_frame_mask_t* mf = (mpe_frame_mask_t*)mpe_frame_arena_frame[i];
+      if (mpe_unlikely(mf->mask == opeff && mf->from <= mask_level)) {
+        mask_level++;
+      }
+    }
+  }
+  mpe_assert_internal(h == mpe_find_linked(optag));
+  return h;
+}
+#else
+#define mpe_find(optag)  mpe_find_linked(optag)
+#endif
+
+#if MPE_USE_FIND_CACHE
+// A direct mapped cache (per thread) from an effect to its innermost handler. An entry is valid 
+// if the top frame is the same frame push (by its id) as when the entry was found, and no
+// handler frames were relinked since then. 
+#define MPE_FIND_CACHE_SIZE  (16)
+
+typedef struct mpe_find_cache_entry_s {
+  mpe_effect_t        effect;
+  const mpe_frame_t*  top;
+  uintptr_t           top_id;
+  uintptr_t           epoch;
+  mpe_frame_handle_t* handler;
+} mpe_find_cache_entry_t;
+
+static mpe_decl_thread mpe_find_cache_entry_t mpe_find_cache[MPE_FIND_CACHE_SIZE];
+
+static inline mpe_frame_handle_t* mpe_find_cached(mpe_optag_t optag) {
+  mpe_frame_t* top = mpe_frame_top;
+  if (mpe_unlikely(top == NULL)) return NULL;
+  mpe_effect_t eff = optag->effect;
+  if (mpe_likely(top->effect == eff)) return (mpe_frame_handle_t*)top;  // innermost handler
+  mpe_find_cache_entry_t* e = &mpe_find_cache[((uintptr_t)eff / sizeof(void*)) % MPE_FIND_CACHE_SIZE];  
+  if (mpe_likely(e->effect == eff && e->top == top && e->top_id == top->id && e->epoch == mpe_frame_epoch)) {
+    mpe_assert_internal(e->handler == mpe_find(optag));
+    return e->handler;
+  }
   mpe_frame_handle_t* h = mpe_find(optag);
+  if (h != NULL) {
+    e->effect = eff;
+    e->top = top;
+    e->top_id = top->id;
+    e->epoch = mpe_frame_epoch;
+    e->handler = h;
+  }
+  return h;
+}
+#else
+#define mpe_find_cached(optag)  mpe_find(optag)
+#endif
+
+void* mpe_perform(mpe_optag_t optag, void* arg) {
+  mpe_frame_handle_t* h = mpe_find_cached(optag);
+  if (mpe_unlikely(h == NULL)) return mpe_unhandled_operation(optag);
+  const mpe_operation_t* op = &h->hdef->operations[optag->opidx];
+  return mpe_perform_at(h, op, arg, NULL);
+}
+
+void* mpe_perform2(mpe_optag_t optag, void* arg0, void* arg1) {
+  mpe_frame_handle_t* h = mpe_find_cached(optag);
   if (mpe_unlikely(h == NULL)) return mpe_unhandled_operation(optag);
   const mpe_operation_t* op = &h->hdef->operations[optag->opidx];
-  return mpe_perform_at(h, op, arg);
+  return mpe_perform_at(h, op, arg0, arg1);
+}
+
+
+/*-----------------------------------------------------------------
+  Evidence
+-----------------------------------------------------------------*/
+
+mpe_evidence_t mpe_evidence_find(mpe_effect_t effect) {
+  struct mpe_optag_s optag = { effect, 0 };
+  mpe_frame_handle_t* h = mpe_find(&optag);
+  mpe_evidence_t ev = { h, (h == NULL ? 0 : h->frame.id) };
+  return ev;
+}
+
+void* mpe_perform2_ev(mpe_evidence_t ev, mpe_optag_t optag, void* arg0, void* arg1) {
+  mpe_frame_handle_t* h = (mpe_frame_handle_t*)ev.handler;
+  if (mpe_unlikely(h == NULL || h->frame.id != ev.id || h->frame.effect != optag->effect)) {
+    // not a valid evidence (anymore); fall back to a dynamic search
+    return mpe_perform2(optag, arg0, arg1);
+  }
+  const mpe_operation_t* op = &h->hdef->operations[optag->opidx];
+  return mpe_perform_at(h, op, arg0, arg1);
+}
+
+void* mpe_perform_ev(mpe_evidence_t ev, mpe_optag_t optag, void* arg) {
+  return mpe_perform2_ev(ev, optag, arg, NULL);
+}
+
+
+
+/*-----------------------------------------------------------------
+  Profiling
+-----------------------------------------------------------------*/
+
+// The profiles are aggregated per effect in a global table (with open addressing);
+// the counters are updated atomically as handlers complete on any thread.
+#define MPE_PROFILE_SIZE  (64)
+
+typedef struct mpe_profile_entry_s {
+  _Atomic(uintptr_t) effect;
+  _Atomic(uintptr_t) handled;
+  _Atomic(uintptr_t) ticks;
+  _Atomic(uintptr_t) resumes;
+  _Atomic(uintptr_t) stack_peak;
+  _Atomic(uintptr_t) stack_grows;
+} mpe_profile_entry_t;
+
+static mpe_profile_entry_t mpe_profiles[MPE_PROFILE_SIZE];
+
+static mpe_profile_entry_t* mpe_profile_entry(mpe_effect_t effect) {
+  const uintptr_t eff = (uintptr_t)effect;
+  size_t idx = (eff / sizeof(void*)) % MPE_PROFILE_SIZE;
+  for (size_t i = 0; i < MPE_PROFILE_SIZE; i++, idx = (idx + 1) % MPE_PROFILE_SIZE) {
+    mpe_profile_entry_t* e = &mpe_profiles[idx];
+    uintptr_t current = mp_atomic_load(&e->effect);
+    if (current == 0) {
+      if (mp_atomic_cas(&e->effect, &current, eff)) return e;
+    }
+    if (current == eff) return e;
+  }
+  return NULL;  // full
+}
+
+// Add the profile of the handler prompt when the handler completes
+static void mpe_profile_handled(mpe_frame_handle_t* h) {
+  mp_prompt_profile_t prof;
+  if (mpe_likely(!mp_prompt_profile(h->prompt, &prof))) return;
+  mpe_profile_entry_t* e = mpe_profile_entry(h->frame.effect);
+  if (e == NULL) return;
+  mp_atomic_add(&e->handled, (uintptr_t)1);
+  mp_atomic_add(&e->ticks, (uintptr_t)prof.ticks);
+  mp_atomic_add(&e->resumes, (uintptr_t)prof.resumes);
+  mp_atomic_add(&e->stack_grows, (uintptr_t)prof.stack_grows);
+  uintptr_t peak = mp_atomic_load(&e->stack_peak);
+  while (peak < prof.stack_peak && !mp_atomic_cas(&e->stack_peak, &peak, (uintptr_t)prof.stack_peak)) { };
 }
 
+size_t mpe_effect_profiles(mpe_effect_profile_t* profiles, size_t max_count) {
+  size_t count = 0;
+  for (size_t i = 0; i < MPE_PROFILE_SIZE; i++) {
+    mpe_profile_entry_t* e = &mpe_profiles[i];
+    const uintptr_t eff = mp_atomic_load(&e->effect);
+    if (eff == 0) continue;
+    if (profiles != NULL && count < max_count) {
+      mpe_effect_profile_t* p = &profiles[count];
+      p->effect = (mpe_effect_t)eff;
+      p->handled = mp_atomic_load(&e->handled);
+      p->ticks = mp_atomic_load(&e->ticks);
+      p->resumes = mp_atomic_load(&e->resumes);
+      p->stack_peak = mp_atomic_load(&e->stack_peak);
+      p->stack_grows = mp_atomic_load(&e->stack_grows);
+    }
+    count++;
+  }
+  return count;
+}
+
+// Clear all profiles; this is racy with handlers that complete concurrently.
+void mpe_effect_profiles_reset(void) {
+  for (size_t i = 0; i < MPE_PROFILE_SIZE; i++) {
+    mpe_profile_entry_t* e = &mpe_profiles[i];
+    mp_atomic_store(&e->handled, (uintptr_t)0);
+    mp_atomic_store(&e->ticks, (uintptr_t)0);
+    mp_atomic_store(&e->resumes, (uintptr_t)0);
+    mp_atomic_store(&e->stack_peak, (uintptr_t)0);
+    mp_atomic_store(&e->stack_grows, (uintptr_t)0);
+  }
+}
 
 
 /*-----------------------------------------------------------------
@@ -406,9 +778,10 @@ void* mpe_perform(mpe_optag_t optag, void* arg) {
 // Pass arguments down in a closure environment
 struct mpe_handle_start_env {
   const mpe_handlerdef_t* hdef;
-  void*            local;
-  mpe_actionfun_t* body;
-  void*            arg;
+  void*              local;
+  mpe_actionfun_t*   body;
+  mpe_evactionfun_t* evbody;   // used instead of `body` if not NULL
+  void*              arg;
 };
 
 // Start a handler
@@ -427,7 +800,13 @@ static mpe_decl_noinline void* mpe_handle_start(mp_prompt_t* prompt, void* earg)
     // push frame on top
     {mpe_with_frame(&h.frame) {
       // and call the action
-      result = (env->body)(env->arg);
+      if (env->evbody != NULL) {
+        mpe_evidence_t ev = { &h, h.frame.id };
+        result = (env->evbody)(ev, env->arg);
+      }
+      else {
+        result = (env->body)(env->arg);
+      }
     }}
     // potentially run return function
     if (h.hdef->resultfun != NULL) {
@@ -441,50 +820,109 @@ static mpe_decl_noinline void* mpe_handle_start(mp_prompt_t* prompt, void* earg)
       throw;  // rethrow 
     }
     //fprintf(stderr, "catch unwind\n");
-    result = (e.op->opfun)(NULL, h.local, e.arg); // or yield to ourselves; (but must be done outside the catch or otherwise the exception leaks memory)
+    result = mpe_opfun_call(e.op, NULL, h.local, e.arg, e.arg1); // or yield to ourselves; (but must be done outside the catch or otherwise the exception leaks memory)
   }
   #endif
+  mpe_profile_handled(&h);
   return result;
 }
 
 /// Handle a particular effect.
 /// Handles operations yielded in `body(arg)` with the given handler definition `def`.
 void* mpe_handle(const mpe_handlerdef_t* hdef, void* local, mpe_actionfun_t* body, void* arg) {
-  struct mpe_handle_start_env env = { hdef, local, body, arg };
+  struct mpe_handle_start_env env = { hdef, local, body, NULL, arg };
+  return mp_prompt(&mpe_handle_start, &env);
+}
+
+/// Handle a particular effect and pass the evidence of the handler to `body`.
+void* mpe_handle_ev(const mpe_handlerdef_t* hdef, void* local, mpe_evactionfun_t* body, void* arg) {
+  struct mpe_handle_start_env env = { hdef, local, NULL, body, arg };
   return mp_prompt(&mpe_handle_start, &env);
 }
 
 
+/*-----------------------------------------------------------------
+  Prompts with detachable handler frames
+-----------------------------------------------------------------*/
+
+struct mpe_prompt_start_env {
+  mp_start_fun_t* fun;
+  void*           arg;
+};
+
+static mpe_decl_noinline void* mpe_prompt_start(mp_prompt_t* prompt, void* earg) {
+  struct mpe_prompt_start_env* env = (struct mpe_prompt_start_env*)earg;
+  mpe_frame_prompt_t f;
+  f.frame.effect = MPE_EFFECT(mpe_frame_prompt);
+  f.prompt = prompt;
+  void* result = NULL;
+  {mpe_with_frame(&f.frame) {
+    result = (env->fun)(prompt, env->arg);
+  }}
+  return result;
+}
+
+/// Run `fun(p,arg)` in a fresh prompt `p` whose handler frames are detached when yielding with `mpe_yield`.
+void* mpe_prompt(mp_start_fun_t* fun, void* arg) {
+  struct mpe_prompt_start_env env = { fun, arg };
+  return mp_prompt(&mpe_prompt_start, &env);
+}
+
+/// Yield to a prompt `p` (entered with `mpe_prompt`) and detach the handler frames
+/// installed inside it. They are relinked to the current handlers when resuming, 
+/// which may be on another thread.
+static mpe_frame_t* mpe_frame_prompt_find(mp_prompt_t* p) {
+  mpe_frame_t* f = mpe_frame_top;
+  while (f != NULL && !(f->effect == MPE_EFFECT(mpe_frame_prompt) && ((mpe_frame_prompt_t*)f)->prompt == p)) {
+    f = f->parent;
+  }
+  return f;
+}
+
+void* mpe_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
+  mpe_frame_t* f = mpe_frame_prompt_find(p);
+  if (f == NULL) {
+    return mp_yield(p, fun, arg);   // not entered with `mpe_prompt`; assume no frames to detach
+  }
+  mpe_frame_t* resume_top = mpe_frame_top;
+  mpe_frame_top = f->parent;        // unlink the frames of `p`  
+  void* result = mp_yield(p, fun, arg);
+  mpe_frames_relink(f, resume_top);
+  return result;
+}
+
+/// Transfer from under a prompt `p` (entered with `mpe_prompt`) directly to a `target` that was
+/// suspended with `mpe_yield` (see `mp_resume_transfer`). The handler frames of `p` are detached 
+/// as with `mpe_yield`, and the target relinks its own frames when it continues.
+void* mpe_resume_transfer(mp_prompt_t* p, mp_resume_t** from, mp_resume_t* target, void* arg) {
+  mpe_frame_t* f = mpe_frame_prompt_find(p);
+  if (f == NULL) {
+    return mp_resume_transfer(p, from, target, arg);
+  }
+  mpe_frame_t* resume_top = mpe_frame_top;
+  mpe_frame_top = f->parent;        // unlink the frames of `p`  
+  void* result = mp_resume_transfer(p, from, target, arg);
+  mpe_frames_relink(f, resume_top);
+  return result;
+}
+
+
 /*-----------------------------------------------------------------
   Resume
 -----------------------------------------------------------------*/
 
 static void* mpe_resume_internal(bool final, mpe_resume_t* resume, void* local, void* arg, bool unwind) {
-  mpe_assert(resume->kind >= MPE_RESUMPTION_SCOPED_ONCE);
-  mpe_resume_env_t renv = { local, arg, unwind };
+  const mpe_resumption_kind_t kind = mpe_resume_kind(resume);
+  mpe_assert(kind >= MPE_RESUMPTION_SCOPED_ONCE);
+  mp_resume_t* mpr = mpe_resume_mp(resume);
   // and resume
-  if (resume->kind == MPE_RESUMPTION_SCOPED_ONCE) {
-    mp_resume_t* mpr = resume->mp.resume;
-    return mp_resume(mpr, &renv);
-  }
-  else if (resume->kind == MPE_RESUMPTION_ONCE) {
-    mp_resume_t* mpr = resume->mp.resume;
+  if (kind == MPE_RESUMPTION_ONCE) {
     mpe_assert_internal(final);
-    //mpe_trace_message("free resume: %p\n", resume);
-    mpe_free(resume);
-    return mp_resume(mpr, &renv);
   }
-  else {
-    mp_resume_t* mpr = resume->mp.resume;
-    if (final) {
-      //mpe_trace_message("free resume: %p\n", resume);
-      mpe_free(resume);
-    }
-    else {
-      mp_resume_dup(mpr); 
-    }
-    return mp_resume(mpr, &renv);
+  else if (kind == MPE_RESUMPTION_MULTI && !final) {
+    mp_resume_dup(mpr); 
   }
+  return mp_resumex(mpr, arg, (unwind ? MPE_RESUME_UNWIND : local));
 }
 
 // Resume to unwind (e.g. run destructors and finally clauses)
@@ -504,38 +942,53 @@ void* mpe_resume(mpe_resume_t* resume, void* local, void* arg) {
 
 // Last resume in tail-position
 void* mpe_resume_tail(mpe_resume_t* resume, void* local, void* arg) {  
-  if (mpe_likely(resume->kind == MPE_RESUMPTION_INPLACE)) {
+  const mpe_resumption_kind_t kind = mpe_resume_kind(resume);
+  if (mpe_likely(kind == MPE_RESUMPTION_INPLACE || kind == MPE_RESUMPTION_TENTATIVE)) {
     *resume->mp.plocal = local;
     return arg;
   }
-  mpe_resume_env_t renv = { local, arg, false };
-  // and tail resume
-  if (resume->kind == MPE_RESUMPTION_SCOPED_ONCE) {
-    mp_resume_t* mpr = resume->mp.resume;
-    return mp_resume_tail(mpr, &renv);
-  }
-  else {
-    mp_resume_t* mpr = resume->mp.resume;    
-    mpe_free(resume); // always assume final?
-    return mp_resume_tail(mpr, &renv);
-  }
+  mpe_assert(kind != MPE_RESUMPTION_SUSPENDED);
+  // and tail resume (always assumed final)
+  return mp_resumex_tail(mpe_resume_mp(resume), arg, local);
 }
 
 
+// Is this an in place resumption of a `MPE_OP_MAYBE_TAIL` operation?
+bool mpe_resume_is_tentative(const mpe_resume_t* resume) {
+  return (resume != NULL && mpe_resume_kind(resume) == MPE_RESUMPTION_TENTATIVE);
+}
+
+// Suspend a tentative resumption: the operation function is invoked again at the handler
+// with a scoped once resumption as soon as it returns. 
+void* mpe_resume_suspend(mpe_resume_t* resume) {
+  mpe_assert(mpe_resume_is_tentative(resume));
+  resume->kind = MPE_RESUMPTION_SUSPENDED;
+  return NULL;
+}
+
+// Clone a (multi-shot or once) resumption into an independent once resumption that 
+// can be resumed concurrently (on another thread) as the handler frames are relinked on resume.
+mpe_resume_t* mpe_resume_clone(mpe_resume_t* resume) {
+  const mpe_resumption_kind_t kind = mpe_resume_kind(resume);
+  mpe_assert(kind == MPE_RESUMPTION_ONCE || kind == MPE_RESUMPTION_MULTI);
+  mp_resume_t* mpr = mp_resume_clone(mpe_resume_mp(resume));
+  return (mpr == NULL ? NULL : mpe_resume_tagged(mpr, MPE_RESUME_TAG_ONCE));
+}
+
 // Release without resuming 
 void mpe_resume_release(mpe_resume_t* resume) {
   if (resume == NULL) return; // in case someone tries to release a NULL (OP_NEVER or OP_ABORT) resumption
-  if (resume->kind == MPE_RESUMPTION_ONCE) {
+  const mpe_resumption_kind_t kind = mpe_resume_kind(resume);
+  if (kind == MPE_RESUMPTION_ONCE) {
     mpe_resume_unwind(resume);    
   }
   else {
-    mpe_assert_internal(resume->kind == MPE_RESUMPTION_MULTI);
-    mp_resume_t* mpr = resume->mp.resume;
+    mpe_assert_internal(kind == MPE_RESUMPTION_MULTI);
+    mp_resume_t* mpr = mpe_resume_mp(resume);
     if (mp_resume_should_unwind(mpr)) {
       mpe_resume_unwind(resume);
     }
     else {
-      mpe_free(resume);
       mp_resume_drop(mpr);
     }
   }
@@ -0,0 +1,404 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------
+  Asynchronous I/O as an effect.
+
+  An event loop runs strands where each strand runs under its own `mpio`
+  handler (with the loop as its local state). An asynchronous operation
+  first tries to complete directly (with the readiness backend); otherwise it
+  performs `mpio_submit` which is an `MPE_OP_ONCE` operation: the operation
+  clause hands the request to the backend and returns to the event loop, which
+  resumes the strand once the request completes. All completions that are
+  harvested in one wait are resumed as a batch.
+
+  There are two backends:
+  - io_uring (Linux 5.6+), using the raw system calls.
+  - a readiness based backend using epoll on Linux and poll() elsewhere.
+-----------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <mprompt.h>
+#include "mpeff.h"
+#include "mpio.h"
+#include "internal/util.h"
+
+#if defined(__linux__)
+#define MPIO_USE_URING  (1)
+#define MPIO_USE_EPOLL  (1)
+#else
+#define MPIO_USE_URING  (0)
+#define MPIO_USE_EPOLL  (0)
+#endif
+
+#if MPIO_USE_URING
+#include <linux/time_types.h>   // struct __kernel_timespec
+#endif
+
+
+/*-----------------------------------------------------------------
+  Requests and strands
+-----------------------------------------------------------------*/
+
+typedef enum mpio_op_e {
+  MPIO_OP_READ,
+  MPIO_OP_WRITE,
+  MPIO_OP_ACCEPT,
+  MPIO_OP_CONNECT,
+  MPIO_OP_SLEEP
+} mpio_op_t;
+
+// A request lives on the stack of the strand that is suspended on it.
+typedef struct mpio_request_s {
+  mpio_op_t         op;
+  int               fd;
+  void*             buf;
+  size_t            len;
+  struct sockaddr*  addr;
+  socklen_t         addrlen;      // connect
+  socklen_t*        paddrlen;     // accept
+  uint64_t          deadline;     // sleep: in milli-seconds on the monotonic clock
+  bool              in_progress;  // connect: waiting for a non-blocking connect to finish
+  ssize_t           result;       // >= 0, or -errno
+  mpe_resume_t*     resume;       // the suspended strand
+  struct mpio_request_s* next;    // in the waiting, timer, or completion lists
+  #if MPIO_USE_URING
+  struct __kernel_timespec ts;    // sleep: timeout for io_uring
+  #endif
+} mpio_request_t;
+
+typedef struct mpio_loop_s mpio_loop_t;
+
+typedef struct mpio_strand_s {
+  mpe_actionfun_t*       action;
+  void*                  arg;
+  void*                  result;
+  mpio_loop_t*           loop;
+  bool                   forked;  // forked strands are allocated and their result is ignored
+  struct mpio_strand_s*  next;
+} mpio_strand_t;
+
+// Called by the backends when a request completes (with `result` >= 0 or -errno)
+static void mpio_loop_complete(mpio_loop_t* loop, mpio_request_t* req, ssize_t result);
+
+static uint64_t mpio_clock_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000) + ((uint64_t)t.tv_nsec / 1000000);
+}
+
+
+/*-----------------------------------------------------------------
+  Backends
+-----------------------------------------------------------------*/
+
+#if MPIO_USE_URING
+#include "mpio_uring.c"
+#endif
+#include "mpio_poll.c"
+
+
+/*-----------------------------------------------------------------
+  Event loop
+-----------------------------------------------------------------*/
+
+struct mpio_loop_s {
+  mpio_backend_t  backend;        // MPIO_BACKEND_URING or MPIO_BACKEND_POLL
+  ssize_t         pending;        // submitted requests that did not complete yet
+  ssize_t         strands;        // strands that are not done yet
+  mpio_strand_t*  ready_first;    // forked strands that are not yet started
+  mpio_strand_t*  ready_last;
+  mpio_request_t* done_first;     // completed requests whose strands should be resumed
+  mpio_request_t* done_last;
+  #if MPIO_USE_URING
+  mpio_uring_t    uring;
+  #endif
+  mpio_poller_t   poller;
+};
+
+static bool mpio_loop_init(mpio_loop_t* loop, mpio_backend_t backend) {
+  memset(loop, 0, sizeof(*loop));
+  #if MPIO_USE_URING
+  if (backend != MPIO_BACKEND_POLL && mpio_uring_init(&loop->uring)) {
+    loop->backend = MPIO_BACKEND_URING;
+    return true;
+  }
+  #endif
+  if (backend == MPIO_BACKEND_URING) {
+    mp_error_message(ENOSYS, "io_uring is not available\n");
+    return false;
+  }
+  if (!mpio_poller_init(&loop->poller)) {
+    mp_error_message(errno, "unable to initialize the event loop\n");
+    return false;
+  }
+  loop->backend = MPIO_BACKEND_POLL;
+  return true;
+}
+
+static void mpio_loop_done(mpio_loop_t* loop) {
+  mp_assert_internal(loop->pending == 0 && loop->strands == 0);
+  #if MPIO_USE_URING
+  if (loop->backend == MPIO_BACKEND_URING) {
+    mpio_uring_done(&loop->uring);
+    return;
+  }
+  #endif
+  mpio_poller_done(&loop->poller);
+}
+
+// Try to complete a request without suspending
+static bool mpio_loop_try(mpio_loop_t* loop, mpio_request_t* req) {
+  if (loop->backend == MPIO_BACKEND_URING) return false;
+  return mpio_poller_try(&loop->poller, req);
+}
+
+static void mpio_loop_submit(mpio_loop_t* loop, mpio_request_t* req) {
+  loop->pending++;
+  #if MPIO_USE_URING
+  if (loop->backend == MPIO_BACKEND_URING) {
+    mpio_uring_submit(&loop->uring, req);
+    return;
+  }
+  #endif
+  mpio_poller_submit(&loop->poller, req);
+}
+
+static void mpio_loop_complete(mpio_loop_t* loop, mpio_request_t* req, ssize_t result) {
+  mp_assert_internal(loop->pending > 0);
+  loop->pending--;
+  req->result = result;
+  req->next = NULL;
+  if (loop->done_last == NULL) { loop->done_first = req; }
+                          else { loop->done_last->next = req; }
+  loop->done_last = req;
+}
+
+// Wait for at least one completion
+static void mpio_loop_wait(mpio_loop_t* loop) {
+  #if MPIO_USE_URING
+  if (loop->backend == MPIO_BACKEND_URING) {
+    mpio_uring_wait(loop, &loop->uring);
+    return;
+  }
+  #endif
+  mpio_poller_wait(loop, &loop->poller);
+}
+
+
+/*-----------------------------------------------------------------
+  The I/O effect
+-----------------------------------------------------------------*/
+
+MPE_DEFINE_EFFECT2(mpio, submit, loop)
+
+// Suspend the strand: the event loop resumes it when the request completes
+static void* mpio_op_submit(mpe_resume_t* r, void* local, void* arg) {
+  mpio_loop_t* loop = (mpio_loop_t*)local;
+  mpio_request_t* req = (mpio_request_t*)arg;
+  req->resume = r;
+  mpio_loop_submit(loop, req);
+  return NULL;  // return to the event loop
+}
+
+static void* mpio_op_loop(mpe_resume_t* r, void* local, void* arg) {
+  MP_UNUSED(arg);
+  return mpe_resume_tail(r, local, local);
+}
+
+static const mpe_handlerdef_t mpio_hdef = { MPE_EFFECT(mpio), NULL, {
+  { MPE_OP_ONCE, MPE_OPTAG(mpio,submit), &mpio_op_submit },
+  { MPE_OP_TAIL_NOOP, MPE_OPTAG(mpio,loop), &mpio_op_loop },
+  { MPE_OP_NULL, mpe_op_null, NULL }
+} };
+
+static mpio_loop_t* mpio_loop_current(mpe_evidence_t* ev) {
+  *ev = mpe_evidence_find(MPE_EFFECT(mpio));
+  if (ev->handler == NULL) return NULL;
+  return (mpio_loop_t*)mpe_perform_ev(*ev, MPE_OPTAG(mpio,loop), NULL);
+}
+
+static void* mpio_strand_action(void* arg) {
+  mpio_strand_t* s = (mpio_strand_t*)arg;
+  void* result = (s->action)(s->arg);
+  s->loop->strands--;
+  if (s->forked) {
+    mp_free(s);
+  }
+  else {
+    s->result = result;
+  }
+  return NULL;
+}
+
+// Run a strand until it completes or is suspended
+static void mpio_strand_start(mpio_loop_t* loop, mpio_strand_t* s) {
+  mpe_handle(&mpio_hdef, loop, &mpio_strand_action, s);
+}
+
+
+/*-----------------------------------------------------------------
+  Interface
+-----------------------------------------------------------------*/
+
+void* mpio_main_ex(mpio_backend_t backend, mpe_actionfun_t* action, void* arg) {
+  mpio_loop_t loop;
+  if (!mpio_loop_init(&loop, backend)) return NULL;
+  mpio_strand_t main_strand = { action, arg, NULL, &loop, false, NULL };
+  loop.strands = 1;
+  mpio_strand_start(&loop, &main_strand);
+  while (loop.strands > 0) {
+    // start forked strands
+    mpio_strand_t* s;
+    while ((s = loop.ready_first) != NULL) {
+      loop.ready_first = s->next;
+      if (loop.ready_first == NULL) loop.ready_last = NULL;
+      mpio_strand_start(&loop, s);
+    }
+    if (loop.strands == 0) break;
+    if (loop.done_first == NULL) {
+      if (loop.ready_first != NULL) continue;  // more strands were forked
+      mp_assert_internal(loop.pending > 0);    // as strands only suspend on a request
+      mpio_loop_wait(&loop);
+    }
+    // resume all completed requests
+    mpio_request_t* req;
+    while ((req = loop.done_first) != NULL) {
+      loop.done_first = req->next;
+      if (loop.done_first == NULL) loop.done_last = NULL;
+      mpe_resume_final(req->resume, &loop, NULL);
+    }
+  }
+  mpio_loop_done(&loop);
+  return main_strand.result;
+}
+
+void* mpio_main(mpe_actionfun_t* action, void* arg) {
+  return mpio_main_ex(MPIO_BACKEND_DEFAULT, action, arg);
+}
+
+void mpio_fork(mpe_actionfun_t* action, void* arg) {
+  mpe_evidence_t ev;
+  mpio_loop_t* loop = mpio_loop_current(&ev);
+  if (loop == NULL) {
+    mp_error_message(EINVAL, "mpio_fork must be called from a strand in an event loop\n");
+    return;
+  }
+  mpio_strand_t* s = mp_zalloc_safe_tp(mpio_strand_t);
+  s->action = action;
+  s->arg = arg;
+  s->loop = loop;
+  s->forked = true;
+  loop->strands++;
+  if (loop->ready_last == NULL) { loop->ready_first = s; }
+                           else { loop->ready_last->next = s; }
+  loop->ready_last = s;
+}
+
+// Complete a request, suspending the current strand if needed
+static ssize_t mpio_perform(mpio_request_t* req) {
+  mpe_evidence_t ev;
+  mpio_loop_t* loop = mpio_loop_current(&ev);
+  if (mp_unlikely(loop == NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!mpio_loop_try(loop, req)) {
+    mpe_perform_ev(ev, MPE_OPTAG(mpio,submit), req);
+  }
+  if (req->result < 0) {
+    errno = (int)(-req->result);
+    return -1;
+  }
+  return req->result;
+}
+
+static void mpio_request_init(mpio_request_t* req, mpio_op_t op, int fd) {
+  memset(req, 0, sizeof(*req));
+  req->op = op;
+  req->fd = fd;
+}
+
+ssize_t mpio_read(int fd, void* buf, size_t count) {
+  mpio_request_t req;
+  mpio_request_init(&req, MPIO_OP_READ, fd);
+  req.buf = buf;
+  req.len = count;
+  return mpio_perform(&req);
+}
+
+ssize_t mpio_write(int fd, const void* buf, size_t count) {
+  mpio_request_t req;
+  mpio_request_init(&req, MPIO_OP_WRITE, fd);
+  req.buf = (void*)buf;
+  req.len = count;
+  return mpio_perform(&req);
+}
+
+int mpio_accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+  mpio_request_t req;
+  mpio_request_init(&req, MPIO_OP_ACCEPT, fd);
+  req.addr = addr;
+  req.paddrlen = addrlen;
+  return (int)mpio_perform(&req);
+}
+
+int mpio_connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+  mpio_request_t req;
+  mpio_request_init(&req, MPIO_OP_CONNECT, fd);
+  req.addr = (struct sockaddr*)addr;
+  req.addrlen = addrlen;
+  return (int)mpio_perform(&req);
+}
+
+int mpio_sleep(uint64_t msecs) {
+  mpio_request_t req;
+  mpio_request_init(&req, MPIO_OP_SLEEP, -1);
+  req.deadline = mpio_clock_now() + msecs;
+  #if MPIO_USE_URING
+  req.ts.tv_sec = (int64_t)(msecs / 1000);
+  req.ts.tv_nsec = (long long)((msecs % 1000) * 1000000);
+  #endif
+  return (int)mpio_perform(&req);
+}
+
+int mpio_close(int fd) {
+  mpe_evidence_t ev;
+  mpio_loop_t* loop = mpio_loop_current(&ev);
+  if (loop != NULL && loop->backend == MPIO_BACKEND_POLL) {
+    mpio_poller_forget(&loop->poller, fd);
+  }
+  return close(fd);
+}
+
+bool mpio_register_buffers(const struct iovec* iovs, size_t count) {
+  mpe_evidence_t ev;
+  mpio_loop_t* loop = mpio_loop_current(&ev);
+  if (loop == NULL) return false;
+  #if MPIO_USE_URING
+  if (loop->backend == MPIO_BACKEND_URING) {
+    return mpio_uring_register_buffers(&loop->uring, iovs, count);
+  }
+  #else
+  MP_UNUSED(iovs); MP_UNUSED(count);
+  #endif
+  return false;
+}
+
+const char* mpio_backend_name(void) {
+  mpe_evidence_t ev;
+  mpio_loop_t* loop = mpio_loop_current(&ev);
+  if (loop == NULL) return NULL;
+  if (loop->backend == MPIO_BACKEND_URING) return "io_uring";
+  return (MPIO_USE_EPOLL ? "epoll" : "poll");
+}
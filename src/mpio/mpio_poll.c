@@ -0,0 +1,248 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------
+  Readiness based backend (included from mpio.c)
+
+  File descriptors are put in non-blocking mode on first use and every
+  operation is first tried directly. Only if it would block, the request
+  waits on its descriptor until it is ready again. We use epoll on Linux
+  (registering each descriptor once, edge triggered), and poll() elsewhere.
+  Regular files are always ready and their operations never wait.
+  Timers are kept in a list sorted by deadline.
+-----------------------------------------------------------------*/
+#include <sys/stat.h>
+#if MPIO_USE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+typedef enum mpio_fd_state_e {
+  MPIO_FD_NEW,        // not used yet
+  MPIO_FD_WATCHED,    // non-blocking and watched for readiness
+  MPIO_FD_FILE        // always ready
+} mpio_fd_state_t;
+
+typedef struct mpio_fd_s {
+  mpio_fd_state_t  state;
+  mpio_request_t*  readers;   // waiting to read or accept (in order)
+  mpio_request_t*  writers;   // waiting to write or connect (in order)
+} mpio_fd_t;
+
+typedef struct mpio_poller_s {
+  mpio_fd_t*       fds;       // indexed by file descriptor
+  size_t           fd_count;
+  mpio_request_t*  timers;    // sorted by deadline
+  #if MPIO_USE_EPOLL
+  int              epfd;
+  #else
+  struct pollfd*   pfds;
+  size_t           pfd_count;
+  #endif
+} mpio_poller_t;
+
+
+static bool mpio_poller_init(mpio_poller_t* p) {
+  memset(p, 0, sizeof(*p));
+  #if MPIO_USE_EPOLL
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epfd < 0) return false;
+  #endif
+  return true;
+}
+
+static void mpio_poller_done(mpio_poller_t* p) {
+  #if MPIO_USE_EPOLL
+  close(p->epfd);
+  #else
+  mp_free(p->pfds);
+  #endif
+  mp_free(p->fds);
+  memset(p, 0, sizeof(*p));
+}
+
+// Get the entry for a descriptor and start watching it on first use
+static mpio_fd_t* mpio_poller_fd(mpio_poller_t* p, int fd) {
+  if ((size_t)fd >= p->fd_count) {
+    size_t count = (p->fd_count == 0 ? 64 : p->fd_count);
+    while (count <= (size_t)fd) count *= 2;
+    p->fds = (mpio_fd_t*)mp_realloc(p->fds, count * sizeof(mpio_fd_t));
+    if (p->fds == NULL) mp_fatal_message(ENOMEM, "out of memory\n");
+    memset(p->fds + p->fd_count, 0, (count - p->fd_count) * sizeof(mpio_fd_t));
+    p->fd_count = count;
+  }
+  mpio_fd_t* entry = &p->fds[fd];
+  if (mp_unlikely(entry->state == MPIO_FD_NEW)) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      entry->state = MPIO_FD_FILE;
+      return entry;
+    }
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_NONBLOCK) == 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    #if MPIO_USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST) {
+      entry->state = MPIO_FD_FILE;  // e.g. EPERM for descriptors that do not support polling
+      return entry;
+    }
+    #endif
+    entry->state = MPIO_FD_WATCHED;
+  }
+  return entry;
+}
+
+static void mpio_poller_forget(mpio_poller_t* p, int fd) {
+  if (fd < 0 || (size_t)fd >= p->fd_count) return;
+  mpio_fd_t* entry = &p->fds[fd];
+  mp_assert_internal(entry->readers == NULL && entry->writers == NULL);
+  #if MPIO_USE_EPOLL
+  if (entry->state == MPIO_FD_WATCHED) epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+  #endif
+  entry->state = MPIO_FD_NEW;
+}
+
+// Perform the operation of a request; returns `false` if it would block.
+static bool mpio_poller_perform(mpio_request_t* req) {
+  ssize_t res;
+  do {
+    switch (req->op) {
+    case MPIO_OP_READ:   res = read(req->fd, req->buf, req->len); break;
+    case MPIO_OP_WRITE:  res = write(req->fd, req->buf, req->len); break;
+    case MPIO_OP_ACCEPT: res = accept(req->fd, req->addr, req->paddrlen); break;
+    case MPIO_OP_CONNECT:
+      if (req->in_progress) {
+        // the descriptor became writable: get the result of the connect
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+        req->result = -err;
+        return true;
+      }
+      res = connect(req->fd, req->addr, req->addrlen);
+      if (res != 0 && errno == EINPROGRESS) {
+        req->in_progress = true;
+        return false;
+      }
+      break;
+    default:
+      return false;  // sleep
+    }
+  } while (res < 0 && errno == EINTR);
+  if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+  req->result = (res < 0 ? -errno : res);
+  return true;
+}
+
+static bool mpio_poller_try(mpio_poller_t* p, mpio_request_t* req) {
+  if (req->op == MPIO_OP_SLEEP) return false;
+  mpio_fd_t* entry = mpio_poller_fd(p, req->fd);
+  // only perform directly if no other requests are waiting on this descriptor (to keep them in order)
+  mpio_request_t* waiting = (req->op == MPIO_OP_READ || req->op == MPIO_OP_ACCEPT ? entry->readers : entry->writers);
+  if (waiting != NULL) return false;
+  return mpio_poller_perform(req);
+}
+
+static void mpio_request_append(mpio_request_t** list, mpio_request_t* req) {
+  req->next = NULL;
+  while (*list != NULL) { list = &(*list)->next; }
+  *list = req;
+}
+
+static void mpio_poller_submit(mpio_poller_t* p, mpio_request_t* req) {
+  if (req->op == MPIO_OP_SLEEP) {
+    // insert in the sorted timer list (after timers with the same deadline)
+    mpio_request_t** t = &p->timers;
+    while (*t != NULL && (*t)->deadline <= req->deadline) { t = &(*t)->next; }
+    req->next = *t;
+    *t = req;
+    return;
+  }
+  mpio_fd_t* entry = mpio_poller_fd(p, req->fd);
+  if (req->op == MPIO_OP_READ || req->op == MPIO_OP_ACCEPT) {
+    mpio_request_append(&entry->readers, req);
+  }
+  else {
+    mpio_request_append(&entry->writers, req);
+  }
+}
+
+// Retry the waiting requests of a descriptor in order until one would block
+static void mpio_poller_retry(mpio_loop_t* loop, mpio_request_t** list) {
+  mpio_request_t* req;
+  while ((req = *list) != NULL && mpio_poller_perform(req)) {
+    *list = req->next;
+    mpio_loop_complete(loop, req, req->result);
+  }
+}
+
+static void mpio_poller_ready(mpio_loop_t* loop, mpio_poller_t* p, int fd, bool readable, bool writable) {
+  if (fd < 0 || (size_t)fd >= p->fd_count) return;
+  mpio_fd_t* entry = &p->fds[fd];
+  if (readable) mpio_poller_retry(loop, &entry->readers);
+  if (writable) mpio_poller_retry(loop, &entry->writers);
+}
+
+// Wait until descriptors are ready or timers expire
+static void mpio_poller_wait(mpio_loop_t* loop, mpio_poller_t* p) {
+  // timeout until the first timer
+  int timeout = -1;
+  if (p->timers != NULL) {
+    const uint64_t now = mpio_clock_now();
+    const uint64_t deadline = p->timers->deadline;
+    timeout = (deadline <= now ? 0 : (deadline - now > INT32_MAX ? INT32_MAX : (int)(deadline - now)));
+  }
+  #if MPIO_USE_EPOLL
+  struct epoll_event events[64];
+  const int n = epoll_wait(p->epfd, events, 64, timeout);
+  for (int i = 0; i < n; i++) {
+    const uint32_t ev = events[i].events;
+    const bool err = ((ev & (EPOLLERR | EPOLLHUP)) != 0);
+    mpio_poller_ready(loop, p, events[i].data.fd, err || (ev & (EPOLLIN | EPOLLRDHUP)) != 0, err || (ev & EPOLLOUT) != 0);
+  }
+  #else
+  // poll all descriptors with waiting requests
+  size_t count = 0;
+  for (size_t fd = 0; fd < p->fd_count; fd++) {
+    if (p->fds[fd].readers != NULL || p->fds[fd].writers != NULL) count++;
+  }
+  if (count > p->pfd_count) {
+    p->pfds = (struct pollfd*)mp_realloc(p->pfds, count * sizeof(struct pollfd));
+    if (p->pfds == NULL) mp_fatal_message(ENOMEM, "out of memory\n");
+    p->pfd_count = count;
+  }
+  size_t i = 0;
+  for (size_t fd = 0; fd < p->fd_count; fd++) {
+    const mpio_fd_t* entry = &p->fds[fd];
+    if (entry->readers == NULL && entry->writers == NULL) continue;
+    p->pfds[i].fd = (int)fd;
+    p->pfds[i].events = (short)((entry->readers != NULL ? POLLIN : 0) | (entry->writers != NULL ? POLLOUT : 0));
+    p->pfds[i].revents = 0;
+    i++;
+  }
+  const int n = poll(p->pfds, (nfds_t)count, timeout);
+  for (i = 0; n > 0 && i < count; i++) {
+    const short ev = p->pfds[i].revents;
+    if (ev == 0) continue;
+    const bool err = ((ev & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+    mpio_poller_ready(loop, p, p->pfds[i].fd, err || (ev & POLLIN) != 0, err || (ev & POLLOUT) != 0);
+  }
+  #endif
+  // expired timers
+  if (p->timers != NULL) {
+    const uint64_t now = mpio_clock_now();
+    mpio_request_t* t;
+    while ((t = p->timers) != NULL && t->deadline <= now) {
+      p->timers = t->next;
+      mpio_loop_complete(loop, t, 0);
+    }
+  }
+}
@@ -0,0 +1,233 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------
+  io_uring backend (included from mpio.c)
+
+  Uses the raw system calls so there is no dependency on liburing.
+  Submissions are queued in the submission ring and passed to the kernel
+  in one `io_uring_enter` call when the event loop waits. Reads and writes
+  within registered buffers use the fixed (zero-copy) variants.
+-----------------------------------------------------------------*/
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#define MPIO_URING_ENTRIES  (256)
+
+typedef struct mpio_uring_s {
+  int                   fd;
+  // submission ring
+  unsigned*             sq_head;
+  unsigned*             sq_tail;
+  unsigned*             sq_array;
+  unsigned              sq_mask;
+  unsigned              sq_entries;
+  unsigned              to_submit;   // queued but not yet passed to the kernel
+  struct io_uring_sqe*  sqes;
+  // completion ring
+  unsigned*             cq_head;
+  unsigned*             cq_tail;
+  unsigned              cq_mask;
+  struct io_uring_cqe*  cqes;
+  // mappings
+  uint8_t*              sq_ring;
+  size_t                sq_ring_size;
+  uint8_t*              cq_ring;
+  size_t                cq_ring_size;
+  size_t                sqes_size;
+  // registered buffers
+  struct iovec*         bufs;
+  unsigned              buf_count;
+} mpio_uring_t;
+
+
+static int mpio_sys_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int mpio_sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int mpio_sys_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void* mpio_uring_mmap(int fd, size_t size, off_t offset) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return (p == MAP_FAILED ? NULL : p);
+}
+
+static void mpio_uring_done(mpio_uring_t* u) {
+  if (u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_size);
+  if (u->fd >= 0) close(u->fd);
+  mp_free(u->bufs);
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+}
+
+static bool mpio_uring_init(mpio_uring_t* u) {
+  memset(u, 0, sizeof(*u));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->fd = mpio_sys_uring_setup(MPIO_URING_ENTRIES, &p);
+  if (u->fd < 0) return false;
+  // we need reads and writes at the current file position (Linux 5.6+)
+  if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+    mpio_uring_done(u);
+    return false;
+  }
+  // map the rings
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = ((p.features & IORING_FEAT_SINGLE_MMAP) != 0);
+  if (single_mmap) {
+    if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  u->sq_ring = (uint8_t*)mpio_uring_mmap(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+  u->cq_ring = (single_mmap ? u->sq_ring : (uint8_t*)mpio_uring_mmap(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING));
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*)mpio_uring_mmap(u->fd, u->sqes_size, IORING_OFF_SQES);
+  if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL) {
+    mpio_uring_done(u);
+    return false;
+  }
+  u->sq_head    = (unsigned*)(u->sq_ring + p.sq_off.head);
+  u->sq_tail    = (unsigned*)(u->sq_ring + p.sq_off.tail);
+  u->sq_array   = (unsigned*)(u->sq_ring + p.sq_off.array);
+  u->sq_mask    = *(unsigned*)(u->sq_ring + p.sq_off.ring_mask);
+  u->sq_entries = *(unsigned*)(u->sq_ring + p.sq_off.ring_entries);
+  u->cq_head    = (unsigned*)(u->cq_ring + p.cq_off.head);
+  u->cq_tail    = (unsigned*)(u->cq_ring + p.cq_off.tail);
+  u->cq_mask    = *(unsigned*)(u->cq_ring + p.cq_off.ring_mask);
+  u->cqes       = (struct io_uring_cqe*)(u->cq_ring + p.cq_off.cqes);
+  return true;
+}
+
+// Pass the queued submissions to the kernel and wait for at least `min_complete` completions.
+static void mpio_uring_enter(mpio_uring_t* u, unsigned min_complete) {
+  const unsigned flags = (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+  while (true) {
+    int n = mpio_sys_uring_enter(u->fd, u->to_submit, min_complete, flags);
+    if (n >= 0) {
+      u->to_submit -= ((unsigned)n < u->to_submit ? (unsigned)n : u->to_submit);
+      return;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EBUSY || errno == EAGAIN) return;  // completion queue is full; harvest first
+    mp_fatal_message(errno, "io_uring_enter failed\n");
+  }
+}
+
+static struct io_uring_sqe* mpio_uring_sqe(mpio_uring_t* u) {
+  const unsigned tail = *u->sq_tail;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+    mpio_uring_enter(u, 0);  // submission ring is full
+  }
+  struct io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void mpio_uring_push(mpio_uring_t* u) {
+  const unsigned tail = *u->sq_tail;
+  const unsigned idx = tail & u->sq_mask;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+}
+
+// Index of the registered buffer that contains `[buf,buf+len)` (or -1)
+static int mpio_uring_buffer_index(mpio_uring_t* u, const void* buf, size_t len) {
+  for (unsigned i = 0; i < u->buf_count; i++) {
+    const uint8_t* start = (const uint8_t*)u->bufs[i].iov_base;
+    if ((const uint8_t*)buf >= start && (const uint8_t*)buf + len <= start + u->bufs[i].iov_len) return (int)i;
+  }
+  return -1;
+}
+
+static void mpio_uring_submit(mpio_uring_t* u, mpio_request_t* req) {
+  struct io_uring_sqe* sqe = mpio_uring_sqe(u);
+  sqe->fd = req->fd;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  switch (req->op) {
+  case MPIO_OP_READ:
+  case MPIO_OP_WRITE: {
+    const size_t len = (req->len > (1UL << 30) ? (1UL << 30) : req->len);  // partial reads and writes are allowed
+    const int idx = mpio_uring_buffer_index(u, req->buf, len);
+    if (idx >= 0) {
+      sqe->opcode = (req->op == MPIO_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+      sqe->buf_index = (uint16_t)idx;
+    }
+    else {
+      sqe->opcode = (req->op == MPIO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE);
+    }
+    sqe->addr = (uint64_t)(uintptr_t)req->buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)(-1);  // at the current position
+    break;
+  }
+  case MPIO_OP_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr = (uint64_t)(uintptr_t)req->addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)req->paddrlen;
+    break;
+  case MPIO_OP_CONNECT:
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->addr = (uint64_t)(uintptr_t)req->addr;
+    sqe->off = req->addrlen;
+    break;
+  case MPIO_OP_SLEEP:
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&req->ts;
+    sqe->len = 1;
+    sqe->off = 0;   // only complete on the timeout
+    break;
+  }
+  mpio_uring_push(u);
+}
+
+// Submit queued requests, wait for completions, and complete them all as a batch
+static void mpio_uring_wait(mpio_loop_t* loop, mpio_uring_t* u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    mpio_uring_enter(u, 1);
+  }
+  else if (u->to_submit > 0) {
+    mpio_uring_enter(u, 0);
+  }
+  const unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+    mpio_request_t* req = (mpio_request_t*)(uintptr_t)cqe->user_data;
+    ssize_t res = cqe->res;
+    if (req->op == MPIO_OP_SLEEP && res == -ETIME) res = 0;
+    mpio_loop_complete(loop, req, res);
+    head++;
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool mpio_uring_register_buffers(mpio_uring_t* u, const struct iovec* iovs, size_t count) {
+  if (u->bufs != NULL) {
+    mpio_sys_uring_register(u->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    mp_free(u->bufs);
+    u->bufs = NULL;
+    u->buf_count = 0;
+  }
+  if (count == 0) return true;
+  if (mpio_sys_uring_register(u->fd, IORING_REGISTER_BUFFERS, iovs, (unsigned)count) != 0) return false;
+  u->bufs = (struct iovec*)mp_malloc_safe(count * sizeof(struct iovec));
+  memcpy(u->bufs, iovs, count * sizeof(struct iovec));
+  u->buf_count = (unsigned)count;
+  return true;
+}
@@ -97,8 +97,11 @@ mp_setjmp PROC
   mov     [rcx+256], r11 
   mov     [rcx+264], r10
   
+  test    word ptr [rcx+278], 1  ; lite context?
+  jnz     @F
   stmxcsr [rcx+272]        ; save sse control word
   fnstcw  [rcx+276]        ; save fpu control word
+@@:
   
 
   xor     rax, rax         ; return 0 at first
@@ -139,9 +142,12 @@ mp_longjmp PROC
   mov     r9,  [rcx+256]
   mov     r10, [rcx+264]
   
+  test    word ptr [rcx+278], 1  ; lite context?
+  jnz     @F
   ldmxcsr [rcx+272]            ; restore sse control word
   ; fnclex                     ; clear fpu exception flags
   fldcw   [rcx+276]            ; restore fpu control word
+@@:
     
   mov     gs:[8],    rax       ; restore stack limits and fiber data  
   mov     gs:[16],   r8
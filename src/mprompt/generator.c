@@ -0,0 +1,191 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Included from "main.c".
+
+  Generators with batched yields. The producer runs under its own prompt and
+  copies its elements into a ring buffer that is owned by the consumer (as part
+  of the `mp_gen_t`). The producer only yields back when the buffer is full,
+  and the consumer only resumes the producer once the buffer is empty, such
+  that the two stack switches are amortized over the capacity of the buffer.
+-----------------------------------------------------------------------------*/
+
+#define MP_GEN_DEFAULT_BUFFER   (4096)    // default buffer size in bytes (if `capacity` is 0)
+
+struct mp_gen_s {
+  mp_gen_fun_t* fun;
+  void*         arg;
+  mp_prompt_t*  prompt;     // the prompt of the producer while it runs
+  mp_resume_t*  resume;     // the suspended producer (if it was started and not yet done)
+  bool          done;       // the producer returned
+  size_t        elem_size;
+  size_t        capacity;   // number of elements in `buffer`
+  size_t        head;       // index of the first element in the buffer
+  size_t        count;      // number of elements in the buffer
+  uint8_t*      buffer;     // `capacity * elem_size` bytes (allocated with the generator)
+};
+
+
+//-----------------------------------------------------------------------
+// Create and free
+//-----------------------------------------------------------------------
+
+mp_gen_t* mp_gen_create(mp_gen_fun_t* fun, void* arg, size_t elem_size, size_t capacity) {
+  if (fun == NULL || elem_size == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (capacity == 0) {
+    capacity = (elem_size >= MP_GEN_DEFAULT_BUFFER ? 1 : MP_GEN_DEFAULT_BUFFER / elem_size);
+  }
+  if (capacity > (PTRDIFF_MAX - sizeof(mp_gen_t)) / elem_size) {
+    errno = EOVERFLOW;
+    return NULL;
+  }
+  mp_gen_t* g = (mp_gen_t*)mp_malloc(sizeof(mp_gen_t) + capacity * elem_size);
+  if (g == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  g->fun = fun;
+  g->arg = arg;
+  g->prompt = NULL;
+  g->resume = NULL;
+  g->done = false;
+  g->elem_size = elem_size;
+  g->capacity = capacity;
+  g->head = 0;
+  g->count = 0;
+  g->buffer = (uint8_t*)(g + 1);
+  return g;
+}
+
+// Free a generator; a suspended producer is dropped without resuming it.
+void mp_gen_free(mp_gen_t* g) {
+  if (g == NULL) return;
+  mp_assert(g->prompt == NULL || g->resume != NULL);  // not from within the producer
+  if (g->resume != NULL) {
+    mp_resume_drop(g->resume);
+  }
+  mp_free(g);
+}
+
+bool mp_gen_is_done(const mp_gen_t* g) {
+  return (g->done && g->count == 0);
+}
+
+
+//-----------------------------------------------------------------------
+// Producer
+//-----------------------------------------------------------------------
+
+static void* mp_gen_suspend(mp_resume_t* r, void* arg) {
+  mp_gen_t* g = (mp_gen_t*)arg;
+  g->resume = r;
+  return NULL;
+}
+
+static void* mp_gen_start(mp_prompt_t* p, void* arg) {
+  mp_gen_t* g = (mp_gen_t*)arg;
+  g->prompt = p;
+  (g->fun)(g, g->arg);
+  g->prompt = NULL;
+  g->done = true;
+  return NULL;
+}
+
+void mp_gen_yield_many(mp_gen_t* g, const void* elems, size_t n) {
+  mp_assert(g->prompt != NULL);  // only from the producer
+  const uint8_t* src = (const uint8_t*)elems;
+  const size_t esize = g->elem_size;
+  while (n > 0) {
+    if (g->count == g->capacity) {
+      // full: suspend until the consumer emptied the buffer
+      mp_yield(g->prompt, &mp_gen_suspend, g);
+      mp_assert_internal(g->count == 0);
+    }
+    size_t tail = g->head + g->count;
+    if (tail >= g->capacity) { tail -= g->capacity; }
+    size_t m = g->capacity - g->count;                  // available
+    if (m > g->capacity - tail) { m = g->capacity - tail; } // contiguous
+    if (m > n) { m = n; }
+    memcpy(g->buffer + tail * esize, src, m * esize);
+    g->count += m;
+    src += m * esize;
+    n -= m;
+  }
+}
+
+void mp_gen_yield(mp_gen_t* g, const void* elem) {
+  mp_gen_yield_many(g, elem, 1);
+}
+
+
+//-----------------------------------------------------------------------
+// Consumer
+//-----------------------------------------------------------------------
+
+// Run the producer to fill the empty buffer; returns `false` if there are no more elements.
+static bool mp_gen_fill(mp_gen_t* g) {
+  mp_assert_internal(g->count == 0);
+  if (g->done) return false;
+  mp_assert(g->prompt == NULL || g->resume != NULL);  // not from within the producer
+  g->head = 0;
+  mp_resume_t* r = g->resume;
+  g->resume = NULL;
+  if (r == NULL) {
+    mp_prompt(&mp_gen_start, g);
+  }
+  else {
+    mp_resume(r, NULL);
+  }
+  return (g->count > 0);
+}
+
+const void* mp_gen_next_span(mp_gen_t* g, size_t* count) {
+  if (g->count == 0 && !mp_gen_fill(g)) {
+    *count = 0;
+    return NULL;
+  }
+  size_t n = g->capacity - g->head;   // contiguous
+  if (n > g->count) { n = g->count; }
+  const uint8_t* span = g->buffer + g->head * g->elem_size;
+  g->head += n;
+  if (g->head == g->capacity) { g->head = 0; }
+  g->count -= n;
+  *count = n;
+  return span;
+}
+
+size_t mp_gen_next_many(mp_gen_t* g, void* elems, size_t max) {
+  uint8_t* dst = (uint8_t*)elems;
+  size_t total = 0;
+  while (total < max && (total == 0 || g->count > 0)) {
+    size_t n = 0;
+    const uint8_t* span = (const uint8_t*)mp_gen_next_span(g, &n);
+    if (span == NULL) break;
+    if (n > max - total) {
+      // put back the elements that do not fit
+      const size_t extra = n - (max - total);
+      g->head = (g->head == 0 ? g->capacity : g->head) - extra;
+      g->count += extra;
+      n -= extra;
+    }
+    memcpy(dst, span, n * g->elem_size);
+    dst += n * g->elem_size;
+    total += n;
+  }
+  return total;
+}
+
+bool mp_gen_next(mp_gen_t* g, void* elem) {
+  if (mp_unlikely(g->count == 0) && !mp_gen_fill(g)) return false;
+  memcpy(elem, g->buffer + g->head * g->elem_size, g->elem_size);
+  g->head++;
+  if (g->head == g->capacity) { g->head = 0; }
+  g->count--;
+  return true;
+}
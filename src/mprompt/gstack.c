@@ -7,7 +7,9 @@
   Implementation of "growable" stacklets.
   Each `gstack` allocates `os_gstack_size` (8MiB) virtual memory
   but allocates on-demand while the stack grows. Uses an OS page 
-  committed memory at minimum (and 2 on Windows)
+  committed memory at minimum (and 2 on Windows).
+  Prompts can also request a small or large stack size class instead.
+  Alternatively, gstacks can be fixed size heap blocks (see "gstack_heap.c").
 -----------------------------------------------------------------------------*/
 
 #include <string.h>
@@ -16,6 +18,7 @@
 #include "internal/util.h"
 #include "internal/longjmp.h"       // mp_stack_enter
 #include "internal/gstack.h"
+#include "internal/atomic.h"
 
 #ifdef __cplusplus
 #include <exception>
@@ -30,15 +33,34 @@
 // To save an allocation, we reserve `extra_size` space where the 
 // `mp_prompt_t` information will be.
 // All sizes (except for `extra_size`) are `os_page_size` aligned.
+typedef struct mp_gstack_owner_s mp_gstack_owner_t;
+
+// Size classes
+typedef enum mp_gstack_class_e {
+  MP_GSTACK_SMALL,
+  MP_GSTACK_DEFAULT,
+  MP_GSTACK_LARGE,
+  MP_GSTACK_CLASS_COUNT
+} mp_gstack_class_t;
+
 struct mp_gstack_s {
-  mp_gstack_t*  next;               // used for the cache and delay list
+  mp_gstack_t*  next;               // used for the cache, delay list, and remote free lists
+  mp_gstack_owner_t* owner;         // the thread that allocated this gstack
   uint8_t*      full;               // stack reserved memory (including noaccess gaps)
-  ssize_t       full_size;          // (for now always fixed to be `os_gstack_size`)
+  ssize_t       full_size;          // fixed per size class (usually `os_gstack_size`)
+  mp_gstack_class_t size_class;
   uint8_t*      stack;              // stack inside the full area (without gaps)
   ssize_t       stack_size;         // actual available total stack size (includes reserved space) (depends on platform, but usually `os_gstack_size - 2*mp_gstack_gap`)
   ssize_t       initial_commit;     // initial committed memory (usually `os_page_size`)  
   ssize_t       committed;          // current committed estimate
   ssize_t       extra_size;         // size of extra allocated bytes.         
+  ssize_t       delay_epoch;        // on the delayed free list: freed once fewer exceptions than this are in flight
+  ssize_t       grow_count;         // stack growths on a page fault since allocation
+  mp_gsave_t*   track;              // incremental saves: if not NULL, the first `track_count` pages (from the base) are read-only and equal to the pages in `track` (unless dirty)
+  ssize_t       track_count;        // number of tracked pages
+  uint8_t*      track_dirty;        // bitmap of tracked pages that have been written to
+  uint8_t*      track_pending;      // bitmap of tracked pages that are not yet restored (and are no-access) (allocated together with `track_dirty`)
+  mp_gstack_t*  track_next;         // global list of tracked gstacks
   uint8_t       extra[1];           // extra allocated (holds the mp_prompt_t structure)
 };
 
@@ -51,6 +73,7 @@ struct mp_gstack_s {
 // Static configuration; should be set once at startup.
 // Todo: make this easier to change by reading environment variables?
 static bool    os_use_gpools              = true;          // reuse gstacks in-process
+static bool    os_gpool_numa              = true;          // partition the gpools per NUMA node (only if there is more than one node)
 static bool    os_use_overcommit          = false;         // commit on demand by relying on overcommit? (only if available)
 static bool    os_stack_grows_down        = true;          // on almost all systems
 static ssize_t os_page_size               = 0;             // initialized at startup
@@ -60,8 +83,19 @@ static ssize_t os_gstack_size             = 8 * MP_MIB;    // reserved memory fo
 static ssize_t os_gstack_gap              = 64 * MP_KIB;   // noaccess gap between stacks; `os_gstack_gap > min(64*1024, os_page_size, os_gstack_size/2`.
 static bool    os_gstack_reset_decommits  = false;         // force full decommit when resetting a stack?
 static bool    os_gstack_grow_fast        = true;          // use doubling to grow gstacks (up to 1MiB)
-static ssize_t os_gstack_cache_max_count  = 4;             // number of prompts to keep in the thread local cache
+static ssize_t os_gstack_keep_hot         = 0;             // size (from the base) of a gstack that is not reset when freed to a gpool
+static ssize_t os_gstack_cache_max_count  = 4;             // minimal number of prompts to keep in the thread local cache
+static ssize_t os_gstack_cache_adapt_max  = 64;            // maximal number of prompts to keep in the thread local cache when adapting to demand
+static ssize_t os_gstack_cache_committed_max = 256 * MP_MIB; // maximal total committed memory in all thread local caches
+static ssize_t os_gstack_delayed_max_count = 32;           // maximal number of gstacks on the thread local delayed free list
+static bool    os_gsave_incremental       = false;         // use dirty page tracking for incremental saves of multi-shot resumptions
+static bool    os_gsave_lazy              = false;         // restore incremental saves on demand
 static ssize_t os_gstack_exn_guaranteed   = 32 * MP_KIB;   // guaranteed stack size available during an exception unwind (only used on Windows)
+static ssize_t os_gstack_huge_from        = 0;             // use transparent huge pages for the part of a gstack deeper than this (from the base) (0 = never) (only used on Linux)
+static ssize_t os_gstack_small_size       = 128 * MP_KIB;  // reserved memory for a stack in the small size class (0 = no small class)
+static ssize_t os_gstack_large_size       = 64 * MP_MIB;   // reserved memory for a stack in the large size class (0 = no large class)
+static ssize_t os_gstack_trim_slack       = 64 * MP_KIB;   // stack space beyond the stack pointer that stays committed on a trim
+static ssize_t os_gstack_heap_size        = 0;             // if > 0, use fixed size heap allocated stacks of this size (no virtual reservations, gpools, or fault handler)
 
 #if defined(_MSC_VER) && !defined(NDEBUG)  // gpool a tad smaller in msvc so debug traces work (as the gpool can be placed lower than the system stack)
 static ssize_t os_gpool_max_size          = 16 * MP_GIB;   // virtual size of one gstack pooled area (holds about 2^15 gstacks)
@@ -87,23 +121,60 @@ static ssize_t mp_unpush(const uint8_t* sp, const uint8_t* stk, ssize_t stk_size
 }
 
 
+//----------------------------------------------------------------------------------
+// Size classes
+//
+// Every size class reserves a fixed amount of memory, `full_size`, with a fixed
+// noaccess gap. The default class uses `os_gstack_size`; the small class uses a 
+// smaller gap as well so many small stacks are densely packed in a gpool.
+//----------------------------------------------------------------------------------
+
+static ssize_t mp_gstack_class_full_size(mp_gstack_class_t cls) {
+  return (cls == MP_GSTACK_SMALL ? os_gstack_small_size : (cls == MP_GSTACK_LARGE ? os_gstack_large_size : os_gstack_size));
+}
+
+static ssize_t mp_gstack_class_gap(mp_gstack_class_t cls) {
+  return (cls == MP_GSTACK_SMALL ? mp_min(os_gstack_gap, mp_max(os_page_size, mp_align_up(os_gstack_small_size / 8, os_page_size))) : os_gstack_gap);
+}
+
+// The usable stack size of a class (when not using gpools one extra gap is used)
+static ssize_t mp_gstack_class_stack_size(mp_gstack_class_t cls) {
+  return (mp_gstack_class_full_size(cls) - (os_use_gpools ? 1 : 2) * mp_gstack_class_gap(cls));
+}
+
+// Find the smallest class that fits a size hint (or the largest class)
+static mp_gstack_class_t mp_gstack_class_of(ssize_t size_hint) {
+  if (size_hint <= 0) return MP_GSTACK_DEFAULT;
+  if (os_gstack_small_size > 0 && size_hint <= mp_gstack_class_stack_size(MP_GSTACK_SMALL)) return MP_GSTACK_SMALL;
+  if (os_gstack_large_size == 0 || size_hint <= mp_gstack_class_stack_size(MP_GSTACK_DEFAULT)) return MP_GSTACK_DEFAULT;
+  return MP_GSTACK_LARGE;
+}
+
+
 //----------------------------------------------------------------------------------
 // Platform specific, low-level OS interface.
 //
-// By design always reserve `os_gstack_size` memory with `os_gstack_initial_commit`
+// By design always reserve the fixed `full_size` of a size class with `os_gstack_initial_commit`
 // initially committed. By making this constant, we can implement efficient caching,
 // "gpools", commit-on-demand handlers etc.
 //----------------------------------------------------------------------------------
-static uint8_t* mp_gstack_os_alloc(uint8_t** stack, ssize_t* stack_size, ssize_t* initial_commit);
-static void     mp_gstack_os_free(uint8_t* full, uint8_t* stack, ssize_t stack_size, ssize_t stk_commit);
+static uint8_t* mp_gstack_os_alloc(ssize_t full_size, ssize_t gap_size, uint8_t** stack, ssize_t* stack_size, ssize_t* initial_commit);
+static void     mp_gstack_os_free(uint8_t* full, ssize_t full_size, uint8_t* stack, ssize_t stack_size, ssize_t stk_commit);
+static bool     mp_gstack_os_trim(uint8_t* start, ssize_t size);  // returns `true` if the range is decommitted (and no longer accessible)
 static bool     mp_gstack_os_init(void);
 static void     mp_gstack_os_thread_init(void);
 static void     mp_gstack_thread_done(void);  // called by hook installed in os specific include
+static void     mp_gstack_thread_init(void);
 
 // Used by the gpool implementation
 static uint8_t* mp_os_mem_reserve(ssize_t size);
+static uint8_t* mp_os_mem_reserve_numa(ssize_t size, int node);   // reserve with a preference for the physical pages on a NUMA node (if `node >= 0`)
+static int      mp_os_numa_node(void);                            // the NUMA node of the calling thread (or -1 if unknown)
+static int      mp_os_numa_node_count(void);                      // the number of NUMA nodes (1 if unknown)
 static void     mp_os_mem_free(uint8_t* p, ssize_t size);
 static bool     mp_os_mem_commit(uint8_t* start, ssize_t size);
+typedef enum mp_prot_e { MP_PROT_NONE, MP_PROT_READ, MP_PROT_RW } mp_prot_t;
+static bool     mp_os_mem_protect(uint8_t* start, ssize_t size, mp_prot_t prot);  // used for incremental saves
 
 // Used by signal handler to check access
 typedef enum mp_access_e {
@@ -114,12 +185,40 @@ typedef enum mp_access_e {
 } mp_access_t;
 
 static mp_access_t  mp_gstack_check_access(mp_gstack_t* g, void* address, ssize_t* stack_size, ssize_t* available, ssize_t* commit_available);
+static bool         mp_gstack_track_fault(void* address);   // handle an access to a protected page of a tracked gstack
+static void         mp_gstack_untrack(mp_gstack_t* g);
 
 // The gpool interface
 typedef struct mp_gpool_s mp_gpool_t;
-static uint8_t*     mp_gpool_alloc(uint8_t** stk, ssize_t* stk_size);
-static void         mp_gpool_free(uint8_t* stk);
+static uint8_t*     mp_gpool_alloc(ssize_t block_size, ssize_t gap_size, uint8_t** stk, ssize_t* stk_size, ssize_t* accessible);
+static void         mp_gpool_free(uint8_t* stk, ssize_t accessible);
 static mp_access_t  mp_gpools_check_access(void* address, ssize_t* available, ssize_t* stack_size, const mp_gpool_t** gp);
+static void         mp_gpool_stats(const mp_gpool_t* gp, mp_gpool_stats_t* stats);
+
+// Statistics are counted per thread (see `mp_stats_get`)
+typedef struct mp_thread_stats_s {
+  struct mp_thread_stats_s* next;   // all registered threads
+  struct mp_thread_stats_s* prev;
+  bool     registered;
+  int64_t  allocs;
+  int64_t  frees;            // not counting delayed frees until they are done
+  int64_t  os_allocs;
+  int64_t  os_frees;
+  int64_t  reserved;
+  int64_t  cached;
+  int64_t  delayed;
+  int64_t  delayed_forced;   // delayed gstacks freed early to stay within `os_gstack_delayed_max_count`
+  int64_t  committed;        // delta of committed bytes by allocating, growing, and releasing gstacks
+  int64_t  faults;
+  int64_t  fast_grows;
+  int64_t  huge_grows;
+  int64_t  trims;
+  int64_t  gsave_count;
+  int64_t  gsave_bytes;
+  int64_t  restore_bytes;
+} mp_thread_stats_t;
+
+static mp_decl_thread mp_thread_stats_t _mp_stats;
 
 
 // platform specific definitions are in included files
@@ -132,6 +231,7 @@ static mp_access_t  mp_gpools_check_access(void* address, ssize_t* available, ss
 #else
 #error "unsupported platform: add specific definitions"
 #endif
+#include "gstack_heap.c"
 
 
 
@@ -163,38 +263,308 @@ static uint8_t* mp_gstack_base(const mp_gstack_t* g) {
 
 
 // We have a small cache per thread of stacks to avoid going to the OS too often.
+// The size of the cache adapts to the demand: it is sized from the high-water mark
+// of gstacks in use by this thread, which decays by half every `MP_GSTACK_CACHE_WINDOW` allocations.
+// Moreover, the total committed memory in all caches is bounded by `os_gstack_cache_committed_max`.
+#define MP_GSTACK_CACHE_WINDOW  (256)
+
 static mp_decl_thread mp_gstack_t* _mp_gstack_cache;
 static mp_decl_thread ssize_t      _mp_gstack_cache_count;
+static mp_decl_thread ssize_t      _mp_gstack_cache_target = -1;  // current maximal size of the cache (initialized on demand)
+static mp_decl_thread ssize_t      _mp_gstack_live;               // gstacks currently in use by this thread
+static mp_decl_thread ssize_t      _mp_gstack_live_peak;          // high-water mark of `_mp_gstack_live` in the current window
+static mp_decl_thread ssize_t      _mp_gstack_window_count;       // allocations in the current window
 
+static _Atomic(intptr_t) mp_gstack_cache_committed;               // total committed memory in all thread local caches
+
+static ssize_t mp_gstack_cache_target(void) {
+  if (mp_unlikely(_mp_gstack_cache_target < 0)) {
+    _mp_gstack_cache_target = os_gstack_cache_max_count;
+  }
+  return _mp_gstack_cache_target;
+}
+
+// Try to put a gstack in the thread local cache 
+static bool mp_gstack_cache_push(mp_gstack_t* g) {
+  if (_mp_gstack_cache_count >= mp_gstack_cache_target()) return false;
+  intptr_t committed = mp_atomic_load(&mp_gstack_cache_committed);
+  do {
+    if (committed + g->committed > os_gstack_cache_committed_max) return false;
+  } while (!mp_atomic_cas(&mp_gstack_cache_committed, &committed, committed + g->committed));
+  g->next = _mp_gstack_cache;
+  _mp_gstack_cache = g;
+  _mp_gstack_cache_count++;
+  _mp_stats.cached++;
+  return true;
+}
+
+// Remove a gstack from the cache (where `prev` is the previous entry in the cache or NULL)
+static void mp_gstack_cache_remove(mp_gstack_t* g, mp_gstack_t* prev) {
+  if (prev == NULL) { _mp_gstack_cache = g->next; }
+               else { prev->next = g->next; }
+  _mp_gstack_cache_count--;
+  _mp_stats.cached--;
+  mp_atomic_add(&mp_gstack_cache_committed, -(intptr_t)g->committed);
+  g->next = NULL;
+}
+
+static void mp_gstack_os_release(mp_gstack_t* g);
+
+// Track demand on every allocation and adapt the cache size
+static void mp_gstack_cache_adapt(void) {
+  _mp_gstack_live++;
+  if (_mp_gstack_live > _mp_gstack_live_peak) { _mp_gstack_live_peak = _mp_gstack_live; }
+  if (mp_likely(++_mp_gstack_window_count < MP_GSTACK_CACHE_WINDOW)) return;
+  // end of a window: decay the target towards the recent high-water mark
+  ssize_t target = mp_max(_mp_gstack_live_peak, mp_gstack_cache_target() / 2);
+  if (target > os_gstack_cache_adapt_max) { target = os_gstack_cache_adapt_max; }
+  if (target < os_gstack_cache_max_count) { target = os_gstack_cache_max_count; }
+  _mp_gstack_cache_target = target;
+  _mp_gstack_live_peak = _mp_gstack_live;
+  _mp_gstack_window_count = 0;
+  // and trim the cache if it shrunk
+  while (_mp_gstack_cache_count > target) {
+    mp_gstack_t* g = _mp_gstack_cache;
+    mp_gstack_cache_remove(g, NULL);
+    mp_gstack_os_release(g);
+  }
+}
 
 // We also have a delayed free list to keep gstacks alive during exception unwinding
 // (since some exception implementations allocate exception information in stack areas that are already unwound)
-// it is cleared when either: 1. another gstack is allocated, 2. clear_cache is called, 3. the thread terminates
-static mp_decl_thread mp_gstack_t* _mp_gstack_delayed_free;
+// Each delayed gstack is tagged with the unwinding epoch: the number of exceptions in flight just before the
+// exception is rethrown from it. It can be freed once no more exceptions than that are in flight, i.e. when
+// that exception is caught (but not while a nested exception in a destructor is unwinding). Without
+// `std::uncaught_exceptions` we can only tell whether any exception is in flight and the epoch is always 0.
+// The list is cleared when either: 1. another gstack is allocated, 2. clear_cache is called, 3. the thread terminates.
+// At most `os_gstack_delayed_max_count` gstacks are kept; beyond that the oldest are freed even if
+// their exception may still be in flight, to bound the memory held during exception storms.
+static mp_decl_thread mp_gstack_t* _mp_gstack_delayed_free;   // newest first
+static mp_decl_thread ssize_t      _mp_gstack_delayed_count;
+
+#if defined(__cplusplus) && defined(__cpp_lib_uncaught_exceptions)
+static ssize_t mp_gstack_unwind_depth(void) { return std::uncaught_exceptions(); }
+static ssize_t mp_gstack_unwind_epoch(void) { return std::uncaught_exceptions(); }
+#elif defined(__cplusplus)
+static ssize_t mp_gstack_unwind_depth(void) { return (std::uncaught_exception() ? 1 : 0); }
+static ssize_t mp_gstack_unwind_epoch(void) { return 0; }
+#else
+static ssize_t mp_gstack_unwind_depth(void) { return 0; }
+static ssize_t mp_gstack_unwind_epoch(void) { return 0; }
+#endif
+
+static void mp_gstack_delayed_release(mp_gstack_t* g) {
+  _mp_stats.delayed--;
+  _mp_gstack_delayed_count--;
+  mp_gstack_free(g, false);  // maybe move to cache
+}
 
+// Free the oldest delayed gstacks beyond the bound
+static void mp_gstack_bound_delayed(void) {
+  if (_mp_gstack_delayed_count <= os_gstack_delayed_max_count) return;
+  ssize_t n = 0;
+  mp_gstack_t** link = &_mp_gstack_delayed_free;
+  mp_gstack_t* g;
+  while ((g = *link) != NULL && n < os_gstack_delayed_max_count) {
+    link = &g->next;
+    n++;
+  }
+  *link = NULL;
+  while (g != NULL) {
+    mp_gstack_t* next = g->next;
+    _mp_stats.delayed_forced++;
+    mp_gstack_delayed_release(g);
+    g = next;
+  }
+  mp_assert_internal(_mp_gstack_delayed_count <= os_gstack_delayed_max_count);
+}
+
+// Free the delayed gstacks whose exception is no longer in flight
 static void mp_gstack_clear_delayed(void) {
   if (_mp_gstack_delayed_free == NULL) return;
-  #ifdef __cplusplus
-  if (std::uncaught_exception()) {
-    return; // don't clear while exception unwinding is active
+  const ssize_t depth = mp_gstack_unwind_depth();
+  mp_gstack_t** link = &_mp_gstack_delayed_free;
+  mp_gstack_t* g;
+  while ((g = *link) != NULL) {
+    if (depth > g->delay_epoch) {
+      link = &g->next;
+    }
+    else {
+      *link = g->next;
+      mp_gstack_delayed_release(g);
+    }
   }
-  #endif
-  mp_gstack_t* g = _mp_gstack_delayed_free;
+  mp_gstack_bound_delayed();
+}
+
+
+//----------------------------------------------------------------------------------
+// Ownership
+//
+// A gstack can be freed by another thread than the one that allocated it 
+// (for example, when a suspended prompt is resumed, or dropped, in another thread).
+// Such gstacks are returned to the owning thread through an atomic `inbox`
+// and the owner reclaims them (in bulk) into its cache at its next allocation.
+// Remote frees are batched per owner to reduce contention on the inbox.
+// 
+// The owner info outlives its thread as long as it owns any gstacks: when the
+// thread terminates the inbox is closed and gstacks freed afterwards are 
+// adopted by the freeing thread instead.
+//----------------------------------------------------------------------------------
+
+#define MP_GSTACK_INBOX_CLOSED  ((mp_gstack_t*)1)
+#define MP_GSTACK_REMOTE_BATCH  (8)      // flush remote frees when this many are pending for one owner
+#define MP_GSTACK_REMOTE_AGE    (32)     // or when this many local frees happened since
+
+struct mp_gstack_owner_s {
+  _Atomic(mp_gstack_t*) inbox;    // gstacks freed by other threads (or `MP_GSTACK_INBOX_CLOSED`)
+  _Atomic(intptr_t)     refcount; // 1 for the owning thread + the number of owned gstacks
+};
+
+static mp_decl_thread mp_gstack_owner_t* _mp_gstack_owner;
+
+// Pending remote frees for a single owner
+static mp_decl_thread mp_gstack_owner_t* _mp_gstack_remote_owner;
+static mp_decl_thread mp_gstack_t*       _mp_gstack_remote_first;
+static mp_decl_thread mp_gstack_t*       _mp_gstack_remote_last;
+static mp_decl_thread ssize_t            _mp_gstack_remote_count;
+static mp_decl_thread ssize_t            _mp_gstack_remote_age;     // local frees while remote frees are pending
+
+static mp_gstack_owner_t* mp_gstack_owner(void) {
+  mp_gstack_owner_t* owner = _mp_gstack_owner;
+  if (mp_unlikely(owner == NULL)) {
+    owner = mp_zalloc_tp(mp_gstack_owner_t);
+    if (owner == NULL) return NULL;
+    mp_atomic_store(&owner->refcount, (intptr_t)1);
+    _mp_gstack_owner = owner;
+  }
+  return owner;
+}
+
+static void mp_gstack_owner_release(mp_gstack_owner_t* owner) {
+  if (mp_atomic_add(&owner->refcount, (intptr_t)-1) == 1) {
+    mp_assert_internal(mp_atomic_load_ptr(mp_gstack_t, &owner->inbox) == MP_GSTACK_INBOX_CLOSED);
+    mp_free(owner);
+  }
+}
+
+// Set the owner of a fresh or adopted gstack to the current thread
+static bool mp_gstack_owner_acquire(mp_gstack_t* g) {
+  mp_gstack_owner_t* owner = mp_gstack_owner();
+  if (owner == NULL) return false;
+  mp_atomic_add(&owner->refcount, (intptr_t)1);
+  g->owner = owner;
+  return true;
+}
+
+// Free a gstack to the OS
+static void mp_gstack_os_release(mp_gstack_t* g) {
+  mp_assert_internal(g->track == NULL);
+  if (g->track_dirty != NULL) { mp_free(g->track_dirty); }
+  if (os_gstack_heap_size > 0) {
+    mp_gstack_heap_free(g->full, g->stack, g->stack_size);
+  }
+  else {
+    mp_gstack_os_free(g->full, g->full_size, g->stack, g->stack_size, g->committed);
+  }
+  _mp_stats.os_frees++;
+  _mp_stats.reserved -= g->full_size;
+  _mp_stats.committed -= g->committed;
+  if (g->owner != NULL) { mp_gstack_owner_release(g->owner); }
+  mp_free(g);
+}
+
+// Move the gstacks in our inbox to the cache (or free them if the cache is full)
+static void mp_gstack_inbox_collect(mp_gstack_owner_t* owner, bool close) {
+  mp_gstack_t* g = mp_atomic_exchange_ptr(mp_gstack_t, &owner->inbox, (close ? MP_GSTACK_INBOX_CLOSED : NULL));
+  mp_assert_internal(g != MP_GSTACK_INBOX_CLOSED);
   while (g != NULL) {
-    mp_gstack_t* next = _mp_gstack_delayed_free = g->next;
-    mp_gstack_free(g, false);  // maybe move to cache
+    mp_gstack_t* next = g->next;
+    mp_assert_internal(g->owner == owner);
+    if (_mp_gstack_live > 0) { _mp_gstack_live--; }
+    if (close || !mp_gstack_cache_push(g)) {
+      mp_gstack_os_release(g);
+    }
     g = next;
   }
-  mp_assert_internal(_mp_gstack_delayed_free == NULL);
 }
 
-// Allocate a growable stacklet.
-mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
+// Free a gstack owned by this thread: try to put it in our thread local cache (as-is),
+// and otherwise free it to the OS
+static void mp_gstack_free_local(mp_gstack_t* g) {
+  if (_mp_gstack_live > 0) { _mp_gstack_live--; }
+  if (!mp_gstack_cache_push(g)) {
+    mp_gstack_os_release(g);
+  }
+}
+
+// Push the pending remote frees to their owner
+static void mp_gstack_remote_flush(void) {
+  mp_gstack_owner_t* owner = _mp_gstack_remote_owner;
+  mp_gstack_t* first = _mp_gstack_remote_first;
+  mp_gstack_t* last  = _mp_gstack_remote_last;
+  if (first == NULL) return;
+  _mp_gstack_remote_owner = NULL;
+  _mp_gstack_remote_first = _mp_gstack_remote_last = NULL;
+  _mp_gstack_remote_count = 0;
+  _mp_gstack_remote_age = 0;
+  mp_gstack_t* inbox = mp_atomic_load_ptr(mp_gstack_t, &owner->inbox);
+  do {
+    if (inbox == MP_GSTACK_INBOX_CLOSED) {
+      // the owning thread has terminated; adopt the gstacks 
+      mp_gstack_t* g = first;
+      while (g != NULL) {
+        mp_gstack_t* next = g->next;
+        g->next = NULL;
+        if (mp_gstack_owner_acquire(g)) {
+          mp_gstack_owner_release(owner);
+          mp_gstack_free_local(g);
+        }
+        else {
+          mp_gstack_os_release(g);   // and release the closed owner
+        }
+        g = next;
+      }
+      return;
+    }
+    last->next = inbox;
+  } while (!mp_atomic_cas_ptr(mp_gstack_t, &owner->inbox, &inbox, first));
+}
+
+// Free a gstack owned by another thread
+static void mp_gstack_remote_free(mp_gstack_t* g) {
+  if (_mp_gstack_remote_owner != g->owner) {
+    mp_gstack_remote_flush();
+    _mp_gstack_remote_owner = g->owner;
+  }
+  g->next = _mp_gstack_remote_first;
+  _mp_gstack_remote_first = g;
+  if (_mp_gstack_remote_last == NULL) { _mp_gstack_remote_last = g; }
+  _mp_gstack_remote_count++;
+  if (_mp_gstack_remote_count >= MP_GSTACK_REMOTE_BATCH) {
+    mp_gstack_remote_flush();
+  }
+}
+
+
+//----------------------------------------------------------------------------------
+// Allocation
+//----------------------------------------------------------------------------------
+
+// Allocate a growable stacklet in a given size class (should be initialized).
+static mp_gstack_t* mp_gstack_alloc_class(mp_gstack_class_t size_class, ssize_t extra_size, void** extra)
 {
   if (extra != NULL) { *extra = NULL;  }
-  mp_gstack_init(NULL);  // always check initialization
   mp_assert(os_page_size != 0);
   mp_gstack_clear_delayed();  // this might free some gstacks to our local cache
+  mp_gstack_owner_t* owner = mp_gstack_owner();
+  if (owner == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (mp_atomic_load_ptr(mp_gstack_t, &owner->inbox) != NULL) {
+    mp_gstack_inbox_collect(owner, false);   // reclaim gstacks freed by other threads
+  }
   
   // first look in our thread local cache..
   #if !defined(NDEBUG)
@@ -203,17 +573,14 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
   mp_gstack_t* g = _mp_gstack_cache;  
   mp_gstack_t* prev = NULL;
   while (g != NULL) {
-    bool good = (g->extra_size >= extra_size);
+    bool good = (g->size_class == size_class && g->extra_size >= extra_size);
     #if !defined(NDEBUG)
     // only use a cached stack if it is under the parent stack (to help unwinding during debugging)
     void* stack = g->stack;
     good = good && (os_stack_grows_down ? stack < sp : sp < stack);
     #endif  
     if (good) {
-      if (prev == NULL) { _mp_gstack_cache = g->next; }
-                   else { prev->next = g->next; }
-      _mp_gstack_cache_count--;
-      g->next = NULL;
+      mp_gstack_cache_remove(g, prev);
       break;
     }
     else {
@@ -224,6 +591,9 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
 
   // otherwise allocate fresh
   if (g == NULL) {
+    // hand back batched remote frees first so their owners can reuse them instead of allocating fresh
+    mp_gstack_remote_flush();
+
     // allocate separately for security
     extra_size = mp_align_up(extra_size, sizeof(void*));    
     g = (mp_gstack_t*)mp_malloc(sizeof(mp_gstack_t) - 1 + extra_size); 
@@ -235,7 +605,9 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
     uint8_t* stk;
     ssize_t  stk_size;
     ssize_t  initial_commit;
-    uint8_t* full = mp_gstack_os_alloc(&stk, &stk_size, &initial_commit);
+    const ssize_t full_size = mp_gstack_class_full_size(size_class);
+    uint8_t* full = (os_gstack_heap_size > 0 ? mp_gstack_heap_alloc(full_size, &stk, &stk_size, &initial_commit)
+                                             : mp_gstack_os_alloc(full_size, mp_gstack_class_gap(size_class), &stk, &stk_size, &initial_commit));
     if (full == NULL) { 
       mp_free(g);
       errno = ENOMEM;
@@ -248,26 +620,94 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
     // initialize with debug 0xFD
     #ifndef NDEBUG
     uint8_t* commit_start;
-    mp_push(base, initial_commit, &commit_start);
-    memset(commit_start, 0xFD, initial_commit);
+    const ssize_t debug_init = mp_min(initial_commit, os_gstack_initial_commit);
+    mp_push(base, debug_init, &commit_start);
+    memset(commit_start, 0xFD, debug_init);
     #endif
     
     //mp_trace_message("alloc gstack: full: %p, base: %p, base_limit: %p\n", full, base, mp_push(base, stk_size,NULL));
     g->next = NULL;
+    g->owner = NULL;
+    mp_gstack_owner_acquire(g);
     g->full = full;
-    g->full_size = os_gstack_size;
+    g->full_size = full_size;
+    g->size_class = size_class;
     g->stack = stk;
     g->stack_size = stk_size;
     g->initial_commit = g->committed = initial_commit;
     g->extra_size = extra_size;
+    g->track = NULL;
+    g->track_count = 0;
+    g->track_dirty = NULL;
+    g->track_pending = NULL;
+    g->track_next = NULL;
+    _mp_stats.os_allocs++;
+    _mp_stats.reserved += full_size;
+    _mp_stats.committed += initial_commit;
   }
 
+  _mp_stats.allocs++;
+  g->grow_count = 0;
   if (extra != NULL && extra_size > 0) {
     *extra = &g->extra[0];
   }
+  mp_gstack_cache_adapt();
   return g;
 }
 
+// Allocate a growable stacklet in the size class that fits `size_hint` (use 0 for the default class).
+mp_gstack_t* mp_gstack_alloc(ssize_t size_hint, ssize_t extra_size, void** extra) {
+  mp_gstack_init(NULL);  // always check initialization
+  return mp_gstack_alloc_class(mp_gstack_class_of(size_hint), extra_size, extra);
+}
+
+
+// Commit at least `commit` bytes of a gstack (from the base) in one go, to avoid
+// page faults when the needed stack size is known (or learned) up front.
+void mp_gstack_commit(mp_gstack_t* g, ssize_t commit) {
+  if (commit <= g->committed || os_gstack_heap_size > 0) return;
+#if _WIN32
+  // todo: move the guard page as well; for now we keep committing on demand
+  return;
+#else
+  commit = mp_min(g->stack_size, mp_align_up(commit, os_page_size));
+  if (commit <= g->committed) return;
+  uint8_t* commit_start;
+  mp_push(mp_gstack_base_at(g, g->committed), commit - g->committed, &commit_start);
+  if (mp_os_mem_commit(commit_start, commit - g->committed)) {
+    _mp_stats.committed += commit - g->committed;
+    g->committed = commit;
+  }
+#endif
+}
+
+ssize_t mp_gstack_committed(const mp_gstack_t* g) {
+  return g->committed;
+}
+
+ssize_t mp_gstack_grow_count(const mp_gstack_t* g) {
+  return g->grow_count;
+}
+
+// Decommit the committed part of a gstack beyond the stack pointer `sp` plus `os_gstack_trim_slack`.
+// If not `eager` we only trim if at least twice the slack is committed beyond the stack pointer
+// (so a gstack that goes just a bit deeper again does not fault on that part every time).
+ssize_t mp_gstack_trim(mp_gstack_t* g, const uint8_t* sp, bool eager) {
+  if (g == NULL || g->track != NULL || os_gstack_heap_size > 0) return 0;
+  if (!mp_gstack_contains(g, sp) && sp != mp_gstack_base(g)) return 0;
+  const ssize_t used = mp_unpush(sp, g->stack, g->stack_size);
+  const ssize_t keep = mp_align_up(used + os_gstack_trim_slack, os_page_size);
+  if (g->committed <= keep || (!eager && g->committed - used <= 2 * os_gstack_trim_slack)) return 0;
+  uint8_t* start;
+  mp_push(mp_gstack_base_at(g, keep), g->committed - keep, &start);
+  const ssize_t size = g->committed - keep;
+  if (!mp_gstack_os_trim(start, size)) return 0;
+  _mp_stats.committed -= size;
+  _mp_stats.trims++;
+  g->committed = keep;
+  return size;
+}
+
 
 // Enter a gstack
 void mp_gstack_enter(mp_gstack_t* g, mp_jmpbuf_t** return_jmp, mp_stack_start_fun_t* fun, void* arg) {
@@ -294,40 +734,47 @@ void mp_gstack_enter(mp_gstack_t* g, mp_jmpbuf_t** return_jmp, mp_stack_start_fu
 void mp_gstack_free(mp_gstack_t* g, bool delay) {
   if (g == NULL) return;
   mp_assert(os_page_size != 0);
+  mp_gstack_thread_init();  // we may free a gstack that was migrated to a fresh thread
   //mp_trace_message("free gstack: %p\n", p);  
+  mp_gstack_untrack(g);
+  if (os_gstack_heap_size > 0) { mp_gstack_heap_check(g->full, g->stack, g->stack_size); }
 
   // if delayed, always push it on the delayed list
   if (delay) {
+    g->delay_epoch = mp_gstack_unwind_epoch();
     g->next = _mp_gstack_delayed_free;
     _mp_gstack_delayed_free = g;
+    _mp_gstack_delayed_count++;
+    _mp_stats.delayed++;
+    mp_gstack_bound_delayed();
     return;
   }
+  _mp_stats.frees++;
 
-  // otherwise try to put it in our thread local cache...
-  if (_mp_gstack_cache_count < os_gstack_cache_max_count) {
-    // allowed to cache.
-    // we keep it as-is    
-    g->next = _mp_gstack_cache;
-    _mp_gstack_cache = g;
-    _mp_gstack_cache_count++;
+  // return it to its owning thread if it was allocated by another thread
+  if (g->owner != _mp_gstack_owner) {
+    mp_gstack_remote_free(g);
     return;
   }
 
-  // otherwise free it to the OS
-  mp_gstack_os_free(g->full, g->stack, g->stack_size, g->committed);
-  mp_free(g);
+  mp_gstack_free_local(g);
+
+  // push pending remote frees after a while, even if we keep reusing our own cache
+  if (mp_unlikely(_mp_gstack_remote_first != NULL) && ++_mp_gstack_remote_age >= MP_GSTACK_REMOTE_AGE) {
+    mp_gstack_remote_flush();
+  }
 }
 
 
 // Clear all (thread local) cached gstacks.
 void mp_gstack_clear_cache(void) {
   mp_gstack_clear_delayed();
+  mp_gstack_remote_flush();
   mp_gstack_t* g = _mp_gstack_cache;
   while( g != NULL) {
-    mp_gstack_t* next = _mp_gstack_cache = g->next;
-    _mp_gstack_cache_count--;
-    mp_gstack_os_free(g->full, g->stack, g->stack_size, g->committed);
-    mp_free(g);
+    mp_gstack_t* next = g->next;
+    mp_gstack_cache_remove(g, NULL);
+    mp_gstack_os_release(g);
     g = next;
   }
   mp_assert_internal(_mp_gstack_cache == NULL);
@@ -337,16 +784,281 @@ void mp_gstack_clear_cache(void) {
 
 //----------------------------------------------------------------------------------
 // Saving / Restoring
+//
+// Normally a save copies the full stack (up to the given stack pointer).
+// With `os_gsave_incremental` enabled, we use dirty page tracking instead (for larger stacks):
+// a save is split in full pages (counted from the base) and a partial top part. The
+// saved full pages are reference counted and after a save (or restore) the pages in the 
+// gstack are made read-only and the gstack is "tracked" by that save. A write to
+// a tracked page causes a fault which marks the page as dirty and makes it writable again. 
+// A next save of the gstack can now share all pages that are not dirty, and a restore
+// only needs to copy back the pages that are dirty or differ from the tracked save.
+//
+// With `os_gsave_lazy` enabled as well, a restore only copies back the top pages
+// and makes the other pages that need restoring no-access ("pending"). An access to 
+// a pending page (usually when returning into the frames on it) faults, and only 
+// then we copy back the page from the tracked save. Such lazily restored save may 
+// outlive its resumption: it is then "released" and owned by the gstack until it is 
+// no longer tracked.
+// 
+// Note: system calls that write into a read-only (or pending) page of a tracked gstack will fail
+// with `EFAULT` (instead of causing a fault that we can handle). This is similar to 
+// stack pages that are not yet committed in a gpool.
 //----------------------------------------------------------------------------------
 
+#define MP_GSAVE_INCREMENTAL_MIN  (4)   // minimal number of full pages to use an incremental save
+#define MP_GSAVE_EAGER_PAGES      (2)   // number of top pages that are always restored eagerly
+
+// A saved stack page; shared between incremental saves
+typedef struct mp_gpage_s {
+  intptr_t refcount;
+  uint8_t  data[1];     // `os_page_size` bytes
+} mp_gpage_t;
+
 struct mp_gsave_s {
-  void*   stack;
-  ssize_t stack_size;
-  void*   extra;        // mp_prompt_t structure
-  ssize_t extra_size;
-  uint8_t data[1];      // combined data; starts with extra
+  mp_gstack_t*  gstack;       // the saved gstack
+  void*         stack;
+  ssize_t       stack_size;
+  void*         extra;        // mp_prompt_t structure
+  ssize_t       extra_size;
+  ssize_t       page_count;   // number of full pages (from the base) in `pages` (0 if not an incremental save)
+  mp_gpage_t**  pages;        // the saved full pages where `pages[i]` is the i'th page from the base
+  bool          released;     // freed but still tracked (and owned) by `gstack` as it has pending pages
+  uint8_t       data[1];      // combined data; starts with extra followed by the stack (or only the partial top part for incremental saves)
 };
 
+
+// Global list of tracked gstacks (used by the signal handler)
+static mp_spin_lock_t        mp_gstack_track_lock;
+static _Atomic(intptr_t)     mp_gstack_track_count;
+static mp_gstack_t*          mp_gstack_tracked;
+static mp_decl_thread bool   _mp_gstack_track_lock_held;   // so the signal handler never spins on a lock held by the same thread
+
+#define mp_gstack_track_locked() \
+  for( bool _once = (mp_spin_lock_acquire(&mp_gstack_track_lock), _mp_gstack_track_lock_held = true, true); \
+       _once; \
+       _once = (_mp_gstack_track_lock_held = false, mp_spin_lock_release(&mp_gstack_track_lock), false))
+
+static void mp_gsave_free_pages(mp_gsave_t* gs);
+
+static inline bool mp_bit_is_set(const uint8_t* bits, ssize_t i) {
+  return ((bits[i/8] & (1 << (i%8))) != 0);
+}
+
+static inline void mp_bit_set(uint8_t* bits, ssize_t i) {
+  bits[i/8] |= (uint8_t)(1 << (i%8));
+}
+
+static inline void mp_bit_clear(uint8_t* bits, ssize_t i) {
+  bits[i/8] &= (uint8_t)~(1 << (i%8));
+}
+
+// The i'th full page (counting from the base)
+static uint8_t* mp_gstack_page(const mp_gstack_t* g, ssize_t i) {
+  mp_assert_internal(os_stack_grows_down);
+  return mp_gstack_base(g) - ((i+1) * os_page_size);
+}
+
+// Set the protection of pages `[from,to)`
+static void mp_gstack_protect(const mp_gstack_t* g, ssize_t from, ssize_t to, mp_prot_t prot) {
+  if (from >= to) return;
+  mp_os_mem_protect(mp_gstack_page(g, to - 1), (to - from) * os_page_size, prot);
+}
+
+// Set the protection of the pages `i < count` for which `cond` holds (using as few calls as possible)
+#define mp_gstack_protect_where(g,count,cond,prot) \
+  do { \
+    ssize_t _run = -1; \
+    for (ssize_t i = 0; i <= (count); i++) { \
+      if (i < (count) && (cond)) { if (_run < 0) { _run = i; } } \
+      else if (_run >= 0) { mp_gstack_protect(g, _run, i, prot); _run = -1; } \
+    } \
+  } while(0)
+
+// Is page `i` equal to the page in `g->track`? (it is then read-only, or no-access if still pending)
+static bool mp_gstack_is_clean(const mp_gstack_t* g, ssize_t i) {
+  return (g->track != NULL && i < g->track_count && !mp_bit_is_set(g->track_dirty, i));
+}
+
+static bool mp_gstack_is_pending(const mp_gstack_t* g, ssize_t i) {
+  return (g->track != NULL && i < g->track_count && mp_bit_is_set(g->track_pending, i));
+}
+
+// Start tracking (by `gs`) the first `count` pages; all those must be read-only (or pending) at this point.
+// Pages beyond `count` that were tracked before must be writable.
+static void mp_gstack_track(mp_gstack_t* g, mp_gsave_t* gs, ssize_t count) {
+  mp_gsave_t* prev = g->track;
+  mp_gstack_track_locked() {
+    if (g->track == NULL) {
+      g->track_next = mp_gstack_tracked;
+      mp_gstack_tracked = g;
+      mp_atomic_add(&mp_gstack_track_count, (intptr_t)1);
+    }
+    for (ssize_t i = count; i < g->track_count; i++) { mp_bit_clear(g->track_pending, i); }
+    g->track = gs;
+    g->track_count = count;
+    memset(g->track_dirty, 0, mp_align_up(count, 8) / 8);
+  }
+  // a released save is no longer needed once it is not tracked
+  if (prev != NULL && prev != gs && prev->released) {
+    mp_gsave_free_pages(prev);
+  }
+}
+
+// Stop tracking a gstack and make all pages writable.
+// Pending pages are not restored; this is only called when the gstack is freed, or fully restored.
+static void mp_gstack_untrack(mp_gstack_t* g) {
+  mp_gsave_t* gs = g->track;
+  if (gs == NULL) return;
+  const ssize_t count = g->track_count;
+  mp_gstack_track_locked() {
+    mp_gstack_t* prev = NULL;
+    for (mp_gstack_t* t = mp_gstack_tracked; t != NULL; prev = t, t = t->track_next) {
+      if (t == g) {
+        if (prev == NULL) { mp_gstack_tracked = g->track_next; }
+                     else { prev->track_next = g->track_next; }
+        break;
+      }
+    }
+    mp_atomic_add(&mp_gstack_track_count, (intptr_t)-1);
+    g->track = NULL;
+    g->track_count = 0;
+    g->track_next = NULL;
+  }
+  mp_gstack_protect(g, 0, count, MP_PROT_RW);
+  memset(g->track_pending, 0, mp_align_up(count, 8) / 8);
+  if (gs->released) {
+    mp_gsave_free_pages(gs);
+  }
+}
+
+// Called from the signal handler on an access to a protected page
+static bool mp_gstack_track_fault(void* address) {
+  if (mp_atomic_load(&mp_gstack_track_count) == 0) return false;
+  if (_mp_gstack_track_lock_held) return false;   // cannot be an access to a tracked page
+  uint8_t* p = (uint8_t*)address;
+  bool handled = false;
+  mp_gstack_track_locked() {
+    for (mp_gstack_t* t = mp_gstack_tracked; t != NULL; t = t->track_next) {
+      uint8_t* base = mp_gstack_base(t);
+      if (p < base && p >= base - (t->track_count * os_page_size)) {
+        const ssize_t i = (base - p - 1) / os_page_size;
+        uint8_t* page = mp_gstack_page(t, i);
+        if (mp_bit_is_set(t->track_pending, i)) {
+          // restore on demand; the page is clean afterwards
+          if (mp_os_mem_protect(page, os_page_size, MP_PROT_RW)) {
+            memcpy(page, t->track->pages[i]->data, os_page_size);
+            mp_bit_clear(t->track_pending, i);
+            handled = mp_os_mem_protect(page, os_page_size, MP_PROT_READ);
+          }
+        }
+        else if (!mp_bit_is_set(t->track_dirty, i)) {
+          // first write to a clean page
+          mp_bit_set(t->track_dirty, i);
+          handled = mp_os_mem_protect(page, os_page_size, MP_PROT_RW);
+        }
+        break;
+      }
+    }
+  }
+  return handled;
+}
+
+static bool mp_gsave_use_incremental(ssize_t stack_size) {
+  return (os_gsave_incremental && (stack_size / os_page_size) >= MP_GSAVE_INCREMENTAL_MIN);
+}
+
+// Incremental save of a gstack
+static mp_gsave_t* mp_gstack_save_incremental(mp_gstack_t* g, uint8_t* sp, ssize_t stack_size) {
+  const ssize_t count = stack_size / os_page_size;
+  const ssize_t partial = stack_size - (count * os_page_size);
+  if (g->track_dirty == NULL) {
+    const ssize_t bits_size = mp_align_up(g->stack_size / os_page_size, 8) / 8;
+    g->track_dirty = (uint8_t*)mp_zalloc_safe(2 * bits_size);
+    g->track_pending = g->track_dirty + bits_size;
+  }
+  mp_gsave_t* gs = (mp_gsave_t*)mp_malloc_safe(sizeof(mp_gsave_t) - 1 + g->extra_size + partial + sizeof(void*) + (count * sizeof(mp_gpage_t*)));
+  gs->gstack = g;
+  gs->stack = sp;
+  gs->stack_size = stack_size;
+  gs->extra = &g->extra[0];
+  gs->extra_size = g->extra_size;
+  gs->page_count = count;
+  gs->pages = (mp_gpage_t**)mp_align_up_ptr(&gs->data[g->extra_size + partial], sizeof(void*));
+  gs->released = false;
+  memcpy(gs->data, gs->extra, gs->extra_size);
+  memcpy(gs->data + gs->extra_size, sp, partial);
+  _mp_stats.gsave_count++;
+  _mp_stats.gsave_bytes += gs->extra_size + partial;
+  // share clean pages (including pending ones) and copy the others
+  for (ssize_t i = 0; i < count; i++) {
+    if (mp_gstack_is_clean(g, i)) {
+      mp_gpage_t* page = g->track->pages[i];
+      page->refcount++;
+      gs->pages[i] = page;
+    }
+    else {
+      mp_gpage_t* page = (mp_gpage_t*)mp_malloc_safe(sizeof(mp_gpage_t) - 1 + os_page_size);
+      page->refcount = 1;
+      memcpy(page->data, mp_gstack_page(g, i), os_page_size);
+      gs->pages[i] = page;
+      _mp_stats.gsave_bytes += os_page_size;
+    }
+  }
+  // protect the pages that were copied
+  mp_gstack_protect_where(g, count, !mp_gstack_is_clean(g, i), MP_PROT_READ);
+  // tracked pages beyond the new save are part of the free stack area again
+  if (g->track != NULL && g->track_count > count) {
+    mp_gstack_protect(g, count, g->track_count, MP_PROT_RW);
+  }
+  mp_gstack_track(g, gs, count);
+  return gs;
+}
+
+// Incremental restore of a gstack
+static void mp_gsave_restore_incremental(mp_gsave_t* gs) {
+  mp_gstack_t* g = gs->gstack;
+  const ssize_t count = gs->page_count;
+  const ssize_t lazy_count = (os_gsave_lazy ? count - MP_GSAVE_EAGER_PAGES : 0);  // pages below `lazy_count` are restored on demand
+  // pages that are clean and shared with `gs` do not need to be restored
+  #define mp_needs_restore(i)  (!mp_gstack_is_clean(g,i) || g->track->pages[i] != gs->pages[i])
+  #define mp_restore_eager(i)  ((i) >= lazy_count && mp_needs_restore(i))
+  #define mp_restore_lazy(i)   ((i) < lazy_count && mp_needs_restore(i))
+  // tracked pages beyond the save are part of the free stack area again
+  if (g->track != NULL && g->track_count > count) {
+    mp_gstack_protect(g, count, g->track_count, MP_PROT_RW);
+  }
+  // copy back the eager pages 
+  mp_gstack_protect_where(g, count, mp_restore_eager(i) && mp_gstack_is_clean(g, i), MP_PROT_RW);
+  for (ssize_t i = lazy_count; i < count; i++) {
+    if (mp_needs_restore(i)) { 
+      memcpy(mp_gstack_page(g, i), gs->pages[i]->data, os_page_size); 
+      _mp_stats.restore_bytes += os_page_size;
+    }
+  }
+  mp_gstack_protect_where(g, count, mp_restore_eager(i), MP_PROT_READ);
+  // and make the lazy ones pending
+  if (os_gsave_lazy) {
+    mp_gstack_protect_where(g, lazy_count, mp_restore_lazy(i), MP_PROT_NONE);
+    mp_gstack_track_locked() {
+      for (ssize_t i = 0; i < count; i++) {
+        if (mp_restore_lazy(i)) { mp_bit_set(g->track_pending, i); }
+        else if (mp_restore_eager(i)) { mp_bit_clear(g->track_pending, i); }
+      }
+    }
+  }
+  #undef mp_restore_lazy
+  #undef mp_restore_eager
+  #undef mp_needs_restore
+  mp_gstack_track(g, gs, count);
+  // and the partial top part
+  const ssize_t partial = gs->stack_size - (count * os_page_size);
+  memcpy(gs->extra, gs->data, gs->extra_size);
+  memcpy(gs->stack, gs->data + gs->extra_size, partial);
+  _mp_stats.restore_bytes += gs->extra_size + partial;
+}
+
+
 // save a gstack
 #if MP_USE_ASAN
 __attribute__((no_sanitize("address")))
@@ -355,11 +1067,18 @@ mp_gsave_t* mp_gstack_save(mp_gstack_t* g, uint8_t* sp) {
   mp_assert_internal(mp_gstack_contains(g, sp));
   ssize_t stack_size = mp_unpush(sp, g->stack, g->stack_size);
   mp_assert_internal(stack_size >= 0 && stack_size <= g->stack_size);
+  if (mp_gsave_use_incremental(stack_size)) {
+    return mp_gstack_save_incremental(g, sp, stack_size);
+  }
   mp_gsave_t* gs = (mp_gsave_t*)mp_malloc_safe(sizeof(mp_gsave_t) - 1 + stack_size + g->extra_size);
+  gs->gstack = g;
   gs->stack = (os_stack_grows_down ? sp : g->stack);
   gs->stack_size = stack_size;
   gs->extra = &g->extra[0];
   gs->extra_size = g->extra_size;
+  gs->page_count = 0;
+  gs->pages = NULL;
+  gs->released = false;
   #if MP_USE_ASAN
     for(ssize_t i = 0; i < gs->extra_size; i++) { gs->data[i] = ((uint8_t*)gs->extra)[i]; }
     for(ssize_t i = 0; i < gs->stack_size; i++) { gs->data[i + gs->extra_size] = ((uint8_t*)gs->stack)[i]; }
@@ -367,18 +1086,235 @@ mp_gsave_t* mp_gstack_save(mp_gstack_t* g, uint8_t* sp) {
     memcpy(gs->data, gs->extra, gs->extra_size);
     memcpy(gs->data + gs->extra_size, gs->stack, gs->stack_size);
   #endif
+  _mp_stats.gsave_count++;
+  _mp_stats.gsave_bytes += gs->extra_size + gs->stack_size;
   return gs;
 }
 
 void mp_gsave_restore(mp_gsave_t* gs) {
+  if (gs->pages != NULL) {
+    mp_gsave_restore_incremental(gs);
+    return;
+  }
+  mp_gstack_untrack(gs->gstack);  // no need to track writes as we restore everything
   memcpy(gs->extra, gs->data, gs->extra_size);
   memcpy(gs->stack, gs->data + gs->extra_size, gs->stack_size);
+  _mp_stats.restore_bytes += gs->extra_size + gs->stack_size;
 }
 
-void mp_gsave_free(mp_gsave_t* gs) {
+static void mp_gsave_free_pages(mp_gsave_t* gs) {
+  for (ssize_t i = 0; i < gs->page_count; i++) {
+    mp_gpage_t* page = gs->pages[i];
+    if (--page->refcount == 0) { mp_free(page); }
+  }
   mp_free(gs);
 }
 
+void mp_gsave_free(mp_gsave_t* gs) {
+  if (gs->pages == NULL) {
+    mp_free(gs);
+  }
+  else if (gs->gstack->track == gs) {
+    // keep it alive as long as it is tracked; this avoids restoring all pending pages
+    // (or all protection changes) when the resumption was used for the last time.
+    gs->released = true;
+  }
+  else {
+    mp_gsave_free_pages(gs);
+  }
+}
+
+
+// Clone the used part of a gstack (from the base up to the stack pointer `sp`) into a fresh gstack 
+// of the same size class at the same offset from the base (the `extra` area is not copied). 
+// The clone is fully committed up to `sp`, so it can be written from another stack (and thread).
+// On return, `*delta` is the distance from an address in `g` to the corresponding one in
+// the clone, and `*start` and `*size` give the copied area in the clone.
+// The words in the clone that point into the original are not adjusted (see `mp_resume_clone`).
+#if MP_USE_ASAN
+__attribute__((no_sanitize("address")))
+#endif
+mp_gstack_t* mp_gstack_clone(const mp_gstack_t* g, const uint8_t* sp, ssize_t extra_size, void** extra, ptrdiff_t* delta, uint8_t** start, ssize_t* size) {
+  #if _WIN32
+  // we cannot commit a gstack up front on Windows (see `mp_gstack_commit`)
+  MP_UNUSED(g); MP_UNUSED(sp); MP_UNUSED(extra_size); MP_UNUSED(delta); MP_UNUSED(start); MP_UNUSED(size);
+  if (extra != NULL) { *extra = NULL; }
+  errno = ENOSYS;
+  return NULL;
+  #else
+  mp_gstack_init(NULL);  // we may clone on a fresh thread
+  mp_assert_internal(mp_gstack_contains(g, sp) || sp == mp_gstack_base(g));
+  const ssize_t used = mp_unpush(sp, g->stack, g->stack_size);
+  mp_gstack_t* c = mp_gstack_alloc_class(g->size_class, extra_size, extra);
+  if (c == NULL) return NULL;
+  if (used > c->stack_size) {
+    // heap gstacks of the same size class can differ slightly in their usable size (due to alignment)
+    mp_gstack_free(c, false);
+    if (extra != NULL) { *extra = NULL; }
+    errno = ENOMEM;
+    return NULL;
+  }
+  mp_gstack_commit(c, used);
+  *delta = mp_gstack_base(c) - mp_gstack_base(g);
+  const uint8_t* src = (os_stack_grows_down ? sp : mp_gstack_base(g));
+  uint8_t* dst = (uint8_t*)src + *delta;
+  #if MP_USE_ASAN
+    for (ssize_t i = 0; i < used; i++) { dst[i] = src[i]; }
+  #else
+    memcpy(dst, src, used);   // this may fault on lazily restored pages of `g` which restores them
+  #endif
+  _mp_stats.gsave_count++;
+  _mp_stats.gsave_bytes += used;
+  *start = dst;
+  *size = used;
+  return c;
+  #endif
+}
+
+// The used part of a gstack from the base up to the stack pointer `sp`; 
+// returns its size and sets `*start` to its lowest address.
+ssize_t mp_gstack_used(const mp_gstack_t* g, const uint8_t* sp, uint8_t** start) {
+  mp_assert_internal(mp_gstack_contains(g, sp) || sp == mp_gstack_base(g));
+  *start = (uint8_t*)(os_stack_grows_down ? sp : mp_gstack_base(g));
+  return mp_unpush(sp, g->stack, g->stack_size);
+}
+
+// The usable size of a gstack
+ssize_t mp_gstack_size(const mp_gstack_t* g) {
+  return g->stack_size;
+}
+
+// Allocate a gstack (as `mp_gstack_alloc`) that is committed for `used` bytes from the base,
+// and set `*start` to the lowest address of those bytes (so a used part of another gstack can be copied there).
+mp_gstack_t* mp_gstack_alloc_used(ssize_t size_hint, ssize_t used, ssize_t extra_size, void** extra, uint8_t** start) {
+  *start = NULL;
+  #if _WIN32
+  MP_UNUSED(size_hint); MP_UNUSED(used); MP_UNUSED(extra_size); 
+  if (extra != NULL) { *extra = NULL; }
+  errno = ENOSYS;
+  return NULL;
+  #else
+  mp_gstack_init(NULL);
+  mp_gstack_t* g = mp_gstack_alloc_class(mp_gstack_class_of(mp_max(size_hint, used)), extra_size, extra);
+  if (g == NULL) return NULL;
+  if (used > g->stack_size) {
+    mp_gstack_free(g, false);
+    if (extra != NULL) { *extra = NULL; }
+    errno = ENOMEM;
+    return NULL;
+  }
+  mp_gstack_commit(g, used);
+  *start = (os_stack_grows_down ? mp_gstack_base(g) - used : mp_gstack_base(g));
+  return g;
+  #endif
+}
+
+
+//----------------------------------------------------------------------------------
+// Statistics
+//
+// Each thread updates its own counters without synchronization. The counters of 
+// all threads are linked in a global list so they can be summed in `mp_stats_get`;
+// reading them while other threads are running is racy but only ever makes the 
+// totals approximate. Counters of terminated threads are added to `mp_stats_retired`.
+// Gpool occupancy is computed on demand by walking the free lists.
+//----------------------------------------------------------------------------------
+
+static mp_spin_lock_t     mp_stats_lock;
+static mp_thread_stats_t* mp_stats_threads;
+static mp_thread_stats_t  mp_stats_retired;
+
+static void mp_stats_add(mp_thread_stats_t* total, const mp_thread_stats_t* st) {
+  total->allocs        += st->allocs;
+  total->frees         += st->frees;
+  total->os_allocs     += st->os_allocs;
+  total->os_frees      += st->os_frees;
+  total->reserved      += st->reserved;
+  total->cached        += st->cached;
+  total->delayed       += st->delayed;
+  total->delayed_forced += st->delayed_forced;
+  total->committed     += st->committed;
+  total->faults        += st->faults;
+  total->fast_grows    += st->fast_grows;
+  total->huge_grows    += st->huge_grows;
+  total->trims         += st->trims;
+  total->gsave_count   += st->gsave_count;
+  total->gsave_bytes   += st->gsave_bytes;
+  total->restore_bytes += st->restore_bytes;
+}
+
+static void mp_stats_thread_register(void) {
+  mp_thread_stats_t* st = &_mp_stats;
+  if (st->registered) return;
+  mp_spin_lock(&mp_stats_lock) {
+    st->registered = true;
+    st->prev = NULL;
+    st->next = mp_stats_threads;
+    if (st->next != NULL) { st->next->prev = st; }
+    mp_stats_threads = st;
+  }
+}
+
+static void mp_stats_thread_unregister(void) {
+  mp_thread_stats_t* st = &_mp_stats;
+  if (!st->registered) return;
+  mp_spin_lock(&mp_stats_lock) {
+    mp_stats_add(&mp_stats_retired, st);
+    if (st->prev != NULL) { st->prev->next = st->next; }
+                     else { mp_stats_threads = st->next; }
+    if (st->next != NULL) { st->next->prev = st->prev; }
+    memset(st, 0, sizeof(*st));
+  }
+}
+
+static size_t mp_stats_size(int64_t n) {
+  return (n <= 0 ? 0 : (size_t)n);
+}
+
+void mp_stats_get(mp_stats_t* stats) {
+  if (stats == NULL) return;
+  memset(stats, 0, sizeof(*stats));
+  mp_thread_stats_t total;
+  memset(&total, 0, sizeof(total));
+  mp_spin_lock(&mp_stats_lock) {
+    mp_stats_add(&total, &mp_stats_retired);
+    for (const mp_thread_stats_t* st = mp_stats_threads; st != NULL; st = st->next) {
+      mp_stats_add(&total, st);
+    }
+  }
+  stats->gstack_live         = mp_stats_size(total.allocs - total.frees - total.delayed);
+  stats->gstack_cached       = mp_stats_size(total.cached);
+  stats->gstack_delayed      = mp_stats_size(total.delayed);
+  stats->gstack_delayed_forced = mp_stats_size(total.delayed_forced);
+  stats->gstack_reserved     = mp_stats_size(total.reserved);
+  stats->gstack_committed    = mp_stats_size(total.committed);
+  stats->gstack_allocs       = mp_stats_size(total.allocs);
+  stats->gstack_os_allocs    = mp_stats_size(total.os_allocs);
+  stats->commit_faults       = mp_stats_size(total.faults);
+  stats->commit_fast_grows   = mp_stats_size(total.fast_grows);
+  stats->commit_huge_grows   = mp_stats_size(total.huge_grows);
+  stats->commit_trims        = mp_stats_size(total.trims);
+  stats->gsave_count         = mp_stats_size(total.gsave_count);
+  stats->gsave_bytes         = mp_stats_size(total.gsave_bytes);
+  stats->gsave_restore_bytes = mp_stats_size(total.restore_bytes);
+  for (const mp_gpool_t* gp = mp_gpool_first(); gp != NULL; gp = mp_gpool_next(gp)) {
+    mp_gpool_stats_t gstats;
+    mp_gpool_stats(gp, &gstats);
+    stats->gpool_count++;
+    stats->gpool_blocks += gstats.blocks;
+    stats->gpool_blocks_used += gstats.blocks_used;
+  }
+}
+
+size_t mp_stats_get_gpools(mp_gpool_stats_t* stats, size_t max_count) {
+  size_t count = 0;
+  for (const mp_gpool_t* gp = mp_gpool_first(); gp != NULL; gp = mp_gpool_next(gp)) {
+    if (stats != NULL && count < max_count) { mp_gpool_stats(gp, &stats[count]); }
+    count++;
+  }
+  return count;
+}
+
 
 //----------------------------------------------------------------------------------
 // Is an address located in a gstack?
@@ -420,8 +1356,6 @@ static void mp_gstack_done(void) {
   mp_gstack_thread_done();
 }
 
-static void mp_gstack_thread_init(void);  // called from `mp_gstack_init`
-
 // Init (called by mp_prompt_init and gstack_alloc)
 bool mp_gstack_init(const mp_config_t* config) {
   if (os_page_size == 0) 
@@ -436,6 +1370,7 @@ bool mp_gstack_init(const mp_config_t* config) {
       }
       else {
         os_use_gpools = config->gpool_enable;
+        os_gpool_numa = config->gpool_numa;
         os_gstack_grow_fast = config->stack_grow_fast;
       }
       if (config->gpool_max_size > 0) {
@@ -450,6 +1385,11 @@ bool mp_gstack_init(const mp_config_t* config) {
       if (config->stack_initial_commit > 0) {
         os_gstack_initial_commit = mp_align_up(config->stack_initial_commit, 4 * MP_KIB);
       }
+      os_gsave_incremental = (config->stack_save_incremental || config->stack_restore_lazy);
+      os_gsave_lazy = config->stack_restore_lazy;
+      if (config->stack_keep_hot > 0) {
+        os_gstack_keep_hot = mp_align_up(config->stack_keep_hot, 4 * MP_KIB);
+      }
       if (config->stack_gap_size > 0) {
         os_gstack_gap = mp_align_up(config->stack_gap_size, 4 * MP_KIB);
       }
@@ -459,19 +1399,58 @@ bool mp_gstack_init(const mp_config_t* config) {
       else if (config->stack_cache_count < 0) {
         os_gstack_cache_max_count = 0;
       }
+      // no adaptation if smaller than the minimal count, and no cache at all if the minimal count is 0
+      os_gstack_cache_adapt_max = (os_gstack_cache_max_count == 0 ? 0 : mp_max(os_gstack_cache_max_count, config->stack_cache_max_count));
+      if (config->stack_cache_max_committed > 0) {
+        os_gstack_cache_committed_max = config->stack_cache_max_committed;
+      }
+      if (config->stack_delayed_max_count > 0) {
+        os_gstack_delayed_max_count = config->stack_delayed_max_count;
+      }
+      if (config->stack_huge_from > 0) {
+        os_gstack_huge_from = mp_align_up(config->stack_huge_from, 4 * MP_KIB);
+      }
+      os_gstack_small_size = (config->stack_small_size <= 0 ? 0 : mp_align_up(config->stack_small_size, 4 * MP_KIB));
+      os_gstack_large_size = (config->stack_large_size <= 0 ? 0 : mp_align_up(config->stack_large_size, 4 * MP_KIB));
+      if (config->stack_trim_slack > 0) {
+        os_gstack_trim_slack = mp_align_up(config->stack_trim_slack, 4 * MP_KIB);
+      }
+      if (config->stack_heap_size > 0) {
+        os_gstack_heap_size = mp_align_up(mp_max(config->stack_heap_size, 16 * MP_KIB), 4 * MP_KIB);
+      }
+    }
+    if (os_gstack_heap_size > 0) {
+      // fixed size heap stacks that never grow (and do not need a fault handler)
+      os_gstack_size = os_gstack_heap_size;
+      os_use_gpools = false;
+      os_gstack_grow_fast = false;
+      os_gsave_incremental = false;
+      os_gstack_huge_from = 0;
+      os_gstack_small_size = 0;
+      os_gstack_large_size = 0;
     }
 
     // os specific initialization
     if (!mp_gstack_os_init()) return false;
     if (os_page_size == 0) os_page_size = 4 * MP_KIB;
+    if (MP_USE_ASAN || !os_stack_grows_down) os_gsave_incremental = false;
+    if (!os_gsave_incremental) os_gsave_lazy = false;
+    if (!os_stack_grows_down) os_gstack_huge_from = 0;
+    if (!os_use_gpools || mp_os_numa_node_count() <= 1) os_gpool_numa = false;
 
     // ensure stack sizes are page aligned
     os_gstack_size = mp_align_up(os_gstack_size, os_page_size);
     os_gstack_exn_guaranteed = mp_align_up(os_gstack_exn_guaranteed, os_page_size);
     os_gstack_gap = mp_align_up(os_gstack_gap, os_page_size);
+    os_gstack_keep_hot = mp_align_up(os_gstack_keep_hot, os_page_size);
     os_gpool_max_size = mp_align_up(os_gpool_max_size, os_page_size);
     os_gstack_initial_commit = (os_gstack_initial_commit == 0 ? os_page_size : mp_align_up(os_gstack_initial_commit, os_page_size));
     if (os_gstack_initial_commit > os_gstack_size) os_gstack_initial_commit = os_gstack_size;
+    // the small class must be smaller than the default class, and the large class larger
+    os_gstack_small_size = mp_align_up(os_gstack_small_size, os_page_size);
+    os_gstack_large_size = mp_align_up(os_gstack_large_size, os_page_size);
+    if (os_gstack_small_size >= os_gstack_size || os_gstack_small_size < 4 * os_page_size) os_gstack_small_size = 0;
+    if (os_gstack_large_size <= os_gstack_size || (os_use_gpools && os_gstack_large_size > os_gpool_max_size / 4)) os_gstack_large_size = 0;
 
     // register exit routine
     atexit(&mp_gstack_done);
@@ -495,18 +1474,44 @@ mp_config_t mp_config_default(void) {
   #endif
   cfg.stack_use_overcommit = false;
   cfg.stack_reset_decommits = false;
+  cfg.gpool_numa = os_gpool_numa;
   cfg.gpool_max_size = os_gpool_max_size;
   cfg.stack_max_size = os_gstack_size;
   cfg.stack_initial_commit = os_gstack_initial_commit;
   cfg.stack_exn_guaranteed = os_gstack_exn_guaranteed;
   cfg.stack_cache_count = os_gstack_cache_max_count;
+  cfg.stack_cache_max_count = os_gstack_cache_adapt_max;
+  cfg.stack_cache_max_committed = os_gstack_cache_committed_max;
+  cfg.stack_delayed_max_count = os_gstack_delayed_max_count;
   cfg.stack_gap_size = os_gstack_gap;
+  cfg.stack_keep_hot = os_gstack_keep_hot;
+  cfg.stack_save_incremental = os_gsave_incremental;
+  cfg.stack_restore_lazy = os_gsave_lazy;
+  cfg.stack_huge_from = os_gstack_huge_from;
+  cfg.stack_small_size = os_gstack_small_size;
+  cfg.stack_large_size = os_gstack_large_size;
+  cfg.stack_heap_size = os_gstack_heap_size;
+  cfg.stack_trim_slack = os_gstack_trim_slack;
+  cfg.stack_trim_on_yield = false;
+  cfg.malloc_fun = mp_allocator.malloc_fun;
+  cfg.realloc_fun = mp_allocator.realloc_fun;
+  cfg.free_fun = mp_allocator.free_fun;
+  cfg.alloc_arg = mp_allocator.arg;
   return cfg;
 }
 
 
 static void mp_gstack_thread_done(void) {
+  mp_prompt_thread_done();
   mp_gstack_clear_cache();  // also does mp_gstack_clear_delayed
+  mp_gstack_owner_t* owner = _mp_gstack_owner;
+  if (owner != NULL) {
+    // close our inbox; any gstacks still in use elsewhere will be adopted by the thread that frees them
+    _mp_gstack_owner = NULL;
+    mp_gstack_inbox_collect(owner, true);
+    mp_gstack_owner_release(owner);
+  }
+  mp_stats_thread_unregister();
 }
 
 static mp_decl_thread bool _mp_gstack_init;
@@ -514,10 +1519,63 @@ static mp_decl_thread bool _mp_gstack_init;
 static void mp_gstack_thread_init(void) {
   if (_mp_gstack_init) return;  // already initialized?
   _mp_gstack_init = true;
+  mp_stats_thread_register();
   mp_gstack_os_thread_init();  
 }
 
 
+//----------------------------------------------------------------------------------
+// Tracing
+//----------------------------------------------------------------------------------
+
+#if MP_TRACE
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+
+mp_trace_fun_t* mp_trace_hook;
+static void*    mp_trace_hook_arg;
+
+static unsigned long long mp_trace_timestamp(void) {
+  #if defined(_WIN32)
+  static LARGE_INTEGER freq;  // racy initialization is fine
+  if (freq.QuadPart == 0) { QueryPerformanceFrequency(&freq); }
+  LARGE_INTEGER t;
+  QueryPerformanceCounter(&t);
+  return (unsigned long long)((t.QuadPart / freq.QuadPart) * 1000000000LL + ((t.QuadPart % freq.QuadPart) * 1000000000LL) / freq.QuadPart);
+  #else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);  // async-signal-safe
+  return ((unsigned long long)t.tv_sec * 1000000000ULL + (unsigned long long)t.tv_nsec);
+  #endif
+}
+
+void mp_trace_emit(mp_trace_event_t event, mp_prompt_t* p, mp_gstack_t* g, size_t size) {
+  mp_trace_fun_t* hook = mp_trace_hook;
+  if (hook == NULL) return;
+  mp_trace_info_t info;
+  info.event = event;
+  info.prompt = p;
+  info.gstack = (g == NULL ? NULL : mp_gstack_base(g));
+  info.size = size;
+  info.timestamp = mp_trace_timestamp();
+  hook(&info, mp_trace_hook_arg);
+}
+
+bool mp_trace_set_hook(mp_trace_fun_t* fun, void* arg) {
+  mp_trace_hook = NULL;
+  mp_trace_hook_arg = arg;
+  mp_trace_hook = fun;
+  return true;
+}
+#else
+bool mp_trace_set_hook(mp_trace_fun_t* fun, void* arg) {
+  MP_UNUSED(fun); MP_UNUSED(arg);
+  return false;
+}
+#endif
+
+
 //----------------------------------------------------------------------------------
 // Support address sanitizer
 //----------------------------------------------------------------------------------
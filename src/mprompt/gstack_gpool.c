@@ -16,28 +16,44 @@
   These are linked with each gpool containing about 32000 8MiB gstacks.
   This allows the page fault handler to quickly determine if a fault is in
   one our stacks. In between each stack is a gap and the first stack
-  is used for the gpool info:
+  is used for the gpool info (or the first few for small stacks):
 
   |----------------------------------------------------------------------------------------|
   | mp_gpool_t .... |xxxx| stack 1  .... |xxxx| stack 2 .... |xxx| ...   | stack N ... |xxx|
   |----------------------------------------------------------------------------------------|
 
-  The mp_gpool_t has a "free stack" itself (`free`) consisting of N (~32000) `int16_t`
-  indices which are demand initialized to zero. The top of the stack starts
-  at 0. Each entry at index `i` represents an available gstack at index `free[i] + i`:
-  so the initial on-demand zero'd `free` stack makes all gstacks available in the pool :-)
+  Free gstacks are kept in a small number of lock-free free lists (`shards`).
+  Each thread is assigned a "home" shard and pushes freed gstacks onto it, and
+  pops from it on allocation. Only when its home shard is empty, a thread steals
+  the free list of another shard (migrating all its blocks to its home shard) and
+  only when all shards are empty do we take a block that was never used before
+  (from `fresh` which counts up from 1 to `block_count`). This way threads
+  allocating and freeing gstacks at high rates rarely touch the same cache lines.
 
-  From this free stack we can pop gstacks to use, or push back ones that are freed
+  Each shard is a Treiber stack of block indices where the links are stored
+  in the `free_next` array (of N `int16_t` entries). The top of a shard is
+  an `intptr_t` that contains the index of the first free block in the lower
+  16 bits and a version tag in the upper bits that is incremented on every
+  update to avoid ABA problems.
+
+  From these free lists we can pop gstacks to use, or push back ones that are freed
   in a very efficient way. Moreover, reused gstacks do not need to be re-committed
   (and re-zero initialized by the OS).
 
-  note: when the stack grows down, we modiy the index to allocate gstacks in 
-  reverse; i.e. the entry at index `i` represents an available gstack at `N - (free[i] + i)`.
+  Each gpool holds blocks of just one size class (see `mp_gstack_class_t` in
+  "gstack.c"), and on allocation we only consider gpools with a matching block size.
+
+  On systems with multiple NUMA nodes (and `gpool_numa` enabled), each gpool
+  is moreover bound to one node: its reservation prefers physical pages on
+  that node (using `mbind` on Linux, or `VirtualAllocExNuma` on Windows) and
+  a thread only allocates from the gpools of the node it runs on. A freed gstack
+  goes back to the gpool it came from, so a recycled gstack keeps its pages
+  local to the node even if it was last used by a thread on another node.
+
+  note: when the stack grows down, we modify the index to allocate gstacks in 
+  reverse; i.e. the free index `i` represents an available gstack at block `N - i`.
   On Windows, backtraces only work if the parent of a gstack is at a higher
   address and this strategy will help to ensure this is often the case.
-
-  Since the gpool list is global we use a small spinlock for thread-safe
-  allocation and free.
 -----------------------------------------------------------------------------*/
 
 // We need atomic operations for the `gpool` on systems that do not have overcommit.
@@ -47,11 +63,21 @@
 // gpool
 //----------------------------------------------------------------------------------
 #define MP_GPOOL_MAX_COUNT  (32000)         // at most INT16_MAX
+#define MP_GPOOL_SHARDS     (8)             // number of free lists per gpool
+#define MP_GPOOL_IDX_BITS   (16)            // lower bits of a shard top that contain the block index
+#define MP_GPOOL_IDX_MASK   ((intptr_t)((1 << MP_GPOOL_IDX_BITS) - 1))
+#define MP_CACHE_LINE       (64)
 
 static inline bool mp_gpool_grows_down(void) {
   return os_stack_grows_down;               // separate definition so we can debug reverse allocation
 }
 
+// A free list of blocks; each on its own cache line
+typedef struct mp_gpool_shard_s {
+  _Atomic(intptr_t) top;    // (version tag << MP_GPOOL_IDX_BITS) | first free index (or 0 if empty)
+  uint8_t  _padding[MP_CACHE_LINE - sizeof(intptr_t)];
+} mp_gpool_shard_t;
+
 typedef struct mp_gpool_s {
   struct mp_gpool_s* next;
   ssize_t  full_size;       // full mmap'd reserved size
@@ -59,13 +85,17 @@ typedef struct mp_gpool_s {
   ssize_t  block_count;
   ssize_t  block_size;
   ssize_t  gap_size;
+  ssize_t  info_count;      // number of initial blocks that hold the `mp_gpool_t` itself
+  int      numa_node;       // the preferred NUMA node of the pages (or -1 for any)
   bool     zeroed;          // is the free area surely zero'd?
-  // protected by a lock:
-  mp_spin_lock_t free_lock;
-  ssize_t  free_sp;
-  int16_t  free[MP_GPOOL_MAX_COUNT];
+  _Atomic(intptr_t) fresh;  // free indices `[fresh,block_count)` have never been allocated
+  mp_gpool_shard_t shards[MP_GPOOL_SHARDS];
+  int16_t  free_next[MP_GPOOL_MAX_COUNT];   // link to the next free index in a shard (or 0)
+  uint16_t accessible[MP_GPOOL_MAX_COUNT];  // per block the pages (from the base) that are still accessible after a reset (`MP_GPOOL_ACCESSIBLE_ALL` for the full stack)
 } mp_gpool_t;
 
+#define MP_GPOOL_ACCESSIBLE_ALL  (UINT16_MAX)
+
 
 // Global list of gpools
 static _Atomic(mp_gpool_t*)mp_gpools;
@@ -81,24 +111,25 @@ static mp_gpool_t* mp_gpool_next(const mp_gpool_t* gp) {
 
 
 // Create a new pool in a given reserved virtual memory area.
-static mp_gpool_t* mp_gpool_create(void* p, ssize_t size, ssize_t stack_size, ssize_t gap_size, bool zeroed) {
+static mp_gpool_t* mp_gpool_create(void* p, ssize_t size, ssize_t stack_size, ssize_t gap_size, int numa_node, bool zeroed) {
   // check parameters  
-  mp_assert_internal(size >= stack_size + gap_size && p != NULL && (size_t)stack_size > sizeof(mp_gpool_t));
+  mp_assert_internal(size >= stack_size + gap_size && p != NULL);
   stack_size = mp_align_up(stack_size, os_page_size);
   gap_size = mp_align_up(gap_size, os_page_size);
   ssize_t block_size = stack_size + gap_size;
+  ssize_t info_count = ((ssize_t)sizeof(mp_gpool_t) + block_size - 1) / block_size;
   ssize_t count = size / block_size;
-  mp_assert_internal(count > 1);
-  if (count <= 0) return NULL;
   if (count > (os_gpool_max_size / block_size)) {
     count = (os_gpool_max_size / block_size);
   }
   if (count > MP_GPOOL_MAX_COUNT) {
     count = MP_GPOOL_MAX_COUNT;
   }
+  mp_assert_internal(count > info_count);
+  if (count <= info_count) return NULL;
   // init
   if (!zeroed) {
-    memset(p, 0, os_page_size); // zero out the initial page; the rest is done on-demand
+    memset(p, 0, sizeof(mp_gpool_t)); // free lists start empty
   }
   mp_gpool_t* gp = (mp_gpool_t*)p;
   gp->zeroed = zeroed;
@@ -107,8 +138,9 @@ static mp_gpool_t* mp_gpool_create(void* p, ssize_t size, ssize_t stack_size, ss
   gp->block_count = count;
   gp->block_size = block_size;
   gp->gap_size = gap_size;
-  gp->free_sp = 1;  // first block is allocated to the gpool_t itself
-  gp->free_lock = mp_spin_lock_create();
+  gp->info_count = info_count;
+  gp->numa_node = numa_node;
+  mp_atomic_store(&gp->fresh, (intptr_t)1);  // the first `info_count` blocks are allocated to the gpool_t itself
   // push atomically at the head of the pools
   gp->next = mp_atomic_load_ptr(mp_gpool_t, &mp_gpools);
   while (!mp_atomic_cas_ptr(mp_gpool_t, &mp_gpools, &gp->next, gp)) {};
@@ -116,46 +148,156 @@ static mp_gpool_t* mp_gpool_create(void* p, ssize_t size, ssize_t stack_size, ss
   return gp;
 }
 
-// Allocate a fresh growable stack area from the pools
-static uint8_t* mp_gpool_alloc_stack(uint8_t** stk, ssize_t* stk_size) {
-  // for all pools
-  for (mp_gpool_t* gp = mp_gpool_first(); gp != NULL; gp = mp_gpool_next(gp)) {
-    ssize_t block_idx = 0;
-    ssize_t sp;
-    volatile int16_t _access = 0;
-    _access += gp->free[gp->free_sp + 64]; // ensure no page fault happens inside the spin lock
-    mp_spin_lock(&gp->free_lock) {
-      // pop from free stack
-      sp = gp->free_sp;
-      if (sp < gp->block_count) {
-        gp->free_sp = sp + 1;
-        block_idx = gp->free[sp] + sp;
-      }
-    }    
-    mp_assert_internal(block_idx >= 0 && block_idx < gp->block_count);
-    if (block_idx > 0) {
-      if (mp_gpool_grows_down()) {
-        block_idx = gp->block_count - block_idx; // grow from top
+
+// Map a free index (in `[1, block_count - info_count]`) to a block index and back.
+static inline ssize_t mp_gpool_block_of(const mp_gpool_t* gp, intptr_t idx) {
+  return (mp_gpool_grows_down() ? gp->block_count - idx : idx + gp->info_count - 1);  // grow from the top if the stack grows down
+}
+
+static inline intptr_t mp_gpool_idx_of(const mp_gpool_t* gp, ssize_t block_idx) {
+  return (mp_gpool_grows_down() ? gp->block_count - block_idx : block_idx - gp->info_count + 1);
+}
+
+
+//----------------------------------------------------------------------------------
+// Free lists
+//----------------------------------------------------------------------------------
+
+// Every thread has a home shard, assigned round-robin on first use.
+static _Atomic(intptr_t) mp_gpool_shard_next;
+static mp_decl_thread ssize_t _mp_gpool_shard = -1;
+
+static ssize_t mp_gpool_shard_home(void) {
+  ssize_t shard = _mp_gpool_shard;
+  if (mp_unlikely(shard < 0)) {
+    intptr_t next = mp_atomic_load(&mp_gpool_shard_next);
+    while (!mp_atomic_cas(&mp_gpool_shard_next, &next, next + 1)) { };
+    shard = _mp_gpool_shard = (ssize_t)(next % MP_GPOOL_SHARDS);
+  }
+  return shard;
+}
+
+// Every thread allocates from the gpools of the NUMA node it runs on. As threads
+// can migrate, the node is looked up again every `MP_GPOOL_NUMA_REFRESH` allocations.
+#define MP_GPOOL_NUMA_REFRESH  (256)
+
+static mp_decl_thread int     _mp_gpool_numa_node = -1;
+static mp_decl_thread ssize_t _mp_gpool_numa_refresh;
+
+static int mp_gpool_numa_home(void) {
+  if (!os_gpool_numa) return -1;
+  if (mp_unlikely(_mp_gpool_numa_refresh <= 0)) {
+    _mp_gpool_numa_node = mp_os_numa_node();
+    _mp_gpool_numa_refresh = MP_GPOOL_NUMA_REFRESH;
+  }
+  _mp_gpool_numa_refresh--;
+  return _mp_gpool_numa_node;
+}
+
+static inline intptr_t mp_gpool_top_idx(intptr_t top) {
+  return (top & MP_GPOOL_IDX_MASK);
+}
+
+static inline intptr_t mp_gpool_top_make(intptr_t prev_top, intptr_t idx) {
+  // increment the version tag on every update
+  return ((((prev_top >> MP_GPOOL_IDX_BITS) + 1) << MP_GPOOL_IDX_BITS) | idx);
+}
+
+// Pop a free index from a shard (or return 0 if it was empty)
+static intptr_t mp_gpool_shard_pop(mp_gpool_t* gp, mp_gpool_shard_t* shard) {
+  intptr_t top = mp_atomic_load(&shard->top);
+  intptr_t idx;
+  do {
+    idx = mp_gpool_top_idx(top);
+    if (idx == 0) return 0;
+    // note: the read of `free_next[idx]` may race with another pop and push, but in that
+    // case the version tag is incremented and the compare-and-swap will fail.
+  } while (!mp_atomic_cas(&shard->top, &top, mp_gpool_top_make(top, gp->free_next[idx])));
+  return idx;
+}
+
+// Push a list of free indices, `first` up to `last` (already linked), on a shard
+static void mp_gpool_shard_push(mp_gpool_t* gp, mp_gpool_shard_t* shard, intptr_t first, intptr_t last) {
+  intptr_t top = mp_atomic_load(&shard->top);
+  do {
+    gp->free_next[last] = (int16_t)mp_gpool_top_idx(top);
+  } while (!mp_atomic_cas(&shard->top, &top, mp_gpool_top_make(top, first)));
+}
+
+// Steal all free indices of another shard and move them to our home shard;
+// returns one index for immediate use (or 0 if all other shards are empty).
+static intptr_t mp_gpool_shard_steal(mp_gpool_t* gp, ssize_t home) {
+  for (ssize_t i = 1; i < MP_GPOOL_SHARDS; i++) {
+    mp_gpool_shard_t* shard = &gp->shards[(home + i) % MP_GPOOL_SHARDS];
+    intptr_t top = mp_atomic_load(&shard->top);
+    intptr_t idx;
+    do {
+      idx = mp_gpool_top_idx(top);
+    } while (idx != 0 && !mp_atomic_cas(&shard->top, &top, mp_gpool_top_make(top, 0)));
+    if (idx != 0) {
+      // we own the list now; keep the first one and move the rest to our home shard
+      intptr_t first = gp->free_next[idx];
+      if (first != 0) {
+        intptr_t last = first;
+        while (gp->free_next[last] != 0) { last = gp->free_next[last]; }
+        mp_gpool_shard_push(gp, &gp->shards[home], first, last);
       }
-      if (block_idx <= 0 || block_idx >= gp->block_count) return NULL; // paranoia
+      return idx;
+    }
+  }
+  return 0;
+}
+
+// Take a never used index (or 0 if the pool is fully used)
+static intptr_t mp_gpool_fresh_pop(mp_gpool_t* gp) {
+  intptr_t idx = mp_atomic_load(&gp->fresh);
+  do {
+    if (idx > gp->block_count - gp->info_count) return 0;
+  } while (!mp_atomic_cas(&gp->fresh, &idx, idx + 1));
+  return idx;
+}
+
+
+//----------------------------------------------------------------------------------
+// Allocation
+//----------------------------------------------------------------------------------
+
+// Allocate a fresh growable stack area from the pools with the given block and gap size (on a given NUMA node).
+// Also returns the size (from the base) that is still accessible from a previous use of the block.
+static uint8_t* mp_gpool_alloc_stack(ssize_t block_size, ssize_t gap_size, int numa_node, uint8_t** stk, ssize_t* stk_size, ssize_t* accessible) {
+  const ssize_t home = mp_gpool_shard_home();
+  // for all pools of this size class (and node)
+  for (mp_gpool_t* gp = mp_gpool_first(); gp != NULL; gp = mp_gpool_next(gp)) {
+    if (gp->block_size != block_size || gp->gap_size != gap_size || gp->numa_node != numa_node) continue;
+    intptr_t idx = mp_gpool_shard_pop(gp, &gp->shards[home]);
+    if (idx == 0) idx = mp_gpool_shard_steal(gp, home);
+    if (idx == 0) idx = mp_gpool_fresh_pop(gp);
+    mp_assert_internal(idx >= 0 && idx <= gp->block_count - gp->info_count);
+    if (idx > 0) {
+      const ssize_t block_idx = mp_gpool_block_of(gp, idx);
+      if (block_idx < gp->info_count || block_idx >= gp->block_count) return NULL; // paranoia
       uint8_t* p = ((uint8_t*)gp + (block_idx * gp->block_size));
-      //mp_trace_message("gpool_alloc: gp: %p, p: %p, block_idx: %zd, sp: %zd\n", gp, p, block_idx, sp);
+      //mp_trace_message("gpool_alloc: gp: %p, p: %p, block_idx: %zd, shard: %zd\n", gp, p, block_idx, home);
       *stk = p;
       *stk_size = gp->block_size - gp->gap_size;
+      const uint16_t pages = gp->accessible[block_idx];
+      *accessible = (pages == MP_GPOOL_ACCESSIBLE_ALL ? *stk_size : mp_min(*stk_size, (ssize_t)pages * os_page_size));
       return p;
     }
   }
   return NULL;
 }
 
-// Allocate a fresh growable stack area from the pools
-static uint8_t* mp_gpool_alloc(uint8_t** stk, ssize_t* stk_size) {
-  uint8_t* p = mp_gpool_alloc_stack(stk, stk_size);
+// Allocate a fresh growable stack area of `block_size` from the pools
+static uint8_t* mp_gpool_alloc(ssize_t block_size, ssize_t gap_size, uint8_t** stk, ssize_t* stk_size, ssize_t* accessible) {
+  *accessible = 0;
+  const int numa_node = mp_gpool_numa_home();
+  uint8_t* p = mp_gpool_alloc_stack(block_size, gap_size, numa_node, stk, stk_size, accessible);
   if (p != NULL) return p;
 
-  // allocate a fresh gpool
-  size_t poolsize = os_gpool_max_size;
-  uint8_t* pool = mp_os_mem_reserve(poolsize);
+  // allocate a fresh gpool (smaller for small stacks as we can have at most `MP_GPOOL_MAX_COUNT` blocks)
+  ssize_t poolsize = mp_min(os_gpool_max_size, MP_GPOOL_MAX_COUNT * block_size);
+  uint8_t* pool = mp_os_mem_reserve_numa(poolsize, numa_node);
   if (pool == NULL) return NULL;
 
   // commit on demand in the regular fault handler
@@ -167,41 +309,30 @@ static uint8_t* mp_gpool_alloc(uint8_t** stk, ssize_t* stk_size) {
   }
     
   // make it available 
-  mp_gpool_create(pool, poolsize, os_gstack_size - os_gstack_gap, os_gstack_gap, true);
+  mp_gpool_create(pool, poolsize, block_size - gap_size, gap_size, numa_node, true);
 
   // and try to allocate again 
-  return mp_gpool_alloc_stack(stk, stk_size);
+  return mp_gpool_alloc_stack(block_size, gap_size, numa_node, stk, stk_size, accessible);
 }
 
 
 // Free a growable stack area back to the pools
-static void mp_gpool_free(uint8_t* stk) {  
+// where `accessible` is the size (from the base) that stays accessible (without needing a commit).
+static void mp_gpool_free(uint8_t* stk, ssize_t accessible) {  
   // for all pools
   for (mp_gpool_t* gp = mp_gpool_first(); gp != NULL; gp = mp_gpool_next(gp)) {
     ptrdiff_t ofs = (uint8_t*)stk - (uint8_t*)gp;
     if (ofs >= 0 && ofs < gp->size) {
       mp_assert(ofs % gp->block_size == 0);
-      ptrdiff_t sp;
       ptrdiff_t block_idx = (ofs / gp->block_size);
-      mp_assert(block_idx > 0); if (block_idx == 0) return;
+      mp_assert(block_idx >= gp->info_count); if (block_idx < gp->info_count) return;
       mp_assert(block_idx < gp->block_count); if (block_idx >= gp->block_count) return;
-      ptrdiff_t idx;
-      if (mp_gpool_grows_down()) {
-        idx = gp->block_count - block_idx; // reverse if growing down
-      }
-      else {
-        idx = block_idx;
-      }
-      mp_spin_lock(&gp->free_lock) {
-        // push on free stack
-        gp->free_sp--;
-        sp = gp->free_sp;
-        //idx = gp->block_count - block_idx - sp;
-        idx = idx - sp;        
-        gp->free[sp] = (int16_t)idx;
-      }
-      mp_assert(idx >= INT16_MIN && idx <= INT16_MAX);
-      mp_assert(sp > 0);
+      const intptr_t idx = mp_gpool_idx_of(gp, block_idx);
+      mp_assert(idx > 0 && idx <= INT16_MAX);
+      const ssize_t pages = mp_align_up(accessible, os_page_size) / os_page_size;
+      gp->accessible[block_idx] = (pages >= MP_GPOOL_ACCESSIBLE_ALL || accessible >= gp->block_size - gp->gap_size ? MP_GPOOL_ACCESSIBLE_ALL : (uint16_t)pages);
+      // push on our home free list
+      mp_gpool_shard_push(gp, &gp->shards[mp_gpool_shard_home()], idx, idx);
       return; // done
     }
   }
@@ -219,8 +350,9 @@ static mp_access_t mp_gpools_check_access(void* p, ssize_t* stack_size, ssize_t*
     ptrdiff_t ofs = (uint8_t*)p - (uint8_t*)gp;
     if (ofs >= 0 && ofs < gp->size) {   // in the pool?
       if (stack_size != NULL) *stack_size = gp->block_size - gp->gap_size;
-      if (ofs <= (ptrdiff_t)sizeof(mp_gpool_t)) {
-        // the start page
+      if (ofs < gp->info_count * gp->block_size) {
+        // the start blocks
+        if (ofs > (ptrdiff_t)sizeof(mp_gpool_t)) return MP_NOACCESS;
         if (available != NULL) *available = (sizeof(mp_gpool_t) - ofs);
         if (gpool != NULL) *gpool = gp;
         return MP_ACCESS_META;
@@ -243,3 +375,30 @@ static mp_access_t mp_gpools_check_access(void* p, ssize_t* stack_size, ssize_t*
   }
   return MP_NOACCESS;
 }
+
+
+//----------------------------------------------------------------------------------
+// Statistics
+//----------------------------------------------------------------------------------
+
+// Occupancy of a gpool: the blocks taken from `fresh` minus those on the free lists.
+// The free lists may change concurrently so we bound the walk and the result is approximate.
+static void mp_gpool_stats(const mp_gpool_t* gp, mp_gpool_stats_t* stats) {
+  const intptr_t fresh = mp_atomic_load((_Atomic(intptr_t)*)&gp->fresh);
+  ssize_t free_count = 0;
+  for (ssize_t i = 0; i < MP_GPOOL_SHARDS; i++) {
+    intptr_t idx = mp_gpool_top_idx(mp_atomic_load((_Atomic(intptr_t)*)&gp->shards[i].top));
+    while (idx > 0 && idx < gp->block_count && free_count < gp->block_count) {
+      free_count++;
+      idx = gp->free_next[idx];
+    }
+  }
+  const ssize_t used = mp_max(0, (ssize_t)fresh - 1 - free_count);
+  stats->start = (void*)gp;
+  stats->size = (size_t)gp->size;
+  const ssize_t usable = gp->block_count - gp->info_count;
+  stats->blocks = (size_t)gp->block_count;
+  stats->blocks_used = (size_t)used;
+  stats->blocks_fresh = (size_t)(usable - mp_min((ssize_t)fresh - 1, usable));
+  stats->numa_node = gp->numa_node;
+}
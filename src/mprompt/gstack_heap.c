@@ -0,0 +1,72 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Included from "gstack.c".
+
+  Heap allocated gstacks, used when `stack_heap_size` is set.
+
+  The regular gstacks reserve a large virtual area per stack and commit it
+  on demand with a page fault handler. In environments with a low
+  `vm.max_map_count`, or where we cannot install signal handlers, this limits
+  the number of prompts. Heap gstacks are instead fixed size blocks allocated
+  with `mp_malloc`, fully accessible from the start and never grow; there
+  are no gaps, no gpools, and no fault handler.
+
+  Since there is no noaccess gap, we put a canary area at the stack limit
+  that is checked whenever the gstack is freed; an overflow is thus detected
+  (and fatal) but only after the fact. We cannot relocate a stack to a bigger
+  block on overflow as C code may hold pointers into its own stack frames.
+
+  |------------------------------------------------|
+  | canary | stack ...                        base |     (if the stack grows down)
+  |------------------------------------------------|
+-----------------------------------------------------------------------------*/
+
+#define MP_HEAP_CANARY_SIZE   (1024)
+#define MP_HEAP_ALIGN         (64)
+
+// The canary value depends on the address so a stale copy of a stack does not match
+static inline uintptr_t mp_heap_canary(const uint8_t* full) {
+  return ((uintptr_t)full ^ (uintptr_t)0xFDFDA5A5C3C35A5AULL);
+}
+
+// The canary area is just beyond the stack limit
+static uintptr_t* mp_heap_canary_area(uint8_t* stk, ssize_t stk_size) {
+  return (uintptr_t*)(os_stack_grows_down ? stk - MP_HEAP_CANARY_SIZE : stk + stk_size);
+}
+
+// Allocate a heap gstack of `full_size` bytes
+static uint8_t* mp_gstack_heap_alloc(ssize_t full_size, uint8_t** stk, ssize_t* stk_size, ssize_t* initial_commit) {
+  if (initial_commit != NULL) { *initial_commit = 0; }
+  uint8_t* full = (uint8_t*)mp_malloc((size_t)full_size);
+  if (full == NULL) return NULL;
+  uint8_t* start = mp_align_up_ptr(full + (os_stack_grows_down ? MP_HEAP_CANARY_SIZE : 0), MP_HEAP_ALIGN);
+  uint8_t* end = mp_align_down_ptr(full + full_size - (os_stack_grows_down ? 0 : MP_HEAP_CANARY_SIZE), MP_HEAP_ALIGN);
+  *stk = start;
+  *stk_size = end - start;
+  uintptr_t* canary = mp_heap_canary_area(*stk, *stk_size);
+  for (size_t i = 0; i < MP_HEAP_CANARY_SIZE / sizeof(uintptr_t); i++) {
+    canary[i] = mp_heap_canary(full);
+  }
+  if (initial_commit != NULL) { *initial_commit = *stk_size; }
+  return full;
+}
+
+// Check the canary of a heap gstack
+static void mp_gstack_heap_check(uint8_t* full, uint8_t* stk, ssize_t stk_size) {
+  const uintptr_t* canary = mp_heap_canary_area(stk, stk_size);
+  for (size_t i = 0; i < MP_HEAP_CANARY_SIZE / sizeof(uintptr_t); i++) {
+    if (canary[i] != mp_heap_canary(full)) {
+      mp_fatal_message(EFAULT, "stack overflow in a heap allocated gstack at %p (of size %zd); increase `stack_heap_size`\n", stk, stk_size);
+    }
+  }
+}
+
+// Free a heap gstack
+static void mp_gstack_heap_free(uint8_t* full, uint8_t* stk, ssize_t stk_size) {
+  mp_gstack_heap_check(full, stk, stk_size);
+  mp_free(full);
+}
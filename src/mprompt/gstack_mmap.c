@@ -14,6 +14,9 @@
 #include <signal.h>    // sigaction
 #include <fcntl.h>     // file read
 #include <pthread.h>   // use pthread local storage keys to detect thread ending
+#if defined(__linux__)
+#include <sys/syscall.h>  // getcpu and mbind (without depending on libnuma)
+#endif
 
 // We need atomic operations for the `gpool` on systems that do not have overcommit.
 #include "internal/atomic.h"
@@ -89,6 +92,56 @@ static uint8_t* mp_os_mem_reserve(ssize_t size) {
   return mp_os_mmap_reserve(size, PROT_NONE, NULL);
 }
 
+// Reserve virtual memory range whose pages are preferably placed on a NUMA node
+static uint8_t* mp_os_mem_reserve_numa(ssize_t size, int node) {
+  uint8_t* p = mp_os_mem_reserve(size);
+  if (p == NULL || node < 0) return p;
+  #if defined(__linux__) && defined(SYS_mbind)
+  // bind with `MPOL_PREFERRED` (= 1) so the pages are placed on the node when first touched
+  // (falling back to other nodes if it is out of memory).  
+  unsigned long nodemask[4] = { 0 };
+  const int bits = (int)(8 * sizeof(unsigned long));
+  if (node < 4 * bits) {
+    nodemask[node / bits] = (1UL << (node % bits));
+    // on failure the pages are just placed by the default policy
+    (void)syscall(SYS_mbind, p, (unsigned long)size, 1 /* MPOL_PREFERRED */, nodemask, (unsigned long)(4 * bits + 1), 0);
+  }
+  #endif
+  return p;
+}
+
+// The NUMA node of the calling thread
+static int mp_os_numa_node(void) {
+  #if defined(__linux__) && defined(SYS_getcpu)
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int)node;
+  #endif
+  return -1;
+}
+
+// The number of NUMA nodes
+static int mp_os_numa_node_count(void) {
+  #if defined(__linux__)
+  // read the range of possible nodes, like `0` or `0-3`, and take the last number as the highest node
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+  if (fd < 0) return 1;
+  char buf[128];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 1;
+  buf[n] = 0;
+  int highest = 0;
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] >= '0' && buf[i] <= '9') { highest = 10 * highest + (buf[i] - '0'); }
+    else if (buf[i] == '-' || buf[i] == ',') { highest = 0; }
+  }
+  return (highest + 1);
+  #else
+  return 1;
+  #endif
+}
+
 // Free reserved memory
 static void  mp_os_mem_free(uint8_t* p, ssize_t size) {
   MP_UNUSED(size);
@@ -108,6 +161,16 @@ static bool mp_os_mem_commit(uint8_t* start, ssize_t size) {
   return true;
 }
 
+// Change the protection of a committed range of pages
+static bool mp_os_mem_protect(uint8_t* start, ssize_t size, mp_prot_t prot) {
+  const int flags = (prot == MP_PROT_RW ? PROT_READ | PROT_WRITE : (prot == MP_PROT_READ ? PROT_READ : PROT_NONE));
+  if (mprotect(start, size, flags) != 0) {
+    mp_system_error_message(EINVAL, "failed to protect memory at %p of size %zd\n", start, size);
+    return false;
+  }
+  return true;
+}
+
 // Reset the memory of a gstack
 static bool mp_os_mem_reset(uint8_t* p, ssize_t size) {
   // we can only decommit if MAP_FIXED is defined
@@ -143,6 +206,29 @@ static bool mp_os_mem_reset(uint8_t* p, ssize_t size) {
 }
 
 
+// Huge pages: parts of a gstack deeper than `os_gstack_huge_from` are committed
+// in ranges aligned to the huge page size and advised for transparent huge pages. The 
+// first part of a stack keeps using regular pages as most stacks stay shallow.
+#define MP_HUGE_PAGE_SIZE  (2 * MP_MIB)
+
+static bool mp_mmap_use_huge(ssize_t used) {
+  #if defined(MADV_HUGEPAGE)
+  return (os_gstack_huge_from > 0 && used >= os_gstack_huge_from);
+  #else
+  MP_UNUSED(used);
+  return false;
+  #endif
+}
+
+static void mp_mmap_advise_huge(uint8_t* start, ssize_t size) {
+  #if defined(MADV_HUGEPAGE)
+  madvise(start, size, MADV_HUGEPAGE);  // ignore errors (e.g. if transparent huge pages are disabled)
+  #else
+  MP_UNUSED(start); MP_UNUSED(size);
+  #endif
+}
+
+
 //----------------------------------------------------------------------------------
 // The OS primitive `gstack` interface based on `mmap`.
 //----------------------------------------------------------------------------------
@@ -156,6 +242,11 @@ static bool mp_mmap_initial_commit(uint8_t* stk, ssize_t stk_size, ssize_t* init
     if (!mp_os_mem_commit(stk, stk_size)) {
       return false;
     }
+    if (os_gstack_huge_from > 0 && os_gstack_huge_from < stk_size) {
+      // the OS commits on demand; only advise the deep part for huge pages
+      uint8_t* huge_end = mp_align_down_ptr(mp_push(mp_base(stk, stk_size), os_gstack_huge_from, NULL), MP_HUGE_PAGE_SIZE);
+      if (huge_end > stk) { mp_mmap_advise_huge(stk, huge_end - stk); }
+    }
     if (initial_commit != NULL) *initial_commit = stk_size;
   }
   else {
@@ -172,50 +263,81 @@ static bool mp_mmap_initial_commit(uint8_t* stk, ssize_t stk_size, ssize_t* init
 }
 
 // Allocate a gstack
-static uint8_t* mp_gstack_os_alloc(uint8_t** stk, ssize_t* stk_size, ssize_t* initial_commit) {
+static uint8_t* mp_gstack_os_alloc(ssize_t full_size, ssize_t gap_size, uint8_t** stk, ssize_t* stk_size, ssize_t* initial_commit) {
   if (initial_commit != NULL) { *initial_commit = 0; }
   if (!os_use_gpools) {
     // use NORESERVE to let the OS commit on demand
     bool zeroed = false; // don't require zeros
-    uint8_t* full = mp_os_mmap_reserve(os_gstack_size, PROT_NONE, &zeroed);
+    uint8_t* full = mp_os_mmap_reserve(full_size, PROT_NONE, &zeroed);
     if (full == NULL) {
       return NULL;
     }
 
-    *stk = full + os_gstack_gap;
-    *stk_size = os_gstack_size - 2 * os_gstack_gap;    
+    *stk = full + gap_size;
+    *stk_size = full_size - 2 * gap_size;    
     if (!mp_mmap_initial_commit(*stk, *stk_size, initial_commit)) {
-      munmap(full, os_gstack_size);
+      munmap(full, full_size);
       return NULL;
     }
     return full;
   }
   else {
     // use the gpool allocator to commit-on-demand even on over-commit systems (using a signal handler)
-    uint8_t* full = mp_gpool_alloc(stk,stk_size);
+    ssize_t accessible;
+    uint8_t* full = mp_gpool_alloc(full_size, gap_size, stk, stk_size, &accessible);
     if (full == NULL) return NULL;      
     if (!mp_mmap_initial_commit(*stk, *stk_size, initial_commit)) {
-      mp_gpool_free(full);
+      mp_gpool_free(full, accessible);
       return NULL;
     }
+    // a reused gstack can still be accessible beyond the initial commit (as a reset keeps it read/write)
+    if (initial_commit != NULL && accessible > *initial_commit) { *initial_commit = accessible; }
     return full;
   }  
 }
 
 // Free the memory of a gstack
-static void mp_gstack_os_free(uint8_t* full, uint8_t* stk, ssize_t stk_size, ssize_t stk_commit) {
-  MP_UNUSED(stk_commit);
+static void mp_gstack_os_free(uint8_t* full, ssize_t full_size, uint8_t* stk, ssize_t stk_size, ssize_t stk_commit) {
   if (!os_use_gpools) {
-    mp_os_mem_free(full,os_gstack_size);
+    mp_os_mem_free(full, full_size);
   }
   else {
-    // reset the full range. todo: just reset the actual committed range?
-    mp_os_mem_reset(stk,stk_size);
-    mp_gpool_free(full);
+    // reset only the committed range, minus the initial part we keep hot
+    // (the `stk_commit` includes any area that stayed accessible from a previous use of the block)
+    stk_commit = mp_min(stk_size, mp_align_up(stk_commit, os_page_size));
+    const ssize_t keep = mp_min(stk_commit, os_gstack_keep_hot);
+    uint8_t* reset_start;
+    mp_push(mp_base(stk, stk_size), stk_commit, &reset_start);
+    if (!os_stack_grows_down) { reset_start += keep; }
+    if (stk_commit > keep && mp_os_mem_reset(reset_start, stk_commit - keep)) {
+      // madvise keeps the range accessible but a decommit does not
+      mp_gpool_free(full, (os_gstack_reset_decommits ? keep : stk_commit));
+    }
+    else {
+      mp_gpool_free(full, stk_commit);
+    }
   }
 }
 
 
+static bool mp_mmap_use_fault_handler(void);
+
+// Decommit the unused end of a gstack (see `mp_gstack_trim`)
+static bool mp_gstack_os_trim(uint8_t* start, ssize_t size) {
+  if (!mp_mmap_use_fault_handler()) {
+    // without a fault handler the pages must stay accessible; we can still release them to the OS
+    if (madvise(start, size, MADV_DONTNEED) != 0) {
+      mp_system_error_message(EINVAL, "failed to reset memory at %p of size %zd\n", start, size);
+    }
+    return false;
+  }
+  if (madvise(start, size, MADV_DONTNEED) != 0 || mprotect(start, size, PROT_NONE) != 0) {
+    mp_system_error_message(EINVAL, "failed to decommit memory at %p of size %zd\n", start, size);
+    return false;
+  }
+  return true;
+}
+
 
 //--------------------------------------------------
 // Init/Done
@@ -293,7 +415,16 @@ static struct sigaction mp_sig_segv_prev_act;
 static struct sigaction mp_sig_bus_prev_act;
 static mp_decl_thread stack_t* mp_sig_stack;  // every thread needs a signal stack in order do demand commit stack pages
 
+// Do we need our signal handler?
+static bool mp_mmap_use_fault_handler(void) {
+  return (os_gstack_heap_size == 0 && (os_use_gpools || !os_use_overcommit || os_gsave_incremental));
+}
+
 static bool mp_mmap_commit_on_demand(void* addr, bool addr_in_other_thread) {
+  // write to a read-only page of a gstack that is tracked for incremental saving?
+  if (mp_gstack_track_fault(addr)) {
+    return true;
+  }
   // demand allocate?
   uint8_t* page = mp_align_down_ptr((uint8_t*)addr, os_page_size);
   ssize_t available = 0;
@@ -318,13 +449,25 @@ static bool mp_mmap_commit_on_demand(void* addr, bool addr_in_other_thread) {
     ssize_t used = stack_size - available;
     if (os_gstack_grow_fast && used > 0) { extra = 2*used; }   // doubling..
     if (extra > 1 * MP_MIB) { extra = 1 * MP_MIB; }            // up to 1MiB growh
+    const bool huge = mp_mmap_use_huge(used);
+    if (huge) { extra = (ssize_t)(page - mp_align_down_ptr(page, MP_HUGE_PAGE_SIZE)); }  // up to the start of the huge page
     if (extra > available) { extra = available; }              // but not more than available
     extra = mp_align_down(extra,os_page_size);
     //mp_trace_message("expand stack: extra: %zd, avail: %zd, used: %d\n", extra, available, used);
     uint8_t* commit_start;
     mp_push(page, extra, &commit_start);
     if (mprotect(commit_start, extra + os_page_size, PROT_READ | PROT_WRITE) == 0) {
-      if (g != NULL) { g->committed = mp_unpush(commit_start, g->stack, g->stack_size ); }
+      if (huge) { mp_mmap_advise_huge(commit_start, extra + os_page_size); }
+      if (g != NULL) { 
+        const ssize_t committed = mp_unpush(commit_start, g->stack, g->stack_size);
+        _mp_stats.committed += committed - g->committed;
+        _mp_stats.faults++;
+        if (extra > 0) { _mp_stats.fast_grows++; }
+        if (huge) { _mp_stats.huge_grows++; }
+        g->grow_count++;
+        g->committed = committed;
+        mp_trace_event(MP_TRACE_GSTACK_GROW, mp_prompt_top(), g, (size_t)committed);
+      }
     };
     return true; 
   }
@@ -382,7 +525,7 @@ static void mp_gpools_thread_done(void) {
 
 // Each thread needs to register an alternative stack for the signal handler to run in.
 static void mp_gpools_thread_init(void) {
-  if (!os_use_gpools && os_use_overcommit) return; // no need for stack for an on-demand commit handler if the OS has overcommit enabled
+  if (!mp_mmap_use_fault_handler()) return; // no need for stack for an on-demand commit handler if the OS has overcommit enabled
 
   // use an alternate signal stack (since we handle stack overflows)
   if (mp_sig_stack == NULL) {    
@@ -432,7 +575,7 @@ static void mp_gpools_process_done(void) {
 // At process initialization we register our page fault handler for gpool on-demand paging.
 static void mp_gpools_process_init(void) {
   mp_gpools_thread_init();
-  if (!os_use_gpools && os_use_overcommit) return; // no need for an on-demand commit handler if the OS has overcommit enabledv
+  if (!mp_mmap_use_fault_handler()) return; // no need for an on-demand commit handler if the OS has overcommit enabled
 
   // install signal handler
   if (mp_sig_segv_prev_act.sa_sigaction == NULL && mp_sig_segv_prev_act.sa_handler == NULL) {
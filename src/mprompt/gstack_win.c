@@ -54,6 +54,32 @@ static uint8_t* mp_os_mem_reserve(ssize_t size) {
   return p;
 }
 
+// Reserve memory whose pages are preferably placed on a NUMA node
+static uint8_t* mp_os_mem_reserve_numa(ssize_t size, int node) {
+  if (node < 0) return mp_os_mem_reserve(size);
+  uint8_t* p = (uint8_t*)VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE, PAGE_NOACCESS, (DWORD)node);
+  if (p == NULL) {
+    p = mp_os_mem_reserve(size);
+  }
+  return p;
+}
+
+// The NUMA node of the calling thread
+static int mp_os_numa_node(void) {
+  PROCESSOR_NUMBER pnum;
+  USHORT node = 0;
+  GetCurrentProcessorNumberEx(&pnum);
+  if (!GetNumaProcessorNodeEx(&pnum, &node)) return -1;
+  return (int)node;
+}
+
+// The number of NUMA nodes
+static int mp_os_numa_node_count(void) {
+  ULONG highest = 0;
+  if (!GetNumaHighestNodeNumber(&highest)) return 1;
+  return (int)highest + 1;
+}
+
 // Free reserved memory
 static void  mp_os_mem_free(uint8_t* p, ssize_t size) {
   MP_UNUSED(size);
@@ -72,19 +98,29 @@ static bool mp_os_mem_commit(uint8_t* start, ssize_t size) {
   return true;
 }
 
+// Change the protection of a committed range of pages 
+static bool mp_os_mem_protect(uint8_t* start, ssize_t size, mp_prot_t prot) {
+  DWORD old_protect;
+  const DWORD flags = (prot == MP_PROT_RW ? PAGE_READWRITE : (prot == MP_PROT_READ ? PAGE_READONLY : PAGE_NOACCESS));
+  if (!VirtualProtect(start, size, flags, &old_protect)) {
+    mp_system_error_message(EINVAL, "failed to protect memory at %p of size %zd\n", start, size);
+    return false;
+  }
+  return true;
+}
 
 // Allocate a gstack
-static uint8_t* mp_gstack_os_alloc(uint8_t** stk, ssize_t* stk_size, ssize_t* initial_commit) {
+static uint8_t* mp_gstack_os_alloc(ssize_t full_size, ssize_t gap_size, uint8_t** stk, ssize_t* stk_size, ssize_t* initial_commit) {
   if (!os_use_gpools) {
     // reserve virtual full stack
-    uint8_t* full = mp_os_mem_reserve(os_gstack_size);
+    uint8_t* full = mp_os_mem_reserve(full_size);
     if (full == NULL) return NULL;
 
-    *stk = full + os_gstack_gap;
-    *stk_size = os_gstack_size - 2 * os_gstack_gap;
+    *stk = full + gap_size;
+    *stk_size = full_size - 2 * gap_size;
     // and initialize the guard page and initial commit
     if (!mp_win_initial_commit(*stk, *stk_size, initial_commit, true)) {
-      mp_os_mem_free(full, os_gstack_size);
+      mp_os_mem_free(full, full_size);
       return NULL;
     }
     //mp_trace_stack_layout(full + os_gstack_size - os_gstack_gap, full + os_gstack_gap);
@@ -92,12 +128,13 @@ static uint8_t* mp_gstack_os_alloc(uint8_t** stk, ssize_t* stk_size, ssize_t* in
   }
   else {
     // Use gpool allocation
-    uint8_t* full = mp_gpool_alloc(stk, stk_size);
+    ssize_t accessible;  // always 0 as we decommit fully on free
+    uint8_t* full = mp_gpool_alloc(full_size, gap_size, stk, stk_size, &accessible);
     if (full == NULL) return NULL;
     
     // and initialize the guard page and initial commit
     if (!mp_win_initial_commit(*stk, *stk_size, initial_commit, true)) {
-      mp_gpool_free(full);
+      mp_gpool_free(full, 0);
       return NULL;
     }
     return full;
@@ -136,10 +173,10 @@ static bool mp_win_initial_commit(uint8_t* stk, ssize_t stk_size, ssize_t* initi
 }
 
 // Free the memory of a gstack
-static void mp_gstack_os_free(uint8_t* full, uint8_t* stk, ssize_t stk_size, ssize_t stk_commit) {
+static void mp_gstack_os_free(uint8_t* full, ssize_t full_size, uint8_t* stk, ssize_t stk_size, ssize_t stk_commit) {
   if (full == NULL) return;
   if (!os_use_gpools) {
-    mp_os_mem_free(full, os_gstack_size);
+    mp_os_mem_free(full, full_size);
   }
   else {
     stk_size   = mp_align_up(stk_size, os_page_size);
@@ -155,10 +192,19 @@ static void mp_gstack_os_free(uint8_t* full, uint8_t* stk, ssize_t stk_size, ssi
     };    
     //mp_trace_message("deallocated gstack:\n");
     //mp_win_trace_stack_layout(mp_base(stk, stk_size), stk);
-    mp_gpool_free(full);
+    mp_gpool_free(full, 0);
   }
 }
 
+// Decommit the unused end of a gstack (see `mp_gstack_trim`)
+static bool mp_gstack_os_trim(uint8_t* start, ssize_t size) {
+  // todo: we would need to set up a fresh guard page at the new commit limit; for now we only reset the memory
+  if (VirtualAlloc(start, size, MEM_RESET, PAGE_READWRITE) == NULL) {
+    mp_system_error_message(EINVAL, "failed to reset memory at %p of size %zd\n", start, size);
+  }
+  return false;
+}
+
 
 // -----------------------------------------------------
 // Initialization
@@ -192,6 +238,9 @@ static bool mp_gstack_os_init(void) {
   GetSystemInfo(&sys_info);
   os_page_size = sys_info.dwPageSize;
 
+  // incremental saves are not supported yet as our exception handler does not handle writes to read-only pages
+  os_gsave_incremental = false;
+
   // remember the system stack
   mp_win_get_stack_extent(NULL, NULL, NULL, &mp_win_main_stack_base);
 
@@ -350,7 +399,15 @@ static LONG WINAPI mp_gstack_win_page_fault(PEXCEPTION_POINTERS ep)
         if (VirtualAlloc(gpage, guard_size, MEM_COMMIT, PAGE_GUARD | PAGE_READWRITE) != NULL) {
           tib->StackLimit = extend;
           tib->StackRealLimit = gpage; 
-          if (g != NULL) { g->committed = mp_unpush(extend, g->stack, g->stack_size); }
+          if (g != NULL) { 
+            const ssize_t committed = mp_unpush(extend, g->stack, g->stack_size);
+            _mp_stats.committed += committed - g->committed;
+            _mp_stats.faults++;
+            if (extra > 0) { _mp_stats.fast_grows++; }
+            g->grow_count++;
+            g->committed = committed; 
+            mp_trace_event(MP_TRACE_GSTACK_GROW, mp_prompt_top(), g, (size_t)committed);
+          }
           //mp_trace_message("expanded stack: extra: %zdk, available: %zdk, stack_size: %zdk, used: %zdk\n", extra/1024, available/1024, g->stack_size/1024, used/1024);
           //mp_win_trace_stack_layout(tib->StackBase, tib->StackBase - g->stack_size);
           return (exncode!=MP_CPP_EXN ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH);
@@ -11,3 +11,4 @@
 #include "mprompt.c"
 #include "gstack.c"
 #include "util.c"
+#include "generator.c"
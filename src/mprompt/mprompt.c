@@ -14,6 +14,7 @@
 #include "internal/util.h"
 #include "internal/longjmp.h"
 #include "internal/gstack.h"
+#include "internal/atomic.h"
 
 #ifdef __cplusplus
 #include <exception>
@@ -29,12 +30,14 @@ typedef enum mp_return_kind_e {
   MP_RETURN,         // normal return
   MP_EXCEPTION,      // return with an exception
   MP_YIELD,          // yielded up
+  MP_YIELDX,         // yielded up with multiple arguments
 } mp_return_kind_t;
 
 
 typedef struct mp_resume_point_s {   // allocated on the suspended stack (which performed a yield)
   mp_jmpbuf_t        jmp;     
   void*              result;  // the yield result (= resume argument)
+  void*              result1; // the second result (see `mp_yieldx`)
 } mp_resume_point_t;
 
 typedef struct mp_return_point_s {   // allocated on the parent stack (which performed an enter/resume)
@@ -42,6 +45,9 @@ typedef struct mp_return_point_s {   // allocated on the parent stack (which per
   mp_return_kind_t   kind;    
   mp_yield_fun_t*    fun;     // if yielding, the function to execute
   void*              arg;     // if yielding, the argument to the function; if returning, the result.
+  mp_yieldx_fun_t*   funx;    // if yielding with `mp_yieldx`, the function to execute with `arg` and `xargs` as its arguments
+  void*              xargs[3];
+  mp_prompt_t*       prompt;  // the prompt that yielded or returned (which differs from the resumed one after a transfer)
   #ifdef __cplusplus
   std::exception_ptr exn;     // returning with an exception to propagate
   #endif
@@ -70,6 +76,9 @@ struct mp_prompt_s {
 
   void*              sp;            // security: contains the (guarded) expected stack pointer for a return (if active) or resume (if suspended)
   mp_unwind_frame_t* unwind_frame;  // used to aid with unwinding on some platforms (windows only for now)
+  mp_prompt_site_t*  site;          // call site that learns the committed stack size (or NULL)
+  mp_prompt_profile_t profile;      // accounted if `prompt_profile` is enabled
+  unsigned long long  profile_start;// ticks at the start of the current run (or 0 if not running)
 };
 
 
@@ -129,15 +138,93 @@ static mp_resume_t* mp_resume_as_multi(mp_mresume_t* r) {
 }
 
 
+//-----------------------------------------------------------------------
+// Thread-local pools for the small fixed-size objects used by multi-shot
+// resumptions (`mp_mresume_t` and `mp_prompt_save_t`). Objects can be freed 
+// to any thread, and each pool keeps at most `MP_POOL_MAX_COUNT` objects.
+//-----------------------------------------------------------------------
+
+#define MP_POOL_MAX_COUNT  (64)
+
+typedef struct mp_pool_block_s {
+  struct mp_pool_block_s* next;
+} mp_pool_block_t;
+
+typedef struct mp_pool_s {
+  mp_pool_block_t* free;
+  ssize_t          count;
+} mp_pool_t;
+
+static mp_decl_thread mp_pool_t _mp_mresume_pool;
+static mp_decl_thread mp_pool_t _mp_prompt_save_pool;
+
+static void* mp_pool_alloc(mp_pool_t* pool, size_t size) {
+  mp_pool_block_t* b = pool->free;
+  if (mp_likely(b != NULL)) {
+    pool->free = b->next;
+    pool->count--;
+    return b;
+  }
+  return mp_malloc_safe(size);
+}
+
+static void mp_pool_free(mp_pool_t* pool, void* p) {
+  if (mp_unlikely(pool->count >= MP_POOL_MAX_COUNT)) {
+    mp_free(p);
+    return;
+  }
+  mp_pool_block_t* b = (mp_pool_block_t*)p;
+  b->next = pool->free;
+  pool->free = b;
+  pool->count++;
+}
+
+static void mp_pool_clear(mp_pool_t* pool) {
+  mp_pool_block_t* b = pool->free;
+  while (b != NULL) {
+    mp_pool_block_t* next = b->next;
+    mp_free(b);
+    b = next;
+  }
+  pool->free = NULL;
+  pool->count = 0;
+}
+
+#define mp_pool_alloc_tp(pool,tp)  (tp*)mp_pool_alloc(pool,sizeof(tp))
+
+// called on thread termination (from `gstack.c`)
+void mp_prompt_thread_done(void) {
+  mp_pool_clear(&_mp_mresume_pool);
+  mp_pool_clear(&_mp_prompt_save_pool);
+}
+
+
 //-----------------------------------------------------------------------
 // Initialize
 //-----------------------------------------------------------------------
 
+// Flags for the register context at each switch (see `longjmp.h`)
+static uint16_t mp_jmpbuf_flags;
+
+// Trim the gstack at every yield? (see `mp_prompt_trim`)
+static bool mp_trim_on_yield;
+
+// Account the running time of prompts? (see `mp_prompt_profile`)
+static bool mp_profile_enabled;
+
 void mp_init(const mp_config_t* config) {
+  mp_jmpbuf_flags = (config != NULL && config->context_switch_lite ? MP_JMPBUF_LITE : 0);
+  mp_trim_on_yield = (config != NULL && config->stack_trim_on_yield);
+  mp_profile_enabled = (config != NULL && config->prompt_profile);
   mp_guard_init();
+  mp_allocator_init(config);
   mp_gstack_init(config);
 }
 
+void mp_thread_init(void) {
+  mp_gstack_init(NULL);
+}
+
 
 //-----------------------------------------------------------------------
 // Prompt chain
@@ -147,7 +234,9 @@ void mp_init(const mp_config_t* config) {
 mp_decl_thread mp_prompt_t* _mp_prompt_top;
 
 // get the top of the prompt chain
-mp_prompt_t* mp_prompt_top(void) {  
+// (not inlined so it is always read on the current thread, even right after resuming a prompt 
+//  that was suspended on another thread)
+mp_decl_noinline mp_prompt_t* mp_prompt_top(void) {  
   return _mp_prompt_top;
 }
 
@@ -181,9 +270,15 @@ static bool mp_prompt_is_ancestor(mp_prompt_t* p) {
 
 // Allocate a fresh (suspended) prompt
 mp_prompt_t* mp_prompt_create(void) {
+  return mp_prompt_create_ex(0, 0);
+}
+
+// Create a fresh prompt in a gstack of the size class that fits `size_hint`, 
+// and commit at least `commit_hint` bytes of it up front.
+mp_prompt_t* mp_prompt_create_ex(size_t size_hint, size_t commit_hint) {
   // allocate a fresh growable stack
   mp_prompt_t* p;
-  mp_gstack_t* gstack = mp_gstack_alloc(sizeof(mp_prompt_t), (void**)&p);
+  mp_gstack_t* gstack = mp_gstack_alloc((size_hint > PTRDIFF_MAX ? PTRDIFF_MAX : (ssize_t)size_hint), sizeof(mp_prompt_t), (void**)&p);
   if (gstack == NULL) { mp_fatal_message(ENOMEM, "unable to allocate a stack\n"); }
   // allocate the prompt structure at the base of the new stack
   p->parent = NULL;
@@ -193,22 +288,110 @@ mp_prompt_t* mp_prompt_create(void) {
   p->resume_point = NULL;
   p->return_point = NULL;
   p->unwind_frame = NULL;
+  p->site = NULL;
+  memset(&p->profile, 0, sizeof(p->profile));
+  p->profile_start = 0;
+  if (commit_hint > 0) {
+    mp_gstack_commit(gstack, (commit_hint > PTRDIFF_MAX ? PTRDIFF_MAX : (ssize_t)commit_hint));
+  }
+  mp_trace_event(MP_TRACE_PROMPT_CREATE, p, gstack, 0);
   return p;
 }
 
+
+//-----------------------------------------------------------------------
+// Call sites that learn the committed stack size of their prompts.
+// The commit size is the high-water mark of the committed size of freed 
+// prompts, which decays by half every `MP_PROMPT_SITE_WINDOW` prompts (as a 
+// prompt that was committed up front never faults, the decay lets us notice 
+// when less stack is needed). A site may be shared among threads: we use separate 
+// atomic loads and stores as a lost update only affects the hint.
+//-----------------------------------------------------------------------
+
+#define MP_PROMPT_SITE_WINDOW  (64)
+
+mp_prompt_t* mp_prompt_create_at(mp_prompt_site_t* site, size_t size_hint) {
+  mp_prompt_t* p = mp_prompt_create_ex(size_hint, (site == NULL ? 0 : (size_t)mp_atomic_load((_Atomic(intptr_t)*)&site->commit)));
+  p->site = site;
+  return p;
+}
+
+static void mp_prompt_site_learn(mp_prompt_site_t* site, ssize_t committed) {
+  _Atomic(intptr_t)* pcommit = (_Atomic(intptr_t)*)&site->commit;
+  _Atomic(intptr_t)* pcount = (_Atomic(intptr_t)*)&site->count;
+  intptr_t commit = mp_atomic_load(pcommit);
+  const intptr_t count = mp_atomic_load(pcount) + 1;
+  if (count >= MP_PROMPT_SITE_WINDOW) {
+    commit /= 2;
+    mp_atomic_store(pcount, (intptr_t)0);
+  }
+  else {
+    mp_atomic_store(pcount, count);
+  }
+  mp_atomic_store(pcommit, mp_max(commit, (intptr_t)committed));
+}
+
+
+//-----------------------------------------------------------------------
+// Trim the gstacks of a prompt chain beyond their stack pointers
+//-----------------------------------------------------------------------
+
+static mp_decl_noinline uint8_t* mp_stack_addr(volatile uint8_t* p) {
+  return (uint8_t*)p;
+}
+
+static mp_decl_noinline uint8_t* mp_current_sp(void) {
+  volatile uint8_t b = 0;
+  return mp_stack_addr(&b);
+}
+
+size_t mp_prompt_trim(mp_prompt_t* p) {
+  if (p == NULL) { p = mp_prompt_top(); }
+  if (p == NULL) return 0;
+  // start at the top of the chain with its stack pointer
+  mp_prompt_t* q;
+  const uint8_t* sp;
+  if (p->top != NULL) {
+    // suspended: the top prompt is at its resume point
+    q = p->top;
+    sp = (const uint8_t*)p->resume_point->jmp.reg_sp;
+  }
+  else {
+    // active: we are running at the current top
+    mp_assert(mp_prompt_is_ancestor(p));
+    q = _mp_prompt_top;
+    sp = mp_current_sp();
+  }
+  // and walk down to `p`; each parent is at the return point of its child
+  size_t trimmed = 0;
+  while (q != NULL) {
+    trimmed += (size_t)mp_gstack_trim(q->gstack, sp, true);
+    if (q == p) break;
+    sp = (const uint8_t*)q->return_point->jmp.reg_sp;
+    q = q->parent;
+  }
+  return trimmed;
+}
+
+size_t mp_resume_trim(mp_resume_t* resume) {
+  mp_prompt_t* p = mp_resume_is_once(resume);
+  if (p == NULL) { p = mp_resume_is_multi(resume)->prompt; }  // note: do not restore a saved stack
+  return (p->top != NULL ? mp_prompt_trim(p) : 0);
+}
+
 // Free a prompt and drop its children
 static void mp_prompt_free(mp_prompt_t* p, bool delay) {
   mp_assert_internal(!mp_prompt_is_active(p));
-  p = p->top;
-  while (p != NULL) {
-    mp_assert_internal(p->refcount == 0);
-    mp_prompt_t* parent = p->parent;    
-    mp_gstack_free(p->gstack, delay);
-    if (parent != NULL) {
-      mp_assert_internal(parent->refcount == 1);
-      parent->refcount--;
-    }
-    p = parent;
+  mp_assert_internal(p->refcount == 0);
+  mp_prompt_t* q = p->top;
+  while (q != NULL) {
+    // the prompts in the suspended chain below `p` are only referenced by their parent
+    mp_assert_internal(q == p || q->refcount == 1);
+    mp_prompt_t* parent = q->parent;    
+    mp_trace_event(MP_TRACE_PROMPT_FREE, q, q->gstack, 0);
+    if (q->site != NULL) { mp_prompt_site_learn(q->site, mp_gstack_committed(q->gstack)); }
+    mp_gstack_free(q->gstack, delay);
+    q = parent;
   }
 }
 
@@ -236,12 +419,91 @@ static mp_prompt_t* mp_prompt_dup(mp_prompt_t* p) {
   return p;
 }
 
+//-----------------------------------------------------------------------
+// Profiling
+//-----------------------------------------------------------------------
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#elif !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+#include <time.h>
+#endif
+
+unsigned long long mp_profile_ticks(void) {
+  #if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  return __builtin_ia32_rdtsc();
+  #elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  return __rdtsc();
+  #elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+  unsigned long long t;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+  #elif defined(_WIN32)
+  LARGE_INTEGER t;
+  QueryPerformanceCounter(&t);
+  return (unsigned long long)t.QuadPart;
+  #else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((unsigned long long)t.tv_sec * 1000000000ULL + (unsigned long long)t.tv_nsec);
+  #endif
+}
+
+static void mp_prompt_profile_sample(mp_prompt_t* q) {
+  const size_t committed = (size_t)mp_gstack_committed(q->gstack);
+  if (committed > q->profile.stack_peak) { q->profile.stack_peak = committed; }
+  q->profile.stack_grows = (size_t)mp_gstack_grow_count(q->gstack);
+}
+
+// Start running the suspended chain from its `top` down to `p` 
+static mp_decl_noinline void mp_prompt_profile_start(mp_prompt_t* p) {
+  const unsigned long long now = mp_profile_ticks();
+  if (p->resume_point != NULL) { p->profile.resumes++; }
+  for (mp_prompt_t* q = p->top; q != NULL; q = (q == p ? NULL : q->parent)) {
+    q->profile_start = now;
+  }
+}
+
+// Stop running the active chain from the current top down to `p` 
+static mp_decl_noinline void mp_prompt_profile_stop(mp_prompt_t* p) {
+  const unsigned long long now = mp_profile_ticks();
+  for (mp_prompt_t* q = _mp_prompt_top; q != NULL; q = (q == p ? NULL : q->parent)) {
+    if (q->profile_start != 0) {
+      q->profile.ticks += now - q->profile_start;
+      q->profile_start = 0;
+    }
+    mp_prompt_profile_sample(q);
+  }
+}
+
+bool mp_prompt_profile(mp_prompt_t* p, mp_prompt_profile_t* profile) {
+  if (p == NULL) { p = mp_prompt_top(); }
+  if (!mp_profile_enabled || p == NULL) {
+    memset(profile, 0, sizeof(*profile));
+    return false;
+  }
+  mp_prompt_profile_sample(p);
+  *profile = p->profile;
+  if (p->profile_start != 0) {
+    profile->ticks += mp_profile_ticks() - p->profile_start;
+  }
+  return true;
+}
+
 // Link a suspended prompt to the current prompt chain and set the new prompt top
 static inline mp_resume_point_t* mp_prompt_link(mp_prompt_t* p, mp_return_point_t* ret, void** sp) {
   mp_assert_internal(ret != NULL);
   mp_assert_internal(!mp_prompt_is_active(p));
+  mp_trace_event((p->resume_point == NULL ? MP_TRACE_PROMPT_ENTER : MP_TRACE_RESUME), p, p->gstack, 0);
+  if (mp_unlikely(mp_profile_enabled)) { mp_prompt_profile_start(p); }
   *sp = p->sp;
-  p->parent = mp_prompt_top();
+  p->parent = _mp_prompt_top;
+  if (mp_unlikely(p->parent == NULL)) {
+    // resuming from the system stack; the prompt may be created on another thread so ensure this thread is initialized
+    mp_gstack_init(NULL);
+  }
   _mp_prompt_top = p->top;
   p->top = NULL;
   if (mp_likely(ret != NULL)) { 
@@ -258,11 +520,14 @@ static inline mp_resume_point_t* mp_prompt_link(mp_prompt_t* p, mp_return_point_
 static inline mp_return_point_t* mp_prompt_unlink(mp_prompt_t* p, mp_resume_point_t* res, void** sp) {
   mp_assert_internal(mp_prompt_is_active(p));
   mp_assert_internal(mp_prompt_is_ancestor(p)); // ancestor of current top?
+  if (res != NULL) { mp_trace_event(MP_TRACE_YIELD, p, p->gstack, 0); }
+  if (mp_unlikely(mp_profile_enabled)) { mp_prompt_profile_stop(p); }
   *sp = p->sp;
-  p->top = mp_prompt_top();
+  p->top = _mp_prompt_top;
   _mp_prompt_top = p->parent;
   p->parent = NULL;  
   p->resume_point = res;
+  p->return_point->prompt = p;
   if (mp_likely(res != NULL)) {   // on return/exception
     p->sp = mp_guard(res->jmp.reg_sp);
   }
@@ -276,13 +541,17 @@ static inline mp_return_point_t* mp_prompt_unlink(mp_prompt_t* p, mp_resume_poin
 //-----------------------------------------------------------------------
 // Checked longjmp
 // We use a form of control-flow integrity by only allowing
-// a longjmp to two known code locations (one for resume, and one for return)
+// a longjmp to four known code locations (two for resume, and two for return)
 //-----------------------------------------------------------------------
 
-// The code addresses are initialized on the first call to setjmp (and are located right after the setjmp call)
+// The code addresses are initialized on the first call to setjmp (and are located right after the setjmp call);
+// the functions that contain these setjmp's are `mp_decl_noclone` so there is just one such location for each.
 // todo: can we make this static so these go to the readonly section? 
 static void* mp_return_label;
+static void* mp_return_batch_label;   // return point in `mp_resume_batch`
 static void* mp_resume_label;
+static void* mp_resume_transfer_label; // resume point in `mp_resume_transfer`
+static void* mp_resumex_label;         // resume point in `mp_yieldx`
 
 
 // Checked longjmp to a known location (with a known stack pointer)
@@ -297,6 +566,19 @@ static mp_decl_noreturn void mp_checked_longjmp(void* label, void* sp, mp_jmpbuf
   mp_longjmp(jmp); 
 }
 
+// Checked longjmp to a return point (in either `mp_prompt_resume` or `mp_resume_batch`)
+static mp_decl_noreturn void mp_return_longjmp(void* sp, mp_jmpbuf_t* jmp) {
+  void* label = (mp_likely(mp_unguard(mp_return_label) == jmp->reg_ip) ? mp_return_label : mp_return_batch_label);
+  mp_checked_longjmp(label, sp, jmp);
+}
+
+// Checked longjmp to a resume point (in either `mp_yield`, `mp_yieldx`, or `mp_resume_transfer`)
+static mp_decl_noreturn void mp_resume_longjmp(void* sp, mp_jmpbuf_t* jmp) {
+  void* label = (mp_likely(mp_unguard(mp_resume_label) == jmp->reg_ip) ? mp_resume_label : 
+                 (mp_unguard(mp_resumex_label) == jmp->reg_ip ? mp_resumex_label : mp_resume_transfer_label));
+  mp_checked_longjmp(label, sp, jmp);
+}
+
 
 //-----------------------------------------------------------------------
 // Create an initial prompt
@@ -339,7 +621,7 @@ static  void mp_prompt_stack_entry(void* penv, mp_unwind_frame_t* unwind_frame)
     ret->kind = MP_EXCEPTION;
   }
   #endif  
-  mp_checked_longjmp(mp_return_label, sp, &ret->jmp);
+  mp_return_longjmp(sp, &ret->jmp);
 }
 
 
@@ -350,6 +632,9 @@ static mp_decl_noinline void* mp_prompt_exec_yield_fun(mp_return_point_t* ret, m
   if (ret->kind == MP_YIELD) {
     return (ret->fun)(mp_resume_as_once(p), ret->arg);
   }
+  else if (ret->kind == MP_YIELDX) {
+    return (ret->funx)(mp_resume_as_once(p), ret->arg, ret->xargs[0], ret->xargs[1], ret->xargs[2]);
+  }
   else if (ret->kind == MP_RETURN) {
     void* result = ret->arg;
     mp_prompt_drop(p);
@@ -369,15 +654,16 @@ static mp_decl_noinline void* mp_prompt_exec_yield_fun(mp_return_point_t* ret, m
 
 
 // Resume a prompt: used for the initial entry as well as for resuming in a suspended prompt.
-static mp_decl_noinline void* mp_prompt_resume(mp_prompt_t * p, void* arg) {
+static mp_decl_noclone void* mp_prompt_resume(mp_prompt_t * p, void* arg, void* arg1) {
   mp_return_point_t ret;    
   // save our return location for yields and regular return  
+  ret.jmp.context_flags = mp_jmpbuf_flags;
   if (mp_setjmp(&ret.jmp)) {
     //mp_return_label:
     // P: return from yield (YR), or a regular return (RET)
     // printf("%s to prompt %p\n", (ret.kind == MP_RETURN ? "returned" : "yielded"), p);    
     mp_debug_asan_end_switch(false);
-    return mp_prompt_exec_yield_fun(&ret, p);  // must be under the setjmp to preserve the stack
+    return mp_prompt_exec_yield_fun(&ret, ret.prompt);  // must be under the setjmp to preserve the stack
   }
   else {
     // security: longjmp can only jump to a known code point
@@ -391,7 +677,8 @@ static mp_decl_noinline void* mp_prompt_resume(mp_prompt_t * p, void* arg) {
     if (res != NULL) {
       // PR: resume to yield point
       res->result = arg;
-      mp_checked_longjmp(mp_resume_label, sp, &res->jmp);
+      res->result1 = arg1;
+      mp_resume_longjmp(sp, &res->jmp);
     }
     else {
       // PI: initial entry, switch to the new stack with an initial function      
@@ -407,7 +694,7 @@ void* mp_prompt_enter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg) {
   env.prompt = p;
   env.fun = fun;
   env.arg = arg;
-  return mp_prompt_resume(p, &env);
+  return mp_prompt_resume(p, &env, NULL);
 }
 
 // Install a fresh prompt `p` with a growable stack and start running `fun(p,arg)` on it.
@@ -423,45 +710,64 @@ void* mp_prompt(mp_start_fun_t* fun, void* arg) {
 //-----------------------------------------------------------------------
 
 // Forwards for multi-shot resumptions
-static void* mp_mresume(mp_mresume_t* r, void* arg);
-static void* mp_mresume_tail(mp_mresume_t* r, void* arg);
+static void* mp_mresume(mp_mresume_t* r, void* arg, void* arg1);
+static void* mp_mresume_tail(mp_mresume_t* r, void* arg, void* arg1);
 static void  mp_mresume_drop(mp_mresume_t* r);
 static mp_mresume_t* mp_mresume_dup(mp_mresume_t* r);
+static mp_prompt_t*  mp_resume_get_prompt(mp_mresume_t* r);
 
 
 // Resume 
 void* mp_resume(mp_resume_t* resume, void* arg) {
   mp_prompt_t* p = mp_resume_is_once(resume);
-  if (mp_unlikely(p == NULL)) return mp_mresume(mp_resume_is_multi(resume), arg);
+  if (mp_unlikely(p == NULL)) return mp_mresume(mp_resume_is_multi(resume), arg, NULL);
+  mp_assert_internal(p->refcount == 1);
+  mp_assert_internal(p->resume_point != NULL);
+  return mp_prompt_resume(p, arg, NULL);  // resume back to yield point
+}
+
+// Resume with two results (see `mp_yieldx`)
+void* mp_resumex(mp_resume_t* resume, void* result0, void* result1) {
+  mp_prompt_t* p = mp_resume_is_once(resume);
+  if (mp_unlikely(p == NULL)) return mp_mresume(mp_resume_is_multi(resume), result0, result1);
   mp_assert_internal(p->refcount == 1);
   mp_assert_internal(p->resume_point != NULL);
-  return mp_prompt_resume(p, arg);  // resume back to yield point
+  return mp_prompt_resume(p, result0, result1);
 }
 
 // Resume in tail position to a prompt `p`
 // Uses longjmp back to the `return_jump` as if it is yielding; this
 // makes the tail-recursion use no stack as they keep getting back (P)
 // and then into the exec_yield_fun function.
-static void* mp_prompt_resume_tail(mp_prompt_t* p, void* arg, mp_return_point_t* ret) {
+static void* mp_prompt_resume_tail(mp_prompt_t* p, void* arg, void* arg1, mp_return_point_t* ret) {
   mp_assert_internal(p->refcount == 1);
   mp_assert_internal(!mp_prompt_is_active(p));
   mp_assert_internal(p->resume_point != NULL);
   void* sp;
   mp_resume_point_t* res = mp_prompt_link(p,ret,&sp);   // make active using the given return point!
   res->result = arg;
-  mp_checked_longjmp(mp_resume_label, sp, &res->jmp);
+  res->result1 = arg1;
+  mp_resume_longjmp(sp, &res->jmp);
 }
 
 
 // Resume in tail position (last and only resume in scope)
 void* mp_resume_tail(mp_resume_t* resume, void* arg) {
   mp_prompt_t* p = mp_resume_is_once(resume);
-  if (mp_unlikely(p == NULL)) return mp_mresume_tail(mp_resume_is_multi(resume), arg);
-  return mp_prompt_resume_tail(p, arg, p->return_point);  // reuse return-point of the original entry
+  if (mp_unlikely(p == NULL)) return mp_mresume_tail(mp_resume_is_multi(resume), arg, NULL);
+  return mp_prompt_resume_tail(p, arg, NULL, p->return_point);  // reuse return-point of the original entry
+}
+
+// Resume in tail position with two results (see `mp_yieldx`)
+void* mp_resumex_tail(mp_resume_t* resume, void* result0, void* result1) {
+  mp_prompt_t* p = mp_resume_is_once(resume);
+  if (mp_unlikely(p == NULL)) return mp_mresume_tail(mp_resume_is_multi(resume), result0, result1);
+  return mp_prompt_resume_tail(p, result0, result1, p->return_point);
 }
 
 void mp_resume_drop(mp_resume_t* resume) {
   mp_prompt_t* p = mp_resume_is_once(resume);
+  mp_trace_event(MP_TRACE_RESUME_DROP, (p != NULL ? p : mp_resume_is_multi(resume)->prompt), NULL, 0);
   if (mp_unlikely(p == NULL)) return mp_mresume_drop(mp_resume_is_multi(resume));
   mp_prompt_drop(p);
 }
@@ -496,11 +802,12 @@ int mp_resume_should_unwind(mp_resume_t* resume) {
 
 
 // Yield back to a prompt with a `mp_resume_once_t` resumption and run `fun(arg)` at the yield point
-void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
+mp_decl_noclone void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
   mp_assert(mp_prompt_is_ancestor(p));           // can only yield up to an ancestor
   mp_assert_internal(mp_prompt_is_active(p));    // can only yield to an active prompt
   // set our resume point (Y)
   mp_resume_point_t res;
+  res.jmp.context_flags = mp_jmpbuf_flags;
   if (mp_setjmp(&res.jmp)) {
     //mp_resume_label:
     // Y: resuming with a result (from PR)
@@ -515,12 +822,90 @@ void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
       mp_resume_label = mp_guard(res.jmp.reg_ip);
     }
     // YR: yielding to prompt, or resumed prompt (P)
+    if (mp_unlikely(mp_trim_on_yield)) { mp_gstack_trim(_mp_prompt_top->gstack, (const uint8_t*)res.jmp.reg_sp, false); }
     void* sp;
     mp_return_point_t* ret = mp_prompt_unlink(p, &res, &sp);
     ret->fun = fun;
     ret->arg = arg;
     ret->kind = MP_YIELD;
-    mp_checked_longjmp(mp_return_label, sp, &ret->jmp);
+    mp_return_longjmp(sp, &ret->jmp);
+  }
+}
+
+// Yield back to a prompt and run `fun(r,arg0,arg1,arg2,arg3)` at the yield point; the arguments and
+// results are passed in the return and resume points directly.
+mp_decl_noclone void* mp_yieldx(mp_prompt_t* p, mp_yieldx_fun_t* fun, void* arg0, void* arg1, void* arg2, void* arg3, void** result1) {
+  mp_assert(mp_prompt_is_ancestor(p));
+  mp_assert_internal(mp_prompt_is_active(p));
+  mp_resume_point_t res;
+  res.jmp.context_flags = mp_jmpbuf_flags;
+  if (mp_setjmp(&res.jmp)) {
+    //mp_resumex_label:
+    // Y: resuming with two results (from PR)
+    mp_assert_internal(mp_prompt_is_active(p));
+    mp_assert_internal(mp_prompt_is_ancestor(p));
+    mp_debug_asan_end_switch(p->parent==NULL);
+    if (result1 != NULL) *result1 = res.result1;
+    return res.result;
+  }
+  else {
+    if (mp_unlikely(mp_resumex_label == NULL)) {
+      mp_resumex_label = mp_guard(res.jmp.reg_ip);
+    }
+    if (mp_unlikely(mp_trim_on_yield)) { mp_gstack_trim(_mp_prompt_top->gstack, (const uint8_t*)res.jmp.reg_sp, false); }
+    void* sp;
+    mp_return_point_t* ret = mp_prompt_unlink(p, &res, &sp);
+    ret->funx = fun;
+    ret->arg = arg0;
+    ret->xargs[0] = arg1;
+    ret->xargs[1] = arg2;
+    ret->xargs[2] = arg3;
+    ret->kind = MP_YIELDX;
+    mp_return_longjmp(sp, &ret->jmp);
+  }
+}
+
+
+
+// Switch directly from the current computation under `p` to the suspended `target`:
+// `p` is unlinked as if yielding, and `target` is linked in its place reusing the return point
+// of `p` in the parent. The parent finds the prompt that eventually returns in `ret->prompt`.
+mp_decl_noclone void* mp_resume_transfer(mp_prompt_t* p, mp_resume_t** from, mp_resume_t* target, void* arg) {
+  mp_assert(mp_prompt_is_ancestor(p));           // can only transfer from under an ancestor
+  mp_assert_internal(mp_prompt_is_active(p));
+  mp_prompt_t* q = mp_resume_is_once(target);
+  if (mp_likely(q != NULL)) {
+    mp_assert_internal(q->refcount == 1);
+  }
+  else {
+    mp_mresume_t* r = mp_resume_is_multi(target);
+    r->resume_count++;
+    q = mp_resume_get_prompt(r);
+  }
+  mp_assert(q->parent == NULL && q->resume_point != NULL);  // can only transfer to a suspended prompt
+  // set our resume point (Y)
+  mp_resume_point_t res;
+  res.jmp.context_flags = mp_jmpbuf_flags;
+  if (mp_setjmp(&res.jmp)) {
+    //mp_resume_transfer_label:
+    // Y: resuming with a result
+    mp_assert_internal(mp_prompt_is_active(p));
+    mp_assert_internal(mp_prompt_is_ancestor(p));
+    mp_debug_asan_end_switch(p->parent==NULL);
+    return res.result;
+  }
+  else {
+    if (mp_unlikely(mp_resume_transfer_label == NULL)) {
+      mp_resume_transfer_label = mp_guard(res.jmp.reg_ip);
+    }
+    // suspend up to `p` and resume `q` in its place (PR)
+    void* sp;
+    mp_return_point_t* ret = mp_prompt_unlink(p, &res, &sp);
+    *from = mp_resume_as_once(p);
+    mp_resume_point_t* qres = mp_prompt_link(q, ret, &sp);
+    qres->result = arg;
+    qres->result1 = NULL;
+    mp_resume_longjmp(sp, &qres->jmp);
   }
 }
 
@@ -534,7 +919,7 @@ void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
 mp_resume_t* mp_resume_multi(mp_resume_t* once) {
   mp_prompt_t* p = mp_resume_is_once(once);
   if (p == NULL) return once; // already multi-shot
-  mp_mresume_t* r = mp_malloc_safe_tp(mp_mresume_t);
+  mp_mresume_t* r = mp_pool_alloc_tp(&_mp_mresume_pool, mp_mresume_t);
   r->prompt = p;
   r->refcount = 1;
   r->resume_count = 0;
@@ -559,13 +944,13 @@ static void mp_mresume_drop(mp_mresume_t* r) {
       mp_prompt_save_t* next = s->next;
       mp_prompt_t* p = s->prompt;
       mp_gsave_free(s->gsave);
-      mp_free(s);
+      mp_pool_free(&_mp_prompt_save_pool, s);
       mp_prompt_drop(p);
       s = next;
     }
     mp_prompt_drop(r->prompt);
     //mp_trace_message("free resume: %p\n", r);
-    mp_free(r);
+    mp_pool_free(&_mp_mresume_pool, r);
   }
 }
 
@@ -577,7 +962,7 @@ static mp_prompt_save_t* mp_prompt_save(mp_prompt_t* p) {
   uint8_t* sp = (uint8_t*)p->resume_point->jmp.reg_sp;
   p = p->top;
   do {
-    mp_prompt_save_t* save = mp_malloc_tp(mp_prompt_save_t);
+    mp_prompt_save_t* save = mp_pool_alloc_tp(&_mp_prompt_save_pool, mp_prompt_save_t);
     save->prompt = mp_prompt_dup(p);
     save->next = savep;
     save->gsave = mp_gstack_save(p->gstack,sp);
@@ -618,25 +1003,569 @@ static mp_prompt_t* mp_resume_get_prompt(mp_mresume_t* r) {
 
 
 // Resume with a regular resumption (and consumes `r` so dup if it needs to used later on)
-static void* mp_mresume(mp_mresume_t* r, void* arg) {
+static void* mp_mresume(mp_mresume_t* r, void* arg, void* arg1) {
   r->resume_count++;
   mp_prompt_t* p = mp_resume_get_prompt(r);
-  return mp_prompt_resume(p, arg);  // set a fresh prompt 
+  return mp_prompt_resume(p, arg, arg1);  // set a fresh prompt 
 }
 
 // Resume in tail position 
 // Note: this only works if all earlier resumes were in-scope -- which should hold
 // or otherwise the tail resumption wasn't in tail position anyways.
-static void* mp_mresume_tail(mp_mresume_t* r, void* arg) {
+static void* mp_mresume_tail(mp_mresume_t* r, void* arg, void* arg1) {
   mp_return_point_t* ret = r->tail_return_point;
   if (ret == NULL) {
-    return mp_mresume(r, arg);  // resume normally as the return_point may not be preserved correctly
+    return mp_mresume(r, arg, arg1);  // resume normally as the return_point may not be preserved correctly
   }
   else {
     r->tail_return_point = NULL;                    // todo: do we need `sp` as well?
     r->resume_count++;
     mp_prompt_t* p = mp_resume_get_prompt(r);       
-    return mp_prompt_resume_tail(p, arg, ret);      // resume tail by reusing the original entry return point
+    return mp_prompt_resume_tail(p, arg, arg1, ret); // resume tail by reusing the original entry return point
+  }
+}
+
+
+//-----------------------------------------------------------------------
+// Cloning a resumption onto fresh gstacks
+//
+// Each gstack in the suspended chain is copied into a fresh gstack at the same
+// offset from its base. Any word on the copied stacks (and in the copied prompt
+// structures) that points into the used part of an original stack, or into an
+// original prompt structure, is then relocated to the copy. This covers the 
+// resume and return points of the chain, saved frame pointers, pointers to locals,
+// and references to the prompts themselves (like `mp_prompt_stack_entry`). 
+//-----------------------------------------------------------------------
+
+typedef struct mp_clone_area_s {
+  uintptr_t    start;     // used part of the original gstack
+  uintptr_t    end;       // (inclusive so the base itself is relocated as well)
+  ptrdiff_t    delta;     // distance to the clone 
+  uintptr_t    from;      // the original prompt
+  mp_prompt_t* to;        // and its clone
+  uint8_t*     copy;      // the copied area in the clone
+  ssize_t      size;
+} mp_clone_area_t;
+
+typedef struct mp_reloc_s {
+  mp_clone_area_t* areas;
+  ssize_t          count;
+  uintptr_t        image_start;   // code and static data of the original binary (when restoring a snapshot)
+  uintptr_t        image_end;
+  ptrdiff_t        image_delta;   
+  uintptr_t        guard_from;    // stack protector canary (when restoring a snapshot)
+  uintptr_t        guard_to;      
+} mp_reloc_t;
+
+static void* mp_reloc_word(void* x, const mp_reloc_t* rel) {
+  const uintptr_t u = (uintptr_t)x;
+  for (ssize_t i = 0; i < rel->count; i++) {
+    const mp_clone_area_t* a = &rel->areas[i];
+    if (u >= a->start && u <= a->end) {
+      return (void*)(u + a->delta);
+    }
+    if (u >= a->from && u < a->from + sizeof(mp_prompt_t)) {
+      return (void*)((uintptr_t)a->to + (u - a->from));
+    }
+  }
+  if (rel->image_delta != 0 && u >= rel->image_start && u < rel->image_end) {
+    return (void*)(u + rel->image_delta);
+  }
+  if (rel->guard_from != rel->guard_to && u == rel->guard_from) {
+    return (void*)rel->guard_to;
+  }
+  return x;
+}
+
+// Relocate the copied stacks and the prompt fields (where `sp` is still unguarded)
+#if MP_USE_ASAN
+__attribute__((no_sanitize("address")))
+#endif
+static mp_prompt_t* mp_reloc_chain(const mp_reloc_t* rel) {
+  for (ssize_t i = 0; i < rel->count; i++) {
+    const mp_clone_area_t* a = &rel->areas[i];
+    void** w = (void**)mp_align_up_ptr(a->copy, sizeof(void*));
+    void** end = (void**)(a->copy + a->size);
+    for (; w < end; w++) {
+      *w = mp_reloc_word(*w, rel);
+    }
+  }
+  for (ssize_t i = 0; i < rel->count; i++) {
+    mp_prompt_t* c = rel->areas[i].to;
+    c->parent = (mp_prompt_t*)mp_reloc_word(c->parent, rel);
+    c->top = (mp_prompt_t*)mp_reloc_word(c->top, rel);
+    c->return_point = (mp_return_point_t*)mp_reloc_word(c->return_point, rel);
+    c->resume_point = (mp_resume_point_t*)mp_reloc_word(c->resume_point, rel);
+    c->unwind_frame = (mp_unwind_frame_t*)mp_reloc_word(c->unwind_frame, rel);
+    c->sp = mp_guard(mp_reloc_word(c->sp, rel));
+    mp_trace_event(MP_TRACE_PROMPT_CREATE, c, c->gstack, 0);
+  }
+  mp_prompt_t* p = rel->areas[rel->count - 1].to;
+  mp_assert_internal(p->parent == NULL && p->top == rel->areas[0].to);
+  return p;
+}
+
+static void mp_reloc_free_chain(mp_clone_area_t* areas, ssize_t count) {
+  for (ssize_t i = 0; i < count; i++) { 
+    mp_gstack_free(areas[i].to->gstack, false); 
+  }
+  mp_free(areas);
+}
+
+// Get the suspended prompt of a resumption with a pristine stack (or NULL with `errno` set)
+static mp_prompt_t* mp_resume_pristine(mp_resume_t* resume) {
+  mp_prompt_t* p = mp_resume_is_once(resume);
+  if (p == NULL) {
+    mp_mresume_t* r = mp_resume_is_multi(resume);
+    p = r->prompt;
+    if (p->top == NULL) {  // active
+      errno = EBUSY;
+      return NULL;
+    }
+    if (r->save != NULL) {
+      mp_prompt_restore(p, r->save);  // as in `mp_resume_get_prompt`
+    }
+  }
+  mp_assert_internal(!mp_prompt_is_active(p) && p->resume_point != NULL);
+  return p;
+}
+
+// The length of the chain from the top down to `p`
+static ssize_t mp_prompt_chain_length(mp_prompt_t* p) {
+  ssize_t n = 0;
+  for (mp_prompt_t* q = p->top; q != NULL; q = (q == p ? NULL : q->parent)) { n++; }
+  return n;
+}
+
+// The resume sp of a prompt `q` in the chain of `p` (where `child` is the prompt above `q`, or NULL for the top)
+static uint8_t* mp_prompt_chain_sp(mp_prompt_t* p, mp_prompt_t* child) {
+  return (uint8_t*)(child == NULL ? p->resume_point->jmp.reg_sp : child->return_point->jmp.reg_sp);
+}
+
+mp_resume_t* mp_resume_clone(mp_resume_t* resume) {
+  mp_prompt_t* p = mp_resume_pristine(resume);
+  if (p == NULL) return NULL;
+  const ssize_t n = mp_prompt_chain_length(p);
+  mp_clone_area_t* areas = (mp_clone_area_t*)mp_malloc(n * sizeof(mp_clone_area_t));
+  if (areas == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // clone each gstack 
+  ssize_t i = 0;
+  mp_prompt_t* child = NULL;
+  for (mp_prompt_t* q = p->top; q != NULL; child = q, q = (q == p ? NULL : q->parent), i++) {
+    mp_clone_area_t* a = &areas[i];
+    mp_prompt_t* c = NULL;
+    mp_gstack_t* g = mp_gstack_clone(q->gstack, mp_prompt_chain_sp(p, child), sizeof(mp_prompt_t), (void**)&c, &a->delta, &a->copy, &a->size);
+    if (g == NULL) {
+      const int err = errno;
+      mp_reloc_free_chain(areas, i);
+      errno = err;
+      return NULL;
+    }
+    *c = *q;
+    c->gstack = g;
+    c->refcount = 1;
+    c->sp = mp_unguard(q->sp);
+    memset(&c->profile, 0, sizeof(c->profile));    // a fresh profile
+    c->profile_start = 0;
+    a->from = (uintptr_t)q;
+    a->to = c;
+    a->start = (uintptr_t)a->copy - a->delta;
+    a->end = a->start + a->size;
+  }
+  // relocate the stacks and prompts
+  mp_reloc_t rel = { areas, n, 0, 0, 0, 0, 0 };
+  mp_prompt_t* clone = mp_reloc_chain(&rel);
+  mp_free(areas);
+  return mp_resume_as_once(clone);
+}
+
+
+//-----------------------------------------------------------------------
+// Serializing a resumption 
+//
+// A snapshot consists of a header followed by each prompt in the chain (from
+// the top down) with its used stack area. It is restored like a clone: into fresh
+// gstacks, relocating pointers into the original stacks and prompts. When it is
+// restored in another process of the same binary, we also relocate pointers into
+// the binary (code and static data) if it was loaded at another address (ASLR),
+// and the stack protector canary.
+//-----------------------------------------------------------------------
+
+#define MP_SNAPSHOT_MAGIC  (0x313050414E53504DULL)   // "MPSNAP01"
+
+typedef struct mp_snapshot_s {
+  uint64_t  magic;
+  uint64_t  size;           // total size in bytes
+  uint64_t  count;          // number of prompts
+  uintptr_t image_ref;      // address of `mp_resume_serialize` 
+  uintptr_t image_start;    // extent of the binary that contains it (or 0 if unknown)
+  uintptr_t image_end;
+  uintptr_t stack_guard;    // the stack protector canary (or 0 if unknown)
+  uintptr_t labels[5];      // the checked longjmp labels (unguarded, or 0 if not yet initialized)
+} mp_snapshot_t;
+
+typedef struct mp_snapshot_prompt_s {
+  uintptr_t prompt;         // original address of the prompt
+  uintptr_t start;          // original start of its used stack area
+  uint64_t  size;           // size of the used stack area (which follows, padded to 16 bytes)
+  uint64_t  stack_size;     // usable size of the original gstack
+  uintptr_t parent;         // prompt fields
+  uintptr_t top;
+  uintptr_t return_point;
+  uintptr_t resume_point;
+  uintptr_t sp;             // unguarded
+} mp_snapshot_prompt_t;
+
+#define MP_SNAPSHOT_ALIGN  (16)
+
+#if defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#include <elf.h>
+#define MP_HAS_IMAGE_EXTENT  1
+// The ELF header of the binary (executable or shared library) we are linked in (defined by the linker)
+extern const Elf64_Ehdr __ehdr_start __attribute__((weak, visibility("hidden")));
+#endif
+
+// Find the extent of the loaded binary containing our code (and static data)
+static bool mp_image_extent(uintptr_t* start, uintptr_t* end) {
+  *start = *end = 0;
+  #if defined(MP_HAS_IMAGE_EXTENT)
+  const Elf64_Ehdr* eh = &__ehdr_start;
+  if (eh == NULL || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) return false;
+  const Elf64_Phdr* phdrs = (const Elf64_Phdr*)((const uint8_t*)eh + eh->e_phoff);
+  // the load bias is given by the segment that maps the header itself
+  bool found = false;
+  uintptr_t bias = 0;
+  for (size_t i = 0; i < eh->e_phnum && !found; i++) {
+    if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_offset == 0) {
+      bias = (uintptr_t)eh - (uintptr_t)phdrs[i].p_vaddr;
+      found = true;
+    }
+  }
+  if (!found) return false;
+  uintptr_t lo = UINTPTR_MAX;
+  uintptr_t hi = 0;
+  for (size_t i = 0; i < eh->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_LOAD) continue;
+    const uintptr_t s = bias + (uintptr_t)phdrs[i].p_vaddr;
+    if (s < lo) { lo = s; }
+    if (s + phdrs[i].p_memsz > hi) { hi = s + (uintptr_t)phdrs[i].p_memsz; }
+  }
+  *start = lo;
+  *end = hi;
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+// The stack protector canary of this process (or 0 if unknown)
+static uintptr_t mp_stack_guard(void) {
+  #if defined(__linux__) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  uintptr_t guard;
+  __asm__ volatile ("movq %%fs:0x28, %0" : "=r"(guard));
+  return guard;
+  #else
+  return 0;
+  #endif
+}
+
+// The checked longjmp labels are initialized lazily on the first switch of each kind, so
+// a fresh process that restores a snapshot may not have seen them yet.
+static void** mp_snapshot_label(size_t i) {
+  switch (i) {
+    case 0: return &mp_return_label;
+    case 1: return &mp_return_batch_label;
+    case 2: return &mp_resume_label;
+    case 3: return &mp_resume_transfer_label;
+    default: return &mp_resumex_label;
+  }
+}
+
+typedef struct mp_labels_env_s {
+  mp_resume_t* target;
+  mp_resume_t* from;
+} mp_labels_env_t;
+
+static void* mp_labels_yield_fun(mp_resume_t* r, void* arg) {
+  (void)(arg);
+  return r;
+}
+
+static void* mp_labels_yieldx_fun(mp_resume_t* r, void* arg0, void* arg1, void* arg2, void* arg3) {
+  (void)(arg0); (void)(arg1); (void)(arg2); (void)(arg3);
+  return r;
+}
+
+static void* mp_labels_start(mp_prompt_t* p, void* arg) {
+  (void)(arg);
+  mp_yield(p, &mp_labels_yield_fun, NULL);
+  mp_yieldx(p, &mp_labels_yieldx_fun, NULL, NULL, NULL, NULL, NULL);
+  return NULL;
+}
+
+static void* mp_labels_transfer(mp_prompt_t* p, void* arg) {
+  mp_labels_env_t* env = (mp_labels_env_t*)arg;
+  return mp_resume_transfer(p, &env->from, env->target, NULL);
+}
+
+// Initialize all labels by switching once in each way
+static void mp_labels_init(void) {
+  mp_labels_env_t env;
+  env.from = NULL;
+  env.target = (mp_resume_t*)mp_prompt(&mp_labels_start, NULL);        // return and resume label
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&mp_labels_transfer, &env); // transfer and resumex label
+  mp_resume_batch(&env.from, NULL, 1, NULL);                           // batch label (and finish the transfer)
+  mp_resume(r, NULL);
+}
+
+// The labels in a snapshot must be our own (relocated) labels
+static bool mp_snapshot_check_labels(const mp_snapshot_t* hdr, const mp_reloc_t* rel) {
+  for (size_t i = 0; i < 5; i++) {
+    if (*mp_snapshot_label(i) == NULL) {
+      mp_labels_init();
+      break;
+    }
+  }
+  for (size_t i = 0; i < 5; i++) {
+    if (hdr->labels[i] == 0) continue;
+    if (hdr->labels[i] < rel->image_start || hdr->labels[i] >= rel->image_end) return false;
+    if (mp_unguard(*mp_snapshot_label(i)) != (void*)(hdr->labels[i] + (uintptr_t)rel->image_delta)) return false;
+  }
+  return true;
+}
+
+static bool mp_snapshot_in_area(const mp_clone_area_t* a, const void* p, size_t size) {
+  const uintptr_t u = (uintptr_t)p;
+  return (u >= a->start && u < a->end && size <= a->end - u);
+}
+
+// Is `jmp` (in the original stack area `a`) a jump to one of the `labels` with stack pointer `sp`?
+#if MP_USE_ASAN
+__attribute__((no_sanitize("address")))
+#endif
+static bool mp_snapshot_check_jump(const mp_clone_area_t* a, const mp_jmpbuf_t* jmp, const void* sp, size_t lo, size_t hi, const mp_reloc_t* rel) {
+  const mp_jmpbuf_t* copy = (const mp_jmpbuf_t*)((uintptr_t)jmp + a->delta);
+  if (copy->reg_sp != sp) return false;
+  for (size_t i = lo; i <= hi; i++) {
+    if (mp_unguard(*mp_snapshot_label(i)) == (void*)((uintptr_t)copy->reg_ip + (uintptr_t)rel->image_delta)) return true;
+  }
+  return false;
+}
+
+// Check that the (not yet relocated) prompt fields of a restored chain only refer to the 
+// restored prompts and stacks: the root resumes at the top, and each other prompt returns into the next.
+static bool mp_snapshot_check_chain(const mp_reloc_t* rel) {
+  const ssize_t n = rel->count;
+  for (ssize_t i = 0; i < n; i++) {
+    const mp_prompt_t* c = rel->areas[i].to;
+    if (i == n - 1) {
+      const mp_clone_area_t* top = &rel->areas[0];
+      if (c->parent != NULL || (uintptr_t)c->top != top->from || c->return_point != NULL) return false;
+      if (!mp_snapshot_in_area(top, c->resume_point, sizeof(mp_resume_point_t)) || !mp_snapshot_in_area(top, c->sp, 1)) return false;
+      if (!mp_snapshot_check_jump(top, &c->resume_point->jmp, c->sp, 2, 4, rel)) return false;
+    }
+    else {
+      const mp_clone_area_t* parent = &rel->areas[i + 1];
+      if ((uintptr_t)c->parent != parent->from || c->top != NULL || c->resume_point != NULL) return false;
+      if (!mp_snapshot_in_area(parent, c->return_point, sizeof(mp_return_point_t)) || !mp_snapshot_in_area(parent, c->sp, 1)) return false;
+      if (!mp_snapshot_check_jump(parent, &c->return_point->jmp, c->sp, 0, 1, rel)) return false;
+    }
+  }
+  return true;
+}
+
+#if MP_USE_ASAN
+__attribute__((no_sanitize("address")))
+#endif
+static void mp_snapshot_copy(uint8_t* dst, const uint8_t* src, ssize_t size) {
+  #if MP_USE_ASAN
+    for (ssize_t i = 0; i < size; i++) { dst[i] = src[i]; }
+  #else
+    memcpy(dst, src, size);
+  #endif
+}
+
+size_t mp_resume_serialize(mp_resume_t* resume, void* buf, size_t buf_size) {
+  mp_prompt_t* p = mp_resume_pristine(resume);
+  if (p == NULL) return 0;
+  // calculate the size
+  size_t total = sizeof(mp_snapshot_t);
+  mp_prompt_t* child = NULL;
+  for (mp_prompt_t* q = p->top; q != NULL; child = q, q = (q == p ? NULL : q->parent)) {
+    uint8_t* start;
+    const ssize_t used = mp_gstack_used(q->gstack, mp_prompt_chain_sp(p, child), &start);
+    total += sizeof(mp_snapshot_prompt_t) + mp_align_up(used, MP_SNAPSHOT_ALIGN);
+  }
+  if (buf == NULL || buf_size < total) return total;
+  // and write the snapshot
+  mp_snapshot_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MP_SNAPSHOT_MAGIC;
+  hdr.size = total;
+  hdr.count = (uint64_t)mp_prompt_chain_length(p);
+  hdr.image_ref = (uintptr_t)&mp_resume_serialize;
+  mp_image_extent(&hdr.image_start, &hdr.image_end);
+  hdr.stack_guard = mp_stack_guard();
+  for (size_t i = 0; i < 5; i++) {
+    void* label = *mp_snapshot_label(i);
+    hdr.labels[i] = (label == NULL ? 0 : (uintptr_t)mp_unguard(label));
+  }
+  uint8_t* out = (uint8_t*)buf;
+  memcpy(out, &hdr, sizeof(hdr));
+  out += sizeof(hdr);
+  child = NULL;
+  for (mp_prompt_t* q = p->top; q != NULL; child = q, q = (q == p ? NULL : q->parent)) {
+    uint8_t* start;
+    const ssize_t used = mp_gstack_used(q->gstack, mp_prompt_chain_sp(p, child), &start);
+    mp_snapshot_prompt_t sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.prompt = (uintptr_t)q;
+    sp.start = (uintptr_t)start;
+    sp.size = (uint64_t)used;
+    sp.stack_size = (uint64_t)mp_gstack_size(q->gstack);
+    sp.parent = (uintptr_t)q->parent;
+    sp.top = (uintptr_t)q->top;
+    sp.return_point = (q == p ? 0 : (uintptr_t)q->return_point);  // only the root resumes, the others return
+    sp.resume_point = (q == p ? (uintptr_t)q->resume_point : 0);
+    sp.sp = (uintptr_t)mp_unguard(q->sp);
+    memcpy(out, &sp, sizeof(sp));
+    out += sizeof(sp);
+    mp_snapshot_copy(out, start, used);
+    memset(out + used, 0, mp_align_up(used, MP_SNAPSHOT_ALIGN) - used);
+    out += mp_align_up(used, MP_SNAPSHOT_ALIGN);
+  }
+  mp_assert_internal(out == (uint8_t*)buf + total);
+  return total;
+}
+
+mp_resume_t* mp_resume_deserialize(const void* buf, size_t size) {
+  mp_snapshot_t hdr;
+  if (buf == NULL || size < sizeof(hdr)) { errno = EINVAL; return NULL; }
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (hdr.magic != MP_SNAPSHOT_MAGIC || hdr.size > size || hdr.count == 0 || hdr.count > hdr.size / sizeof(mp_snapshot_prompt_t)) { 
+    errno = EINVAL; 
+    return NULL; 
+  }
+  // the snapshot must come from this binary (possibly loaded at another address)
+  uintptr_t image_start;
+  uintptr_t image_end;
+  if (!mp_image_extent(&image_start, &image_end) || hdr.image_start >= hdr.image_end ||
+      hdr.image_ref < hdr.image_start || hdr.image_ref >= hdr.image_end || 
+      hdr.image_end - hdr.image_start != image_end - image_start) {
+    errno = EINVAL;
+    return NULL;
+  }
+  mp_reloc_t rel;
+  memset(&rel, 0, sizeof(rel));
+  rel.image_delta = (ptrdiff_t)((uintptr_t)&mp_resume_serialize - hdr.image_ref);
+  rel.image_start = hdr.image_start;
+  rel.image_end = hdr.image_end;
+  rel.guard_from = hdr.stack_guard;
+  rel.guard_to = (hdr.stack_guard == 0 ? 0 : mp_stack_guard());
+  if (rel.guard_to == 0) { rel.guard_from = 0; }
+  if (hdr.image_start + (uintptr_t)rel.image_delta != image_start || !mp_snapshot_check_labels(&hdr, &rel)) { 
+    errno = EINVAL; 
+    return NULL; 
+  }
+  rel.count = (ssize_t)hdr.count;
+  rel.areas = (mp_clone_area_t*)mp_malloc(rel.count * sizeof(mp_clone_area_t));
+  if (rel.areas == NULL) { errno = ENOMEM; return NULL; }
+  // restore each gstack
+  const uint8_t* in = (const uint8_t*)buf + sizeof(hdr);
+  const uint8_t* in_end = (const uint8_t*)buf + hdr.size;
+  for (ssize_t i = 0; i < rel.count; i++) {
+    mp_snapshot_prompt_t sp;
+    int err = EINVAL;
+    mp_gstack_t* g = NULL;
+    mp_clone_area_t* a = &rel.areas[i];
+    mp_prompt_t* c = NULL;
+    if (in + sizeof(sp) <= in_end) {
+      memcpy(&sp, in, sizeof(sp));
+      in += sizeof(sp);
+      if (sp.size <= (uint64_t)(in_end - in) && sp.size <= PTRDIFF_MAX && sp.stack_size <= PTRDIFF_MAX && sp.start <= UINTPTR_MAX - sp.size) {
+        g = mp_gstack_alloc_used((ssize_t)sp.stack_size, (ssize_t)sp.size, sizeof(mp_prompt_t), (void**)&c, &a->copy);
+        err = errno;
+      }
+    }
+    if (g == NULL) {
+      mp_reloc_free_chain(rel.areas, i);
+      errno = err;
+      return NULL;
+    }
+    a->size = (ssize_t)sp.size;
+    mp_snapshot_copy(a->copy, in, a->size);
+    in += mp_align_up(a->size, MP_SNAPSHOT_ALIGN);
+    a->start = sp.start;
+    a->end = sp.start + sp.size;
+    a->delta = (ptrdiff_t)((uintptr_t)a->copy - sp.start);
+    a->from = sp.prompt;
+    a->to = c;
+    memset(c, 0, sizeof(*c));
+    c->gstack = g;
+    c->refcount = 1;
+    c->parent = (mp_prompt_t*)sp.parent;
+    c->top = (mp_prompt_t*)sp.top;
+    c->return_point = (mp_return_point_t*)sp.return_point;
+    c->resume_point = (mp_resume_point_t*)sp.resume_point;
+    c->sp = (void*)sp.sp;
+  }
+  if (!mp_snapshot_check_chain(&rel)) {
+    mp_reloc_free_chain(rel.areas, rel.count);
+    errno = EINVAL;
+    return NULL;
+  }
+  mp_prompt_t* p = mp_reloc_chain(&rel);
+  mp_free(rel.areas);
+  return mp_resume_as_once(p);
+}
+
+
+//-----------------------------------------------------------------------
+// Batched resume
+//-----------------------------------------------------------------------
+
+// Resume `rs[i]` with `args[i]` (or NULL if `args` is NULL) in order, and store what `mp_resume` would 
+// return in `results[i]` (if `results` is not NULL). This sets up the return point only once for 
+// all resumptions: each prompt longjmp's back to the same point when it yields or returns.
+// If a resumption raises an exception, the remaining resumptions are not resumed (and not consumed).
+mp_decl_noclone void mp_resume_batch(mp_resume_t** rs, void** args, size_t n, void** results) {
+  mp_return_point_t ret;
+  volatile size_t i = 0;                     // volatile as these are used after a longjmp
+  mp_prompt_t* volatile p = NULL;
+  ret.jmp.context_flags = mp_jmpbuf_flags;
+  if (mp_setjmp(&ret.jmp)) {
+    //mp_return_batch_label:
+    // P: return from a yield or a regular return to the current prompt `p`
+    mp_debug_asan_end_switch(false);
+    void* result = mp_prompt_exec_yield_fun(&ret, ret.prompt);
+    if (results != NULL) { results[i] = result; }
+    i = i + 1;
+  }
+  else if (mp_unlikely(mp_return_batch_label == NULL)) {
+    mp_return_batch_label = mp_guard(ret.jmp.reg_ip);
+  }
+  if (i < n) {
+    // resume the next one
+    mp_resume_t* resume = rs[i];
+    p = mp_resume_is_once(resume);
+    if (mp_likely(p != NULL)) {
+      mp_assert_internal(p->refcount == 1);
+    }
+    else {
+      mp_mresume_t* r = mp_resume_is_multi(resume);
+      r->resume_count++;
+      p = mp_resume_get_prompt(r);
+    }
+    mp_assert_internal(p->resume_point != NULL);
+    mp_assert(p->parent == NULL);
+    void* sp;
+    mp_resume_point_t* res = mp_prompt_link(p, &ret, &sp);
+    res->result = (args == NULL ? NULL : args[i]);
+    res->result1 = NULL;
+    mp_resume_longjmp(sp, &res->jmp);
   }
 }
 
@@ -153,6 +153,35 @@ mp_decl_noreturn void mp_unreachable(const char* msg) {
 }
 
 
+/* ----------------------------------------------------------------------------
+  Custom allocator
+-----------------------------------------------------------------------------*/
+
+mp_allocator_t mp_allocator;
+
+void mp_allocator_init(const mp_config_t* config) {
+  if (config == NULL) return;
+  const bool any = (config->malloc_fun != NULL || config->realloc_fun != NULL || config->free_fun != NULL);
+  if (!any) return;
+  if (config->malloc_fun == NULL || config->realloc_fun == NULL || config->free_fun == NULL) {
+    mp_error_message(EINVAL, "either all custom allocation functions must be given, or none (using the default allocator instead)\n");
+    return;
+  }
+  mp_allocator.malloc_fun = config->malloc_fun;
+  mp_allocator.realloc_fun = config->realloc_fun;
+  mp_allocator.free_fun = config->free_fun;
+  mp_allocator.arg = config->alloc_arg;
+}
+
+void* mp_lib_malloc(size_t size) {
+  return mp_malloc(size);
+}
+
+void mp_lib_free(void* p) {
+  mp_free(p);
+}
+
+
 /* ----------------------------------------------------------------------------
   Guard cookie
   To get an initial secure random context we rely on the OS:
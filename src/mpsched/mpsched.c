@@ -0,0 +1,950 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------
+  A work-stealing M:N scheduler.
+
+  Each worker thread has a Chase-Lev deque of ready tasks: it pushes and
+  pops at the bottom while idle workers steal from the top of a randomly
+  chosen victim. Tasks spawned from outside the workers go into a shared
+  injection queue. Workers that find no work park on a condition variable.
+
+  A task runs in its own prompt. On a yield or await, the task yields
+  to its prompt and the yield function (that runs on the worker stack
+  after the task is suspended) records the resumption in the task. At that
+  point it is safe to make the task available to other workers again.
+  Since a suspended task can be resumed on any worker, task code should
+  not cache thread-local addresses across `mps_yield` and `mps_await`.
+  Tasks are entered with `mpe_prompt` and suspended with `mpe_yield` so any 
+  effect handlers installed in a task migrate along with it.
+
+  Tasks that block on a channel are woken up by another task (see
+  the channels below), and can also be resumed directly through a 
+  transfer from the task that woke them up on the same worker.
+-----------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <mprompt.h>
+#include "mpeff.h"
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+
+
+/*-----------------------------------------------------------------
+  Threads, locks, and condition variables
+-----------------------------------------------------------------*/
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef HANDLE              mps_thread_t;
+typedef SRWLOCK             mps_mutex_t;
+typedef CONDITION_VARIABLE  mps_cond_t;
+
+static void mps_mutex_init(mps_mutex_t* m)   { InitializeSRWLock(m); }
+static void mps_mutex_lock(mps_mutex_t* m)   { AcquireSRWLockExclusive(m); }
+static void mps_mutex_unlock(mps_mutex_t* m) { ReleaseSRWLockExclusive(m); }
+static void mps_cond_init(mps_cond_t* c)     { InitializeConditionVariable(c); }
+static void mps_cond_wait(mps_cond_t* c, mps_mutex_t* m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+static void mps_cond_signal(mps_cond_t* c)   { WakeConditionVariable(c); }
+static void mps_cond_broadcast(mps_cond_t* c){ WakeAllConditionVariable(c); }
+static void mps_thread_yield(void)           { SwitchToThread(); }
+
+static DWORD WINAPI mps_thread_start(LPVOID arg);
+
+static bool mps_thread_create(mps_thread_t* t, void* arg) {
+  *t = CreateThread(NULL, 0, &mps_thread_start, arg, 0, NULL);
+  return (*t != NULL);
+}
+
+static void mps_thread_join(mps_thread_t t) {
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+}
+
+static ssize_t mps_cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (ssize_t)info.dwNumberOfProcessors;
+}
+
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+typedef pthread_t           mps_thread_t;
+typedef pthread_mutex_t     mps_mutex_t;
+typedef pthread_cond_t      mps_cond_t;
+
+static void mps_mutex_init(mps_mutex_t* m)   { pthread_mutex_init(m, NULL); }
+static void mps_mutex_lock(mps_mutex_t* m)   { pthread_mutex_lock(m); }
+static void mps_mutex_unlock(mps_mutex_t* m) { pthread_mutex_unlock(m); }
+static void mps_cond_init(mps_cond_t* c)     { pthread_cond_init(c, NULL); }
+static void mps_cond_wait(mps_cond_t* c, mps_mutex_t* m) { pthread_cond_wait(c, m); }
+static void mps_cond_signal(mps_cond_t* c)   { pthread_cond_signal(c); }
+static void mps_cond_broadcast(mps_cond_t* c){ pthread_cond_broadcast(c); }
+static void mps_thread_yield(void)           { sched_yield(); }
+
+static void* mps_thread_start(void* arg);
+
+static bool mps_thread_create(mps_thread_t* t, void* arg) {
+  return (pthread_create(t, NULL, &mps_thread_start, arg) == 0);
+}
+
+static void mps_thread_join(mps_thread_t t) {
+  pthread_join(t, NULL);
+}
+
+static ssize_t mps_cpu_count(void) {
+  #if defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return (ssize_t)n;
+  #endif
+  return 1;
+}
+#endif
+
+
+/*-----------------------------------------------------------------
+  Types
+-----------------------------------------------------------------*/
+
+typedef enum mps_task_state_e {
+  MPS_TASK_READY,       // fresh or yielded
+  MPS_TASK_RUNNING,
+  MPS_TASK_AWAITING,    // suspended until `await_target` is done
+  MPS_TASK_BLOCKED,     // suspended until woken up (see `mps_task_wakeup`)
+  MPS_TASK_DONE
+} mps_task_state_t;
+
+// special values of the `waiter` field of a task
+#define MPS_WAITER_NONE      ((intptr_t)0)
+#define MPS_WAITER_EXTERNAL  ((intptr_t)1)  // a non-task thread is blocked on the task
+#define MPS_WAITER_DONE      ((intptr_t)2)  // the task is done
+
+struct mps_task_s {
+  mps_task_fun_t*     fun;
+  void*               arg;
+  void*               result;
+  mp_prompt_t*        prompt;        // the prompt the task runs in (once started)
+  mp_resume_t*        resume;        // the resumption if suspended (or NULL if not started yet)
+  mps_task_state_t    state;         // only accessed by the worker that runs it
+  mps_task_t*         await_target;  // task we are awaiting on (when `state == MPS_TASK_AWAITING`)
+  _Atomic(intptr_t)   waiter;        // the task waiting on us, or one of the `MPS_WAITER_` values
+  _Atomic(intptr_t)   refcount;      // one for the scheduler, and one for the task handle
+  _Atomic(intptr_t)   wakeup;        // when blocked, both the blocking worker and the waker increment this; the second one schedules the task
+  mps_task_t*         next;          // used in the injection queue
+};
+
+// Chase-Lev work-stealing deque
+typedef struct mps_deque_buf_s {
+  ssize_t                  capacity; // always a power of 2
+  struct mps_deque_buf_s*  retired;  // previous (smaller) buffers; we free those when the deque is freed
+  _Atomic(intptr_t)        items[1];
+} mps_deque_buf_t;
+
+typedef struct mps_deque_s {
+  _Atomic(intptr_t)          top;
+  _Atomic(intptr_t)          bottom;
+  _Atomic(mps_deque_buf_t*)  buf;
+} mps_deque_t;
+
+typedef struct mps_worker_s {
+  mps_deque_t     deque;
+  ssize_t         id;
+  uint64_t        rnd;       // for random victim selection
+  mps_task_t*     current;   // the currently running task
+  mps_task_t*     handoff;   // a task that transferred to `current` (and is scheduled by it once it runs)
+  mps_thread_t    thread;
+} mps_worker_t;
+
+typedef struct mps_scheduler_s {
+  mps_worker_t*       workers;
+  ssize_t             worker_count;
+  _Atomic(intptr_t)   task_count;     // number of tasks that are not done yet
+  _Atomic(intptr_t)   stopping;
+  // injection queue for tasks spawned outside of workers
+  mps_mutex_t         inject_lock;
+  mps_task_t*         inject_first;
+  mps_task_t*         inject_last;
+  _Atomic(intptr_t)   inject_count;
+  // parking for idle workers
+  mps_mutex_t         idle_lock;
+  mps_cond_t          idle_cond;
+  _Atomic(intptr_t)   sleepers;
+  // external (non-task) waiters
+  mps_mutex_t         external_lock;
+  mps_cond_t          external_cond;
+} mps_scheduler_t;
+
+static mps_scheduler_t mps_sched;
+static mp_decl_thread mps_worker_t* _mps_worker;
+
+#define MPS_DEQUE_INITIAL_CAPACITY  (64)
+
+
+/*-----------------------------------------------------------------
+  Deque
+-----------------------------------------------------------------*/
+
+static mps_deque_buf_t* mps_deque_buf_alloc(ssize_t capacity) {
+  mps_deque_buf_t* a = (mps_deque_buf_t*)mp_malloc_safe(sizeof(mps_deque_buf_t) + (capacity - 1) * sizeof(_Atomic(intptr_t)));
+  a->capacity = capacity;
+  a->retired = NULL;
+  return a;
+}
+
+static void mps_deque_init(mps_deque_t* d) {
+  mp_atomic_store(&d->top, (intptr_t)0);
+  mp_atomic_store(&d->bottom, (intptr_t)0);
+  mp_atomic_store_ptr(mps_deque_buf_t, &d->buf, mps_deque_buf_alloc(MPS_DEQUE_INITIAL_CAPACITY));
+}
+
+static void mps_deque_done(mps_deque_t* d) {
+  mps_deque_buf_t* a = mp_atomic_load_ptr(mps_deque_buf_t, &d->buf);
+  while (a != NULL) {
+    mps_deque_buf_t* retired = a->retired;
+    mp_free(a);
+    a = retired;
+  }
+}
+
+// Double the capacity (only called by the owner)
+static mps_deque_buf_t* mps_deque_grow(mps_deque_t* d, mps_deque_buf_t* a, intptr_t b, intptr_t t) {
+  mps_deque_buf_t* na = mps_deque_buf_alloc(2 * a->capacity);
+  for (intptr_t i = t; i < b; i++) {
+    mp_atomic_store(&na->items[i & (na->capacity - 1)], mp_atomic_load(&a->items[i & (a->capacity - 1)]));
+  }
+  na->retired = a;  // thieves may still read from the old buffer
+  mp_atomic_store_ptr(mps_deque_buf_t, &d->buf, na);
+  return na;
+}
+
+// Push at the bottom (only called by the owner)
+static void mps_deque_push(mps_deque_t* d, mps_task_t* task) {
+  intptr_t b = mp_atomic_load(&d->bottom);
+  intptr_t t = mp_atomic_load(&d->top);
+  mps_deque_buf_t* a = mp_atomic_load_ptr(mps_deque_buf_t, &d->buf);
+  if (b - t >= a->capacity) {
+    a = mps_deque_grow(d, a, b, t);
+  }
+  mp_atomic_store(&a->items[b & (a->capacity - 1)], (intptr_t)task);
+  mp_atomic_store(&d->bottom, b + 1);
+}
+
+// Pop from the bottom (only called by the owner)
+static mps_task_t* mps_deque_pop(mps_deque_t* d) {
+  intptr_t b = mp_atomic_load(&d->bottom) - 1;
+  mps_deque_buf_t* a = mp_atomic_load_ptr(mps_deque_buf_t, &d->buf);
+  mp_atomic_store(&d->bottom, b);
+  intptr_t t = mp_atomic_load(&d->top);
+  if (t > b) {
+    // empty
+    mp_atomic_store(&d->bottom, b + 1);
+    return NULL;
+  }
+  mps_task_t* task = (mps_task_t*)mp_atomic_load(&a->items[b & (a->capacity - 1)]);
+  if (t == b) {
+    // last element; race against thieves
+    if (!mp_atomic_cas(&d->top, &t, t + 1)) {
+      task = NULL;
+    }
+    mp_atomic_store(&d->bottom, b + 1);
+  }
+  return task;
+}
+
+// Steal from the top (called by other workers)
+static mps_task_t* mps_deque_steal(mps_deque_t* d) {
+  intptr_t t = mp_atomic_load(&d->top);
+  intptr_t b = mp_atomic_load(&d->bottom);
+  if (t >= b) return NULL;
+  mps_deque_buf_t* a = mp_atomic_load_ptr(mps_deque_buf_t, &d->buf);
+  mps_task_t* task = (mps_task_t*)mp_atomic_load(&a->items[t & (a->capacity - 1)]);
+  if (!mp_atomic_cas(&d->top, &t, t + 1)) return NULL;  // lost the race
+  return task;
+}
+
+static bool mps_deque_is_empty(mps_deque_t* d) {
+  return (mp_atomic_load(&d->top) >= mp_atomic_load(&d->bottom));
+}
+
+
+/*-----------------------------------------------------------------
+  Scheduling
+-----------------------------------------------------------------*/
+
+// Wake up a parked worker if there is any
+static void mps_wake_one(void) {
+  if (mp_atomic_load(&mps_sched.sleepers) > 0) {
+    mps_mutex_lock(&mps_sched.idle_lock);
+    mps_cond_signal(&mps_sched.idle_cond);
+    mps_mutex_unlock(&mps_sched.idle_lock);
+  }
+}
+
+static void mps_wake_all(void) {
+  mps_mutex_lock(&mps_sched.idle_lock);
+  mps_cond_broadcast(&mps_sched.idle_cond);
+  mps_mutex_unlock(&mps_sched.idle_lock);
+}
+
+static void mps_inject(mps_task_t* task) {
+  task->next = NULL;
+  mps_mutex_lock(&mps_sched.inject_lock);
+  if (mps_sched.inject_last == NULL) { mps_sched.inject_first = task; }
+                                else { mps_sched.inject_last->next = task; }
+  mps_sched.inject_last = task;
+  mp_atomic_add(&mps_sched.inject_count, (intptr_t)1);
+  mps_mutex_unlock(&mps_sched.inject_lock);
+}
+
+static mps_task_t* mps_inject_take(void) {
+  if (mp_atomic_load(&mps_sched.inject_count) == 0) return NULL;
+  mps_task_t* task = NULL;
+  mps_mutex_lock(&mps_sched.inject_lock);
+  task = mps_sched.inject_first;
+  if (task != NULL) {
+    mps_sched.inject_first = task->next;
+    if (mps_sched.inject_first == NULL) { mps_sched.inject_last = NULL; }
+    mp_atomic_add(&mps_sched.inject_count, (intptr_t)-1);
+  }
+  mps_mutex_unlock(&mps_sched.inject_lock);
+  return task;
+}
+
+// Make a task ready to run; from a worker it is pushed on its own deque
+static void mps_schedule(mps_worker_t* w, mps_task_t* task) {
+  task->state = MPS_TASK_READY;
+  if (w != NULL) {
+    mps_deque_push(&w->deque, task);
+  }
+  else {
+    mps_inject(task);
+  }
+  mps_wake_one();
+}
+
+static uint64_t mps_random_next(mps_worker_t* w) {
+  uint64_t x = w->rnd;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;  // xorshift64
+  w->rnd = x;
+  return x;
+}
+
+static mps_task_t* mps_steal(mps_worker_t* w) {
+  const ssize_t n = mps_sched.worker_count;
+  if (n <= 1) return NULL;
+  const ssize_t start = (ssize_t)(mps_random_next(w) % (uint64_t)n);
+  for (ssize_t i = 0; i < n; i++) {
+    mps_worker_t* victim = &mps_sched.workers[(start + i) % n];
+    if (victim == w) continue;
+    mps_task_t* task = mps_deque_steal(&victim->deque);
+    if (task != NULL) return task;
+  }
+  return NULL;
+}
+
+static bool mps_has_work(void) {
+  if (mp_atomic_load(&mps_sched.inject_count) > 0) return true;
+  for (ssize_t i = 0; i < mps_sched.worker_count; i++) {
+    if (!mps_deque_is_empty(&mps_sched.workers[i].deque)) return true;
+  }
+  return false;
+}
+
+static bool mps_should_exit(void) {
+  return (mp_atomic_load(&mps_sched.stopping) != 0 && mp_atomic_load(&mps_sched.task_count) == 0);
+}
+
+// Park until there may be work again
+static void mps_park(void) {
+  mps_mutex_lock(&mps_sched.idle_lock);
+  mp_atomic_add(&mps_sched.sleepers, (intptr_t)1);
+  if (!mps_has_work() && !mps_should_exit()) {   // check again after announcing we sleep (to avoid lost wakeups)
+    mps_cond_wait(&mps_sched.idle_cond, &mps_sched.idle_lock);
+  }
+  mp_atomic_add(&mps_sched.sleepers, (intptr_t)-1);
+  mps_mutex_unlock(&mps_sched.idle_lock);
+}
+
+
+/*-----------------------------------------------------------------
+  Tasks
+-----------------------------------------------------------------*/
+
+static void mps_task_release(mps_task_t* task) {
+  if (mp_atomic_add(&task->refcount, (intptr_t)-1) == 1) {
+    mp_free(task);
+  }
+}
+
+static void* mps_task_start(mp_prompt_t* p, void* arg) {
+  mps_task_t* task = (mps_task_t*)arg;
+  task->prompt = p;
+  task->result = (task->fun)(task->arg);
+  task->state = MPS_TASK_DONE;
+  return NULL;
+}
+
+// Runs on the worker stack (after the task has been suspended)
+static void* mps_task_suspended(mp_resume_t* r, void* arg) {
+  mps_task_t* task = (mps_task_t*)arg;
+  task->resume = r;
+  return NULL;
+}
+
+static void mps_task_done(mps_worker_t* w, mps_task_t* task) {
+  const intptr_t waiter = mp_atomic_exchange(&task->waiter, MPS_WAITER_DONE);
+  if (waiter == MPS_WAITER_EXTERNAL) {
+    mps_mutex_lock(&mps_sched.external_lock);
+    mps_cond_broadcast(&mps_sched.external_cond);
+    mps_mutex_unlock(&mps_sched.external_lock);
+  }
+  else if (waiter != MPS_WAITER_NONE) {
+    mps_schedule(w, (mps_task_t*)waiter);
+  }
+  mps_task_release(task);
+  if (mp_atomic_add(&mps_sched.task_count, (intptr_t)-1) == 1 && mp_atomic_load(&mps_sched.stopping) != 0) {
+    mps_wake_all();
+  }
+}
+
+// Run a task (on a worker) until it is done or suspended
+static void mps_task_run(mps_worker_t* w, mps_task_t* task) {
+  w->current = task;
+  task->state = MPS_TASK_RUNNING;
+  mp_resume_t* r = task->resume;
+  if (r == NULL) {
+    mpe_prompt(&mps_task_start, task);
+  }
+  else {
+    task->resume = NULL;
+    mp_resume(r, NULL);
+  }
+  task = w->current;  // may differ after a transfer
+  w->current = NULL;
+  // the task is done or suspended
+  if (task->state == MPS_TASK_DONE) {
+    mps_task_done(w, task);
+  }
+  else if (task->state == MPS_TASK_AWAITING) {
+    mps_task_t* target = task->await_target;
+    intptr_t expected = MPS_WAITER_NONE;
+    if (!mp_atomic_cas(&target->waiter, &expected, (intptr_t)task)) {
+      mp_assert_internal(expected == MPS_WAITER_DONE);
+      mps_schedule(w, task);  // already done
+    }
+  }
+  else if (task->state == MPS_TASK_BLOCKED) {
+    if (mp_atomic_add(&task->wakeup, (intptr_t)1) == 1) {
+      mps_schedule(w, task);  // already woken up
+    }
+  }
+  else {
+    mp_assert_internal(task->state == MPS_TASK_READY);  // yielded
+    mps_schedule(w, task);
+  }
+}
+
+static void mps_worker_run(mps_worker_t* w) {
+  _mps_worker = w;
+  mp_thread_init();
+  while (true) {
+    mps_task_t* task = mps_deque_pop(&w->deque);
+    if (task == NULL) task = mps_inject_take();
+    if (task == NULL) task = mps_steal(w);
+    if (task != NULL) {
+      mps_task_run(w, task);
+    }
+    else if (mps_should_exit()) {
+      break;
+    }
+    else {
+      mps_park();
+    }
+  }
+  _mps_worker = NULL;
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI mps_thread_start(LPVOID arg) {
+  mps_worker_run((mps_worker_t*)arg);
+  return 0;
+}
+#else
+static void* mps_thread_start(void* arg) {
+  mps_worker_run((mps_worker_t*)arg);
+  return NULL;
+}
+#endif
+
+// Not inlined so the thread-local worker is never cached across a suspension of the current task
+static mp_decl_noinline mps_worker_t* mps_worker_current(void) {
+  return _mps_worker;
+}
+
+static mps_task_t* mps_task_current(void) {
+  mps_worker_t* w = mps_worker_current();
+  return (w == NULL ? NULL : w->current);
+}
+
+// Switch from the current task directly to a blocked `target` that we woke up (on the same worker)
+static void mps_task_transfer(mps_task_t* current, mps_task_t* target) {
+  mps_worker_t* w = mps_worker_current();
+  mp_assert_internal(w->current == current && w->handoff == NULL);
+  mp_resume_t* r = target->resume;
+  target->resume = NULL;
+  target->state = MPS_TASK_RUNNING;
+  current->state = MPS_TASK_READY;
+  w->current = target;
+  w->handoff = current;
+  mpe_resume_transfer(current->prompt, &current->resume, r, NULL);
+}
+
+// Called by a blocked task when it continues: schedule the task that transferred to us (if any).
+// This cannot be done before the transfer as the transferring task is still running on its own stack until then.
+static void mps_task_handoff_done(void) {
+  mps_worker_t* w = mps_worker_current();
+  mps_task_t* task = w->handoff;
+  if (task != NULL) {
+    w->handoff = NULL;
+    mps_schedule(w, task);
+  }
+}
+
+// Wake up a blocked task; with `handoff` the current task (if any) transfers to it directly
+static void mps_task_wakeup(mps_task_t* task, bool handoff) {
+  if (mp_atomic_add(&task->wakeup, (intptr_t)1) == 1) {
+    // it is suspended already
+    mps_task_t* current = (handoff ? mps_task_current() : NULL);
+    if (current != NULL) {
+      mps_task_transfer(current, task);
+    }
+    else {
+      mps_schedule(mps_worker_current(), task);
+    }
+  }
+}
+
+// Block the current task until it is woken up (with `mps_task_wakeup`)
+static void mps_task_block(mps_task_t* task) {
+  task->state = MPS_TASK_BLOCKED;
+  mpe_yield(task->prompt, &mps_task_suspended, task);
+  mps_task_handoff_done();
+}
+
+
+/*-----------------------------------------------------------------
+  Interface
+-----------------------------------------------------------------*/
+
+bool mps_start(ptrdiff_t worker_count) {
+  if (mps_sched.workers != NULL) {
+    mp_error_message(EINVAL, "the scheduler is already started\n");
+    return false;
+  }
+  const ssize_t n = (worker_count <= 0 ? mps_cpu_count() : worker_count);
+  mps_mutex_init(&mps_sched.inject_lock);
+  mps_mutex_init(&mps_sched.idle_lock);
+  mps_cond_init(&mps_sched.idle_cond);
+  mps_mutex_init(&mps_sched.external_lock);
+  mps_cond_init(&mps_sched.external_cond);
+  mps_sched.inject_first = mps_sched.inject_last = NULL;
+  mp_atomic_store(&mps_sched.inject_count, (intptr_t)0);
+  mp_atomic_store(&mps_sched.task_count, (intptr_t)0);
+  mp_atomic_store(&mps_sched.sleepers, (intptr_t)0);
+  mp_atomic_store(&mps_sched.stopping, (intptr_t)0);
+  mps_sched.workers = (mps_worker_t*)mp_zalloc_safe(n * sizeof(mps_worker_t));
+  mps_sched.worker_count = n;
+  for (ssize_t i = 0; i < n; i++) {
+    mps_worker_t* w = &mps_sched.workers[i];
+    w->id = i;
+    w->rnd = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+    mps_deque_init(&w->deque);
+  }
+  for (ssize_t i = 0; i < n; i++) {
+    mps_worker_t* w = &mps_sched.workers[i];
+    if (!mps_thread_create(&w->thread, w)) {
+      mp_fatal_message(EAGAIN, "unable to create worker thread %zd\n", i);
+    }
+  }
+  return true;
+}
+
+void mps_stop(void) {
+  if (mps_sched.workers == NULL) return;
+  mp_atomic_store(&mps_sched.stopping, (intptr_t)1);
+  mps_wake_all();
+  for (ssize_t i = 0; i < mps_sched.worker_count; i++) {
+    mps_thread_join(mps_sched.workers[i].thread);
+  }
+  for (ssize_t i = 0; i < mps_sched.worker_count; i++) {
+    mps_deque_done(&mps_sched.workers[i].deque);
+  }
+  mp_free(mps_sched.workers);
+  mps_sched.workers = NULL;
+  mps_sched.worker_count = 0;
+}
+
+mps_task_t* mps_spawn(mps_task_fun_t* fun, void* arg) {
+  mps_task_t* task = mp_zalloc_safe_tp(mps_task_t);
+  task->fun = fun;
+  task->arg = arg;
+  mp_atomic_store(&task->waiter, MPS_WAITER_NONE);
+  mp_atomic_store(&task->refcount, (intptr_t)2);
+  mp_atomic_add(&mps_sched.task_count, (intptr_t)1);
+  mps_schedule(mps_worker_current(), task);
+  return task;
+}
+
+void* mps_await(mps_task_t* task) {
+  if (mp_atomic_load(&task->waiter) != MPS_WAITER_DONE) {
+    mps_task_t* current = mps_task_current();
+    if (current != NULL) {
+      // suspend until the task is done
+      current->state = MPS_TASK_AWAITING;
+      current->await_target = task;
+      mpe_yield(current->prompt, &mps_task_suspended, current);
+    }
+    else {
+      // block the current thread
+      intptr_t expected = MPS_WAITER_NONE;
+      if (mp_atomic_cas(&task->waiter, &expected, MPS_WAITER_EXTERNAL)) {
+        mps_mutex_lock(&mps_sched.external_lock);
+        while (mp_atomic_load(&task->waiter) != MPS_WAITER_DONE) {
+          mps_cond_wait(&mps_sched.external_cond, &mps_sched.external_lock);
+        }
+        mps_mutex_unlock(&mps_sched.external_lock);
+      }
+    }
+  }
+  mp_assert_internal(mp_atomic_load(&task->waiter) == MPS_WAITER_DONE);
+  void* result = task->result;
+  mps_task_release(task);
+  return result;
+}
+
+void mps_detach(mps_task_t* task) {
+  mps_task_release(task);
+}
+
+void mps_yield(void) {
+  mps_task_t* current = mps_task_current();
+  if (current == NULL) {
+    mps_thread_yield();
+    return;
+  }
+  current->state = MPS_TASK_READY;
+  mpe_yield(current->prompt, &mps_task_suspended, current);
+}
+
+bool mps_in_task(void) {
+  return (mps_task_current() != NULL);
+}
+
+ptrdiff_t mps_worker_id(void) {
+  mps_worker_t* w = mps_worker_current();
+  return (w == NULL ? -1 : w->id);
+}
+
+
+/*-----------------------------------------------------------------
+  Channels
+
+  Each channel has a lock, a ring buffer, and queues of waiting
+  senders and receivers. The waiters are allocated on the stack of the
+  waiting task (which stays valid while it is suspended) so waiting does
+  not allocate. A select locks all its channels (in address order) and
+  either completes a ready case right away, or enqueues a waiter on each
+  channel and blocks. A waker holds just the lock of its own channel and
+  claims a waiter by setting the `done` field of its select; waiters of 
+  selects that are already done are skipped (and removed by their owner).
+-----------------------------------------------------------------*/
+
+#define MPS_SELECT_MAX  (32)
+
+typedef struct mps_select_s {
+  _Atomic(intptr_t)  done;       // index of the completed case, or -1 while waiting
+  mps_task_t*        task;       // the blocked task, or NULL if a thread is blocked
+  _Atomic(intptr_t)  signaled;   // set when a blocked thread is woken up
+} mps_select_t;
+
+typedef struct mps_waiter_s {
+  struct mps_waiter_s* next;
+  struct mps_waiter_s* prev;
+  mps_select_t*        sel;
+  mps_select_case_t*   scase;    // the case with the value to send (or to receive into)
+  intptr_t             index;    // the index of `scase`
+  bool                 queued;
+} mps_waiter_t;
+
+typedef struct mps_waitq_s {
+  mps_waiter_t* first;
+  mps_waiter_t* last;
+} mps_waitq_t;
+
+struct mps_chan_s {
+  mps_mutex_t   lock;
+  bool          closed;
+  size_t        capacity;
+  size_t        head;
+  size_t        count;
+  mps_waitq_t   senders;
+  mps_waitq_t   receivers;
+  void*         buffer[1];       // `capacity` entries
+};
+
+static void mps_waitq_push(mps_waitq_t* q, mps_waiter_t* w) {
+  w->next = NULL;
+  w->prev = q->last;
+  if (q->last == NULL) { q->first = w; }
+                  else { q->last->next = w; }
+  q->last = w;
+  w->queued = true;
+}
+
+static void mps_waitq_remove(mps_waitq_t* q, mps_waiter_t* w) {
+  if (!w->queued) return;
+  if (w->prev == NULL) { q->first = w->next; }
+                  else { w->prev->next = w->next; }
+  if (w->next == NULL) { q->last = w->prev; }
+                  else { w->next->prev = w->prev; }
+  w->next = w->prev = NULL;
+  w->queued = false;
+}
+
+// Dequeue the first waiter whose select we can claim
+static mps_waiter_t* mps_waitq_claim(mps_waitq_t* q) {
+  mps_waiter_t* w;
+  while ((w = q->first) != NULL) {
+    mps_waitq_remove(q, w);
+    intptr_t expected = -1;
+    if (mp_atomic_cas(&w->sel->done, &expected, w->index)) return w;
+  }
+  return NULL;
+}
+
+// Wake up the owner of a claimed select (after its case is completed)
+static void mps_select_wakeup(mps_select_t* sel, bool handoff) {
+  mps_task_t* task = sel->task;
+  if (task != NULL) {
+    mps_task_wakeup(task, handoff);
+  }
+  else {
+    mps_mutex_lock(&mps_sched.external_lock);
+    mp_atomic_store(&sel->signaled, (intptr_t)1);
+    mps_cond_broadcast(&mps_sched.external_cond);
+    mps_mutex_unlock(&mps_sched.external_lock);
+  }
+}
+
+static void mps_select_block(mps_select_t* sel) {
+  if (sel->task != NULL) {
+    mps_task_block(sel->task);
+  }
+  else {
+    mps_mutex_lock(&mps_sched.external_lock);
+    while (mp_atomic_load(&sel->signaled) == 0) {
+      mps_cond_wait(&mps_sched.external_cond, &mps_sched.external_lock);
+    }
+    mps_mutex_unlock(&mps_sched.external_lock);
+  }
+}
+
+// Try to complete a case (with the lock of its channel held); 
+// sets `*wake` to the select of a waiter that should be woken up.
+static bool mps_chan_try(mps_select_case_t* c, mps_select_t** wake) {
+  mps_chan_t* ch = c->chan;
+  *wake = NULL;
+  if (c->send) {
+    if (ch->closed) {
+      c->ok = false;
+      return true;
+    }
+    mps_waiter_t* r = mps_waitq_claim(&ch->receivers);  
+    if (r != NULL) {
+      // direct to a waiting receiver (the buffer is empty)
+      r->scase->value = c->value;
+      r->scase->ok = true;
+      *wake = r->sel;
+    }
+    else if (ch->count < ch->capacity) {
+      size_t tail = ch->head + ch->count;
+      if (tail >= ch->capacity) { tail -= ch->capacity; }
+      ch->buffer[tail] = c->value;
+      ch->count++;
+    }
+    else {
+      return false;
+    }
+    c->ok = true;
+    return true;
+  }
+  else {
+    if (ch->count > 0) {
+      c->value = ch->buffer[ch->head];
+      ch->head++;
+      if (ch->head == ch->capacity) { ch->head = 0; }
+      ch->count--;
+      // move a waiting sender into the buffer
+      mps_waiter_t* s = mps_waitq_claim(&ch->senders);
+      if (s != NULL) {
+        size_t tail = ch->head + ch->count;
+        if (tail >= ch->capacity) { tail -= ch->capacity; }
+        ch->buffer[tail] = s->scase->value;
+        ch->count++;
+        s->scase->ok = true;
+        *wake = s->sel;
+      }
+      c->ok = true;
+      return true;
+    }
+    mps_waiter_t* s = mps_waitq_claim(&ch->senders);
+    if (s != NULL) {
+      c->value = s->scase->value;
+      c->ok = true;
+      s->scase->ok = true;
+      *wake = s->sel;
+      return true;
+    }
+    if (ch->closed) {
+      c->value = NULL;
+      c->ok = false;
+      return true;
+    }
+    return false;
+  }
+}
+
+// Sort the distinct channels of the cases by address (to lock them in a fixed order)
+static size_t mps_select_lock_order(mps_select_case_t* cases, size_t n, mps_chan_t** order) {
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    mps_chan_t* ch = cases[i].chan;
+    size_t j = m;
+    while (j > 0 && (uintptr_t)order[j-1] > (uintptr_t)ch) { j--; }
+    if (j > 0 && order[j-1] == ch) continue;  // duplicate
+    memmove(&order[j+1], &order[j], (m - j) * sizeof(mps_chan_t*));
+    order[j] = ch;
+    m++;
+  }
+  return m;
+}
+
+static void mps_select_lock(mps_chan_t** order, size_t m) {
+  for (size_t i = 0; i < m; i++) { mps_mutex_lock(&order[i]->lock); }
+}
+
+static void mps_select_unlock(mps_chan_t** order, size_t m) {
+  for (size_t i = m; i > 0; i--) { mps_mutex_unlock(&order[i-1]->lock); }
+}
+
+ptrdiff_t mps_select(mps_select_case_t* cases, size_t n, bool block) {
+  if (n > MPS_SELECT_MAX) {
+    mp_error_message(EINVAL, "too many select cases (%zu, at most %d)\n", n, MPS_SELECT_MAX);
+    return -1;
+  }
+  mps_chan_t* order[MPS_SELECT_MAX];
+  const size_t m = mps_select_lock_order(cases, n, order);
+  mps_select_lock(order, m);
+  // complete the first case that is ready
+  for (size_t i = 0; i < n; i++) {
+    mps_select_t* wake;
+    if (mps_chan_try(&cases[i], &wake)) {
+      mps_select_unlock(order, m);
+      if (wake != NULL) {
+        mps_select_wakeup(wake, cases[i].send);  // hand off to a receiver
+      }
+      return (ptrdiff_t)i;
+    }
+  }
+  if (!block || n == 0) {
+    mps_select_unlock(order, m);
+    return -1;
+  }
+  // wait on all channels
+  mps_select_t sel;
+  mp_atomic_store(&sel.done, (intptr_t)-1);
+  mp_atomic_store(&sel.signaled, (intptr_t)0);
+  sel.task = mps_task_current();
+  if (sel.task != NULL) {
+    mp_atomic_store(&sel.task->wakeup, (intptr_t)0);
+  }
+  mps_waiter_t waiters[MPS_SELECT_MAX];
+  for (size_t i = 0; i < n; i++) {
+    mps_waiter_t* w = &waiters[i];
+    w->sel = &sel;
+    w->scase = &cases[i];
+    w->index = (intptr_t)i;
+    mps_waitq_push((cases[i].send ? &cases[i].chan->senders : &cases[i].chan->receivers), w);
+  }
+  mps_select_unlock(order, m);
+  mps_select_block(&sel);
+  // and remove the waiters that were not claimed
+  mps_select_lock(order, m);
+  for (size_t i = 0; i < n; i++) {
+    mps_waitq_remove((cases[i].send ? &cases[i].chan->senders : &cases[i].chan->receivers), &waiters[i]);
+  }
+  mps_select_unlock(order, m);
+  return (ptrdiff_t)mp_atomic_load(&sel.done);
+}
+
+mps_chan_t* mps_chan_create(size_t capacity) {
+  mps_chan_t* ch = (mps_chan_t*)mp_zalloc_safe(sizeof(mps_chan_t) + (capacity > 0 ? capacity - 1 : 0) * sizeof(void*));
+  mps_mutex_init(&ch->lock);
+  ch->capacity = capacity;
+  return ch;
+}
+
+void mps_chan_free(mps_chan_t* ch) {
+  if (ch == NULL) return;
+  mp_assert(ch->senders.first == NULL && ch->receivers.first == NULL);
+  mp_free(ch);
+}
+
+void mps_chan_close(mps_chan_t* ch) {
+  mps_waiter_t* woken = NULL;
+  mps_mutex_lock(&ch->lock);
+  if (!ch->closed) {
+    ch->closed = true;
+    mps_waiter_t* w;
+    while ((w = mps_waitq_claim(&ch->receivers)) != NULL) {
+      w->scase->value = NULL;
+      w->scase->ok = false;
+      w->next = woken; woken = w;
+    }
+    while ((w = mps_waitq_claim(&ch->senders)) != NULL) {
+      w->scase->ok = false;
+      w->next = woken; woken = w;
+    }
+  }
+  mps_mutex_unlock(&ch->lock);
+  while (woken != NULL) {
+    mps_waiter_t* next = woken->next;  // read before the waiter's stack can go away
+    mps_select_wakeup(woken->sel, false);
+    woken = next;
+  }
+}
+
+bool mps_chan_send(mps_chan_t* ch, void* value) {
+  mps_select_case_t c = { ch, true, false, value };
+  mps_select(&c, 1, true);
+  return c.ok;
+}
+
+bool mps_chan_recv(mps_chan_t* ch, void** value) {
+  mps_select_case_t c = { ch, false, false, NULL };
+  mps_select(&c, 1, true);
+  if (value != NULL) { *value = c.value; }
+  return c.ok;
+}
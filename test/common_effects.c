@@ -127,6 +127,24 @@ void* gstate_handle(mpe_actionfun_t action, long init, void* arg) {
   return mpe_handle(&gstate_hdef, mpe_voidp_long(init), action, arg);
 }
 
+// Set suspends (and is invoked again at the handler) for every 1000th value
+static void* handle_tstate_set(mpe_resume_t* r, void* local, void* arg) {
+  if (mpe_resume_is_tentative(r) && (mpe_long_voidp(arg) % 1000) == 0) {
+    return mpe_resume_suspend(r);
+  }
+  return handle_state_set(r, local, arg);
+}
+
+static const mpe_handlerdef_t tstate_hdef = { MPE_EFFECT(state), NULL, {
+  { MPE_OP_MAYBE_TAIL, MPE_OPTAG(state,get), &handle_state_get },
+  { MPE_OP_MAYBE_TAIL, MPE_OPTAG(state,set), &handle_tstate_set },
+  { MPE_OP_NULL, mpe_op_null, NULL }
+} };
+
+void* tstate_handle(mpe_actionfun_t action, long init, void* arg) {
+  return mpe_handle(&tstate_hdef, mpe_voidp_long(init), action, arg);
+}
+
 
 /*-----------------------------------------------------------------
    ambiguity handler
@@ -22,6 +22,32 @@ static void* bench_xor(void* arg) {
   return mpe_voidp_bool((x && !y) || (!x && y));
 }
 
+/*-----------------------------------------------------------------
+  Resume the second branch in a clone 
+-----------------------------------------------------------------*/
+
+static void* handle_amb_result(void* local, void* arg) {
+  UNUSED(local);  
+  return mpe_voidp_blist( blist_single(arg) );
+}
+
+static void* handle_amb_clone_flip(mpe_resume_t* rc, void* local, void* arg) {
+  UNUSED(arg);
+  mpe_resume_t* rclone = mpe_resume_clone(rc);   // could be resumed on another thread
+  mpt_assert(rclone != NULL, "amb clone");
+  blist xs = mpe_blist_voidp( mpe_resume_final(rclone,local,mpe_voidp_bool(false)));
+  blist ys = mpe_blist_voidp( mpe_resume_final(rc,local,mpe_voidp_bool(true)));
+  return mpe_voidp_blist(blist_appendto(xs,ys));
+}
+
+static blist amb_clone_handle(mpe_actionfun_t* action, void* arg) {
+  static const mpe_handlerdef_t amb_clone_def = { MPE_EFFECT(amb), &handle_amb_result, {
+    { MPE_OP_SCOPED, MPE_OPTAG(amb,flip), &handle_amb_clone_flip },
+    { MPE_OP_NULL, mpe_op_null, NULL }
+  }};
+  return mpe_blist_voidp( mpe_handle(&amb_clone_def, NULL, action, arg) );
+}
+
 /*-----------------------------------------------------------------
   Bench
 -----------------------------------------------------------------*/
@@ -35,6 +61,11 @@ static void test() {
   mpt_printf("amb:      : "); blist_println(xs, &print_bool); 
   mpt_assert(blist_length(xs)==4, "ambxor");
   blist_free(xs);  
+
+  mpt_bench{ xs = mpe_blist_voidp(amb_clone_handle(&bench_xor, NULL)); }
+  mpt_printf("amb-clone : "); blist_println(xs, &print_bool); 
+  mpt_assert(blist_length(xs)==4, "ambxor-clone");
+  blist_free(xs);  
 }
 
 
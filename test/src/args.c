@@ -0,0 +1,90 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/* ----------------------------------------------------------------------------
+   Operations with two arguments (`mpe_perform2`)
+-----------------------------------------------------------------------------*/
+#include "test.h"
+
+MPE_DEFINE_EFFECT2(accum, add, stop)
+MPE_DEFINE_OP2(accum, add, long, long, long)
+MPE_DEFINE_VOIDOP2(accum, stop, long, long)
+
+// add `x*y` to the accumulator and return the new total
+static void* handle_accum_add(mpe_resume_t* r, void* local, void* arg0, void* arg1) {
+  long total = mpe_long_voidp(local) + mpe_long_voidp(arg0)*mpe_long_voidp(arg1);
+  return mpe_resume_tail(r, mpe_voidp_long(total), mpe_voidp_long(total));
+}
+
+// the total if the last factors were equal; -1 otherwise
+static void* handle_accum_stop(mpe_resume_t* r, void* local, void* arg0, void* arg1) {
+  UNUSED(r);
+  return (arg0 == arg1 ? local : mpe_voidp_long(-1));
+}
+
+static void* accum_handle(mpe_opkind_t addkind, mpe_actionfun_t action, void* arg) {
+  const mpe_handlerdef_t accum_hdef = { MPE_EFFECT(accum), NULL, {
+    { addkind, MPE_OPTAG(accum,add), NULL, &handle_accum_add },
+    { MPE_OP_ABORT, MPE_OPTAG(accum,stop), NULL, &handle_accum_stop },
+    { MPE_OP_NULL, mpe_op_null, NULL, NULL }
+  } };
+  return mpe_handle(&accum_hdef, mpe_voidp_long(0), action, arg);
+}
+
+
+/*-----------------------------------------------------------------
+  Benchmark
+-----------------------------------------------------------------*/
+
+static void* bench_accum(void* arg) {
+  long count = mpe_long_voidp(arg);
+  long total = 0;
+  for (long i = 0; i < count; i++) {
+    total = accum_add(i, 2);
+  }
+  return mpe_voidp_long(total);
+}
+
+static void* bench_accum_stop(void* arg) {
+  long count = mpe_long_voidp(arg);
+  accum_add(count, count);
+  accum_stop(count, count);
+  return mpe_voidp_long(0);  // never reached
+}
+
+
+/*-----------------------------------------------------------------
+  Run
+-----------------------------------------------------------------*/
+static void test(long count) {
+  const long expect = count*(count - 1);
+  long res = 0;
+  mpt_bench{ res = mpe_long_voidp(accum_handle(MPE_OP_TAIL_NOOP, &bench_accum, mpe_voidp_long(count))); }
+  mpt_printf("accum     : %ld\n", res);
+  mpt_assert(res == expect, "accum");
+
+  mpt_bench{ res = mpe_long_voidp(accum_handle(MPE_OP_TAIL, &bench_accum, mpe_voidp_long(count))); }
+  mpt_printf("uaccum    : %ld\n", res);
+  mpt_assert(res == expect, "uaccum");
+
+  mpt_bench{ res = mpe_long_voidp(accum_handle(MPE_OP_SCOPED_ONCE, &bench_accum, mpe_voidp_long(count/10))); }
+  mpt_printf("gaccum    : %ld\n", res);
+  mpt_assert(res == (count/10)*(count/10 - 1), "gaccum");
+
+  res = mpe_long_voidp(accum_handle(MPE_OP_ONCE, &bench_accum_stop, mpe_voidp_long(100)));
+  mpt_printf("saccum    : %ld\n", res);
+  mpt_assert(res == 100*100, "saccum");
+}
+
+
+void args_run(void) {
+#ifdef NDEBUG
+  test(10010010L);
+#else
+  test(100100L);
+#endif
+}
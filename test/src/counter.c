@@ -25,6 +25,19 @@ static void* bench_counter(void* arg) {
 }
 
 
+static void* bench_counter_ev(void* arg) {
+  UNUSED(arg);
+  mpe_evidence_t ev = mpe_evidence_find(MPE_EFFECT(state));
+  long count = 0;
+  long i;
+  while ((i = mpe_long_voidp(mpe_perform_ev(ev, MPE_OPTAG(state,get), NULL))) > 0) {
+    mpe_perform_ev(ev, MPE_OPTAG(state,set), mpe_voidp_long(i-1));
+    count++;
+  }
+  return mpe_voidp_long(count);
+}
+
+
 /*-----------------------------------------------------------------
   Run
 -----------------------------------------------------------------*/
@@ -34,6 +47,10 @@ static void test(long count) {
   mpt_printf("counter   : %ld\n", res);
   mpt_assert(res == count, "counter");
 
+  mpt_bench{ res = mpe_long_voidp(state_handle(&bench_counter_ev, count, NULL)); }
+  mpt_printf("ecounter  : %ld\n", res);
+  mpt_assert(res == count, "ecounter");
+
   mpt_bench{ res = mpe_long_voidp(ustate_handle(&bench_counter, count, NULL)); }
   mpt_printf("ucounter  : %ld\n", res);
   mpt_assert(res == count, "ucounter");
@@ -42,6 +59,10 @@ static void test(long count) {
   mpt_printf("ocounter  : %ld\n", res);
   mpt_assert(res == count, "ocounter");
 
+  mpt_bench{ res = mpe_long_voidp(tstate_handle(&bench_counter, count, NULL)); }
+  mpt_printf("tcounter  : %ld\n", res);
+  mpt_assert(res == count, "tcounter");
+
   mpt_bench{ res = mpe_long_voidp(gstate_handle(&bench_counter, count/10, NULL)); }  
   mpt_printf("gcounter  : %ld\n", res);
   mpt_assert(res == count/10, "gcounter");
@@ -0,0 +1,100 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/* ----------------------------------------------------------------------------
+   Aborting through nested handlers with finalizers (`MPE_OP_ABORT_FINALLY`)
+-----------------------------------------------------------------------------*/
+#include "test.h"
+
+MPE_DEFINE_EFFECT1(cancel, cancel)
+MPE_DEFINE_VOIDOP1(cancel, cancel, long)
+
+static void* handle_cancel(mpe_resume_t* r, void* local, void* arg) {
+  UNUSED(r); UNUSED(local);
+  return arg;
+}
+
+static void* cancel_handle(mpe_opkind_t kind, mpe_actionfun_t action, void* arg) {
+  const mpe_handlerdef_t cancel_hdef = { MPE_EFFECT(cancel), NULL, {
+    { kind, MPE_OPTAG(cancel,cancel), &handle_cancel, NULL },
+    { MPE_OP_NULL, mpe_op_null, NULL, NULL }
+  } };
+  return mpe_handle(&cancel_hdef, NULL, action, arg);
+}
+
+
+/*-----------------------------------------------------------------
+  Benchmark
+-----------------------------------------------------------------*/
+
+static long finalized;
+
+static void release(void* local) {
+  // the handlers outside of the finally frame are still available
+  finalized += (state_get() == mpe_long_voidp(local) ? 1 : 1000);
+}
+
+static void* nested_finally(void* arg);
+
+// nest `depth` state handlers, each with a finalizer, and cancel at the bottom
+static void* nested(void* arg) {
+  long depth = mpe_long_voidp(arg);
+  if (depth <= 0) {
+    cancel_cancel(42);
+    return mpe_voidp_long(-1);  // never reached
+  }
+  return state_handle(&nested_finally, depth, mpe_voidp_long(depth - 1));
+}
+
+static void* nested_finally(void* arg) {
+  return mpe_finally(mpe_voidp_long(mpe_long_voidp(arg) + 1), &release, &nested, arg);
+}
+
+// after aborting, the handlers outside the cancel handler are intact
+static void* cancel_under_state(void* arg) {
+  UNUSED(arg);
+  cancel_handle(MPE_OP_ABORT_FINALLY, &nested, mpe_voidp_long(3));
+  return mpe_voidp_long(state_get());
+}
+
+
+/*-----------------------------------------------------------------
+  Run
+-----------------------------------------------------------------*/
+static void test(long count, long depth) {
+  long res = 0;
+  finalized = 0;
+  mpt_bench{
+    for (long i = 0; i < count; i++) {
+      res += mpe_long_voidp(cancel_handle(MPE_OP_ABORT_FINALLY, &nested, mpe_voidp_long(depth)));
+    }
+  }
+  mpt_printf("fcancel   : %ld, %ld\n", res, finalized);
+  mpt_assert(res == 42*count && finalized == depth*count, "fcancel");
+
+  // in C, `MPE_OP_NEVER` runs the finalizers in the same way; in C++ through an exception
+  res = 0;
+  finalized = 0;
+  mpt_bench{
+    for (long i = 0; i < count/10; i++) {
+      res += mpe_long_voidp(cancel_handle(MPE_OP_NEVER, &nested, mpe_voidp_long(depth)));
+    }
+  }
+  mpt_printf("ncancel   : %ld, %ld\n", res, finalized);
+  mpt_assert(res == 42*(count/10) && finalized == depth*(count/10), "ncancel");
+
+  res = mpe_long_voidp(state_handle(&cancel_under_state, 7, NULL));
+  mpt_assert(res == 7, "cancel state");
+}
+
+void finally_run(void) {
+#ifdef NDEBUG
+  test(100000L, 10);
+#else
+  test(10000L, 10);
+#endif
+}
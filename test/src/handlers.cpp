@@ -0,0 +1,158 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/* ----------------------------------------------------------------------------
+   Handlers defined with the C++ layer (`mpeff.hpp`)
+-----------------------------------------------------------------------------*/
+#include <vector>
+#include <mpeff.hpp>
+#include "test.h"
+
+namespace {
+
+// State
+struct counter;
+struct get : mpe::op<counter, long()> { static constexpr const char* name = "get"; };
+struct set : mpe::op<counter, void(long)> { static constexpr const char* name = "set"; };
+struct counter : mpe::effect<counter, get, set> { static constexpr const char* name = "counter"; };
+
+struct counter_handler {
+  long st;
+  long operator()(get) { return st; }
+  void operator()(set, long x) { st = x; }
+  static constexpr mpe_opkind_t opkind(get) { return MPE_OP_TAIL_NOOP; }
+  static constexpr mpe_opkind_t opkind(set) { return MPE_OP_TAIL_NOOP; }
+};
+
+struct ucounter_handler {   // as MPE_OP_TAIL
+  long st;
+  long operator()(get) { return st; }
+  void operator()(set, long x) { st = x; }
+};
+
+// Ambiguity
+struct choose;
+struct flip : mpe::op<choose, bool()> { static constexpr const char* name = "flip"; };
+struct choose : mpe::effect<choose, flip> { static constexpr const char* name = "choose"; };
+
+struct all_handler {
+  std::vector<bool> operator()(flip, mpe::resume<bool, std::vector<bool>> k) {
+    std::vector<bool> xs = k(true);
+    std::vector<bool> ys = k(false);
+    xs.insert(xs.end(), ys.begin(), ys.end());
+    return xs;
+  }
+  static constexpr mpe_opkind_t opkind(flip) { return MPE_OP_MULTI; }
+};
+
+// Exceptions (never resuming)
+struct except;
+struct raise : mpe::op<except, long(const char*)> { static constexpr const char* name = "raise"; };
+struct except : mpe::effect<except, raise> { static constexpr const char* name = "except"; };
+
+struct except_handler {
+  const char* msg = nullptr;
+  long operator()(raise, mpe::resume<long, long> k, const char* s) {
+    (void)(k);      // released (and the performer unwound) when `k` is destructed
+    msg = s;
+    return -1;
+  }
+};
+
+}
+
+
+/*-----------------------------------------------------------------
+  Benchmark
+-----------------------------------------------------------------*/
+
+static long bench_counter(void) {
+  long count = 0;
+  long i;
+  while ((i = mpe::perform<get>()) > 0) {
+    mpe::perform<set>(i - 1);
+    count++;
+  }
+  return count;
+}
+
+static long bench_counter_ev(mpe::evidence<counter_handler> ev) {
+  long count = 0;
+  long i;
+  while ((i = ev.perform<get>()) > 0) {
+    ev.perform<set>(i - 1);
+    count++;
+  }
+  return count;
+}
+
+static bool d_destructed;
+
+static long bench_raise(void) {
+  test_raii_t d("d", &d_destructed);
+  long x = mpe::perform<get>();
+  if (x > 0) {
+    mpe::perform<raise>("x > 0");
+  }
+  return x;
+}
+
+
+/*-----------------------------------------------------------------
+  Run
+-----------------------------------------------------------------*/
+
+static void test(long count) {
+  long res = 0;
+  mpt_bench{
+    counter_handler h{ count };
+    res = mpe::handle<counter>(h, [] { return bench_counter(); });
+  }
+  mpt_printf("hpp-counter : %ld\n", res);
+  mpt_assert(res == count, "hpp-counter");
+
+  mpt_bench{
+    counter_handler h{ count };
+    res = mpe::handle<counter>(h, [](mpe::evidence<counter_handler> ev) { return bench_counter_ev(ev); });
+  }
+  mpt_printf("hpp-ecounter: %ld\n", res);
+  mpt_assert(res == count, "hpp-ecounter");
+
+  mpt_bench{
+    ucounter_handler h{ count };
+    res = mpe::handle<counter>(h, [] { return bench_counter(); });
+    mpt_assert(h.st == 0, "hpp-ucounter state");
+  }
+  mpt_printf("hpp-ucounter: %ld\n", res);
+  mpt_assert(res == count, "hpp-ucounter");
+
+  std::vector<bool> xs;
+  all_handler ah;
+  mpt_bench{
+    xs = mpe::handle<choose>(ah, [] {
+      bool x = mpe::perform<flip>();
+      bool y = mpe::perform<flip>();
+      return std::vector<bool>{ x != y };
+    });
+  }
+  mpt_printf("hpp-amb     : %zu\n", xs.size());
+  mpt_assert(xs.size() == 4 && !xs[0] && xs[1] && xs[2] && !xs[3], "hpp-amb");
+
+  except_handler eh;
+  counter_handler ch{ 1 };
+  res = mpe::handle<except>(eh, [&] { return mpe::handle<counter>(ch, [] { return bench_raise(); }); });
+  mpt_printf("hpp-except  : %ld, %s\n", res, eh.msg);
+  mpt_assert(res == -1 && eh.msg != nullptr && d_destructed, "hpp-except");
+}
+
+void handlers_run(void) {
+#ifdef NDEBUG
+  test(10010010L);
+#else
+  test(100100L);
+#endif
+}
@@ -0,0 +1,59 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/* ----------------------------------------------------------------------------
+   Handler profiles per effect (with `prompt_profile` enabled)
+-----------------------------------------------------------------------------*/
+#include "test.h"
+
+static void* yield_loop(void* arg) {
+  long n = mpe_long_voidp(arg);
+  long sum = 0;
+  for (long i = 0; i < n; i++) {
+    sum += state_get();
+  }
+  return mpe_voidp_long(sum);
+}
+
+static void* ask_loop(void* arg) {
+  long n = mpe_long_voidp(arg);
+  long sum = 0;
+  for (long i = 0; i < n; i++) {
+    sum += reader_ask();
+  }
+  return mpe_voidp_long(sum);
+}
+
+static const mpe_effect_profile_t* profile_find(const mpe_effect_profile_t* profiles, size_t count, mpe_effect_t effect) {
+  for (size_t i = 0; i < count; i++) {
+    if (profiles[i].effect == effect) return &profiles[i];
+  }
+  return NULL;
+}
+
+void profile_run(void) {
+  mpe_effect_profiles_reset();
+  // a chatty yield loop (every `get` yields to the general state handler) and a tail resumptive one
+  long res = mpe_long_voidp(gstate_handle(&yield_loop, 1, mpe_voidp_long(1000)));
+  mpt_assert(res == 1000, "gstate loop");
+  res = mpe_long_voidp(reader_handle(&ask_loop, 1, mpe_voidp_long(1000)));
+  mpt_assert(res == 1000, "reader loop");
+  mpe_effect_profile_t profiles[16];
+  size_t count = mpe_effect_profiles(profiles, 16);
+  if (count > 16) { count = 16; }
+  const mpe_effect_profile_t* state = profile_find(profiles, count, MPE_EFFECT(state));
+  const mpe_effect_profile_t* reader = profile_find(profiles, count, MPE_EFFECT(reader));
+  if (state == NULL) {
+    mpt_assert(reader == NULL, "no profiles without `prompt_profile`");
+    return;
+  }
+  mpt_assert(reader != NULL, "profiled effects");
+  mpt_printf("profile   : state: %zu resumes in %llu ticks, reader: %zu resumes in %llu ticks\n", 
+             state->resumes, state->ticks, reader->resumes, reader->ticks);
+  mpt_assert(state->handled >= 1 && state->resumes >= 1000 && state->ticks > 0, "state profile");
+  mpt_assert(reader->handled >= 1 && reader->resumes == 0, "reader profile");
+}
@@ -27,6 +27,17 @@ void* reader_action(void* arg) {
   return mpe_voidp_long( i + reader_ask());
 }
 
+// Ask through many handlers of another effect (beyond the handler frame arena if that is enabled)
+static void* deep_action(void* arg) {
+  long depth = mpe_long_voidp(arg);
+  if (depth > 0) return ostate_handle(&deep_action, depth, mpe_voidp_long(depth - 1));
+  long sum = 0;
+  for (int i = 0; i < 10; i++) {
+    sum += reader_ask() + state_get();
+  }
+  return mpe_voidp_long(sum);
+}
+
 /*-----------------------------------------------------------------
   testing
 -----------------------------------------------------------------*/
@@ -39,5 +50,8 @@ void reader_run(void) {
   mpt_bench{ res = mpe_long_voidp(greader_handle(reader_action, init, NULL)); }
   mpt_printf("greader   : %ld\n", res);
   mpt_assert(res == 2*init, "greader");
+  res = mpe_long_voidp(greader_handle(&deep_action, init, mpe_voidp_long(300)));
+  mpt_printf("dreader   : %ld\n", res);
+  mpt_assert(res == 10*(init + 1), "dreader");
 }
 
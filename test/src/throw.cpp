@@ -46,7 +46,43 @@ static void test(long count) {
 }
 
 
+// Throw through prompts while another exception is in flight (in a destructor during unwinding):
+// the delayed gstacks must be freed once each inner exception is caught
+static long storm_caught;
+
+struct storm_t {
+  long count;
+  ~storm_t() {
+    for (long i = 0; i < count; i++) {
+      try {
+        state_handle(&bench_reader, 100, NULL);
+      }
+      catch (const std::exception&) {
+        storm_caught++;
+      }
+    }
+  }
+};
+
+static void test_storm(long count) {
+  storm_caught = 0;
+  mp_stats_t stats0, stats;
+  mp_stats_get(&stats0);
+  try {
+    storm_t storm = { count };
+    throw std::logic_error("outer");
+  }
+  catch (const std::exception&) {
+    mp_stats_get(&stats);
+  }
+  mpt_printf("test-storm : %ld caught, %zu delayed\n", storm_caught, stats.gstack_delayed);
+  mpt_assert(storm_caught == count, "test-storm");
+  mpt_assert(stats.gstack_delayed <= stats0.gstack_delayed + 4, "test-storm delayed");
+  mpt_assert(stats.gstack_delayed_forced == stats0.gstack_delayed_forced, "test-storm forced");
+}
+
 void throw_run(void) {
   test(100);
+  test_storm(1000);
 }
 
@@ -31,11 +31,14 @@ void reader_run(void);
 void state_run(void);
 void counter_run(void);
 void countern_run(void);
+void args_run(void);
+void finally_run(void);
 void mstate_run(void);
 void nqueens_run(void);
 void amb_run(void);
 void amb_state_run(void);
 void rehandle_run(void);
+void profile_run(void);
 
 
 #ifdef __cplusplus
@@ -43,12 +46,14 @@ void throw_run(void);
 void exn_run(void);
 void multi_unwind_run(void);
 void thread_rehandle_run(void);
+void handlers_run(void);
 #else
 // dummies in C
 static inline void throw_run(void) { }
 static inline void exn_run(void) { }
 static inline void multi_unwind_run(void) { };
 static inline void thread_rehandle_run(void) { };
+static inline void handlers_run(void) { };
 #endif
 
 #ifdef __cplusplus
@@ -94,6 +99,7 @@ void* state_handle(mpe_actionfun_t* action, long init, void* arg);    // tail_no
 void* ustate_handle(mpe_actionfun_t* action, long init, void* arg);   // tail
 void* gstate_handle(mpe_actionfun_t* action, long init, void* arg);   // general
 void* ostate_handle(mpe_actionfun_t* action, long init, void* arg);   // scoped_once
+void* tstate_handle(mpe_actionfun_t* action, long init, void* arg);   // maybe_tail
 
 // Ambiguity
 MPE_DECLARE_EFFECT1(amb, flip)
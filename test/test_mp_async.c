@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <mprompt.h>
 #include "test.h"
 
@@ -17,16 +19,35 @@
 #define USE_KB       32    // use 32KiB stack per request
 
 static void async_workers(void);
+static void async_workers_batch(void);
+static void async_workers_small(void);
+static void async_commit_hints(void);
+static void async_trim(void);
+static void async_clone(void);
+static void async_serialize(void);
+static void async_profile(void);
+static void async_stats(void);
 
-int main() {
+int main(int argc, char** argv) {
   mp_config_t config = mp_config_default();
   //config.stack_use_overcommit = true;  // easier debugging in gdb/lldb as no SEGV signals are used
   //config.gpool_enable = true;
   //config.stack_grow_fast = true;
   //config.stack_cache_count = -1; // disable per-thread cache
+  if (argc > 1 && strcmp(argv[1], "--profile") == 0) {
+    config.prompt_profile = true;   // see `async_profile`
+  }
   mp_init(&config);
 
   async_workers();
+  async_workers_batch();
+  async_workers_small();
+  async_commit_hints();
+  async_trim();
+  async_clone();
+  async_serialize();
+  async_profile();
+  async_stats();
   return 0;
 }
 
@@ -110,3 +131,382 @@ static void async_workers(void) {
   printf("Total of %d prompts with %d active at a time\nUsing %dkb stack per request, total stack used: %.3fmb, count=%zd\n", M, N, USE_KB, total_mb, count);
 }
 
+
+
+// -------------------------------
+// Async workers that are resumed in batches (as when draining a completion queue)
+
+#define BATCH_YIELDS  10
+
+static void* async_batch_worker(mp_prompt_t* parent, void* arg) {
+  (void)(arg);
+  intptr_t kb = 0;
+  for (int i = 0; i < BATCH_YIELDS; i++) {
+    kb = (intptr_t)mp_yield(parent, &await_result, NULL);  // await a request
+  }
+  stack_use(kb);
+  return NULL;  // done
+}
+
+static void async_workers_batch(void) {
+  mp_resume_t** workers = (mp_resume_t**)calloc(N, sizeof(mp_resume_t*));
+  void** args = (void**)calloc(N, sizeof(void*));
+  void** results = (void**)calloc(N, sizeof(void*));
+  for (int j = 0; j < N; j++) { args[j] = (void*)((intptr_t)USE_KB); }
+  const intptr_t total = M/100;
+  intptr_t started = 0;
+  intptr_t count = 0;
+  printf("run batched requests...\n");
+  size_t start_rss;
+  mpt_timer_t start = mpt_show_process_info_start(&start_rss);
+  size_t active = 0;
+  for (; active < N; active++, started++) {
+    workers[active] = (mp_resume_t*)mp_prompt(&async_batch_worker, NULL);
+  }
+  while (active > 0) {
+    // resume all suspended workers at once
+    mp_resume_batch(workers, args, active, results);
+    size_t k = 0;
+    for (size_t j = 0; j < active; j++) {
+      if (results[j] != NULL) {
+        workers[k++] = (mp_resume_t*)results[j];   // suspended again
+      }
+      else {
+        count++;
+        if (started < total) {
+          workers[k++] = (mp_resume_t*)mp_prompt(&async_batch_worker, NULL);
+          started++;
+        }
+      }
+    }
+    active = k;
+  }
+  free(workers);
+  free(args);
+  free(results);
+  mpt_show_process_info(stdout, start, start_rss);
+  printf("Total of %zd prompts with %d active at a time, resumed %d times each in batches, count=%zd\n", total, N, BATCH_YIELDS, count);
+  mpt_assert(count == total, "batched resume count");
+}
+
+
+
+// -------------------------------
+// Async workers in gstacks of the small size class
+
+#define SMALL_KB  64
+
+static void async_workers_small(void) {
+  const mp_config_t config = mp_config_default();
+  mp_resume_t** workers = (mp_resume_t**)calloc(N, sizeof(mp_resume_t*));
+  const intptr_t total = M/10;
+  intptr_t count = 0;
+  printf("run requests in small gstacks...\n");
+  size_t start_rss;
+  mpt_timer_t start = mpt_show_process_info_start(&start_rss);
+  for (intptr_t i = 0; i < total + N; i++) {
+    const size_t j = (size_t)(i % N);
+    if (workers[j] != NULL) {
+      mp_resume(workers[j], (void*)((intptr_t)USE_KB));   // completes the worker
+      count++;
+    }
+    workers[j] = (i < total ? (mp_resume_t*)mp_prompt_enter(mp_prompt_create_ex(SMALL_KB * 1024, 0), &async_worker, NULL) : NULL);
+  }
+  free(workers);
+  mpt_show_process_info(stdout, start, start_rss);
+  printf("Total of %zd prompts with %dKiB stacks and %d active at a time, count=%zd\n", total, SMALL_KB, N, count);
+  mpt_assert(count == total, "small resume count");
+  // the small gstacks live in their own gpool with smaller blocks
+  if (config.gpool_enable && config.stack_small_size > 0) {
+    mp_gpool_stats_t gstats[16];
+    const size_t n = mp_stats_get_gpools(gstats, 16);
+    bool found = false;
+    for (size_t i = 0; i < n && i < 16; i++) {
+      if (gstats[i].blocks > 0 && gstats[i].size / gstats[i].blocks <= (size_t)config.stack_small_size) found = true;
+      mpt_assert(config.gpool_numa ? gstats[i].numa_node >= -1 : gstats[i].numa_node == -1, "gpool numa node");
+    }
+    mpt_assert(found, "small gpool");
+  }
+}
+
+
+// -------------------------------
+// Commit stack up front with a hint, or as learned at a call site.
+// We use the large size class so the gstacks are fresh and would page fault otherwise.
+
+#define HINT_KB     96
+#define HINT_COUNT  100
+
+static void* hint_worker(mp_prompt_t* parent, void* arg) {
+  (void)(arg);
+  intptr_t kb = (intptr_t)mp_yield(parent, &await_result, NULL);
+  stack_use(kb);
+  return NULL;
+}
+
+static size_t hint_run(mp_prompt_site_t* site, size_t commit_hint) {
+  const mp_config_t config = mp_config_default();
+  if (config.stack_large_size == 0) return 0;
+  mp_stats_t stats;
+  mp_stats_get(&stats);
+  const size_t faults = stats.commit_faults;
+  mp_resume_t* workers[HINT_COUNT];
+  for (int i = 0; i < HINT_COUNT; i++) {
+    mp_prompt_t* p = (site != NULL ? mp_prompt_create_at(site, (size_t)config.stack_large_size / 2) 
+                                   : mp_prompt_create_ex((size_t)config.stack_large_size / 2, commit_hint));
+    workers[i] = (mp_resume_t*)mp_prompt_enter(p, &hint_worker, NULL);
+  }
+  for (int i = 0; i < HINT_COUNT; i++) {
+    mp_resume(workers[i], (void*)((intptr_t)HINT_KB));
+  }
+  mp_stats_get(&stats);
+  return (stats.commit_faults - faults);
+}
+
+static void async_commit_hints(void) {
+  const size_t faults_hinted = hint_run(NULL, (HINT_KB + 16) * 1024);
+  static mp_prompt_site_t site;
+  hint_run(&site, 0);   // learn
+  const size_t faults_learned = hint_run(&site, 0);
+  printf("commit hints: %zu faults with a hint, %zu after learning (site commit: %zdkb)\n", faults_hinted, faults_learned, site.commit / 1024);
+  mpt_assert(faults_hinted == 0, "commit hint");
+  mpt_assert(site.commit == 0 || site.commit >= HINT_KB * 1024, "learned commit");
+}
+
+
+// -------------------------------
+// Trim a long lived prompt after a deep excursion
+
+#define TRIM_DEEP_KB  2048
+
+static void* trim_worker(mp_prompt_t* parent, void* arg) {
+  (void)(arg);
+  for (int i = 0; i < 2; i++) {
+    stack_use(TRIM_DEEP_KB);            // deep excursion
+    mp_yield(parent, &await_result, NULL);
+    mp_yield(parent, &await_result, NULL);
+  }
+  return NULL;
+}
+
+static void async_trim(void) {
+  mp_stats_t stats;
+  mp_stats_get(&stats);
+  const size_t trims = stats.commit_trims;
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&trim_worker, NULL);
+  size_t total = 0;
+  for (int i = 0; i < 2; i++) {
+    total += mp_resume_trim(r);
+    r = (mp_resume_t*)mp_resume(r, NULL);
+    mpt_assert(mp_resume_trim(r) == 0, "nothing left to trim");
+    r = (mp_resume_t*)mp_resume(r, NULL);
+  }
+  mpt_assert(r == NULL, "trim worker done");
+  mp_stats_get(&stats);
+  printf("trim: %zukb decommitted in %zu trims\n", total / 1024, stats.commit_trims - trims);
+  const mp_config_t config = mp_config_default();
+  if (config.gpool_enable) {
+    mpt_assert(total >= 2 * (TRIM_DEEP_KB - 128) * 1024, "trimmed after each deep excursion");
+  }
+}
+
+
+// -------------------------------
+// Clone a suspended chain of prompts and run the clones interleaved and on other threads
+
+#define CLONE_DEPTH    100
+#define CLONE_THREADS  4
+
+// keep pointers into our own and our parent's frames across the yields
+static __noinline long clone_rec(mp_prompt_t* p, long* acc, long depth) {
+  long local = depth;
+  long* plocal = &local;
+  long x;
+  if (depth == 0) {
+    x = (long)(intptr_t)mp_yield(p, &await_result, NULL);  // fork point
+    mp_yield(p, &await_result, NULL);                       // and suspend once more
+  }
+  else {
+    x = clone_rec(p, plocal, depth - 1);
+  }
+  *acc += x * 10 + *plocal;
+  return x;
+}
+
+static void* clone_inner(mp_prompt_t* inner, void* arg) {
+  (void)(inner);
+  long total = 0;
+  clone_rec((mp_prompt_t*)arg, &total, CLONE_DEPTH);   // yield to the outer prompt through the inner one
+  return (void*)((intptr_t)total);
+}
+
+static void* clone_worker(mp_prompt_t* parent, void* arg) {
+  (void)(arg);
+  return mp_prompt(&clone_inner, parent);
+}
+
+static long clone_finish(mp_resume_t* r, long x) {
+  r = (mp_resume_t*)mp_resume(r, (void*)((intptr_t)x));   // up to the second yield
+  return (long)((intptr_t)mp_resume(r, NULL));
+}
+
+static long clone_expected(long x) {
+  return clone_finish((mp_resume_t*)mp_prompt(&clone_worker, NULL), x);
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+typedef struct clone_thread_s {
+  mp_resume_t* r;
+  long         x;
+  long         result;
+} clone_thread_t;
+
+static void* clone_thread(void* arg) {
+  clone_thread_t* t = (clone_thread_t*)arg;
+  t->result = clone_finish(t->r, t->x);
+  return NULL;
+}
+#endif
+
+static void async_clone(void) {
+  mp_resume_t* r = mp_resume_multi((mp_resume_t*)mp_prompt(&clone_worker, NULL));
+  // interleaved: with `mp_resume_multi` alone both would be restored at the same address
+  mp_resume_t* c1 = mp_resume_clone(r);
+  mp_resume_t* c2 = mp_resume_clone(r);
+  mpt_assert(c1 != NULL && c2 != NULL, "clone");
+  c1 = (mp_resume_t*)mp_resume(c1, (void*)((intptr_t)1));
+  c2 = (mp_resume_t*)mp_resume(c2, (void*)((intptr_t)2));
+  const long r2 = (long)((intptr_t)mp_resume(c2, NULL));
+  const long r1 = (long)((intptr_t)mp_resume(c1, NULL));
+  mpt_assert(r1 == clone_expected(1) && r2 == clone_expected(2), "interleaved clones");
+  #if !defined(_WIN32)
+  // fan out over threads
+  clone_thread_t ts[CLONE_THREADS];
+  pthread_t tids[CLONE_THREADS];
+  for (int i = 0; i < CLONE_THREADS; i++) {
+    ts[i].r = mp_resume_clone(r);
+    ts[i].x = i + 3;
+    mpt_assert(ts[i].r != NULL, "clone");
+    pthread_create(&tids[i], NULL, &clone_thread, &ts[i]);
+  }
+  for (int i = 0; i < CLONE_THREADS; i++) {
+    pthread_join(tids[i], NULL);
+    mpt_assert(ts[i].result == clone_expected(ts[i].x), "threaded clones");
+  }
+  #endif
+  // and the original is unaffected
+  const long r7 = clone_finish(r, 7);
+  printf("clone: %ld, %ld, %ld\n", r1, r2, r7);
+  mpt_assert(r7 == clone_expected(7), "original after clones");
+}
+
+
+// -------------------------------
+// Serialize a suspended chain of prompts and restore it (twice)
+
+static void async_serialize(void) {
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&clone_worker, NULL);
+  const size_t size = mp_resume_serialize(r, NULL, 0);
+  mpt_assert(size > 0, "snapshot size");
+  void* snapshot = malloc(size);
+  mpt_assert(mp_resume_serialize(r, snapshot, size) == size, "serialize");
+  const long r5 = clone_finish(r, 5);   // the original runs on
+  mp_resume_t* d1 = mp_resume_deserialize(snapshot, size);
+  mp_resume_t* d2 = mp_resume_deserialize(snapshot, size);
+  mpt_assert(d1 != NULL && d2 != NULL, "deserialize");
+  mpt_assert(mp_resume_deserialize(snapshot, size / 2) == NULL, "truncated snapshot");
+  if (sizeof(void*) == 8) {
+    // corrupt the header (magic, image address, and labels), and the fields of the top prompt (its 
+    // address, and its parent, top, return point, resume point, and stack pointer) which follow the header
+    static const size_t corrupt[] = { 0, 3, 7, 8, 9, 10, 11, 12, 16, 17, 18, 19, 20 };
+    uint64_t* copy = (uint64_t*)malloc(size);
+    for (size_t i = 0; i < sizeof(corrupt) / sizeof(corrupt[0]); i++) {
+      memcpy(copy, snapshot, size);
+      copy[corrupt[i]] += 16;
+      mpt_assert(mp_resume_deserialize(copy, size) == NULL && errno == EINVAL, "corrupted snapshot");
+    }
+    free(copy);
+  }
+  d1 = (mp_resume_t*)mp_resume(d1, (void*)((intptr_t)1));
+  d2 = (mp_resume_t*)mp_resume(d2, (void*)((intptr_t)2));
+  const long r1 = (long)((intptr_t)mp_resume(d1, NULL));
+  const long r2 = (long)((intptr_t)mp_resume(d2, NULL));
+  free(snapshot);
+  printf("serialize: %zu bytes: %ld, %ld, %ld\n", size, r1, r2, r5);
+  mpt_assert(r1 == clone_expected(1) && r2 == clone_expected(2) && r5 == clone_expected(5), "restored snapshots");
+}
+
+
+// -------------------------------
+// Profile a prompt (with a nested prompt) while it is suspended
+
+#define PROFILE_KB  256
+
+static mp_prompt_t* profile_outer;
+static mp_prompt_t* profile_nested;
+
+static void* profile_inner(mp_prompt_t* p, void* arg) {
+  (void)(arg);
+  profile_nested = p;
+  mp_yield(profile_outer, &await_result, NULL);   // suspends both prompts
+  profile_nested = NULL;
+  return NULL;
+}
+
+static void* profile_worker(mp_prompt_t* p, void* arg) {
+  (void)(arg);
+  profile_outer = p;
+  stack_use(PROFILE_KB);
+  mp_yield(p, &await_result, NULL);
+  mp_yield(p, &await_result, NULL);
+  return mp_prompt(&profile_inner, NULL);
+}
+
+static void async_profile(void) {
+  const mp_config_t config = mp_config_default();
+  mp_prompt_profile_t prof;
+  mp_prompt_profile_t again;
+  size_t suspended = 0;
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&profile_worker, NULL);
+  if (!mp_prompt_profile(profile_outer, &prof)) {
+    // profiling is not enabled (see `--profile`)
+    while (r != NULL) { r = (mp_resume_t*)mp_resume(r, NULL); }
+    return;
+  }
+  while (r != NULL) {
+    mp_prompt_profile(profile_outer, &prof);
+    stack_use(16);  // time passes while suspended
+    mp_prompt_profile(profile_outer, &again);
+    mpt_assert(prof.ticks > 0 && prof.ticks == again.ticks, "no ticks while suspended");
+    mpt_assert(prof.resumes == suspended, "resume count");
+    mpt_assert(prof.stack_peak >= PROFILE_KB * 1024, "peak stack");
+    mpt_assert(prof.stack_grows > 0 || config.stack_use_overcommit, "stack grows");
+    if (profile_nested != NULL) {
+      mp_prompt_profile(profile_nested, &again);
+      mpt_assert(again.ticks > 0 && again.ticks <= prof.ticks && again.resumes == 0, "nested profile");
+    }
+    suspended++;
+    r = (mp_resume_t*)mp_resume(r, NULL);
+  }
+  printf("profile: %zu resumes, %llu ticks, %zukb peak stack in %zu grows\n", prof.resumes, prof.ticks, prof.stack_peak / 1024, prof.stack_grows);
+  mpt_assert(suspended == 3, "suspended three times");
+}
+
+
+// -------------------------------
+// Statistics after all workers are done
+
+static void async_stats(void) {
+  mp_stats_t stats;
+  mp_stats_get(&stats);
+  printf("gstacks: %zu allocated (%zu fresh), %zu live, %zu cached, %zukb committed\n", 
+          stats.gstack_allocs, stats.gstack_os_allocs, stats.gstack_live, stats.gstack_cached, stats.gstack_committed / 1024);
+  printf("commit faults: %zu (%zu fast grows), gpools: %zu, blocks used: %zu\n",
+          stats.commit_faults, stats.commit_fast_grows, stats.gpool_count, stats.gpool_blocks_used);
+  mpt_assert(stats.gstack_live == 0, "all gstacks should be freed");
+  mpt_assert(stats.gstack_allocs >= M, "every request allocates a gstack");
+  mpt_assert(stats.gstack_os_allocs <= stats.gstack_allocs, "fresh allocations");
+  mpt_assert(stats.gpool_count == 0 || stats.gpool_blocks_used <= stats.gpool_blocks, "gpool occupancy");
+}
@@ -48,7 +48,105 @@ static void* my_foreach_body(intptr_t i) {
   return NULL;
 }
 
+
+
+// Pipeline: a producer and consumer that switch directly between each
+// other with a symmetric transfer (instead of going through the parent each time)
+typedef struct pipe_env_s {
+  mp_resume_t* producer;
+  mp_resume_t* consumer;
+  intptr_t     n;
+} pipe_env_t;
+
+static void* pipe_suspend(mp_resume_t* r, void* arg) {
+  (void)(arg);
+  return r;  // return our resumption to the parent
+}
+
+static void* pipe_producer(mp_prompt_t* p, void* arg) {
+  pipe_env_t* env = (pipe_env_t*)arg;
+  mp_yield(p, &pipe_suspend, NULL);  // wait for the consumer
+  for (intptr_t i = 1; i <= env->n; i++) {
+    mp_resume_transfer(p, &env->producer, env->consumer, (void*)i);
+  }
+  mp_resume_transfer(p, &env->producer, env->consumer, (void*)((intptr_t)0));  // end of stream
+  return NULL;  // not reached
+}
+
+static void* pipe_consumer(mp_prompt_t* p, void* arg) {
+  pipe_env_t* env = (pipe_env_t*)arg;
+  intptr_t sum = 0;
+  intptr_t i;
+  while ((i = (intptr_t)mp_resume_transfer(p, &env->consumer, env->producer, NULL)) != 0) {
+    sum += i;
+  }
+  return (void*)sum;
+}
+
+static intptr_t pipe_sum(intptr_t n) {
+  pipe_env_t env = { NULL, NULL, n };
+  env.producer = (mp_resume_t*)mp_prompt(&pipe_producer, &env);
+  intptr_t sum = (intptr_t)mp_prompt(&pipe_consumer, &env);
+  mp_resume_drop(env.producer);  // still suspended after the end of stream
+  return sum;
+}
+
+
+
+// Batched generator: the producer yields many elements into the buffer of the
+// generator and only switches back to the consumer when the buffer is full
+static void batch_producer(mp_gen_t* g, void* arg) {
+  intptr_t n = (intptr_t)arg;
+  intptr_t chunk[5];
+  intptr_t i = 1;
+  while (i <= n) {
+    if (i % 3 == 0) {
+      mp_gen_yield(g, &i);    // single elements
+      i++;
+    }
+    else {
+      size_t k = 0;
+      for (; k < 5 && i <= n; k++, i++) { chunk[k] = i; }
+      mp_gen_yield_many(g, chunk, k);
+    }
+  }
+}
+
+static intptr_t batch_sum(intptr_t n, size_t capacity) {
+  mp_gen_t* g = mp_gen_create(&batch_producer, (void*)n, sizeof(intptr_t), capacity);
+  intptr_t sum = 0;
+  intptr_t x;
+  intptr_t xs[4];
+  size_t count;
+  for (int round = 0; !mp_gen_is_done(g); round = (round + 1) % 3) {
+    if (round == 0) {
+      if (mp_gen_next(g, &x)) { sum += x; }
+    }
+    else if (round == 1) {
+      count = mp_gen_next_many(g, xs, 4);
+      for (size_t i = 0; i < count; i++) { sum += xs[i]; }
+    }
+    else {
+      const intptr_t* span = (const intptr_t*)mp_gen_next_span(g, &count);
+      for (size_t i = 0; i < count; i++) { sum += span[i]; }
+    }
+  }
+  mp_gen_free(g);
+  return sum;
+}
+
 int main() {
   gen_foreach( my_foreach_body, 10);
-  printf("\ndone\n");
+  intptr_t sum = pipe_sum(100);
+  printf("\npipeline sum: %zd\n", sum);
+  intptr_t bsum = batch_sum(100000, 0);
+  intptr_t bsum7 = batch_sum(1000, 7);
+  printf("batched sum: %zd, %zd\n", bsum, bsum7);
+  // a generator that is freed while its producer is suspended
+  mp_gen_t* g = mp_gen_create(&batch_producer, (void*)((intptr_t)100), sizeof(intptr_t), 8);
+  intptr_t x = 0;
+  bool ok = mp_gen_next(g, &x) && x == 1;
+  mp_gen_free(g);
+  printf("done\n");
+  return (sum == 5050 && bsum == 5000050000 && bsum7 == 500500 && ok ? 0 : 1);
 }
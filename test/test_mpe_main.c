@@ -8,6 +8,7 @@
 -----------------------------------------------------------------------------*/
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <mprompt.h>
 #include <mpeff.h>
@@ -27,6 +28,20 @@ int main(int argc, char** argv) {
   //config.stack_max_size = 1 * 1024 * 1024L;
   //config.stack_initial_commit = 64 * 1024L; 
   //config.stack_cache_count = 0; // disable per-thread cache
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--heap") == 0) {
+      config.stack_heap_size = 256 * 1024L;  // fixed size heap allocated gstacks
+    }
+    else if (strcmp(argv[i], "--incremental") == 0) {
+      config.stack_save_incremental = true;  // use dirty page tracking for multi-shot resumptions
+    }
+    else if (strcmp(argv[i], "--lazy") == 0) {
+      config.stack_restore_lazy = true;      // restore multi-shot resumptions on demand
+    }
+    else if (strcmp(argv[i], "--profile") == 0) {
+      config.prompt_profile = true;          // account the running time of handlers (see `profile_run`)
+    }
+  }
   mp_init(&config);
 
   size_t start_rss = 0;
@@ -45,6 +60,8 @@ static void test_c(void) {
   reader_run();
   counter_run();
   countern_run();
+  args_run();
+  finally_run();
   mstate_run();
   rehandle_run();
 
@@ -52,6 +69,9 @@ static void test_c(void) {
   amb_run();
   amb_state_run();
   nqueens_run();
+
+  // profiles per effect
+  profile_run();
 }
 
 
@@ -62,6 +82,9 @@ static void test_cpp(void) {
   exn_run();
   multi_unwind_run();
   throw_run();
+
+  // handlers with the C++ layer
+  handlers_run();
 }
 
 
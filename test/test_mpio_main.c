@@ -0,0 +1,240 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Test the asynchronous I/O effect
+-----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <mpio.h>
+#include "test.h"
+
+#define MESSAGES  1000
+#define STRANDS   1000
+
+// -------------------------------
+// Pass messages through two pipes and a forwarding strand
+
+static int pipe_a[2];
+static int pipe_b[2];
+
+static void* producer(void* arg) {
+  UNUSED(arg);
+  for (long i = 1; i <= MESSAGES; i++) {
+    mpt_assert(mpio_write(pipe_a[1], &i, sizeof(i)) == sizeof(i), "write");
+  }
+  return NULL;
+}
+
+static void* forwarder(void* arg) {
+  UNUSED(arg);
+  for (long i = 1; i <= MESSAGES; i++) {
+    long x;
+    mpt_assert(mpio_read(pipe_a[0], &x, sizeof(x)) == sizeof(x), "read");
+    mpt_assert(mpio_write(pipe_b[1], &x, sizeof(x)) == sizeof(x), "write");
+  }
+  return NULL;
+}
+
+static void* pipes_main(void* arg) {
+  UNUSED(arg);
+  mpio_fork(&forwarder, NULL);
+  mpio_fork(&producer, NULL);
+  long sum = 0;
+  for (long i = 1; i <= MESSAGES; i++) {
+    long x;
+    mpt_assert(mpio_read(pipe_b[0], &x, sizeof(x)) == sizeof(x), "read");
+    sum += x;
+  }
+  return mpe_voidp_long(sum);
+}
+
+static void test_pipes(mpio_backend_t backend) {
+  mpt_assert(pipe(pipe_a) == 0 && pipe(pipe_b) == 0, "pipe");
+  long res = 0;
+  mpt_bench{ res = mpe_long_voidp(mpio_main_ex(backend, &pipes_main, NULL)); }
+  mpt_printf("pipes     : %ld\n", res);
+  mpt_assert(res == (long)MESSAGES * (MESSAGES + 1) / 2, "pipes");
+  close(pipe_a[0]); close(pipe_a[1]); close(pipe_b[0]); close(pipe_b[1]);
+}
+
+
+// -------------------------------
+// Sleeping strands wake up in order of their deadline
+
+static int order[3];
+static int order_count;
+
+static void* sleeper(void* arg) {
+  long msecs = mpe_long_voidp(arg);
+  mpio_sleep((uint64_t)msecs);
+  order[order_count++] = (int)msecs;
+  return NULL;
+}
+
+static void* sleep_main(void* arg) {
+  UNUSED(arg);
+  mpio_fork(&sleeper, mpe_voidp_long(30));
+  mpio_fork(&sleeper, mpe_voidp_long(10));
+  mpio_fork(&sleeper, mpe_voidp_long(20));
+  return NULL;
+}
+
+static void test_sleep(mpio_backend_t backend) {
+  order_count = 0;
+  mpt_bench{ mpio_main_ex(backend, &sleep_main, NULL); }
+  mpt_printf("sleep     : %d, %d, %d\n", order[0], order[1], order[2]);
+  mpt_assert(order_count == 3 && order[0] == 10 && order[1] == 20 && order[2] == 30, "sleep");
+}
+
+
+// -------------------------------
+// Many strands that are resumed in batches
+
+static long strands_done;
+
+static void* short_sleeper(void* arg) {
+  UNUSED(arg);
+  mpio_sleep(1);
+  mpio_sleep(0);
+  strands_done++;
+  return NULL;
+}
+
+static void* strands_main(void* arg) {
+  UNUSED(arg);
+  for (int i = 0; i < STRANDS; i++) {
+    mpio_fork(&short_sleeper, NULL);
+  }
+  return NULL;
+}
+
+static void test_strands(mpio_backend_t backend) {
+  strands_done = 0;
+  mpt_bench{ mpio_main_ex(backend, &strands_main, NULL); }
+  mpt_printf("strands   : %ld\n", strands_done);
+  mpt_assert(strands_done == STRANDS, "strands");
+}
+
+
+// -------------------------------
+// Echo over a loopback TCP connection
+
+static int listener;
+
+static void* echo_server(void* arg) {
+  UNUSED(arg);
+  int conn = mpio_accept(listener, NULL, NULL);
+  mpt_assert(conn >= 0, "accept");
+  char buf[64];
+  ssize_t n;
+  while ((n = mpio_read(conn, buf, sizeof(buf))) > 0) {
+    mpt_assert(mpio_write(conn, buf, (size_t)n) == n, "echo write");
+  }
+  mpio_close(conn);
+  return NULL;
+}
+
+static void* echo_main(void* arg) {
+  UNUSED(arg);
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  mpt_assert(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(listener, 4) == 0, "listen");
+  mpt_assert(getsockname(listener, (struct sockaddr*)&addr, &len) == 0, "getsockname");
+  mpio_fork(&echo_server, NULL);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  mpt_assert(mpio_connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0, "connect");
+  const char* msg = "hello mpio";
+  long total = 0;
+  for (int i = 0; i < 10; i++) {
+    char buf[64];
+    mpt_assert(mpio_write(client, msg, strlen(msg)) == (ssize_t)strlen(msg), "write");
+    ssize_t got = 0;
+    while (got < (ssize_t)strlen(msg)) {
+      ssize_t n = mpio_read(client, buf + got, sizeof(buf) - (size_t)got);
+      mpt_assert(n > 0, "read");
+      got += n;
+    }
+    mpt_assert(memcmp(buf, msg, strlen(msg)) == 0, "echo");
+    total += (long)got;
+  }
+  mpio_close(client);   // ends the server
+  return mpe_voidp_long(total);
+}
+
+static void test_echo(mpio_backend_t backend) {
+  long res = 0;
+  mpt_bench{ res = mpe_long_voidp(mpio_main_ex(backend, &echo_main, NULL)); }
+  mpt_printf("echo      : %ld\n", res);
+  mpt_assert(res == 10 * (long)strlen("hello mpio"), "echo");
+  close(listener);
+}
+
+
+// -------------------------------
+// Reads and writes in registered buffers
+
+static char regbuf[4096];
+
+static void* registered_main(void* arg) {
+  UNUSED(arg);
+  struct iovec iov = { regbuf, sizeof(regbuf) };
+  bool registered = mpio_register_buffers(&iov, 1);
+  mpt_assert(registered == (strcmp(mpio_backend_name(), "io_uring") == 0), "register");
+  strcpy(regbuf, "zero-copy");
+  mpt_assert(mpio_write(pipe_a[1], regbuf, 10) == 10, "write");
+  mpt_assert(mpio_read(pipe_a[0], regbuf + 100, 10) == 10, "read");
+  return mpe_voidp_long(strcmp(regbuf + 100, "zero-copy") == 0 ? 1 : 0);
+}
+
+static void test_registered(mpio_backend_t backend) {
+  mpt_assert(pipe(pipe_a) == 0, "pipe");
+  long res = mpe_long_voidp(mpio_main_ex(backend, &registered_main, NULL));
+  mpt_printf("registered: %ld\n", res);
+  mpt_assert(res == 1, "registered");
+  close(pipe_a[0]); close(pipe_a[1]);
+}
+
+
+// -------------------------------
+
+static void* backend_name(void* arg) {
+  UNUSED(arg);
+  return (void*)mpio_backend_name();
+}
+
+static void test_all(mpio_backend_t backend) {
+  const char* name = (const char*)mpio_main_ex(backend, &backend_name, NULL);
+  if (name == NULL) {
+    mpt_printf("backend   : unavailable\n");
+    return;
+  }
+  mpt_printf("backend   : %s\n", name);
+  test_pipes(backend);
+  test_sleep(backend);
+  test_strands(backend);
+  test_echo(backend);
+  test_registered(backend);
+}
+
+int main() {
+  mp_config_t config = mp_config_default();
+  mp_init(&config);
+  test_all(MPIO_BACKEND_URING);
+  test_all(MPIO_BACKEND_POLL);
+  mpt_printf("done.\n");
+  return 0;
+}
@@ -0,0 +1,282 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Test the work-stealing scheduler
+-----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <mprompt.h>
+#include <mpsched.h>
+#include "test.h"
+
+#ifdef NDEBUG
+#define FIB_N     27
+#define TASKS     1000000
+#else
+#define FIB_N     20
+#define TASKS     100000
+#endif
+#define YIELDS    10
+#define ETASKS    (TASKS/10)
+#define MESSAGES  (TASKS/2)
+#define PRODUCERS 4
+
+// -------------------------------
+// Parallel fibonacci using spawn and await
+
+static void* fib_task(void* arg) {
+  intptr_t n = (intptr_t)arg;
+  if (n < 2) return (void*)n;
+  mps_task_t* t = mps_spawn(&fib_task, (void*)(n - 1));
+  intptr_t y = (intptr_t)fib_task((void*)(n - 2));
+  intptr_t x = (intptr_t)mps_await(t);
+  return (void*)(x + y);
+}
+
+static intptr_t fib(intptr_t n) {
+  return (n < 2 ? n : fib(n - 1) + fib(n - 2));
+}
+
+static void test_fib(void) {
+  intptr_t res = 0;
+  mpt_bench{ res = (intptr_t)mps_await(mps_spawn(&fib_task, (void*)((intptr_t)FIB_N))); }
+  mpt_printf("fib %d     : %zd\n", FIB_N, res);
+  mpt_assert(res == fib(FIB_N), "fib");
+}
+
+
+// -------------------------------
+// Many tasks that yield repeatedly (and may migrate between workers)
+
+static void* yield_task(void* arg) {
+  intptr_t sum = 0;
+  for (int i = 0; i < YIELDS; i++) {
+    sum += (intptr_t)arg;
+    mps_yield();
+  }
+  return (void*)sum;
+}
+
+static void* spawn_many(void* arg) {
+  intptr_t n = (intptr_t)arg;
+  mps_task_t** tasks = (mps_task_t**)malloc(n * sizeof(mps_task_t*));
+  for (intptr_t i = 0; i < n; i++) {
+    tasks[i] = mps_spawn(&yield_task, (void*)(i % 7));
+  }
+  intptr_t total = 0;
+  for (intptr_t i = 0; i < n; i++) {
+    total += (intptr_t)mps_await(tasks[i]);
+  }
+  free(tasks);
+  return (void*)total;
+}
+
+static void test_yield(void) {
+  intptr_t expect = 0;
+  for (intptr_t i = 0; i < TASKS; i++) { expect += YIELDS * (i % 7); }
+  intptr_t res = 0;
+  mpt_bench{ res = (intptr_t)mps_await(mps_spawn(&spawn_many, (void*)((intptr_t)TASKS))); }
+  mpt_printf("yield     : %zd\n", res);
+  mpt_assert(res == expect, "yield");
+}
+
+
+// -------------------------------
+// Detached tasks spawned from the main thread
+
+static void* count_task(void* arg) {
+  mps_yield();
+  mpt_assert(mps_in_task() && mps_worker_id() >= 0, "in task");
+  return arg;
+}
+
+static void test_detach(void) {
+  mpt_bench{
+    for (int i = 0; i < 1000; i++) {
+      mps_detach(mps_spawn(&count_task, NULL));
+    }
+  }
+  mpt_printf("detach    : done\n");
+}
+
+
+// -------------------------------
+// Tasks with effect handlers that migrate between workers while suspended
+
+static void* effect_action(void* arg) {
+  UNUSED(arg);
+  long count = 0;
+  long i;
+  while ((i = state_get()) > 0) {
+    mps_yield();            // detaches the handlers of this task
+    state_set(i - 1);
+    count++;
+  }
+  return mpe_voidp_long(count);
+}
+
+static void* effect_task(void* arg) {
+  // no handlers of other tasks on this worker should be visible
+  mpt_assert(mpe_evidence_find(MPE_EFFECT(state)).handler == NULL, "no leaked handlers");
+  long n = (long)(intptr_t)arg;
+  long x = mpe_long_voidp(state_handle(&effect_action, n, NULL));            // tail resumptive
+  long y = mpe_long_voidp(gstate_handle(&effect_action, n, NULL));           // yields to the handler
+  return (void*)((intptr_t)(x + y));
+}
+
+static void* spawn_effects(void* arg) {
+  intptr_t n = (intptr_t)arg;
+  mps_task_t** tasks = (mps_task_t**)malloc(n * sizeof(mps_task_t*));
+  for (intptr_t i = 0; i < n; i++) {
+    tasks[i] = mps_spawn(&effect_task, (void*)(i % 5));
+  }
+  intptr_t total = 0;
+  for (intptr_t i = 0; i < n; i++) {
+    total += (intptr_t)mps_await(tasks[i]);
+  }
+  free(tasks);
+  return (void*)total;
+}
+
+static void test_effects(void) {
+  intptr_t expect = 0;
+  for (intptr_t i = 0; i < ETASKS; i++) { expect += 2 * (i % 5); }
+  intptr_t res = 0;
+  mpt_bench{ res = (intptr_t)mps_await(mps_spawn(&spawn_effects, (void*)((intptr_t)ETASKS))); }
+  mpt_printf("effects   : %zd\n", res);
+  mpt_assert(res == expect, "effects");
+}
+
+
+// -------------------------------
+// Channels: producers and consumers, select, and closing
+
+typedef struct chan_env_s {
+  mps_chan_t* ch;
+  intptr_t    n;
+} chan_env_t;
+
+static void* producer_task(void* arg) {
+  chan_env_t* env = (chan_env_t*)arg;
+  for (intptr_t i = 1; i <= env->n; i++) {
+    mps_chan_send(env->ch, (void*)i);
+  }
+  return NULL;
+}
+
+static void* consumer_task(void* arg) {
+  mps_chan_t* ch = (mps_chan_t*)arg;
+  intptr_t sum = 0;
+  void* x;
+  while (mps_chan_recv(ch, &x)) {
+    sum += (intptr_t)x;
+  }
+  return (void*)sum;
+}
+
+// `PRODUCERS` producers and consumers over a channel with the given capacity
+static void* channel_task(void* arg) {
+  chan_env_t env = { mps_chan_create((size_t)(intptr_t)arg), MESSAGES / PRODUCERS };
+  mps_task_t* consumers[PRODUCERS];
+  mps_task_t* producers[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; i++) {
+    consumers[i] = mps_spawn(&consumer_task, env.ch);
+    producers[i] = mps_spawn(&producer_task, &env);
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    mps_await(producers[i]);
+  }
+  mps_chan_close(env.ch);
+  intptr_t total = 0;
+  for (int i = 0; i < PRODUCERS; i++) {
+    total += (intptr_t)mps_await(consumers[i]);
+  }
+  mpt_assert(!mps_chan_send(env.ch, NULL), "send after close");
+  mps_chan_free(env.ch);
+  return (void*)total;
+}
+
+static void* select_task(void* arg) {
+  mps_chan_t** chs = (mps_chan_t**)arg;
+  mps_select_case_t cases[2] = { { chs[0], false, false, NULL }, { chs[1], false, false, NULL } };
+  intptr_t sum = 0;
+  size_t open = 2;
+  while (open > 0) {
+    ptrdiff_t i = mps_select(cases, open, true);
+    mpt_assert(i >= 0 && (size_t)i < open, "select index");
+    if (cases[i].ok) {
+      sum += (cases[i].chan == chs[0] ? 1 : -1) * (intptr_t)cases[i].value;
+    }
+    else {
+      // closed: remove the case
+      cases[i] = cases[open - 1];
+      open--;
+    }
+  }
+  return (void*)sum;
+}
+
+static void test_channels(void) {
+  const intptr_t n = MESSAGES / PRODUCERS;
+  const intptr_t expect = PRODUCERS * (n * (n + 1) / 2);
+  intptr_t res = 0;
+  mpt_bench{ res = (intptr_t)mps_await(mps_spawn(&channel_task, (void*)((intptr_t)0))); }
+  mpt_printf("rendezvous: %zd\n", res);
+  mpt_assert(res == expect, "rendezvous");
+
+  mpt_bench{ res = (intptr_t)mps_await(mps_spawn(&channel_task, (void*)((intptr_t)64))); }
+  mpt_printf("channel   : %zd\n", res);
+  mpt_assert(res == expect, "channel");
+
+  // select over two channels (one buffered)
+  mps_chan_t* chs[2] = { mps_chan_create(0), mps_chan_create(8) };
+  chan_env_t env0 = { chs[0], 1000 };
+  chan_env_t env1 = { chs[1], 500 };
+  mps_task_t* sel = mps_spawn(&select_task, chs);
+  mps_task_t* p0 = mps_spawn(&producer_task, &env0);
+  mps_task_t* p1 = mps_spawn(&producer_task, &env1);
+  mps_await(p0); mps_chan_close(chs[0]);
+  mps_await(p1); mps_chan_close(chs[1]);
+  res = (intptr_t)mps_await(sel);
+  mpt_printf("select    : %zd\n", res);
+  mpt_assert(res == 500500 - 125250, "select");
+  mps_chan_free(chs[0]);
+  mps_chan_free(chs[1]);
+
+  // the main thread receives (blocking the thread)
+  mps_chan_t* ch = mps_chan_create(0);
+  chan_env_t env = { ch, 1000 };
+  mps_task_t* p = mps_spawn(&producer_task, &env);
+  intptr_t sum = 0;
+  void* x;
+  for (intptr_t i = 0; i < env.n; i++) {
+    mpt_assert(mps_chan_recv(ch, &x), "external recv");
+    sum += (intptr_t)x;
+  }
+  mps_await(p);
+  mps_chan_close(ch);
+  mpt_assert(!mps_chan_recv(ch, &x) && sum == 500500, "external");
+  mps_chan_free(ch);
+  mpt_printf("external  : %zd\n", sum);
+}
+
+
+int main() {
+  mp_config_t config = mp_config_default();
+  mp_init(&config);
+  mps_start(4);  // use multiple workers even on a single core to test migration
+
+  test_fib();
+  test_yield();
+  test_detach();
+  test_effects();
+  test_channels();
+
+  mps_stop();
+  mpt_printf("done.\n");
+  return 0;
+}